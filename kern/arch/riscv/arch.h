@@ -6,11 +6,14 @@
 #include <ros/arch/membar.h>
 #include <arch/riscv.h>
 #include <arch/time.h>
+#include <string.h>
 
 /* Arch Constants */
 #define ARCH_CL_SIZE 64
 
 void print_cpuinfo(void);
+struct core_set;
+void send_ipi_set(struct core_set *cset, uint8_t vector);
 void show_mapping(pgdir_t pgdir, uintptr_t start, size_t size);
 void backtrace(void);
 
@@ -158,6 +161,10 @@ static __inline void reboot(void)
 
 extern void cpu_halt(void);
 
+static inline void cpu_idle_hint(uint64_t idle_usec)
+{
+}
+
 static inline void prefetch(void *addr)
 {
 }
@@ -166,6 +173,11 @@ static inline void prefetchw(void *addr)
 {
 }
 
+static inline void clear_page_nocache(void *kva)
+{
+	memset(kva, 0, PGSIZE);
+}
+
 /* Resets a stack pointer to sp, then calls f(arg) */
 static inline void __attribute__((noreturn))
 __reset_stack_pointer(void *arg, uintptr_t sp, void (*f)(void *))
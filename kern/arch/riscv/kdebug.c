@@ -38,6 +38,12 @@ size_t backtrace_list(uintptr_t pc, uintptr_t fp, uintptr_t *pcs,
 	return 0;
 }
 
+size_t backtrace_list_here(uintptr_t *pcs, size_t nr_slots)
+{
+	printk("\n\tTODO: %s on riscv\n\n", __func__);
+	return 0;
+}
+
 size_t backtrace_user_list(uintptr_t pc, uintptr_t fp, uintptr_t *pcs,
 						   size_t nr_slots)
 {
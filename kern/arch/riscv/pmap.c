@@ -128,6 +128,22 @@ void arch_pgdir_clear(pgdir_t *pd)
 }
 
 /* Returns the page shift of the largest jumbo supported */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int pml_shift,
+                       int create)
+{
+	return pgdir_walk(pgdir, va, create);
+}
+
+int pgdir_split_jumbo(pgdir_t pgdir, const void *va)
+{
+	return 0;
+}
+
+int arch_smaller_page_shift(int shift)
+{
+	return PGSHIFT;
+}
+
 int arch_max_jumbo_page_shift(void)
 {
 	#warning "What jumbo page sizes does RISC support?"
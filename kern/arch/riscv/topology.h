@@ -8,3 +8,21 @@
  * riscv. */
 static void topology_init(void) {}
 static void print_cpu_topology(void) {}
+
+#define num_numa 1
+
+static inline int core_numa_id(int coreid)
+{
+	return 0;
+}
+
+static inline int paddr_numa_id(physaddr_t pa)
+{
+	return 0;
+}
+
+static inline bool numa_mem_range(int idx, int *numa_id, physaddr_t *start,
+                                  physaddr_t *end)
+{
+	return FALSE;
+}
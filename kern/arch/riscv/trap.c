@@ -13,6 +13,7 @@
 #include <mm.h>
 #include <umem.h>
 #include <pmap.h>
+#include <core_set.h>
 
 /* These are the stacks the kernel will load when it receives a trap from user
  * space.  The deal is that they get set right away in entry.S, and can always
@@ -357,6 +358,14 @@ handle_trap(struct hw_trapframe *hw_tf)
 		proc_restartcore();
 }
 
+void send_ipi_set(struct core_set *cset, uint8_t vector)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (core_set_getcpu(cset, i))
+			send_ipi(i, vector);
+	}
+}
+
 /* We don't have NMIs now. */
 void send_nmi(uint32_t os_coreid)
 {
@@ -84,6 +84,8 @@ static inline void send_broadcast_ipi(uint8_t vector);
 static inline void send_all_others_ipi(uint8_t vector);
 static inline void __send_ipi(uint8_t hw_coreid, uint8_t vector);
 static inline void send_group_ipi(uint8_t hw_groupid, uint8_t vector);
+static inline void send_cluster_ipi(uint16_t cluster, uint16_t mask,
+                                    uint8_t vector);
 static inline void __send_nmi(uint8_t hw_coreid);
 
 /* XXX: remove these */
@@ -172,6 +174,15 @@ static inline void send_group_ipi(uint8_t hw_groupid, uint8_t vector)
 	apicsendipi(((uint64_t)hw_groupid << 32) | 0x00004800 | vector);
 }
 
+/* In x2APIC mode, a logical destination is a cluster (hw_coreid >> 4) and a
+ * mask of that cluster's 16 cores (1 << (hw_coreid & 0xf)). */
+static inline void send_cluster_ipi(uint16_t cluster, uint16_t mask,
+                                    uint8_t vector)
+{
+	apicsendipi(((uint64_t)cluster << 48) | ((uint64_t)mask << 32) |
+	            0x00004800 | vector);
+}
+
 static inline void __send_nmi(uint8_t hw_coreid)
 {
 	if (hw_coreid == 255)
@@ -26,12 +26,15 @@ static inline void reboot(void)
               __attribute__((always_inline)) __attribute__((noreturn));
 static inline void prefetch(void *addr);
 static inline void prefetchw(void *addr);
+static inline void clear_page_nocache(void *kva);
 static inline void swap_gs(void);
 static inline void __attribute__((noreturn))
 __reset_stack_pointer(void *arg, uintptr_t sp, void (*f)(void *));
 
 /* in trap.c */
 void send_ipi(uint32_t os_coreid, uint8_t vector);
+struct core_set;
+void send_ipi_set(struct core_set *cset, uint8_t vector);
 /* in cpuinfo.c */
 void print_cpuinfo(void);
 void show_mapping(pgdir_t pgdir, uintptr_t start, size_t size);
@@ -42,6 +45,7 @@ void tlbflush(void);
 void tlb_flush_global(void);
 /* idle.c */
 void cpu_halt(void);
+void cpu_idle_hint(uint64_t idle_usec);
 
 static inline void breakpoint(void)
 {
@@ -163,6 +167,23 @@ static inline void prefetchw(void *addr)
 	asm volatile("prefetchw (%0)" : : "r"(addr));
 }
 
+/* Zeros a page with non-temporal stores, so we don't pull the page into the
+ * cache (and evict someone else's lines) just to write zeros.  The sfence
+ * orders the weakly-ordered movnti stores before anyone else sees the page. */
+static inline void clear_page_nocache(void *kva)
+{
+	uint64_t *p = kva;
+
+	for (int i = 0; i < PGSIZE / sizeof(uint64_t); i += 4) {
+		asm volatile("movnti %1, 0(%0);"
+		             "movnti %1, 8(%0);"
+		             "movnti %1, 16(%0);"
+		             "movnti %1, 24(%0);"
+		             : : "r"(&p[i]), "r"(0UL) : "memory");
+	}
+	asm volatile("sfence" : : : "memory");
+}
+
 /* Guest VMs have a maximum physical address they can use.  Guest
  * physical addresses are mapped into this MCP 1:1, but limited to
  * this max address *in hardware*.  I.e., the MCP process can address
@@ -3,19 +3,43 @@
 #include <arch/mmu.h>
 #include <cpu_feat.h>
 #include <arch/uaccess.h>
+#include <percpu.h>
 
+/* The deepest C-state we'll use, set via #arch/c-state */
 static unsigned int x86_cstate;
+/* The C-state for this core's next halt, picked by cpu_idle_hint().  It is only
+ * good for one halt; other halts (e.g. sys_halt_core()) use x86_cstate. */
+static DEFINE_PERCPU(bool, idle_hinted);
+static DEFINE_PERCPU(unsigned int, idle_cstate);
+
+/* How long we need to stay idle in a C-state for it to be worth the exit
+ * latency.  These are ballpark numbers; the real ones vary by model. */
+static struct {
+	unsigned int				cstate;
+	uint64_t					residency_usec;
+} cstate_residency[] = {
+	{X86_MWAIT_C6, 600},
+	{X86_MWAIT_C3, 100},
+	{X86_MWAIT_C2, 20},
+	{X86_MWAIT_C1, 0},
+};
 
 /* This atomically enables interrupts and halts.
  *
  * Note that sti does not take effect until after the *next* instruction */
 void cpu_halt(void)
 {
+	unsigned int cstate = ACCESS_ONCE(x86_cstate);
+
+	if (PERCPU_VAR(idle_hinted)) {
+		cstate = PERCPU_VAR(idle_cstate);
+		PERCPU_VAR(idle_hinted) = FALSE;
+	}
 	if (cpu_has_feat(CPU_FEAT_X86_MWAIT)) {
 		/* TODO: since we're monitoring anyway, x86 could use monitor/mwait for
 		 * KMSGs, instead of relying on IPIs.  (Maybe only for ROUTINE). */
 		asm volatile("monitor" : : "a"(KERNBASE), "c"(0), "d"(0));
-		asm volatile("sti; mwait" : : "c"(0x0), "a"(x86_cstate) : "memory");
+		asm volatile("sti; mwait" : : "c"(0x0), "a"(cstate) : "memory");
 	} else {
 		asm volatile("sti; hlt" : : : "memory");
 	}
@@ -61,6 +85,27 @@ unsigned int get_pstate(void)
 	return (perf_ctl & 0xff00) >> 8;
 }
 
+/* Picks the C-state for this core's next cpu_halt(), given how long we expect
+ * to be idle: the deepest one we'll stay in long enough, up to x86_cstate.
+ * Call with IRQs disabled, right before halting. */
+void cpu_idle_hint(uint64_t idle_usec)
+{
+	unsigned int limit = ACCESS_ONCE(x86_cstate);
+	unsigned int cstate = X86_MWAIT_C1;
+
+	for (int i = 0; i < ARRAY_SIZE(cstate_residency); i++) {
+		if (cstate_residency[i].cstate > limit)
+			continue;
+		if (idle_usec >= cstate_residency[i].residency_usec) {
+			cstate = cstate_residency[i].cstate;
+			break;
+		}
+	}
+	PERCPU_VAR(idle_cstate) = cstate;
+	PERCPU_VAR(idle_hinted) = TRUE;
+}
+
+/* Sets the deepest C-state cpu_halt() will use */
 void set_cstate(unsigned int cstate)
 {
 	/* No real need to lock for an assignment.  Any core can set this, and other
@@ -327,6 +327,14 @@ void gen_backtrace(void (*pfunc)(void *, const char *), void *opaque)
 	print_backtrace_list(pcs, nr_pcs, pfunc, opaque);
 }
 
+size_t backtrace_list_here(uintptr_t *pcs, size_t nr_slots)
+{
+	uintptr_t ebp, eip;
+
+	GET_FRAME_START(ebp, eip);
+	return backtrace_list(eip, ebp, pcs, nr_slots);
+}
+
 static bool pc_is_asm_trampoline(uintptr_t pc)
 {
 	extern char __asm_entry_points_start[], __asm_entry_points_end[];
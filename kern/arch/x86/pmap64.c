@@ -398,6 +398,65 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Returns the PTE for va at the level of pml_shift (e.g. PML2_SHIFT for a 2 MB
+ * jumbo), creating intermediate tables if asked.  If there is already a jumbo
+ * at a higher level, you'll get that instead.  If there is a page table at
+ * pml_shift's level, you'll get that intermediate PTE, which is present but not
+ * a jumbo. */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int pml_shift,
+                       int create)
+{
+	int flags = pml_shift;
+
+	if (create)
+		flags |= PG_WALK_CREATE;
+	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
+}
+
+/* Splits the jumbo PTE that maps va into a page table of the next smaller page
+ * size, mapping the same memory with the same settings.  Present or not, the
+ * new PTEs match the old one.  The caller deals with the TLB and with whatever
+ * the jumbo was tracking.
+ *
+ * Returns the shift of the new PTEs, 0 if va isn't mapped by a jumbo, or
+ * -ENOMEM. */
+int pgdir_split_jumbo(pgdir_t pgdir, const void *va)
+{
+	kpte_t *pml = pgdir_get_kpt(pgdir);
+	kpte_t *kpte, *new_pml;
+	epte_t *epte;
+	physaddr_t pa;
+	int shift, child_shift, settings;
+
+	for (shift = PML4_SHIFT; shift > PML1_SHIFT; shift -= BITS_PER_PML) {
+		kpte = &pml[PMLx(va, shift)];
+		if (!kpte_is_mapped(kpte))
+			return 0;
+		if (kpte_is_jumbo(kpte))
+			break;
+		pml = kpte2pml(*kpte);
+	}
+	if (shift == PML1_SHIFT)
+		return 0;
+	/* Users can't map jumbos above ULIM, so we can always have EPT entries. */
+	assert((uintptr_t)va < ULIM);
+	new_pml = kpages_zalloc(2 * PGSIZE, MEM_ATOMIC);
+	if (!new_pml)
+		return -ENOMEM;
+	child_shift = shift - BITS_PER_PML;
+	pa = kpte_get_paddr(kpte) & ~((1UL << shift) - 1);
+	settings = kpte_get_settings(kpte);
+	if (child_shift == PML1_SHIFT)
+		settings &= ~PTE_PS;
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&new_pml[i], pa + ((uintptr_t)i << child_shift), settings);
+	/* Same as for an intermediate in __pml_walk */
+	epte = kpte_to_epte(kpte);
+	*kpte = PADDR(new_pml) | PTE_P | PTE_U | PTE_W;
+	*epte = (PADDR(new_pml) + PGSIZE) | EPTE_R | EPTE_X | EPTE_W;
+	return child_shift;
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
@@ -499,8 +558,9 @@ void x86_cleanup_bootmem(void)
 }
 
 /* Walks len bytes from start, executing 'callback' on every PTE, passing it a
- * specific VA and whatever arg is passed in.  Note, this cannot handle jumbo
- * pages.
+ * specific VA and whatever arg is passed in.  Jumbo PTEs are passed to the
+ * callback too, once per jumbo, so callbacks that care need to check
+ * pte_is_jumbo().  The walk must not cover only part of a jumbo.
  *
  * This is just a clumsy wrapper around the more powerful pml_for_each, which
  * can handle jumbo and intermediate pages. */
@@ -517,8 +577,8 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 	{
 		struct tramp_package *tp = (struct tramp_package*)data;
 		assert(tp->cb);
-		/* memwalk CBs don't know how to handle intermediates or jumbos */
-		if (shift != PML1_SHIFT)
+		/* memwalk CBs don't know how to handle intermediates */
+		if ((shift != PML1_SHIFT) && !kpte_is_jumbo(kpte))
 			return 0;
 		return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
 	}
@@ -669,6 +729,12 @@ void arch_pgdir_clear(pgdir_t *pd)
 	pd->eptp = 0;
 }
 
+/* Returns the page shift of the next smaller page size below shift */
+int arch_smaller_page_shift(int shift)
+{
+	return MAX(shift - BITS_PER_PML, PML1_SHIFT);
+}
+
 /* Returns the page shift of the largest jumbo supported */
 int arch_max_jumbo_page_shift(void)
 {
@@ -16,9 +16,18 @@
 struct topology_info cpu_topology_info;
 int *os_coreid_lookup;
 
+/* Physical memory ranges from the SRAT, tagged with our (adjusted) numa_id. */
+#define MAX_NUMA_MEM_RANGES 32
+struct numa_mem_range {
+	physaddr_t start;
+	physaddr_t end;
+	int numa_id;
+};
+static struct numa_mem_range numa_mem_ranges[MAX_NUMA_MEM_RANGES];
+static int nr_numa_mem_ranges;
+
 #define num_cpus            (cpu_topology_info.num_cpus)
 #define num_sockets         (cpu_topology_info.num_sockets)
-#define num_numa            (cpu_topology_info.num_numa)
 #define cores_per_numa      (cpu_topology_info.cores_per_numa)
 #define cores_per_socket    (cpu_topology_info.cores_per_socket)
 #define cores_per_cpu       (cpu_topology_info.cores_per_cpu)
@@ -314,6 +323,41 @@ static void update_core_list_with_absolute_ids(void)
 	}
 }
 
+/* The SRAT's memory entries use raw proximity domains, but core_list has the
+ * adjusted numa_ids.  We translate by finding a core in the same domain.
+ * Domains with memory but no cores get lumped in with domain 0. */
+static int srat_dom_to_numa_id(int dom)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (find_numa_domain(core_list[i].apic_id) == dom)
+			return core_list[i].numa_id;
+	}
+	return 0;
+}
+
+static void set_numa_mem_ranges(void)
+{
+	struct numa_mem_range *range;
+
+	if (srat == NULL)
+		return;
+
+	for (int i = 0; i < srat->nchildren; i++) {
+		struct Srat *temp = srat->children[i]->tbl;
+
+		if (temp == NULL || temp->type != SRmem || !temp->mem.len)
+			continue;
+		if (nr_numa_mem_ranges == MAX_NUMA_MEM_RANGES) {
+			warn("Too many SRAT memory ranges, ignoring the rest!");
+			break;
+		}
+		range = &numa_mem_ranges[nr_numa_mem_ranges++];
+		range->start = temp->mem.addr;
+		range->end = temp->mem.addr + temp->mem.len;
+		range->numa_id = srat_dom_to_numa_id(temp->mem.dom);
+	}
+}
+
 static void build_topology(uint32_t core_bits, uint32_t cpu_bits)
 {
 	set_num_cores();
@@ -323,6 +367,7 @@ static void build_topology(uint32_t core_bits, uint32_t cpu_bits)
 	init_core_list(core_bits, cpu_bits);
 	set_remaining_topology_info();
 	update_core_list_with_absolute_ids();
+	set_numa_mem_ranges();
 }
 
 static void build_flat_topology(void)
@@ -365,6 +410,29 @@ void topology_init(void)
 		build_flat_topology();
 }
 
+/* Returns the numa_id of the memory at physical address pa.  Memory we don't
+ * know about (e.g. a flat topology) is in domain 0. */
+int paddr_numa_id(physaddr_t pa)
+{
+	for (int i = 0; i < nr_numa_mem_ranges; i++) {
+		if ((numa_mem_ranges[i].start <= pa) && (pa < numa_mem_ranges[i].end))
+			return numa_mem_ranges[i].numa_id;
+	}
+	return 0;
+}
+
+/* Iterator over the NUMA memory ranges.  Returns FALSE once idx is past the
+ * last range. */
+bool numa_mem_range(int idx, int *numa_id, physaddr_t *start, physaddr_t *end)
+{
+	if (idx >= nr_numa_mem_ranges)
+		return FALSE;
+	*numa_id = numa_mem_ranges[idx].numa_id;
+	*start = numa_mem_ranges[idx].start;
+	*end = numa_mem_ranges[idx].end;
+	return TRUE;
+}
+
 void print_cpu_topology()
 {
 	printk("num_numa: %d, num_sockets: %d, num_cpus: %d, num_cores: %d\n",
@@ -35,9 +35,12 @@ struct topology_info {
 extern struct topology_info cpu_topology_info;
 extern int *os_coreid_lookup;
 #define num_cores (cpu_topology_info.num_cores)
+#define num_numa (cpu_topology_info.num_numa)
 
 void topology_init();
 void print_cpu_topology();
+int paddr_numa_id(physaddr_t pa);
+bool numa_mem_range(int idx, int *numa_id, physaddr_t *start, physaddr_t *end);
 
 static inline int get_hw_coreid(uint32_t coreid)
 {
@@ -60,6 +63,11 @@ static inline int numa_id(void)
 	return cpu_topology_info.core_list[os_coreid].numa_id;
 }
 
+static inline int core_numa_id(int coreid)
+{
+	return cpu_topology_info.core_list[coreid].numa_id;
+}
+
 static inline int core_id(void)
 {
 	int coreid;
@@ -20,6 +20,7 @@
 #include <ex_table.h>
 #include <arch/mptables.h>
 #include <ros/procinfo.h>
+#include <core_set.h>
 
 enum {
 	NMI_NORMAL_OPN = 0,
@@ -877,6 +878,29 @@ void send_ipi(uint32_t os_coreid, uint8_t vector)
 	__send_ipi(hw_coreid, vector);
 }
 
+/* Declared in x86/arch.h.  Sends one multicast IPI per x2APIC cluster. */
+void send_ipi_set(struct core_set *cset, uint8_t vector)
+{
+	int nr_clusters = (cpu_topology_info.max_apic_id >> 4) + 1;
+	uint16_t masks[nr_clusters];
+	int hw_coreid;
+
+	assert(vector != T_NMI);
+	memset(masks, 0, sizeof(masks));
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(cset, i))
+			continue;
+		hw_coreid = get_hw_coreid(i);
+		if (hw_coreid == -1)
+			panic("Unmapped OS coreid (OS %d)!\n", i);
+		masks[hw_coreid >> 4] |= 1 << (hw_coreid & 0xf);
+	}
+	for (int i = 0; i < nr_clusters; i++) {
+		if (masks[i])
+			send_cluster_ipi(i, masks[i], vector);
+	}
+}
+
 /****************** VM exit handling ******************/
 
 static bool handle_vmexit_cpuid(struct vm_trapframe *tf)
@@ -39,6 +39,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <hash.h>
 
 struct dev etherdevtab;
 
@@ -49,6 +50,11 @@ static char *devname(void)
 
 enum {
 	Type8021Q = 0x8100,			/* value of type field for 802.1[pQ] tags */
+	TypeIP4 = 0x0800,
+	TypeIP6 = 0x86DD,
+	IP6HDRLEN = 40,
+	ProtoTCP = 6,
+	ProtoUDP = 17,
 };
 
 static struct ether *etherxx[MaxEther];	/* real controllers */
@@ -302,11 +308,61 @@ static inline int eaddrcmp(uint8_t *x, uint8_t *y)
 	return (a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]);
 }
 
+/*
+ *  Hash the addresses and TCP/UDP ports, so a connection's packets all go to
+ *  the same fanout reader.  IPv4 fragments only hash on the addresses, so
+ *  they stay together.
+ */
+static uint32_t etherflowhash(struct block *bp, int type)
+{
+	uint8_t *p = bp->rp + ETHERHDRSIZE;
+	long len = BHLEN(bp) - ETHERHDRSIZE;
+	uint32_t h = type;
+	int hl, proto;
+
+	switch (type) {
+	case TypeIP4:
+		if (len < IPV4HDR_LEN)
+			break;
+		hl = (p[0] & 0xf) << 2;
+		proto = p[9];
+		h ^= nhgetl(p + 12) ^ nhgetl(p + 16);
+		if ((nhgets(p + 6) & 0x3fff) == 0 &&
+		    (proto == ProtoTCP || proto == ProtoUDP) && len >= hl + 4)
+			h ^= nhgetl(p + hl);
+		break;
+	case TypeIP6:
+		if (len < IP6HDRLEN)
+			break;
+		for (int i = 8; i < IP6HDRLEN; i += 4)
+			h ^= nhgetl(p + i);
+		proto = p[6];
+		if ((proto == ProtoTCP || proto == ProtoUDP) &&
+		    len >= IP6HDRLEN + 4)
+			h ^= nhgetl(p + IP6HDRLEN);
+		break;
+	}
+	return hash_32(h, 16);
+}
+
+/*
+ *  Is f the member of its fanout group that gets this flow?  netif
+ *  numbers the group when members come and go.  we can race with
+ *  that, and a packet might go to no member while the group changes.
+ */
+static int etherfanout(struct netfile *f, uint32_t flow)
+{
+	int n = ACCESS_ONCE(f->nfanout);
+
+	return n && ACCESS_ONCE(f->fanoutid) == flow % n;
+}
+
 struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 {
 	struct etherpkt *pkt;
 	uint16_t type;
-	int multi, tome, fromme, vlanid, i;
+	int multi, tome, fromme, vlanid, i, hashed;
+	uint32_t flow = 0;
 	struct netfile **ep, *f, **fp, *fx;
 	struct block *xbp;
 	struct ether *vlan;
@@ -336,6 +392,7 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	}
 
 	fx = 0;
+	hashed = 0;
 	ep = &ether->f[Ntypes];
 
 	multi = pkt->d[0] & 1;
@@ -367,6 +424,14 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 				/* Don't want to hear bridged packets */
 				if (f->bridge && !fromwire && !fromme)
 					continue;
+				if (f->fanout) {
+					if (!hashed) {
+						flow = etherflowhash(bp, type);
+						hashed = 1;
+					}
+					if (!etherfanout(f, flow))
+						continue;
+				}
 				if (f->headersonly) {
 					etherrtrace(f, pkt, BHLEN(bp));
 					continue;
@@ -26,6 +26,7 @@
 #include <umem.h>
 #include <profiler.h>
 #include <kprof.h>
+#include <kmalloc_prof.h>
 #include <ros/procinfo.h>
 #include <init.h>
 
@@ -40,6 +41,8 @@ enum {
 	Kprintxqid,
 	Kmpstatqid,
 	Kmpstatrawqid,
+	Kmheapqid,
+	Kmliveqid,
 };
 
 struct trace_printk_buffer {
@@ -63,6 +66,8 @@ struct dirtab kproftab[] = {
 	{"kprintx",		{Kprintxqid},		0,	0600},
 	{"mpstat",		{Kmpstatqid},		0,	0600},
 	{"mpstat-raw",	{Kmpstatrawqid},	0,	0600},
+	{"kmheap",		{Kmheapqid},		0,	0600},
+	{"kmlive",		{Kmliveqid},		0,	0400},
 };
 
 static struct kprof kprof;
@@ -227,6 +232,12 @@ static struct chan *kprof_open(struct chan *c, int omode)
 		profiler_setup();
 		qunlock(&kprof.lock);
 		break;
+	case Kmheapqid:
+		c->synth_buf = kmalloc_prof_build_heap();
+		break;
+	case Kmliveqid:
+		c->synth_buf = kmalloc_prof_build_live();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -245,6 +256,10 @@ static void kprof_close(struct chan *c)
 			kprof.opened = FALSE;
 			qunlock(&kprof.lock);
 			break;
+		case Kmheapqid:
+		case Kmliveqid:
+			kfree(c->synth_buf);
+			break;
 		}
 	}
 }
@@ -324,6 +339,7 @@ static long kprof_read(struct chan *c, void *va, long n, int64_t off)
 	char *a, *ea;
 	uintptr_t offset = off;
 	uint64_t pc;
+	struct sized_alloc *sza;
 
 	switch ((int) c->qid.path) {
 	case Kprofdirqid:
@@ -343,6 +359,11 @@ static long kprof_read(struct chan *c, void *va, long n, int64_t off)
 	case Kmpstatrawqid:
 		n = mpstatraw_read(va, n, offset);
 		break;
+	case Kmheapqid:
+	case Kmliveqid:
+		sza = c->synth_buf;
+		n = readmem(offset, va, n, sza->buf, sza->size);
+		break;
 	default:
 		n = 0;
 		break;
@@ -421,6 +442,25 @@ static long kprof_write(struct chan *c, void *a, long n, int64_t unused)
 			error(EFAIL, "Bad mpstat option (reset|ipi|on|off)");
 		}
 		break;
+	case Kmheapqid:
+		if (cb->nf < 1)
+			error(EFAIL, "Bad kmheap option (start [period]|stop|reset)");
+		if (!strcmp(cb->f[0], "start")) {
+			long period = KMALLOC_PROF_DEFAULT_PERIOD;
+
+			if (cb->nf > 1)
+				period = strtol(cb->f[1], 0, 0);
+			if ((period < 1) || (period > UINT32_MAX))
+				error(EINVAL, "Bad kmheap period %ld", period);
+			kmalloc_prof_start(period);
+		} else if (!strcmp(cb->f[0], "stop")) {
+			kmalloc_prof_stop();
+		} else if (!strcmp(cb->f[0], "reset")) {
+			kmalloc_prof_reset();
+		} else {
+			error(EFAIL, "Bad kmheap option (start [period]|stop|reset)");
+		}
+		break;
 	default:
 		error(EBADFD, ERROR_FIXME);
 	}
@@ -13,6 +13,8 @@
 #include <error.h>
 #include <syscall.h>
 #include <sys/queue.h>
+#include <reclaim.h>
+#include <page_alloc.h>
 
 struct dev mem_devtab;
 
@@ -69,6 +71,10 @@ static size_t fetch_arena_stats(struct arena *arena, struct sized_alloc *sza,
 	size_t amt_imported = 0;
 	size_t empty_hash_chain = 0;
 	size_t longest_hash_chain = 0;
+	size_t nr_btags = 0;
+	size_t nr_unused_btags = 0;
+	size_t nr_free_segs = 0;
+	size_t largest_free_seg = 0;
 
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Arena: %s (%p)\n--------------\n", arena->name, arena);
@@ -79,18 +85,27 @@ static size_t fetch_arena_stats(struct arena *arena, struct sized_alloc *sza,
 	                  "\tsource: %s\n",
 	                  arena->source ? arena->source->name : "none");
 	spin_lock_irqsave(&arena->lock);
+	/* Fragmentation: how the free space is spread across the size classes.
+	 * Lots of small free segs and no big ones means xallocs will struggle. */
 	for (int i = 0; i < ARENA_NR_FREE_LISTS; i++) {
 		int j = 0;
+		size_t amt = 0;
 
 		if (!BSD_LIST_EMPTY(&arena->free_segs[i])) {
 			sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 			                  "\tList of [2^%d - 2^%d):\n", i, i + 1);
-			BSD_LIST_FOREACH(bt_i, &arena->free_segs[i], misc_link)
+			BSD_LIST_FOREACH(bt_i, &arena->free_segs[i], misc_link) {
 				j++;
+				amt += bt_i->size;
+				largest_free_seg = MAX(largest_free_seg, bt_i->size);
+			}
+			nr_free_segs += j;
 			sofar += snprintf(sza->buf + sofar, sza->size - sofar,
-			                  "\t\tNr free segs: %d\n", j);
+			                  "\t\tNr free segs: %d, amt free: %llu\n", j,
+			                  amt);
 		}
 	}
+	nr_unused_btags = arena->nr_unused_btags;
 	for (int i = 0; i < arena->hh.nr_hash_lists; i++) {
 		int j = 0;
 
@@ -104,6 +119,7 @@ static size_t fetch_arena_stats(struct arena *arena, struct sized_alloc *sza,
 	                  "\tSegments:\n\t--------------\n");
 	for (rb_i = rb_first(&arena->all_segs); rb_i; rb_i = rb_next(rb_i)) {
 		bt_i = container_of(rb_i, struct btag, all_link);
+		nr_btags++;
 		if (bt_i->status == BTAG_SPAN) {
 			nr_imports++;
 			amt_imported += bt_i->size;
@@ -132,7 +148,33 @@ static size_t fetch_arena_stats(struct arena *arena, struct sized_alloc *sza,
 	                  "\t\tNr hash %d, empty hash: %d, longest hash %d\n",
 	                  arena->hh.nr_hash_lists, empty_hash_chain,
 					  longest_hash_chain);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\t\tNr free segs: %d, largest free seg: %llu (%p)\n",
+	                  nr_free_segs, largest_free_seg, largest_free_seg);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\t\tNr btags in use: %d, nr unused btags: %d\n",
+	                  nr_btags, nr_unused_btags);
 	spin_unlock_irqsave(&arena->lock);
+	/* Racy, but these are just for reporting */
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\t\tarena_amt_free: %llu, arena_amt_total: %llu\n",
+	                  arena_amt_free(arena), arena_amt_total(arena));
+	if (arena->pcpu_caches) {
+		struct arena_pcpu_cache *pcc;
+		size_t hits = 0, misses = 0, amt_cached = 0;
+
+		for (int i = 0; i < num_cores; i++) {
+			pcc = &arena->pcpu_caches[i];
+			hits += pcc->nr_hits;
+			misses += pcc->nr_misses;
+			for (int j = 0; j < ARENA_NR_PCPU_CACHES; j++)
+				amt_cached += pcc->nr_segs[j] * (arena->quantum << j);
+		}
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\t\tPcpu cache hits: %llu, misses: %llu, "
+		                  "amt cached: %llu\n",
+		                  hits, misses, amt_cached);
+	}
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "\tImporting Arenas:\n\t-----------------\n");
 	TAILQ_FOREACH(a_i, &arena->__importing_arenas, import_link)
@@ -156,7 +198,7 @@ static struct sized_alloc *build_arena_stats(void)
 	qlock(&arenas_and_slabs_lock);
 	/* Rough guess about how many chars per arena we'll need. */
 	TAILQ_FOREACH(a_i, &all_arenas, next)
-		alloc_amt += 1000;
+		alloc_amt += 1500;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
 	TAILQ_FOREACH(a_i, &all_arenas, next)
 		sofar = fetch_arena_stats(a_i, sza, sofar);
@@ -164,6 +206,52 @@ static struct sized_alloc *build_arena_stats(void)
 	return sza;
 }
 
+/* Returns part / whole in tenths of a percent, for printing as %d.%d */
+static size_t permille(size_t part, size_t whole)
+{
+	if (!whole)
+		return 0;
+	return part * 1000 / whole;
+}
+
+/* Prints the magazine layer's hit rates, per core and overall.  A 'miss' is an
+ * alloc or free that couldn't be handled by the core's magazines and had to
+ * lock the depot.  Only cores that used the cache get a line. */
+static size_t fetch_pcpu_stats(struct kmem_cache *kc, struct sized_alloc *sza,
+                               size_t sofar)
+{
+	struct kmem_pcpu_cache *pcc;
+	size_t allocs = 0, frees = 0, alloc_misses = 0, free_misses = 0;
+	size_t hit;
+
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Pcpu caches (core: allocs/misses, frees/misses, hit%%, "
+	                  "magsize):\n");
+	/* Lockless peek at the pcpu state */
+	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
+		pcc = &kc->pcpu_caches[i];
+		if (!pcc->nr_allocs_ever && !pcc->nr_frees_ever)
+			continue;
+		allocs += pcc->nr_allocs_ever;
+		frees += pcc->nr_frees_ever;
+		alloc_misses += pcc->nr_alloc_misses;
+		free_misses += pcc->nr_free_misses;
+		hit = permille(pcc->nr_allocs_ever + pcc->nr_frees_ever
+		               - pcc->nr_alloc_misses - pcc->nr_free_misses,
+		               pcc->nr_allocs_ever + pcc->nr_frees_ever);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\t%3d: %lu/%lu, %lu/%lu, %d.%d%%, %d\n", i,
+		                  pcc->nr_allocs_ever, pcc->nr_alloc_misses,
+		                  pcc->nr_frees_ever, pcc->nr_free_misses,
+		                  hit / 10, hit % 10, pcc->magsize);
+	}
+	hit = permille(allocs + frees - alloc_misses - free_misses, allocs + frees);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "\tall: %lu/%lu, %lu/%lu, %d.%d%%\n", allocs,
+	                  alloc_misses, frees, free_misses, hit / 10, hit % 10);
+	return sofar;
+}
+
 /* Prints arena's stats to the sza, starting at sofar.  Returns the new sofar.*/
 static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
                                size_t sofar)
@@ -172,6 +260,8 @@ static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
 	struct kmem_bufctl *bc_i;
 
 	size_t nr_unalloc_objs = 0;
+	size_t nr_full = 0, nr_partial = 0, nr_empty = 0;
+	size_t amt_imported = 0;
 	size_t empty_hash_chain = 0;
 	size_t longest_hash_chain = 0;
 
@@ -184,12 +274,25 @@ static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
 	                  "Objsize (incl align): %d\n", kc->obj_size);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Align: %d\n", kc->align);
-	TAILQ_FOREACH(s_i, &kc->empty_slab_list, link) {
-		assert(!s_i->num_busy_obj);
-		nr_unalloc_objs += s_i->num_total_obj;
+	for (int i = 0; i < kc->nr_nodes; i++) {
+		TAILQ_FOREACH(s_i, &kc->nodes[i].empty_slab_list, link) {
+			assert(!s_i->num_busy_obj);
+			nr_unalloc_objs += s_i->num_total_obj;
+			nr_empty++;
+		}
+		TAILQ_FOREACH(s_i, &kc->nodes[i].partial_slab_list, link) {
+			nr_unalloc_objs += s_i->num_total_obj - s_i->num_busy_obj;
+			nr_partial++;
+		}
+		TAILQ_FOREACH(s_i, &kc->nodes[i].full_slab_list, link)
+			nr_full++;
+		amt_imported += kc->nodes[i].amt_imported;
 	}
-	TAILQ_FOREACH(s_i, &kc->partial_slab_list, link)
-		nr_unalloc_objs += s_i->num_total_obj - s_i->num_busy_obj;
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Nr slabs: full %lu, partial %lu, empty %lu\n",
+	                  nr_full, nr_partial, nr_empty);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Amt imported from source: %lu\n", amt_imported);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Nr unallocated in slab layer: %lu\n", nr_unalloc_objs);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
@@ -208,15 +311,29 @@ static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
 	                  kc->hh.nr_hash_lists, empty_hash_chain,
 					  longest_hash_chain, kc->hh.load_limit);
 	spin_unlock_irqsave(&kc->cache_lock);
-	spin_lock_irqsave(&kc->depot.lock);
-	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
-	                  "Depot magsize: %d\n", kc->depot.magsize);
-	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
-	                  "Nr empty mags: %d\n", kc->depot.nr_empty);
-	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
-	                  "Nr non-empty mags: %d\n", kc->depot.nr_not_empty);
-	spin_unlock_irqsave(&kc->depot.lock);
-	return sofar;
+	for (int i = 0; i < kc->nr_nodes; i++) {
+		struct kmem_depot *depot = &kc->nodes[i].depot;
+
+		if (kc->nr_nodes > 1)
+			sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+			                  "NUMA node %d, source %s, amt imported %lu\n", i,
+			                  kc->nodes[i].source->name,
+			                  kc->nodes[i].amt_imported);
+		spin_lock_irqsave(&depot->lock);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "Depot magsize: %d\n", depot->magsize);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "Nr empty mags: %d\n", depot->nr_empty);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "Nr non-empty mags: %d\n", depot->nr_not_empty);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "Depot locks: %lu, contended: %lu, "
+		                  "magsize grows: %lu\n",
+		                  depot->nr_lock_acquires, depot->nr_lock_contended,
+		                  depot->nr_magsize_grows);
+		spin_unlock_irqsave(&depot->lock);
+	}
+	return fetch_pcpu_stats(kc, sza, sofar);
 }
 
 static struct sized_alloc *build_slab_stats(void)
@@ -227,8 +344,9 @@ static struct sized_alloc *build_slab_stats(void)
 	struct kmem_cache *kc_i;
 
 	qlock(&arenas_and_slabs_lock);
+	/* Rough guess: the fixed stats, plus a line per node and per core. */
 	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
-		alloc_amt += 500;
+		alloc_amt += 800 + 300 * kc_i->nr_nodes + 80 * kmc_nr_pcpu_caches();
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
 	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
 		sofar = fetch_slab_stats(kc_i, sza, sofar);
@@ -259,6 +377,11 @@ static struct sized_alloc *build_free(void)
 	                  "Used Memory  : %15llu\n", amt_alloc);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Free Memory  : %15llu\n", amt_total - amt_alloc);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Low Watermark: %15llu\n",
+	                  mem_watermark(RECLAIM_WMARK_LOW));
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Reclaimed    : %15llu\n", mem_amt_reclaimed());
 	return sza;
 }
 
@@ -298,10 +421,12 @@ static size_t fetch_slab_line(struct kmem_cache *kc, struct sized_alloc *sza,
 	size_t nr_allocs_ever = 0;
 
 	spin_lock_irqsave(&kc->cache_lock);
-	TAILQ_FOREACH(s_i, &kc->empty_slab_list, link)
-		nr_unalloc_objs += s_i->num_total_obj;
-	TAILQ_FOREACH(s_i, &kc->partial_slab_list, link)
-		nr_unalloc_objs += s_i->num_total_obj - s_i->num_busy_obj;
+	for (int i = 0; i < kc->nr_nodes; i++) {
+		TAILQ_FOREACH(s_i, &kc->nodes[i].empty_slab_list, link)
+			nr_unalloc_objs += s_i->num_total_obj;
+		TAILQ_FOREACH(s_i, &kc->nodes[i].partial_slab_list, link)
+			nr_unalloc_objs += s_i->num_total_obj - s_i->num_busy_obj;
+	}
 	spin_unlock_irqsave(&kc->cache_lock);
 	/* Lockless peak at the pcpu state */
 	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
@@ -93,6 +93,11 @@ enum {
 	CMstraceme,
 	CMstraceall,
 	CMstraceoff,
+	CMweight,
+	CMlatency,
+	CMbatch,
+	CMpool,
+	CMpreemptwarn,
 };
 
 enum {
@@ -160,6 +165,11 @@ struct cmdtab proccmd[] = {
 	{CMstraceme, "straceme", 0},
 	{CMstraceall, "straceall", 0},
 	{CMstraceoff, "straceoff", 0},
+	{CMweight, "weight", 2},
+	{CMlatency, "latency", 2},
+	{CMbatch, "batch", 1},
+	{CMpool, "pool", 2},
+	{CMpreemptwarn, "preemptwarn", 3},
 };
 
 /*
@@ -1333,6 +1343,7 @@ static void procctlreq(struct proc *p, char *va, int n)
 	ERRSTACK(1);
 	int8_t irq_state = 0;
 	int npc, pri, core;
+	unsigned long weight, latency;
 	struct cmdbuf *cb;
 	struct cmdtab *ct;
 	int64_t time;
@@ -1420,6 +1431,43 @@ static void procctlreq(struct proc *p, char *va, int n)
 		p->strace_on = FALSE;
 		p->strace_inherit = FALSE;
 		break;
+	/* Anyone can lower their priority, but only eve can raise it */
+	case CMweight:
+		weight = strtoul(cb->f[1], 0, 0);
+		if ((weight > p->ksched_data.weight) && !iseve())
+			error(EPERM, "Only the hostowner can raise a weight");
+		if (ksched_set_weight(p, weight))
+			error(EINVAL, "weight must be 1 to %d", KSCHED_MAX_WEIGHT);
+		break;
+	case CMlatency:
+		latency = strtoul(cb->f[1], 0, 0);
+		/* Any latency target beats batch (0), and tighter beats looser */
+		if (latency && (!p->ksched_data.latency_usec ||
+		                (latency < p->ksched_data.latency_usec)) && !iseve())
+			error(EPERM, "Only the hostowner can tighten a latency target");
+		if (ksched_set_latency(p, latency))
+			error(EINVAL, "latency must be 0 to %d usec",
+			      KSCHED_MAX_LATENCY_USEC);
+		break;
+	case CMbatch:
+		ksched_set_latency(p, 0);
+		break;
+	case CMpool:
+		if (corepool_set_proc(p, cb->f[1],
+		                      iseve() ? NULL : current->user.name))
+			error(get_errno(), "Can't move to pool %s", cb->f[1]);
+		break;
+	case CMpreemptwarn:
+#ifdef CONFIG_PREEMPT_WARN_CTL
+		if (!iseve())
+			error(EPERM, "Only the hostowner can warn vcores");
+		if (!proc_preempt_warn_vcore(p, strtoul(cb->f[1], 0, 0),
+		                             strtoul(cb->f[2], 0, 0)))
+			error(EINVAL, "vcore %s is not running", cb->f[1]);
+#else
+		error(ENOSYS, "Build with CONFIG_PREEMPT_WARN_CTL");
+#endif
+		break;
 	}
 	poperror();
 	kfree(cb);
@@ -0,0 +1,209 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * #sched: the ksched and vcore event tracer.
+ *
+ * ctl: write start, stop, or reset.  Reads back whether we're tracing and how
+ *      many events were recorded since the last reset.
+ * trace: a binary snapshot of the trace, taken when the file is opened.  See
+ *        ros/sched_trace.h.  tools/dev-util/schedtrace turns it into per-core
+ *        timelines.
+ * pools: the core pools (see corepool.h), as of when the file is opened.
+ *        Write one of:
+ *        create NAME PARENT MIN MAX
+ *        limits NAME MIN MAX
+ *        weight NAME WEIGHT
+ *        remove NAME
+ *        Processes join pools through their #proc ctl. */
+
+#include <ros/common.h>
+#include <ros/errno.h>
+#include <sched_trace.h>
+#include <schedule.h>
+#include <syscall.h>
+#include <smp.h>
+#include <ns.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <err.h>
+
+enum {
+	Schdirqid = 0,
+	Schctlqid,
+	Schtraceqid,
+	Schpoolsqid,
+};
+
+static char sched_ctl_usage[] = "start|stop|reset";
+static char sched_pools_usage[] =
+	"create NAME PARENT MIN MAX|limits NAME MIN MAX|weight NAME WEIGHT|"
+	"remove NAME";
+
+struct dev schedevtab;
+static struct dirtab schedtab[] = {
+	{".",			{Schdirqid,		0, QTDIR}, 0,	DMDIR|0550},
+	{"ctl",			{Schctlqid},	0,	0600},
+	{"trace",		{Schtraceqid},	0,	0400},
+	{"pools",		{Schpoolsqid},	0,	0600},
+};
+
+static struct chan *sched_attach(char *spec)
+{
+	return devattach(schedevtab.name, spec);
+}
+
+static struct walkqid *sched_walk(struct chan *c, struct chan *nc, char **name,
+                                  int nname)
+{
+	return devwalk(c, nc, name, nname, schedtab, ARRAY_SIZE(schedtab), devgen);
+}
+
+static int sched_stat(struct chan *c, uint8_t *db, int n)
+{
+	return devstat(c, db, n, schedtab, ARRAY_SIZE(schedtab), devgen);
+}
+
+static struct chan *sched_open(struct chan *c, int omode)
+{
+	if (c->qid.type & QTDIR) {
+		if (openmode(omode) != O_READ)
+			error(EPERM, ERROR_FIXME);
+	}
+	switch ((int) c->qid.path) {
+	case Schtraceqid:
+		c->synth_buf = sched_trace_build();
+		break;
+	case Schpoolsqid:
+		c->synth_buf = corepool_build_status();
+		break;
+	}
+	c->mode = openmode(omode);
+	c->flag |= COPEN;
+	c->offset = 0;
+	return c;
+}
+
+static void sched_close(struct chan *c)
+{
+	if (!(c->flag & COPEN))
+		return;
+	switch ((int) c->qid.path) {
+	case Schtraceqid:
+	case Schpoolsqid:
+		kfree(c->synth_buf);
+		break;
+	}
+}
+
+static long sched_ctl_read(void *va, long n, int64_t off)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%s %lu\n", sched_trace_on ? "on" : "off",
+	         sched_trace_nr_events());
+	return readstr(off, va, n, buf);
+}
+
+static long sched_read(struct chan *c, void *va, long n, int64_t off)
+{
+	struct sized_alloc *sza;
+
+	switch ((int) c->qid.path) {
+	case Schdirqid:
+		return devdirread(c, va, n, schedtab, ARRAY_SIZE(schedtab), devgen);
+	case Schctlqid:
+		return sched_ctl_read(va, n, off);
+	case Schtraceqid:
+	case Schpoolsqid:
+		sza = c->synth_buf;
+		return readmem(off, va, n, sza->buf, sza->size);
+	default:
+		error(EINVAL, ERROR_FIXME);
+	}
+	return 0;
+}
+
+static void sched_pools_write(struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		error(EFAIL, sched_pools_usage);
+	if (!strcmp(cb->f[0], "create")) {
+		if (cb->nf != 5)
+			error(EFAIL, sched_pools_usage);
+		if (corepool_create(cb->f[1], cb->f[2], strtoul(cb->f[3], 0, 0),
+		                    strtoul(cb->f[4], 0, 0)))
+			error(get_errno(), "Can't create pool %s under %s", cb->f[1],
+			      cb->f[2]);
+	} else if (!strcmp(cb->f[0], "limits")) {
+		if (cb->nf != 4)
+			error(EFAIL, sched_pools_usage);
+		if (corepool_set_limits(cb->f[1], strtoul(cb->f[2], 0, 0),
+		                        strtoul(cb->f[3], 0, 0)))
+			error(get_errno(), "Can't set pool %s's limits", cb->f[1]);
+	} else if (!strcmp(cb->f[0], "weight")) {
+		if (cb->nf != 3)
+			error(EFAIL, sched_pools_usage);
+		if (corepool_set_weight(cb->f[1], strtoul(cb->f[2], 0, 0)))
+			error(get_errno(), "Weight must be 1 to %d", KSCHED_MAX_WEIGHT);
+	} else if (!strcmp(cb->f[0], "remove")) {
+		if (corepool_remove(cb->f[1]))
+			error(get_errno(), "Can't remove pool %s", cb->f[1]);
+	} else {
+		error(EFAIL, sched_pools_usage);
+	}
+}
+
+static long sched_write(struct chan *c, void *a, long n, int64_t unused)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb = parsecmd(a, n);
+
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	switch ((int) c->qid.path) {
+	case Schctlqid:
+		if (cb->nf < 1)
+			error(EFAIL, sched_ctl_usage);
+		if (!strcmp(cb->f[0], "start"))
+			sched_trace_start();
+		else if (!strcmp(cb->f[0], "stop"))
+			sched_trace_stop();
+		else if (!strcmp(cb->f[0], "reset"))
+			sched_trace_reset();
+		else
+			error(EFAIL, sched_ctl_usage);
+		break;
+	case Schpoolsqid:
+		sched_pools_write(cb);
+		break;
+	default:
+		error(EBADFD, ERROR_FIXME);
+	}
+	kfree(cb);
+	poperror();
+	return n;
+}
+
+struct dev schedevtab __devtab = {
+	.name = "sched",
+
+	.reset = devreset,
+	.init = devinit,
+	.shutdown = devshutdown,
+	.attach = sched_attach,
+	.walk = sched_walk,
+	.stat = sched_stat,
+	.open = sched_open,
+	.create = devcreate,
+	.close = sched_close,
+	.read = sched_read,
+	.bread = devbread,
+	.write = sched_write,
+	.bwrite = devbwrite,
+	.remove = devremove,
+	.wstat = devwstat,
+};
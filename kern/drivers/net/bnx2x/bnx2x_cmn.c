@@ -2030,6 +2030,7 @@ static int bnx2x_set_real_num_queues(struct bnx2x *bp, int include_cnic)
 		return rc;
 	}
 #else
+	bp->dev->nrxq = rx;
 	rc = 0;
 #endif
 
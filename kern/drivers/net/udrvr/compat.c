@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <error.h>
 #include <pmap.h>
+#include <pagemap.h>
 #include <smp.h>
 #include <devfs.h>
 #include <linux/rdma/ib_user_verbs.h>
@@ -79,7 +80,10 @@ int map_upage_at_addr(struct proc *p, physaddr_t paddr, uintptr_t addr, int ptep
 
 void set_page_dirty_lock(struct page *pagep)
 {
-	atomic_or(&pagep->pg_flags, PG_DIRTY);
+	if (atomic_read(&pagep->pg_flags) & PG_PAGEMAP)
+		pm_page_set_dirty(pagep);
+	else
+		atomic_or(&pagep->pg_flags, PG_DIRTY);
 }
 
 void put_page(struct page *pagep)
@@ -117,7 +121,8 @@ int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
 			goto err1;
 		pte_write(pte, page2pa(pp), prot);
 	} else {
-		pp = pa2page(pte_get_paddr(pte));
+		/* page_lookup() gets the right page within a jumbo */
+		pp = page_lookup(p->env_pgdir, (void*)uvastart, NULL);
 
 		/* __vmr_free_pgs() refcnt's pagemap pages differently */
 		if (atomic_read(&pp->pg_flags) & PG_PAGEMAP) {
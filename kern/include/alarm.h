@@ -93,6 +93,7 @@ struct timer_chain {
 	struct awaiters_tailq		waiters;
 	uint64_t					earliest_time;
 	uint64_t					latest_time;
+	uint64_t					armed_time;		/* hw deadline, 0 if off */
 	void (*set_interrupt)(struct timer_chain *);
 };
 
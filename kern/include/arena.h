@@ -43,6 +43,22 @@ BSD_LIST_HEAD(btag_list, btag);
 #define ARENA_NR_FREE_LISTS		64
 #define ARENA_NAME_SZ			32
 
+/* Per-core caches of recently freed, naturally aligned segments of quantum << i
+ * for i < ARENA_NR_PCPU_CACHES.  These serve xallocs that only care about
+ * alignment (e.g. get_cont_pages()) without touching the arena lock.  The
+ * per-core lock is only contended when someone drains the caches. */
+#define ARENA_NR_PCPU_CACHES	6
+#define ARENA_PCPU_CACHE_DEPTH	4
+
+struct arena_pcpu_cache {
+	spinlock_t					lock;
+	unsigned int				nr_segs[ARENA_NR_PCPU_CACHES];
+	void						*segs[ARENA_NR_PCPU_CACHES]
+	                                 [ARENA_PCPU_CACHE_DEPTH];
+	size_t						nr_hits;
+	size_t						nr_misses;
+};
+
 /* Forward declarations of import lists */
 struct arena;
 TAILQ_HEAD(arena_tailq, arena);
@@ -61,6 +77,7 @@ struct arena {
 	struct kmem_cache			*qcaches;
 	struct rb_root				all_segs;		/* BTs, using all_link */
 	struct btag_list			unused_btags;	/* BTs, using misc_link */
+	size_t						nr_unused_btags;
 	struct btag_list			*alloc_hash;	/* BTs, using misc_link */
 	struct hash_helper			hh;
 	void *(*afunc)(struct arena *, size_t, int);
@@ -70,6 +87,7 @@ struct arena {
 	size_t						amt_alloc_segs;
 	size_t						nr_allocs_ever;
 	uintptr_t					last_nextfit_alloc;
+	struct arena_pcpu_cache		*pcpu_caches;	/* NULL if no qcaches */
 	struct btag_list			free_segs[ARENA_NR_FREE_LISTS];
 	struct btag_list			static_hash[HASH_INIT_SZ];
 
@@ -110,6 +128,7 @@ void arena_xfree(struct arena *arena, void *addr, size_t size);
 
 size_t arena_amt_free(struct arena *arena);
 size_t arena_amt_total(struct arena *arena);
+void arena_reap_qcaches(struct arena *arena);
 
 /* All lists that track the existence of arenas, slabs, and the connections
  * between them are tracked by a global qlock.  For the most part, slabs/arenas
@@ -124,6 +143,10 @@ void del_importing_slab(struct arena *source, struct kmem_cache *importer);
 /* Low-level memory allocator intefaces */
 extern struct arena *base_arena;
 extern struct arena *kpages_arena;
+/* Per-NUMA-domain arenas, indexed by numa_id.  Domain 0's are base_arena and
+ * kpages_arena.  These are NULL until kpages_numa_init(). */
+extern struct arena **base_numa_arenas;
+extern struct arena **kpages_numa_arenas;
 struct arena *arena_builder(void *pgaddr, char *name, size_t quantum,
                             void *(*afunc)(struct arena *, size_t, int),
                             void (*ffunc)(struct arena *, void *, size_t),
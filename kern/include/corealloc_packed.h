@@ -0,0 +1,44 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Topology-aware core allocation.  Beyond a process's provisioned cores, we
+ * try to keep an MCP's cores on as few sockets (and thus LLCs) as possible,
+ * pair or split hyperthreads as the process asks, and start new MCPs on the
+ * least busy NUMA node. */
+
+#pragma once
+
+/* The core request algorithm maintains an internal array of these: the
+ * global pcore map. Note the prov_proc and alloc_proc are weak (internal)
+ * references, and should only be used as a ref source while the ksched has a
+ * valid kref. */
+struct sched_pcore {
+	TAILQ_ENTRY(sched_pcore)   prov_next;    /* on a proc's prov list */
+	struct proc                *prov_proc;   /* who this is prov to */
+	struct proc                *alloc_proc;  /* who this is alloc to */
+	struct sched_pcore         *sibling;     /* ring of cores on our cpu */
+	int                        numa_id;
+	int                        socket_id;
+	bool                       usable;       /* ever given out (not LL, etc) */
+	bool                       idle;
+};
+TAILQ_HEAD(sched_pcore_tailq, sched_pcore);
+
+struct core_request_data {
+	struct sched_pcore_tailq  prov_alloc_me;      /* prov cores alloced us */
+	struct sched_pcore_tailq  prov_not_alloc_me;  /* maybe alloc to others */
+};
+
+static inline uint32_t spc2pcoreid(struct sched_pcore *spc)
+{
+	extern struct sched_pcore *all_pcores;
+
+	return spc - all_pcores;
+}
+
+static inline struct sched_pcore *pcoreid2spc(uint32_t pcoreid)
+{
+	extern struct sched_pcore *all_pcores;
+
+	return &all_pcores[pcoreid];
+}
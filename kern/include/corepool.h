@@ -0,0 +1,83 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Core pools: named groups of processes that share cores.  Pools form a tree
+ * under the root pool, which is every core the ksched can give out.  Each pool
+ * has a min, which it is guaranteed if its members want that many, a max,
+ * which its members can never exceed together, and a weight for splitting its
+ * parent's spare cores with its siblings.  A process is in exactly one pool,
+ * which it inherits from its parent.  Only the user that created a pool (or the
+ * hostowner) can move processes into it.
+ *
+ * Every MCP ksched pass, the pools split their cores top down: first each
+ * child pool's min, then the rest by weight, with the pool's own members
+ * counting as one more child.  The MCP policy then splits each pool's own share
+ * among its members.  The result is each MCP's entitlement, so the ksched
+ * balances cores inside a pool first.  Idle cores are still lent to anyone
+ * (up to their pools' maxes), and a pool below its entitlement reclaims lent
+ * cores by preempting MCPs above theirs, the same way MCPs do under the share
+ * and deadline policies.  FCFS doesn't entitle anyone to anything, so under it
+ * the pools only enforce their maxes.
+ *
+ * Everything here is protected by the sched_lock. */
+
+#pragma once
+
+#include <schedule.h>
+
+#define CORE_POOL_NAMELEN			32
+#define CORE_POOL_MAX_DEPTH			8
+/* Bounds __split_pool()'s claims, which are on the stack */
+#define CORE_POOL_MAX_CHILDREN		16
+
+struct core_pool {
+	char						name[CORE_POOL_NAMELEN];
+	struct core_pool			*parent;
+	char						*owner;			/* NULL for the root */
+	TAILQ_ENTRY(core_pool)		link;			/* on the list of all pools */
+	unsigned int				depth;
+	uint32_t					min_cores;
+	uint32_t					max_cores;
+	unsigned int				weight;
+	unsigned int				nr_procs;
+	unsigned int				nr_children;
+	/* set by corepool_plan() each ksched pass */
+	struct proc_list			mcps;
+	uint32_t					demand;			/* capped at max_cores */
+	uint32_t					own_demand;		/* of our own members */
+	uint32_t					entitled;
+	uint32_t					own_share;		/* for our own members */
+	uint32_t					nr_alloc;		/* for __corepool_room() */
+};
+TAILQ_HEAD(core_pool_tailq, core_pool);
+
+extern struct core_pool root_core_pool;
+extern unsigned int nr_core_pools;
+
+void corepool_init(void);
+void __corepool_add_proc(struct proc *p, struct proc *parent);
+void __corepool_remove_proc(struct proc *p);
+
+/* Sets every MCP's ksched_data.demand and .entitled, and leaves mcps in the
+ * policy's order. */
+void __corepool_plan(struct proc_list *mcps);
+
+/* How many more cores p can get before its pool, or a pool above it, hits its
+ * max. */
+uint32_t __corepool_room(struct proc *p);
+
+/* These return 0 on success, or -1 and set errno.  The caller allocates new
+ * pools, and frees removed ones after unlocking. */
+int __corepool_create(struct core_pool *cp, const char *name,
+                      const char *parent, uint32_t min_cores,
+                      uint32_t max_cores);
+int __corepool_set_limits(const char *name, uint32_t min_cores,
+                          uint32_t max_cores);
+int __corepool_set_weight(const char *name, unsigned int weight);
+struct core_pool *__corepool_remove(const char *name);
+/* user is whoever is asking, or NULL for the hostowner, who can use any pool */
+int __corepool_set_proc(struct proc *p, const char *name, const char *user);
+
+/* One line per pool, about this long */
+#define CORE_POOL_LINE_SZ			(2 * CORE_POOL_NAMELEN + 8 * 11 + 2)
+size_t __corepool_print(char *buf, size_t bufsz);
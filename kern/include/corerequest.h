@@ -11,6 +11,8 @@
 #include <arch/topology.h>
 #if defined(CONFIG_COREALLOC_FCFS)
   #include <corealloc_fcfs.h>
+#elif defined(CONFIG_COREALLOC_PACKED)
+  #include <corealloc_packed.h>
 #endif
 
 /* Initialize any data assocaited with doing core allocation. */
@@ -86,15 +88,19 @@ static inline struct proc *get_prov_proc(uint32_t pcoreid)
 	return all_pcores[pcoreid].prov_proc;
 }
 
-/* TODO: need more thorough CG/LL management.  For now, core0 is the only LL
- * core.  This won't play well with the ghetto shit in schedule_init() if you do
- * anything like 'DEDICATED_MONITOR' or the ARSC server.  All that needs an
- * overhaul. */
+/* TODO: need more thorough CG/LL management.  For now, the LL cores are cores
+ * 0 through CONFIG_NR_LL_CORES - 1, and we always leave at least one CG core.
+ * Only core 0 runs SCPs.  This won't play well with the ghetto shit in
+ * schedule_init() if you do anything like 'DEDICATED_MONITOR' or the ARSC
+ * server.  All that needs an overhaul. */
+static inline uint32_t nr_ll_cores(void)
+{
+	return MAX(MIN(CONFIG_NR_LL_CORES, num_cores - 1), 1);
+}
+
 static inline bool is_ll_core(uint32_t pcoreid)
 {
-	if (pcoreid == 0)
-		return TRUE;
-	return FALSE;
+	return pcoreid < nr_ll_cores();
 }
 
 /* Normally it'll be the max number of CG cores ever */
@@ -102,8 +108,9 @@ static inline uint32_t max_vcores(struct proc *p)
 {
 /* TODO: (CG/LL) */
 #ifdef CONFIG_DISABLE_SMT
-	return num_cores >> 1;
+	/* odd cores, minus the odd LL cores */
+	return (num_cores >> 1) - (nr_ll_cores() >> 1);
 #else
-	return num_cores - 1;	/* reserving core 0 */
+	return num_cores - nr_ll_cores();	/* reserving the LL cores */
 #endif /* CONFIG_DISABLE_SMT */
 }
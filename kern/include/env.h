@@ -16,6 +16,7 @@
 #include <arch/arch.h>
 #include <sys/queue.h>
 #include <atomic.h>
+#include <rcu.h>
 #include <mm.h>
 #include <vfs.h>
 #include <schedule.h>
@@ -52,6 +53,8 @@ struct proc {
 	char *binary_path;
 
 	pid_t pid;
+	struct proc *pid_hash_next;	/* protected by the pid_hash_lock */
+	struct rcu_head rcu;
 	/* Tempting to add a struct proc *parent, but we'd need to protect the use
 	 * of that reference from concurrent parent-death (letting init inherit
 	 * children, etc), which is basically what we do when we do pid2proc.  If we
@@ -13,7 +13,12 @@
 
 void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
                 uint32_t vcoreid);
+void send_event_batch(struct proc *p, struct event_queue *ev_q,
+                      struct event_msg *msgs, unsigned int nr,
+                      uint32_t vcoreid);
 void send_kernel_event(struct proc *p, struct event_msg *msg, uint32_t vcoreid);
+void send_kernel_event_batch(struct proc *p, struct event_msg *msgs,
+                             unsigned int nr, uint32_t vcoreid);
 void post_vcore_event(struct proc *p, struct event_msg *msg, uint32_t vcoreid,
                       int ev_flags);
 void send_posix_signal(struct proc *p, int sig_nr);
@@ -29,6 +29,7 @@
 
 #pragma once
 #include <ns.h>
+#include <rcu.h>
 
 enum {
 	Addrlen = 64,
@@ -265,7 +266,9 @@ struct Ipmulti {
  *  hash table for 2 ip addresses + 2 ports
  */
 enum {
-	Nipht = 521,				/* convenient prime */
+	Niphtlocks = 64,			/* power of 2, no more than the first table */
+	Iphtbits = 6,				/* log2 of the first table's size */
+	Iphtmaxbits = 20,
 
 	IPmatchexact = 0,	/* match on 4 tuple */
 	IPmatchany,	/* *!* */
@@ -274,18 +277,38 @@ enum {
 	IPmatchpa,	/* addr!port */
 };
 struct Iphash {
-	struct Iphash *next;
+	struct Iphash *next[2];		/* one per table, see Iphtab.link */
 	struct conv *c;
 	int match;
+	uint32_t hv;
+	struct rcu_head rcu;
 };
 
-struct Iphash;
+/* One size of the table.  When the table grows, every entry is linked into the
+ * new one through its other next pointer, so lookups still walking the old one
+ * don't notice. */
+struct Iphtab {
+	struct Ipht *ht;
+	uint32_t mask;
+	int link;					/* which of Iphash.next we use */
+	struct rcu_head rcu;
+	struct Iphash *tab[];
+};
+
+/* Lookups are under RCU.  Writers hold the lock for the bucket, picked by the
+ * low bits of the hash, so a bucket keeps its lock when the table grows.
+ * Growing takes all of them. */
 struct Ipht {
-	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	struct Iphtab *tab;
+	spinlock_t locks[Niphtlocks];
+	atomic_t nentries;
+	bool retiring;				/* the last table isn't freed yet */
+	unsigned int ngrows;
 };
+void iphtinit(struct Ipht *);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
+char *iphtstats(struct Ipht *, char *p, char *e);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp);
 
@@ -607,6 +630,31 @@ extern uint8_t IPnoaddr[IPaddrlen];
 extern uint8_t v4prefix[IPaddrlen];
 extern uint8_t IPallbits[IPaddrlen];
 
+/*
+ *  gro.c: coalescing received TCP segments, one per ether reader
+ */
+enum {
+	GRO_FLOWS = 8,				/* flows held at once */
+	GRO_BATCH = 64,				/* most packets read between flushes */
+};
+
+struct groflow {
+	struct block *bp;			/* what we have so far */
+	uint32_t nxtseq;			/* seq the next segment has to have */
+};
+
+struct gro {
+	struct Fs *f;
+	struct Ipifc *ifc;
+	int nflows;
+	struct groflow flows[GRO_FLOWS];
+};
+
+extern void gro_init(struct gro *, struct Fs *, struct Ipifc *);
+extern void gro_input(struct gro *, struct block *);
+extern void gro_flush(struct gro *);
+extern void gro_drop(struct gro *);
+
 /*
  *  media
  */
@@ -946,6 +994,9 @@ struct netfile {
 	int scan;					/* base station scanning interval */
 	int bridge;					/* bridge mode */
 	int headersonly;			/* headers only - no data */
+	int fanout;					/* share the type's packets by flow */
+	int fanoutid;				/* our place in the fanout group */
+	int nfanout;				/* size of the fanout group */
 	uint8_t maddr[8];			/* bitmask of multicast addresses requested */
 	int nmaddr;					/* number of multicast addresses */
 
@@ -997,6 +1048,7 @@ struct netif {
 	int mbps;					/* megabits per sec */
 	int link;					/* link status */
 	unsigned int feat;				/* dev features */
+	int nrxq;					/* hw receive queues, 0 if unknown */
 	uint8_t addr[Nmaxaddr];
 	uint8_t bcast[Nmaxaddr];
 	struct netaddr *maddr;		/* known multicast addresses */
@@ -1032,6 +1084,7 @@ struct chan *netifopen(struct ether *, struct chan *, int);
 void netifclose(struct ether *, struct chan *);
 long netifread(struct ether *, struct chan *, void *, long, uint32_t);
 struct block *netifbread(struct ether *, struct chan *, long, uint32_t);
+struct queue *netifinq(struct ether *, struct chan *);
 long netifwrite(struct ether *, struct chan *, void *, long);
 int netifwstat(struct ether *, struct chan *, uint8_t *, int);
 int netifstat(struct ether *, struct chan *, uint8_t *, int);
@@ -1056,7 +1109,8 @@ struct etherpkt {
 enum {
 	MaxEther = 32,
 	MaxFID = 16,
-	Ntypes = 8,
+	MaxRxQ = 8,		/* fanned-out readers per type */
+	Ntypes = 8 + MaxRxQ,
 };
 
 struct ether {
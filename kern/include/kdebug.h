@@ -32,6 +32,8 @@ void backtrace_user_ctx(struct proc *p, struct user_context *ctx);
 /* Backtraces a PC/FP, stores results in *pcs, with no protections */
 size_t backtrace_list(uintptr_t pc, uintptr_t fp, uintptr_t *pcs,
                       size_t nr_slots);
+/* Backtraces the calling kernel context, stores results in *pcs */
+size_t backtrace_list_here(uintptr_t *pcs, size_t nr_slots);
 /* Backtraces a user PC/FP, stores results in *pcs */
 size_t backtrace_user_list(uintptr_t pc, uintptr_t fp, uintptr_t *pcs,
 						   size_t nr_slots);
@@ -45,6 +45,8 @@ void *debug_canary;
 #define KMALLOC_TAG_UNALIGN		3	/* not a real tag, jump back by offset */
 #define KMALLOC_ALIGN_SHIFT		4	/* max flag is 16 */
 #define KMALLOC_FLAG_MASK		((1 << KMALLOC_ALIGN_SHIFT) - 1)
+/* Flag specific data for CACHE and PAGES tags.  SAMPLED: see kmalloc_prof. */
+#define KMALLOC_FLAG_SAMPLED	(1 << KMALLOC_ALIGN_SHIFT)
 
 #define KMALLOC_CANARY 0xdeadbabe
 
@@ -0,0 +1,27 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Sampled kmalloc profiler.  When running, every Nth kmalloc on a core records
+ * its backtrace and size.  Sampled buffers are tracked until they are freed, so
+ * we can report both what was allocated and what is still live, by call site.
+ * #kprof/kmheap is a pprof heap profile, and #kprof/kmlive lists the live
+ * samples with their ages, for hunting slow leaks. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <kmalloc.h>
+
+#define KMALLOC_PROF_DEFAULT_PERIOD		1024
+
+/* 0 when the profiler is off.  Checked on every kmalloc. */
+extern unsigned int kmalloc_prof_period;
+
+void kmalloc_prof_alloc(struct kmalloc_tag *tag, size_t size);
+void kmalloc_prof_free(struct kmalloc_tag *tag);
+
+void kmalloc_prof_start(unsigned int period);
+void kmalloc_prof_stop(void);
+void kmalloc_prof_reset(void);
+struct sized_alloc *kmalloc_prof_build_heap(void);
+struct sized_alloc *kmalloc_prof_build_live(void);
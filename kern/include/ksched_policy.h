@@ -0,0 +1,33 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * MCP ksched policies.  At the start of every MCP ksched pass, the policy
+ * orders the MCPs (who gets serviced first) and sets how many cores each is
+ * entitled to.  It does this for each core pool (see corepool.h), over the
+ * pool's own members and its share of the cores.  An MCP can always take idle
+ * cores beyond its entitlement, but an MCP below its entitlement can preempt
+ * cores from MCPs above theirs.
+ *
+ * All of these are called with the sched_lock held. */
+
+#pragma once
+
+#include <schedule.h>
+
+struct ksched_policy {
+	char						*name;
+	/* Returns TRUE if a should be serviced before b.  NULL keeps the order
+	 * the MCPs asked in. */
+	bool (*before)(struct proc *a, struct proc *b);
+	/* Sets ksched_data.demand and .entitled for every MCP on mcps, splitting
+	 * up to avail cores. */
+	void (*plan)(struct proc_list *mcps, uint32_t avail);
+};
+
+extern struct ksched_policy *ksched_policy;
+
+/* How many cores p wants, as far as the policies are concerned */
+uint32_t ksched_mcp_demand(struct proc *p);
+
+/* Sorts mcps with the policy's before(), if it has one. */
+void ksched_sort_mcps(struct proc_list *mcps);
@@ -28,6 +28,8 @@ TAILQ_HEAD(semaphore_tailq, semaphore);
 
 #define KTH_IS_KTASK			(1 << 0)
 #define KTH_SAVE_ADDR_SPACE		(1 << 1)
+#define KTH_PINNED				(1 << 2)
+#define KTH_IN_RECLAIM			(1 << 3)
 #define KTH_KTASK_FLAGS			(KTH_IS_KTASK)
 #define KTH_DEFAULT_FLAGS		(KTH_SAVE_ADDR_SPACE)
 
@@ -43,6 +45,7 @@ struct kthread {
 	TAILQ_ENTRY(kthread)		link;
 	/* ID, other shit, etc */
 	int							flags;
+	uint32_t					pinned_core;	/* if KTH_PINNED */
 	char						*name;
 	char						generic_buf[GENBUF_SZ];
 	struct systrace_record		*strace;
@@ -107,6 +110,7 @@ void kthread_runnable(struct kthread *kthread);
 void kthread_yield(void);
 void kthread_usleep(uint64_t usec);
 void ktask(char *name, void (*fn)(void*), void *arg);
+void ktask_pinned(uint32_t coreid, char *name, void (*fn)(void*), void *arg);
 
 static inline bool is_ktask(struct kthread *kthread)
 {
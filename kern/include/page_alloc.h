@@ -32,6 +32,7 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_JUMBO		0x040	/* part of a jumbo allocation, see pg_private */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -74,6 +75,13 @@ void free_cont_pages(void *buf, size_t order);
 
 void page_decref(page_t *page);
 
+struct page *jumbo_page_alloc(size_t order, bool zero);
+int jumbo_page_split(struct page *page, size_t child_order);
+void jumbo_page_unsplit(struct page *page, size_t child_order);
+size_t jumbo_page_order(struct page *page);
+void page_zero_pool_init(void);
+void page_zero_pool_drain(void);
+
 int page_is_free(size_t ppn);
 void lock_page(struct page *page);
 void unlock_page(struct page *page);
@@ -84,3 +92,8 @@ static inline bool page_is_pagemap(struct page *page)
 {
 	return atomic_read(&page->pg_flags) & PG_PAGEMAP ? true : false;
 }
+
+static inline bool page_is_jumbo(struct page *page)
+{
+	return atomic_read(&page->pg_flags) & PG_JUMBO ? true : false;
+}
@@ -35,6 +35,7 @@ struct page_map {
 	spinlock_t					pm_lock;
 	struct vmr_tailq			pm_vmrs;
 	atomic_t					pm_removal;
+	TAILQ_ENTRY(page_map)		pm_link;		/* all_page_maps */
 };
 
 /* Operations performed on a page_map.  These are usually FS specific, which
@@ -58,12 +59,15 @@ struct page_map_operations {
 
 /* Page cache functions */
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
+void pm_destroy(struct page_map *pm);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
 void pm_put_page(struct page *page);
+void pm_page_set_dirty(struct page *page);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 int pm_remove_contig(struct page_map *pm, unsigned long index,
                      unsigned long nr_pgs);
+unsigned long pm_reclaim_clean(unsigned long nr_wanted);
 void print_page_map_info(struct page_map *pm);
@@ -78,6 +78,7 @@ bool enable_pse(void);
 void vm_init(void);
 
 void pmem_init(struct multiboot_info *mbi);
+void kpages_numa_init(void);
 void *boot_alloc(size_t amt, size_t align);
 void *boot_zalloc(size_t amt, size_t align);
 
@@ -100,11 +101,15 @@ void map_segment(pgdir_t pgdir, uintptr_t va, size_t size, physaddr_t pa,
                  int perm, int pml_shift);
 int unmap_segment(pgdir_t pgdir, uintptr_t va, size_t size);
 pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create);
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int pml_shift,
+                       int create);
+int pgdir_split_jumbo(pgdir_t pgdir, const void *va);
 int get_va_perms(pgdir_t pgdir, const void *va);
 int arch_pgdir_setup(pgdir_t boot_copy, pgdir_t *new_pd);
 physaddr_t arch_pgdir_get_cr3(pgdir_t pd);
 void arch_pgdir_clear(pgdir_t *pd);
 int arch_max_jumbo_page_shift(void);
+int arch_smaller_page_shift(int shift);
 void arch_add_intermediate_pts(pgdir_t pgdir, uintptr_t va, size_t len);
 
 static inline page_t *ppn2page(size_t ppn)
@@ -73,9 +73,8 @@ struct process_set {
 	struct proc **procs;
 };
 
-/* Can use a htable iterator to iterate through all active procs */
-extern struct hashtable *pid_hash;
-extern spinlock_t pid_hash_lock;
+/* Iterates through all procs in the PID hash */
+void pid_for_each(void (*func)(void *item, void *opaque), void *opaque);
 
 /* Initialization */
 void proc_init(void);
@@ -113,6 +112,7 @@ bool __proc_is_mcp(struct proc *p);
 bool proc_is_vcctx_ready(struct proc *p);
 int proc_change_to_vcore(struct proc *p, uint32_t new_vcoreid,
                          bool enable_my_notif);
+int proc_handoff_vcore(struct proc *p, uint32_t new_vcoreid);
 void proc_get_set(struct process_set *pset);
 void proc_free_set(struct process_set *pset);
 
@@ -154,6 +154,8 @@ void __proc_preempt_warnall(struct proc *p, uint64_t when);
 void __proc_preempt_core(struct proc *p, uint32_t pcoreid);
 uint32_t __proc_preempt_all(struct proc *p, uint32_t *pc_arr);
 bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec);
+bool proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t usec);
+bool proc_preempt_warn_vcore(struct proc *p, uint32_t vcoreid, uint64_t usec);
 void proc_preempt_all(struct proc *p, uint64_t usec);
 
 /* Current / cr3 / context management */
@@ -12,34 +12,57 @@
  * There are some utility functions, probably unimplemented til we need them,
  * that will make the tree have enough memory for future calls.
  *
- * You can also store a tag along with the void* for a given item, and do
- * lookups based on those tags.  Or you will be able to, once it is
- * implemented. */
+ * You can also store tags along with the void* for a given item, and do gang
+ * lookups based on those tags.  Interior nodes have a tag set if any item below
+ * them has that tag, so tagged lookups skip untagged parts of the tree.
+ *
+ * Concurrency: writers (insert, delete, tag changes, destroy) need to be
+ * serialized by the caller.  Lookups, including gang lookups, are lockless and
+ * can run concurrently with a writer.  The tree's seq counter protects the
+ * root and depth, which change when the tree grows.  Deleting the last item in
+ * a node prunes the node (and any ancestors it leaves empty, but never the
+ * root), and the node is freed after an RCU grace period.  A slot pointer a
+ * reader got from a lookup stays the slot for that key for as long as the
+ * reader is in an RCU read-side critical section or the slot holds an item.
+ * Lockless readers might miss an item being inserted or see one being deleted,
+ * and tagged lookups can be stale; callers that care need to hold the writer's
+ * lock. */
 
 #pragma once
 
-#define LOG_RNODE_SLOTS 6
+#define LOG_RNODE_SLOTS 7
 #define NR_RNODE_SLOTS (1 << LOG_RNODE_SLOTS)
+#define RNODE_TAG_LONGS (NR_RNODE_SLOTS / (sizeof(unsigned long) * 8))
+
+/* Tags, used by the page cache */
+#define RADIX_TAG_DIRTY			0
+#define RADIX_TAG_WRITEBACK		1
+#define RADIX_NR_TAGS			2
 
 #include <ros/common.h>
+#include <ros/atomic.h>
+#include <rcu.h>
 
 struct radix_node {
 	void						*items[NR_RNODE_SLOTS];
+	unsigned long				tags[RADIX_NR_TAGS][RNODE_TAG_LONGS];
 	unsigned int				num_items;
 	bool						leaf;
 	struct radix_node			*parent;
 	struct radix_node			**my_slot;
+	struct rcu_head				rcu;
 };
 
 /* Defines the whole tree. */
 struct radix_tree {
+	seq_ctr_t					seq;
 	struct radix_node			*root;
 	unsigned int				depth;
 	unsigned long				upper_bound;
 };
 
 void radix_init(void);		/* initializes the whole radix system */
-#define RADIX_INITIALIZER {0, 0, 0}
+#define RADIX_INITIALIZER {SEQCTR_INITIALIZER, 0, 0, 0}
 void radix_tree_init(struct radix_tree *tree);	/* inits one tree */
 void radix_tree_destroy(struct radix_tree *tree);
 
@@ -51,6 +74,9 @@ void *radix_lookup(struct radix_tree *tree, unsigned long key);
 void **radix_lookup_slot(struct radix_tree *tree, unsigned long key);
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items);
+int radix_gang_lookup_slot(struct radix_tree *tree, void ***slots,
+                           unsigned long *keys, unsigned long first,
+                           unsigned int max_items);
 
 /* Memory management */
 int radix_grow(struct radix_tree *tree, unsigned long max);
@@ -63,6 +89,9 @@ int radix_tag_get(struct radix_tree *tree, unsigned long key, int tag);
 int radix_tree_tagged(struct radix_tree *tree, int tag);
 int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
                           unsigned long first, unsigned int max_items, int tag);
+int radix_tag_gang_lookup_slot(struct radix_tree *tree, void ***slots,
+                               unsigned long *keys, unsigned long first,
+                               unsigned int max_items, int tag);
 
 /* Debugging */
 void print_radix_tree(struct radix_tree *tree);
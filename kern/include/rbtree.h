@@ -33,9 +33,7 @@
 #ifndef WRITE_ONCE
 #define WRITE_ONCE(d, s) (d) = (s)
 #endif
-#ifndef rcu_assign_pointer
-#define rcu_assign_pointer(d, s) (d) = (s)
-#endif
+#include <rcu.h>
 
 struct rb_node {
 	unsigned long  __rb_parent_color;
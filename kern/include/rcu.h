@@ -0,0 +1,50 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Read-copy-update.
+ *
+ * Readers wrap their accesses in rcu_read_lock()/rcu_read_unlock() and follow
+ * pointers with rcu_dereference().  Writers still synchronize among themselves
+ * (usually with a lock), publish with rcu_assign_pointer(), and free anything
+ * they unlinked with call_rcu() or after synchronize_rcu().
+ *
+ * Read-side critical sections cannot block.  The kernel is not preemptive, so
+ * a core is in a quiescent state (holds no RCU references) whenever it is at
+ * the top of its stack: in smp_idle() or returning to userspace in
+ * proc_restartcore().  Cores report that they passed a quiescent state from
+ * there.  A grace period ends once every core has reported.  Callbacks are
+ * queued per core and run on that core, from a routine kernel message, once
+ * the grace period they were waiting on completes. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <atomic.h>
+
+struct rcu_head {
+	struct rcu_head				*next;
+	void (*func)(struct rcu_head *head);
+};
+
+#define rcu_read_lock() cmb()
+#define rcu_read_unlock() cmb()
+
+#define rcu_dereference(p)                                                     \
+({                                                                             \
+	typeof(p) ___p = ACCESS_ONCE(p);                                           \
+	cmb();                                                                     \
+	___p;                                                                      \
+})
+
+/* Make sure the object is initialized before readers can see it. */
+#define rcu_assign_pointer(p, v)                                               \
+({                                                                             \
+	wmb();                                                                     \
+	ACCESS_ONCE(p) = (v);                                                      \
+})
+
+void rcu_init(void);
+void rcu_report_qs(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void synchronize_rcu(void);
+void print_rcu_info(void);
@@ -0,0 +1,26 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory reclaim.  When free memory in the base arenas drops below the low
+ * watermark, the reclaimer ktask gives cached memory back until we're above
+ * the high watermark.  Base arenas that run dry also reclaim synchronously
+ * before failing an allocation. */
+
+#pragma once
+
+#include <ros/common.h>
+
+enum {
+	RECLAIM_WMARK_MIN,
+	RECLAIM_WMARK_LOW,
+	RECLAIM_WMARK_HIGH,
+	RECLAIM_NR_WMARKS,
+};
+
+void reclaim_init(void);
+size_t mem_amt_free(void);
+size_t mem_watermark(int wmark);
+size_t mem_amt_reclaimed(void);
+bool mem_below_watermark(int wmark);
+void reclaim_check(void);
+size_t mem_reclaim(size_t goal, int flags);
@@ -47,6 +47,7 @@
 #define SYS_nanosleep				36
 #define SYS_pop_ctx					37
 #define SYS_vmm_poke_guest			38
+#define SYS_handoff_vcore			39
 
 /* FS Syscalls */
 #define SYS_read				100
@@ -19,6 +19,9 @@
 /* Flags */
 #define REQ_ASYNC			0x01 // Sync by default (?)
 #define REQ_SOFT			0x02 // just making something up
+/* Hyperthread hints for RES_CORES, used by some core allocation policies */
+#define REQ_SMT_PAIR		0x04 // want our vcores on sibling hyperthreads
+#define REQ_SMT_AVOID		0x08 // want a physical core per vcore
 
 struct resource_req {
 	unsigned long				amt_wanted;
@@ -0,0 +1,47 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * ksched and vcore trace records, as read from #sched/trace.  The file is a
+ * struct sched_trace_hdr followed by nr_events struct sched_trace_events, in
+ * timestamp order. */
+
+#pragma once
+
+#include <stdint.h>
+
+#define SCHED_TRACE_MAGIC			0x53434854	/* "SCHT" */
+#define SCHED_TRACE_VERSION			1
+
+enum {
+	SCHED_TR_GRANT = 1,		/* vcoreid of pid mapped to pcoreid */
+	SCHED_TR_REVOKE,		/* vcoreid of pid unmapped.  arg: 1 if preempted */
+	SCHED_TR_PREEMPT_WARN,	/* arg: the deadline, in TSC ticks */
+	SCHED_TR_VC_START,		/* vcoreid started running on pcoreid */
+	SCHED_TR_VC_YIELD,		/* vcoreid gave up pcoreid */
+	SCHED_TR_VC_PREEMPT,	/* vcoreid's context was saved off pcoreid */
+	SCHED_TR_VC_DEATH,		/* vcoreid was torn down on pcoreid */
+	SCHED_TR_NOTIFY,		/* vcoreid was sent a notification */
+	SCHED_TR_SCP_RUN,		/* SCP pid started running on pcoreid */
+	SCHED_TR_SCP_STOP,		/* SCP pid stopped running on pcoreid */
+	NR_SCHED_TR_TYPES,
+};
+
+struct sched_trace_hdr {
+	uint32_t					magic;
+	uint32_t					version;
+	uint64_t					tsc_freq;
+	uint32_t					nr_cores;
+	uint32_t					nr_events;
+	uint64_t					nr_lost;	/* overwritten before we read */
+};
+
+struct sched_trace_event {
+	uint64_t					tsc;
+	uint64_t					arg;
+	uint32_t					pid;
+	uint32_t					vcoreid;
+	uint16_t					type;
+	uint16_t					pcoreid;
+	uint16_t					srccore;	/* the core that recorded it */
+	uint16_t					pad;
+};
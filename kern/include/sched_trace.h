@@ -0,0 +1,33 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * ksched and vcore event tracer.  When on, the process code and the ksched
+ * record core grants and revocations, vcore starts, yields, preemptions and
+ * notifications, and SCP context switches into per-core rings.  #sched/ctl
+ * turns it on and off, and #sched/trace is a timestamp-ordered snapshot of all
+ * of the rings.  See ros/sched_trace.h for the format. */
+
+#pragma once
+
+#include <ros/sched_trace.h>
+#include <compiler.h>
+#include <kmalloc.h>
+
+/* Checked on every trace point. */
+extern bool sched_trace_on;
+
+void __sched_trace(uint16_t type, uint32_t pcoreid, uint32_t pid,
+                   uint32_t vcoreid, uint64_t arg);
+
+static inline void sched_trace(uint16_t type, uint32_t pcoreid, uint32_t pid,
+                               uint32_t vcoreid, uint64_t arg)
+{
+	if (unlikely(sched_trace_on))
+		__sched_trace(type, pcoreid, pid, vcoreid, arg);
+}
+
+void sched_trace_start(void);
+void sched_trace_stop(void);
+void sched_trace_reset(void);
+size_t sched_trace_nr_events(void);
+struct sized_alloc *sched_trace_build(void);
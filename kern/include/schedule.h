@@ -13,13 +13,27 @@
 #include <corerequest.h>
 
 struct proc;	/* process.h includes us, but we need pointers now */
+struct scp_rq;
+struct core_pool;
 TAILQ_HEAD(proc_list, proc);		/* Declares 'struct proc_list' */
 
+#define KSCHED_DEFAULT_WEIGHT		100
+#define KSCHED_MAX_WEIGHT			10000
+#define KSCHED_MAX_LATENCY_USEC		1000000
+
 /* One of these embedded in every struct proc */
 struct sched_proc_data {
 	TAILQ_ENTRY(proc)			proc_link;			/* tailq linkage */
 	struct proc_list 			*cur_list;			/* which tailq we're on */
+	struct scp_rq				*scp_rq;			/* if on a run queue */
 	struct core_request_data	crd;				/* prov/alloc cores */
+	unsigned int				weight;				/* proportional share */
+	unsigned int				latency_usec;		/* 0 for batch */
+	struct core_pool			*pool;				/* NULL once destroyed */
+	/* set by the MCP policy each ksched pass */
+	uint32_t					demand;
+	uint32_t					entitled;
+	uint32_t					nr_alloc;			/* for picking victims */
 	/* count of lists? */
 	/* other accounting info */
 };
@@ -82,6 +96,25 @@ void put_idle_core(int coreid);
  * schedulers. */
 int provision_core(struct proc *p, uint32_t pcoreid);
 
+/* Set p's share of the cores relative to other MCPs, and its latency class
+ * (0 usec for batch, else at most KSCHED_MAX_LATENCY_USEC).  What these mean
+ * depends on the MCP policy.  Return 0 on success, -1 and set errno on
+ * failure. */
+int ksched_set_weight(struct proc *p, unsigned int weight);
+int ksched_set_latency(struct proc *p, unsigned int latency_usec);
+
+/* Core pools, see corepool.h.  Return 0 on success, -1 and set errno on
+ * failure. */
+int corepool_create(const char *name, const char *parent, uint32_t min_cores,
+                    uint32_t max_cores);
+int corepool_set_limits(const char *name, uint32_t min_cores,
+                        uint32_t max_cores);
+int corepool_set_weight(const char *name, unsigned int weight);
+int corepool_remove(const char *name);
+int corepool_set_proc(struct proc *p, const char *name, const char *user);
+/* Returns a kmalloc'd snapshot of the pools, for reading. */
+struct sized_alloc *corepool_build_status(void);
+
 /************** Debugging **************/
 void sched_diag(void);
 void print_resources(struct proc *p);
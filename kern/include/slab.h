@@ -19,6 +19,12 @@
  * address of the next free item.  The slab structure is stored at the end of
  * the page.  There is only one page per slab.
  *
+ * Caches that pull from kpages_arena (the default source) are NUMA-aware: each
+ * NUMA domain has its own depot and its own lists of slabs, which import from
+ * that domain's kpages arena.  The pcpu caches use their core's domain, and
+ * objects freed on a remote domain go straight to their home domain's depot.
+ * Other caches only have domain 0's depot and slabs.
+ *
  * Be careful with source arenas and NOTOUCH.  If a cache's source arena is not
  * page-aligned memory, you need to set NOTOUCH.  Otherwise, for small objects,
  * a slab will be constructed that uses the source for a page of objects.
@@ -60,6 +66,10 @@ struct kmem_pcpu_cache {
 	struct kmem_magazine		*loaded;
 	struct kmem_magazine		*prev;
 	size_t						nr_allocs_ever;
+	size_t						nr_frees_ever;
+	/* Allocs and frees that missed both mags and had to go to the depot */
+	size_t						nr_alloc_misses;
+	size_t						nr_free_misses;
 } __attribute__((aligned(ARCH_CL_SIZE)));
 
 struct kmem_depot {
@@ -71,6 +81,10 @@ struct kmem_depot {
 	unsigned int				nr_not_empty;
 	unsigned int				busy_count;
 	uint64_t					busy_start;
+	/* Stats, protected by the lock */
+	size_t						nr_lock_acquires;
+	size_t						nr_lock_contended;
+	size_t						nr_magsize_grows;
 };
 
 struct kmem_slab;
@@ -91,6 +105,7 @@ struct kmem_slab {
 	TAILQ_ENTRY(kmem_slab) link;
 	size_t num_busy_obj;
 	size_t num_total_obj;
+	unsigned int node;
 	union {
 		struct kmem_bufctl_list bufctl_freelist;
 		void *free_small_obj;
@@ -98,20 +113,29 @@ struct kmem_slab {
 };
 TAILQ_HEAD(kmem_slab_list, kmem_slab);
 
+/* Per-NUMA-domain part of a cache.  The slab lists are protected by the cache's
+ * cache_lock.  Slabs on these lists imported their memory from source. */
+struct kmem_node {
+	struct kmem_depot depot;
+	struct arena *source;
+	struct kmem_slab_list full_slab_list;
+	struct kmem_slab_list partial_slab_list;
+	struct kmem_slab_list empty_slab_list;
+	size_t amt_imported;	/* bytes currently held from source */
+};
+
 /* Actual cache */
 struct kmem_cache {
 	TAILQ_ENTRY(kmem_cache) all_kmc_link;
 	struct kmem_pcpu_cache *pcpu_caches;
-	struct kmem_depot depot;
+	struct kmem_node *nodes;
+	unsigned int nr_nodes;
 	spinlock_t cache_lock;
 	size_t obj_size;
 	size_t import_amt;
 	int align;
 	int flags;
 	struct arena *source;
-	struct kmem_slab_list full_slab_list;
-	struct kmem_slab_list partial_slab_list;
-	struct kmem_slab_list empty_slab_list;
 	int (*ctor)(void *obj, void *priv, int flags);
 	void (*dtor)(void *obj, void *priv);
 	void *priv;
@@ -119,6 +143,7 @@ struct kmem_cache {
 	struct hash_helper hh;
 	struct kmem_bufctl_list *alloc_hash;
 	struct kmem_bufctl_list static_hash[HASH_INIT_SZ];
+	struct kmem_node static_node[1];
 	char name[KMC_NAME_SZ];
 	TAILQ_ENTRY(kmem_cache)	import_link;
 };
@@ -138,7 +163,9 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 /* Back end: internal functions */
 void kmem_cache_init(void);
+void kmem_cache_numa_init(void);
 void kmem_cache_reap(struct kmem_cache *cp);
+void kmem_cache_set_magsize(struct kmem_cache *kc, unsigned int magsize);
 unsigned int kmc_nr_pcpu_caches(void);
 /* Low-level interface for initializing a cache. */
 void __kmem_cache_create(struct kmem_cache *kc, const char *name,
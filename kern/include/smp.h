@@ -66,10 +66,12 @@ struct per_cpu_info {
 	segdesc_t *gdt;
 #endif
 	/* KMSGs */
-	spinlock_t immed_amsg_lock;
-	struct kernel_msg_list immed_amsgs;
-	spinlock_t routine_amsg_lock;
-	struct kernel_msg_list routine_amsgs;
+	struct kmsg_queue immed_amsgs;
+	struct kmsg_queue routine_amsgs;
+	/* KMSGs we sent, and the IPIs we sent or skipped for them */
+	unsigned long nr_kmsgs_sent;
+	unsigned long nr_kmsg_ipis;
+	unsigned long nr_kmsg_ipis_suppressed;
 	/* profiling -- opaque to all but the profiling code. */
 	void *profiling;
 }__attribute__((aligned(ARCH_CL_SIZE)));
@@ -9,6 +9,7 @@
 #include <arch/mmu.h>
 #include <sys/queue.h>
 #include <arch/trap.h>
+#include <core_set.h>
 
 // func ptr for interrupt service routines
 typedef void (*isr_t)(struct hw_trapframe *hw_tf, void *data);
@@ -111,13 +112,42 @@ struct kernel_message
 STAILQ_HEAD(kernel_msg_list, kernel_message);
 typedef struct kernel_message kernel_message_t;
 
+/* Per-core KMSG queue.  Any core can push onto incoming, without locking.  Only
+ * the owning core pops, with IRQs disabled: it takes all of incoming at once,
+ * puts it in order on ready, and runs from there.  Senders only IPI when
+ * incoming was empty; otherwise, the owner has an IPI on the way (or is about
+ * to look) for the messages already there. */
+struct kmsg_queue {
+	struct kernel_message		*incoming;	/* newest first */
+	struct kernel_msg_list		ready;		/* oldest first, owner only */
+	unsigned long				nr_msgs;	/* owner only */
+	unsigned long				nr_refills;	/* owner only */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static inline bool kmsg_queue_empty(struct kmsg_queue *q)
+{
+	return STAILQ_EMPTY(&q->ready) && !ACCESS_ONCE(q->incoming);
+}
+
+/* Batches kernel messages to several cores, so that sending them takes one
+ * multicast IPI instead of one IPI per message. */
+struct kmsg_batch {
+	struct core_set				ipi_cores;
+};
+
 void kernel_msg_init(void);
+void kmsg_queue_init(struct kmsg_queue *q);
 uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
                              long arg2, int type);
+void kmsg_batch_init(struct kmsg_batch *kb);
+void kmsg_batch_add(struct kmsg_batch *kb, uint32_t dst, amr_t pc, long arg0,
+                    long arg1, long arg2, int type);
+void kmsg_batch_send(struct kmsg_batch *kb);
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data);
 bool has_routine_kmsg(void);
 void process_routine_kmsg(void);
 void print_kmsgs(uint32_t coreid);
+void kmsg_queue_stat(void);
 
 /* Kernel context depths.  IRQ depth is how many nested IRQ stacks/contexts we
  * are working on.  Kernel trap depth is how many nested kernel traps (not
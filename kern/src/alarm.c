@@ -41,6 +41,7 @@ void init_timer_chain(struct timer_chain *tchain,
 {
 	spinlock_init_irqsave(&tchain->lock);
 	TAILQ_INIT(&tchain->waiters);
+	tchain->armed_time = 0;
 	tchain->set_interrupt = set_interrupt;
 	reset_tchain_times(tchain);
 }
@@ -183,7 +184,9 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 	if (changed_list) {
 		reset_tchain_times(tchain);
 	}
-	/* Need to reset the interrupt no matter what */
+	/* Need to reset the interrupt no matter what.  Either the timer went off,
+	 * or another core wants us to reprogram it. */
+	tchain->armed_time = 0;
 	reset_tchain_interrupt(tchain);
 	spin_unlock_irqsave(&tchain->lock);
 }
@@ -431,6 +434,11 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 		return;
 	}
 	time = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
+	/* The timer is one-shot, and only goes off for the earliest waiter.  If
+	 * it's already set for that, leave it alone. */
+	if (time == tchain->armed_time)
+		return;
+	tchain->armed_time = time;
 	if (time) {
 		/* Arm the alarm.  For times in the past, we just need to make sure it
 		 * goes off. */
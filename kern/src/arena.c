@@ -21,19 +21,19 @@
  * the base arena using an aligned allocation helper for its afunc.  I think,
  * without a lot of thought, that the fragmentation would be equivalent.
  *
- * In the future, we can set up N base_arenas, one for each NUMA domain, each of
- * which is a source for other NUMA allocators, e.g. kpages_i_arena.  Higher
- * level allocators (kmalloc()) will need to choose a NUMA domain and call into
- * the correct allocator.  Each NUMA base arena is self-sufficient: they have no
- * qcaches and their BTs come from their own free page list.  This just
- * replicates the default memory allocator across each NUMA node, and at some
- * point, some generic allocator software needs to pick which node to pull from.
- * I tried to keep assumptions about a single base_arena to a minimum, but
- * you'll see some places where the arena code needs to find some base arena for
- * its BT allocations.  Also note that the base setup happens before we know
- * about NUMA domains.  The plan is to do a small part of domain 0 during
- * pmem_init(), then once we know the full memory layout, add in the rest of
- * domain 0's memory and bootstrap the other domains.
+ * There are N base_arenas, one for each NUMA domain, each of which is a source
+ * for its NUMA domain's kpages arena (base_numa_arenas[i] and
+ * kpages_numa_arenas[i]).  Higher level allocators (e.g. the slab allocator)
+ * need to choose a NUMA domain and call into the correct allocator.  Each NUMA
+ * base arena is self-sufficient: they have no qcaches and their BTs come from
+ * their own free page list.  This just replicates the default memory allocator
+ * across each NUMA node.  Note that the base setup happens before we know about
+ * NUMA domains.  All memory starts in base_arena during pmem_init().  Once we
+ * know the memory layout, kpages_numa_init() pulls every other domain's free
+ * memory out of base_arena and hands it to that domain's base arena.  From then
+ * on, base_arena and kpages_arena are domain 0's arenas.  Anything allocated
+ * from base_arena before then still gets freed back to base_arena, regardless
+ * of its domain.
  *
  * When it comes to importing spans, it's not clear whether or not we should
  * import exactly the current allocation request or to bring in more.  If we
@@ -69,6 +69,18 @@
  *   will have their own stats, and it'd be a minor pain to sync up with them
  *   all the time.  Also, the important stat is when the base arena starts to
  *   run out of memory, and base arenas don't have qcaches, so it's moot.
+ * - What are the per-core caches for?  qcaches only help arena_alloc().  Any
+ *   xalloc, even one that just wants natural alignment (get_cont_pages(), and
+ *   through it DMA buffers and jumbo pages), goes to the arena under its lock.
+ *   Arenas with qcaches also keep a few freed, naturally aligned segments per
+ *   core for each of the smaller power-of-two sizes.  Like the qcaches, those
+ *   segments are still allocated as far as the arena is concerned.  NEXTFIT
+ *   xallocs skip them, since the point of NEXTFIT is to not reuse addresses
+ *   right away.
+ * - Why do we top up the BTs before grabbing the lock?  Non-base arenas get
+ *   their BTs from a base arena.  If we run out while holding our lock, we have
+ *   to drop it in the middle of an operation.  Checking a counter on the way in
+ *   and adding a page when we're low keeps that off the common path.
  */
 
 #include <arena.h>
@@ -78,12 +90,18 @@
 #include <hash.h>
 #include <slab.h>
 #include <kthread.h>
+#include <reclaim.h>
+
+/* Non-base arenas top up their unused BTs when they drop below this. */
+#define ARENA_BTAG_LOW_WATER	8
 
 struct arena_tailq all_arenas = TAILQ_HEAD_INITIALIZER(all_arenas);
 qlock_t arenas_and_slabs_lock = QLOCK_INITIALIZER(arenas_and_slabs_lock);
 
 struct arena *base_arena;
 struct arena *kpages_arena;
+struct arena **base_numa_arenas;
+struct arena **kpages_numa_arenas;
 
 /* Misc helpers and forward declarations */
 static struct btag *__get_from_freelists(struct arena *arena, int list_idx);
@@ -93,17 +111,26 @@ static void *__xalloc_nextfit(struct arena *arena, size_t size, size_t align,
                               size_t phase, size_t nocross);
 static void __try_hash_resize(struct arena *arena, int flags,
                               void **to_free_addr, size_t *to_free_sz);
+static void free_batch_from_arena(struct arena *arena, void **addrs,
+                                  size_t nr, size_t size);
+static void arena_drain_pcpu_caches(struct arena *arena);
 static void __arena_asserter(struct arena *arena);
 void print_arena_stats(struct arena *arena, bool verbose);
 
 /* For NUMA situations, where there are multiple base arenas, we'll need a way
  * to find *some* base arena.  Ideally, it'll be in the same NUMA domain as
- * arena. */
+ * arena, so we walk down the sources until we find a base.  Otherwise (e.g. a
+ * NULL arena or an arena that is neither a base nor has a source), we use the
+ * default base_arena.
+ *
+ * Callers that base_alloc() and base_free() must use the same @arena for both,
+ * which is easy as long as an arena's source never changes. */
 static struct arena *find_my_base(struct arena *arena)
 {
-	/* TODO: could walk down sources until is_base is set.  But barring that,
-	 * we'd still need a way to find a base arena for some other allocator that
-	 * just wants a page.  arena may be NULL, so handle that. */
+	for (struct arena *a_i = arena; a_i; a_i = a_i->source) {
+		if (a_i->is_base)
+			return a_i;
+	}
 	return base_arena;
 }
 
@@ -129,6 +156,19 @@ static void setup_qcaches(struct arena *arena, size_t quantum,
 	}
 }
 
+/* Only arenas with qcaches get per-core caches.  Those are the ones that were
+ * meant to be fast, and it keeps the base arenas simple. */
+static void setup_pcpu_caches(struct arena *arena)
+{
+	arena->pcpu_caches = NULL;
+	if (!arena->qcache_max || !IS_PWR2(arena->quantum))
+		return;
+	arena->pcpu_caches = base_zalloc(arena, sizeof(struct arena_pcpu_cache) *
+	                                 num_cores, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++)
+		spinlock_init_irqsave(&arena->pcpu_caches[i].lock);
+}
+
 /* Helper to init.  Split out from create so we can bootstrap. */
 static void arena_init(struct arena *arena, char *name, size_t quantum,
                        void *(*afunc)(struct arena *, size_t, int),
@@ -156,6 +196,7 @@ static void arena_init(struct arena *arena, char *name, size_t quantum,
 
 	arena->all_segs = RB_ROOT;
 	BSD_LIST_INIT(&arena->unused_btags);
+	arena->nr_unused_btags = 0;
 	for (int i = 0; i < ARENA_NR_FREE_LISTS; i++)
 		BSD_LIST_INIT(&arena->free_segs[i]);
 
@@ -169,6 +210,7 @@ static void arena_init(struct arena *arena, char *name, size_t quantum,
 
 	strlcpy(arena->name, name, ARENA_NAME_SZ);
 	setup_qcaches(arena, quantum, qcache_max);
+	setup_pcpu_caches(arena);
 
 	if (source)
 		add_importing_arena(source, arena);
@@ -210,6 +252,11 @@ void arena_destroy(struct arena *arena)
 	qunlock(&arenas_and_slabs_lock);
 	if (arena->source)
 		del_importing_arena(arena->source, arena);
+	if (arena->pcpu_caches) {
+		arena_drain_pcpu_caches(arena);
+		base_free(arena, arena->pcpu_caches,
+		          sizeof(struct arena_pcpu_cache) * num_cores);
+	}
 
 	for (int i = 0; i < arena->hh.nr_hash_lists; i++)
 		assert(BSD_LIST_EMPTY(&arena->alloc_hash[i]));
@@ -358,18 +405,16 @@ static void __try_hash_resize(struct arena *arena, int flags,
 	}
 }
 
-/* Typically this will be just checking for one or two BTs on the free list */
 static bool __has_enough_btags(struct arena *arena, size_t nr_needed)
 {
-	struct btag *bt_i;
-	size_t so_far = 0;
+	return arena->nr_unused_btags >= nr_needed;
+}
 
-	BSD_LIST_FOREACH(bt_i, &arena->unused_btags, misc_link) {
-		so_far++;
-		if (so_far == nr_needed)
-			return TRUE;
-	}
-	return FALSE;
+static void __add_btags(struct arena *arena, struct btag *tags, size_t nr_bts)
+{
+	for (int i = 0; i < nr_bts; i++)
+		BSD_LIST_INSERT_HEAD(&arena->unused_btags, &tags[i], misc_link);
+	arena->nr_unused_btags += nr_bts;
 }
 
 /* Allocs new boundary tags and puts them on the arena's free list.  Returns 0
@@ -417,11 +462,32 @@ static struct btag *__add_more_btags(struct arena *arena, int mem_flags)
 		if (!tags)
 			return 0;
 	}
-	for (int i = 0; i < nr_bts; i++)
-		BSD_LIST_INSERT_HEAD(&arena->unused_btags, &tags[i], misc_link);
+	__add_btags(arena, tags, nr_bts);
 	return tags;
 }
 
+/* Tops up a non-base arena's BTs, a page at a time, before the caller grabs the
+ * lock.  That way __get_enough_btags() rarely has to drop the lock in the
+ * middle of an operation.  This is racy: a few threads could each add a page,
+ * which is harmless.  Failures are fine too; __get_enough_btags() will sort it
+ * out. */
+static void prefill_btags(struct arena *arena, int mem_flags)
+{
+	struct btag *tags;
+
+	if (arena->is_base)
+		return;
+	if (ACCESS_ONCE(arena->nr_unused_btags) >= ARENA_BTAG_LOW_WATER)
+		return;
+	tags = arena_alloc(find_my_base(arena), PGSIZE,
+	                   mem_flags | ARENA_INSTANTFIT);
+	if (!tags)
+		return;
+	spin_lock_irqsave(&arena->lock);
+	__add_btags(arena, tags, PGSIZE / sizeof(struct btag));
+	spin_unlock_irqsave(&arena->lock);
+}
+
 /* Helper, returns TRUE when we have enough BTs.  Hold the lock, but note this
  * will unlock and relock, and will attempt to acquire more BTs.  Returns FALSE
  * if an alloc failed (MEM_ATOMIC).
@@ -461,12 +527,14 @@ static struct btag *__get_btag(struct arena *arena)
 	 * diving in. */
 	assert(ret);
 	BSD_LIST_REMOVE(ret, misc_link);
+	arena->nr_unused_btags--;
 	return ret;
 }
 
 static void __free_btag(struct arena *arena, struct btag *bt)
 {
 	BSD_LIST_INSERT_HEAD(&arena->unused_btags, bt, misc_link);
+	arena->nr_unused_btags++;
 }
 
 /* Helper: adds seg pointed to by @bt to the appropriate free list of @arena. */
@@ -582,6 +650,7 @@ static void *alloc_from_arena(struct arena *arena, size_t size, int flags)
 	void *to_free_addr = 0;
 	size_t to_free_sz = 0;
 
+	prefill_btags(arena, flags & MEM_FLAGS);
 	spin_lock_irqsave(&arena->lock);
 	if (!__get_enough_btags(arena, 1, flags & MEM_FLAGS)) {
 		spin_unlock_irqsave(&arena->lock);
@@ -627,6 +696,7 @@ static void *__arena_add(struct arena *arena, void *base, size_t size,
 	 * mess with us in other ways, such as adding overlapping spans. */
 	assert_quantum_alignment(arena, base, size);
 	assert(base < base + size);
+	prefill_btags(arena, flags & MEM_FLAGS);
 	spin_lock_irqsave(&arena->lock);
 	/* Make sure there are two, bt and span. */
 	if (!__get_enough_btags(arena, 2, flags & MEM_FLAGS)) {
@@ -680,8 +750,13 @@ static bool get_more_resources(struct arena *arena, size_t size, int flags)
 			arena->ffunc(arena->source, span, import_size);
 			return FALSE;
 		}
+		/* Imports are what eat into the base arenas */
+		reclaim_check();
 	} else {
-		/* TODO: allow blocking */
+		/* We're a base arena, with nowhere to import from.  Try to get memory
+		 * back from the caches above us before giving up. */
+		if (mem_reclaim(size, flags))
+			return TRUE;
 		if (!(flags & MEM_ATOMIC))
 			panic("OOM!");
 		return FALSE;
@@ -845,6 +920,9 @@ static void *__xalloc_min_max(struct arena *arena, size_t size,
 	 * scan from here. */
 	for (/* node set */; node; node = rb_next(node)) {
 		bt = container_of(node, struct btag, all_link);
+		/* all_segs includes allocated segments and spans too */
+		if (bt->status != BTAG_FREE)
+			continue;
 		try = __find_sufficient(bt->start, bt->size, size, align, phase,
 		                        nocross);
 		if (!try)
@@ -914,6 +992,87 @@ static void *__xalloc_nextfit(struct arena *arena, size_t size, size_t align,
 	return ret;
 }
 
+/* Helper: returns the index of the per-core cache for segments of @size, or -1
+ * if there isn't one. */
+static int pcpu_cache_idx(struct arena *arena, size_t size)
+{
+	int idx;
+
+	if (!arena->pcpu_caches || !IS_PWR2(size))
+		return -1;
+	idx = LOG2_DOWN(size) - LOG2_DOWN(arena->quantum);
+	if (idx >= ARENA_NR_PCPU_CACHES)
+		return -1;
+	return idx;
+}
+
+/* Kernel code doesn't migrate unless it blocks, so we can find our cache before
+ * locking it. */
+static struct arena_pcpu_cache *get_my_pcpu_cache(struct arena *arena)
+{
+	return &arena->pcpu_caches[core_id()];
+}
+
+static void *pcpu_cache_alloc(struct arena *arena, int idx)
+{
+	struct arena_pcpu_cache *pcc = get_my_pcpu_cache(arena);
+	void *ret = NULL;
+
+	spin_lock_irqsave(&pcc->lock);
+	if (pcc->nr_segs[idx]) {
+		ret = pcc->segs[idx][--pcc->nr_segs[idx]];
+		pcc->nr_hits++;
+	} else {
+		pcc->nr_misses++;
+	}
+	spin_unlock_irqsave(&pcc->lock);
+	return ret;
+}
+
+/* When the cache is full, we give half of it back to the arena in one lock
+ * acquisition, so the next few frees don't need the arena at all. */
+static void pcpu_cache_free(struct arena *arena, int idx, void *addr)
+{
+	struct arena_pcpu_cache *pcc = get_my_pcpu_cache(arena);
+	void *batch[ARENA_PCPU_CACHE_DEPTH / 2];
+	size_t nr_batch = 0;
+
+	spin_lock_irqsave(&pcc->lock);
+	if (pcc->nr_segs[idx] == ARENA_PCPU_CACHE_DEPTH) {
+		nr_batch = ARENA_PCPU_CACHE_DEPTH / 2;
+		pcc->nr_segs[idx] -= nr_batch;
+		memcpy(batch, &pcc->segs[idx][pcc->nr_segs[idx]], sizeof(batch));
+	}
+	pcc->segs[idx][pcc->nr_segs[idx]++] = addr;
+	spin_unlock_irqsave(&pcc->lock);
+	if (nr_batch)
+		free_batch_from_arena(arena, batch, nr_batch, arena->quantum << idx);
+}
+
+/* Gives every core's cached segments back to the arena. */
+static void arena_drain_pcpu_caches(struct arena *arena)
+{
+	struct arena_pcpu_cache *pcc;
+	void *batch[ARENA_PCPU_CACHE_DEPTH];
+	size_t nr_batch;
+
+	if (!arena->pcpu_caches)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		pcc = &arena->pcpu_caches[i];
+		for (int j = 0; j < ARENA_NR_PCPU_CACHES; j++) {
+			spin_lock_irqsave(&pcc->lock);
+			nr_batch = pcc->nr_segs[j];
+			memcpy(batch, pcc->segs[j], nr_batch * sizeof(void*));
+			pcc->nr_segs[j] = 0;
+			spin_unlock_irqsave(&pcc->lock);
+			if (nr_batch)
+				free_batch_from_arena(arena, batch, nr_batch,
+				                      arena->quantum << j);
+		}
+	}
+}
+
 static void *xalloc_from_arena(struct arena *arena, size_t size,
                                size_t align, size_t phase, size_t nocross,
                                void *minaddr, void *maxaddr, int flags)
@@ -922,6 +1081,7 @@ static void *xalloc_from_arena(struct arena *arena, size_t size,
 	void *to_free_addr = 0;
 	size_t to_free_sz = 0;
 
+	prefill_btags(arena, flags & MEM_FLAGS);
 	spin_lock_irqsave(&arena->lock);
 	/* Need two, since we might split a BT into 3 BTs. */
 	if (!__get_enough_btags(arena, 2, flags & MEM_FLAGS)) {
@@ -955,6 +1115,7 @@ void *arena_xalloc(struct arena *arena, size_t size, size_t align, size_t phase,
 {
 	void *ret;
 	size_t req_size;
+	int idx;
 
 	size = ROUNDUP(size, arena->quantum);
 	if (!size)
@@ -978,6 +1139,16 @@ void *arena_xalloc(struct arena *arena, size_t size, size_t align, size_t phase,
 	if (align + phase < align)
 		panic("Arena %s, align %p + phase %p overflow%p", arena->name, align,
 		      phase);
+	/* Anything in the per-core caches is aligned to its size. */
+	if (!phase && !nocross && !minaddr && !maxaddr && (align <= size) &&
+	    !(flags & ARENA_NEXTFIT)) {
+		idx = pcpu_cache_idx(arena, size);
+		if (idx >= 0) {
+			ret = pcpu_cache_alloc(arena, idx);
+			if (ret)
+				return ret;
+		}
+	}
 	/* Ok, it's a pain to import resources from a source such that we'll be able
 	 * to guarantee we make progress without stranding resources if we have
 	 * nocross or min/maxaddr.  For min/maxaddr, when we ask the source, we
@@ -1091,13 +1262,13 @@ static void __coalesce_free_seg(struct arena *arena, struct btag *bt,
 	}
 }
 
-static void free_from_arena(struct arena *arena, void *addr, size_t size)
+/* Frees the segment.  If that frees an entire span, we'll return it for our
+ * caller to give back to the source.  Hold the lock. */
+static void __free_from_arena(struct arena *arena, void *addr, size_t size,
+                              void **to_free_addr, size_t *to_free_sz)
 {
 	struct btag *bt;
-	void *to_free_addr = 0;
-	size_t to_free_sz = 0;
 
-	spin_lock_irqsave(&arena->lock);
 	bt = __untrack_alloc_seg(arena, (uintptr_t)addr);
 	if (!bt)
 		panic("Free of unallocated addr %p from arena %s", addr, arena->name);
@@ -1106,13 +1277,42 @@ static void free_from_arena(struct arena *arena, void *addr, size_t size)
 		      bt->size, arena->name);
 	arena->amt_alloc_segs -= size;
 	__track_free_seg(arena, bt);
-	__coalesce_free_seg(arena, bt, &to_free_addr, &to_free_sz);
-	arena->amt_total_segs -= to_free_sz;
+	__coalesce_free_seg(arena, bt, to_free_addr, to_free_sz);
+	arena->amt_total_segs -= *to_free_sz;
+}
+
+static void free_from_arena(struct arena *arena, void *addr, size_t size)
+{
+	void *to_free_addr = 0;
+	size_t to_free_sz = 0;
+
+	spin_lock_irqsave(&arena->lock);
+	__free_from_arena(arena, addr, size, &to_free_addr, &to_free_sz);
 	spin_unlock_irqsave(&arena->lock);
 	if (to_free_addr)
 		arena->ffunc(arena->source, to_free_addr, to_free_sz);
 }
 
+/* Frees @nr segments of @size, at most ARENA_PCPU_CACHE_DEPTH, with one lock
+ * acquisition. */
+static void free_batch_from_arena(struct arena *arena, void **addrs,
+                                  size_t nr, size_t size)
+{
+	void *to_free_addr[ARENA_PCPU_CACHE_DEPTH] = {0};
+	size_t to_free_sz[ARENA_PCPU_CACHE_DEPTH] = {0};
+
+	assert(nr <= ARENA_PCPU_CACHE_DEPTH);
+	spin_lock_irqsave(&arena->lock);
+	for (int i = 0; i < nr; i++)
+		__free_from_arena(arena, addrs[i], size, &to_free_addr[i],
+		                  &to_free_sz[i]);
+	spin_unlock_irqsave(&arena->lock);
+	for (int i = 0; i < nr; i++) {
+		if (to_free_addr[i])
+			arena->ffunc(arena->source, to_free_addr[i], to_free_sz[i]);
+	}
+}
+
 void arena_free(struct arena *arena, void *addr, size_t size)
 {
 	size = ROUNDUP(size, arena->quantum);
@@ -1123,7 +1323,14 @@ void arena_free(struct arena *arena, void *addr, size_t size)
 
 void arena_xfree(struct arena *arena, void *addr, size_t size)
 {
+	int idx;
+
 	size = ROUNDUP(size, arena->quantum);
+	idx = pcpu_cache_idx(arena, size);
+	if ((idx >= 0) && ALIGNED(addr, size)) {
+		pcpu_cache_free(arena, idx, addr);
+		return;
+	}
 	free_from_arena(arena, addr, size);
 }
 
@@ -1146,8 +1353,7 @@ struct arena *arena_builder(void *pgaddr, char *name, size_t quantum,
 	arena_init(a, name, quantum, afunc, ffunc, source, qcache_max);
 	if (!source)
 		a->is_base = TRUE;
-	BSD_LIST_INSERT_HEAD(&a->unused_btags, &two_tags[0], misc_link);
-	BSD_LIST_INSERT_HEAD(&a->unused_btags, &two_tags[1], misc_link);
+	__add_btags(a, two_tags, 2);
 	return a;
 }
 
@@ -1193,6 +1399,15 @@ size_t arena_amt_total(struct arena *arena)
 	return arena->amt_total_segs;
 }
 
+/* Has the arena's qcaches and per-core caches give their free segments back to
+ * the arena. */
+void arena_reap_qcaches(struct arena *arena)
+{
+	arena_drain_pcpu_caches(arena);
+	for (int i = 0; i < arena->qcache_max / arena->quantum; i++)
+		kmem_cache_reap(&arena->qcaches[i]);
+}
+
 void add_importing_arena(struct arena *source, struct arena *importer)
 {
 	qlock(&arenas_and_slabs_lock);
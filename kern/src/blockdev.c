@@ -271,7 +271,7 @@ void bdev_dirty_buffer(struct buffer_head *bh)
 	struct page *page = bh->bh_page;
 	/* TODO: race on flag modification */
 	bh->bh_flags |= BH_DIRTY;
-	atomic_or(&page->pg_flags, PG_DIRTY);
+	pm_page_set_dirty(page);
 }
 
 /* Decrefs the buffer from bdev_get_buffer().  Call this when you no longer
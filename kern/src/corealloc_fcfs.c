@@ -121,7 +121,7 @@ int __get_any_idle_core(void)
 	struct sched_pcore *spc;
 	int ret = -1;
 
-	while ((spc = TAILQ_FIRST(&idlecores))) {
+	TAILQ_FOREACH(spc, &idlecores, alloc_next) {
 		/* Don't take cores that are provisioned to a process */
 		if (spc->prov_proc)
 			continue;
@@ -0,0 +1,313 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Topology-aware core allocation.  Provisioned cores still come first.  After
+ * that, we score every idle core against the process's current allocation and
+ * give out the best one.  In order of importance:
+ * - Packing: the socket, then the NUMA node, where p already has the most
+ *   cores.  We don't know the LLC layout, so we treat each socket as one LLC.
+ * - SMT: with REQ_SMT_PAIR, cores whose hyperthread siblings are p's.  With
+ *   REQ_SMT_AVOID, cores whose siblings are idle.  Either way, we'd rather not
+ *   share a physical core with another process.
+ * - Cores that aren't provisioned to someone else, who could take them back.
+ * - Spreading: the NUMA node, then the socket, with the most idle cores.  For
+ *   a process with no cores yet, this is what picks its home node, so
+ *   independent MCPs end up on different nodes.
+ *
+ * All of this is O(num_cores) per core handed out, under the ksched lock. */
+
+#include <arch/topology.h>
+#include <sys/queue.h>
+#include <env.h>
+#include <corerequest.h>
+#include <kmalloc.h>
+
+/* The pcores in the system. (array gets alloced in init()).  */
+struct sched_pcore *all_pcores;
+
+/* Idle, usable cores per socket and NUMA node */
+static int *nr_idle_socket;
+static int *nr_idle_numa;
+
+/* Set by __next_core_to_alloc(), until that core gets allocated. */
+static int next_pcoreid = -1;
+
+#define num_sockets (cpu_topology_info.num_sockets)
+
+struct pack_score {
+	int							p_socket;
+	int							p_numa;
+	int							smt;
+	int							unprov;
+	int							idle_numa;
+	int							idle_socket;
+};
+
+static void __spc_set_idle(struct sched_pcore *spc, bool idle)
+{
+	int delta = idle ? 1 : -1;
+
+	assert(spc->usable);
+	assert(spc->idle != idle);
+	spc->idle = idle;
+	nr_idle_socket[spc->socket_id] += delta;
+	nr_idle_numa[spc->numa_id] += delta;
+}
+
+/* Initialize any data assocaited with doing core allocation. */
+void corealloc_init(void)
+{
+	struct core_info *ci;
+	struct sched_pcore *spc, *last;
+
+	all_pcores = kzmalloc(sizeof(struct sched_pcore) * num_cores, MEM_WAIT);
+	nr_idle_socket = kzmalloc(sizeof(int) * num_sockets, MEM_WAIT);
+	nr_idle_numa = kzmalloc(sizeof(int) * num_numa, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		ci = &cpu_topology_info.core_list[i];
+		spc = pcoreid2spc(i);
+		spc->numa_id = ci->numa_id;
+		spc->socket_id = ci->socket_id;
+		/* Link into the ring of hyperthreads on our cpu.  The last sibling we
+		 * find is the one before us in the ring. */
+		spc->sibling = spc;
+		last = NULL;
+		for (int j = 0; j < i; j++) {
+			if (cpu_topology_info.core_list[j].cpu_id == ci->cpu_id)
+				last = pcoreid2spc(j);
+		}
+		if (last) {
+			spc->sibling = last->sibling;
+			last->sibling = spc;
+		}
+		/* if they turned off hyperthreading, give them the odds from
+		 * 1..max-1.  otherwise, give them everything by 0 (default mgmt core).
+		 * TODO: (CG/LL) better LL/CG mgmt */
+#ifdef CONFIG_DISABLE_SMT
+		spc->usable = (i % 2) && !is_ll_core(i);
+#else
+		spc->usable = !is_ll_core(i);
+#endif /* CONFIG_DISABLE_SMT */
+		if (spc->usable)
+			__spc_set_idle(spc, TRUE);
+	}
+}
+
+/* Initialize any data associated with allocating cores to a process. */
+void corealloc_proc_init(struct proc *p)
+{
+	TAILQ_INIT(&p->ksched_data.crd.prov_alloc_me);
+	TAILQ_INIT(&p->ksched_data.crd.prov_not_alloc_me);
+}
+
+static int __smt_score(struct proc *p, struct sched_pcore *spc, int smt_flags)
+{
+	bool mine = FALSE, theirs = FALSE;
+
+	for (struct sched_pcore *s = spc->sibling; s != spc; s = s->sibling) {
+		if (s->alloc_proc == p)
+			mine = TRUE;
+		else if (s->alloc_proc)
+			theirs = TRUE;
+	}
+	if (smt_flags & REQ_SMT_PAIR)
+		return mine ? 2 : (theirs ? 0 : 1);
+	if (smt_flags & REQ_SMT_AVOID)
+		return mine ? 0 : (theirs ? 1 : 2);
+	return theirs ? 0 : 1;
+}
+
+static bool __score_better(struct pack_score *a, struct pack_score *b)
+{
+	if (a->p_socket != b->p_socket)
+		return a->p_socket > b->p_socket;
+	if (a->p_numa != b->p_numa)
+		return a->p_numa > b->p_numa;
+	if (a->smt != b->smt)
+		return a->smt > b->smt;
+	if (a->unprov != b->unprov)
+		return a->unprov > b->unprov;
+	if (a->idle_numa != b->idle_numa)
+		return a->idle_numa > b->idle_numa;
+	return a->idle_socket > b->idle_socket;
+}
+
+/* Find the best core to allocate to a process as dictated by the core
+ * allocation algorithm. This code assumes that the scheduler that uses it
+ * holds a lock for the duration of the call. */
+uint32_t __find_best_core_to_alloc(struct proc *p)
+{
+	struct sched_pcore *spc_i, *best = NULL;
+	struct pack_score score, best_score = {0};
+	int p_socket[num_sockets];
+	int p_numa[num_numa];
+	int smt_flags;
+
+	spc_i = TAILQ_FIRST(&p->ksched_data.crd.prov_not_alloc_me);
+	if (spc_i)
+		return spc2pcoreid(spc_i);
+	if ((next_pcoreid >= 0) && pcoreid2spc(next_pcoreid)->idle)
+		return next_pcoreid;
+	/* The hint lives in procdata, so p can change it whenever.  It's just a
+	 * hint. */
+	smt_flags = ACCESS_ONCE(p->procdata->res_req[RES_CORES].flags);
+	memset(p_socket, 0, sizeof(p_socket));
+	memset(p_numa, 0, sizeof(p_numa));
+	for (int i = 0; i < num_cores; i++) {
+		spc_i = pcoreid2spc(i);
+		if (spc_i->alloc_proc == p) {
+			p_socket[spc_i->socket_id]++;
+			p_numa[spc_i->numa_id]++;
+		}
+	}
+	for (int i = 0; i < num_cores; i++) {
+		spc_i = pcoreid2spc(i);
+		if (!spc_i->idle)
+			continue;
+		score.p_socket = p_socket[spc_i->socket_id];
+		score.p_numa = p_numa[spc_i->numa_id];
+		score.smt = __smt_score(p, spc_i, smt_flags);
+		score.unprov = !spc_i->prov_proc;
+		score.idle_numa = nr_idle_numa[spc_i->numa_id];
+		score.idle_socket = nr_idle_socket[spc_i->socket_id];
+		if (!best || __score_better(&score, &best_score)) {
+			best = spc_i;
+			best_score = score;
+		}
+	}
+	if (!best)
+		return -1;
+	return spc2pcoreid(best);
+}
+
+/* Track the pcore properly when it is allocated to p. This code assumes that
+ * the scheduler that uses it holds a lock for the duration of the call. */
+void __track_core_alloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	assert(spc->alloc_proc != p);	/* corruption or double-alloc */
+	spc->alloc_proc = p;
+	/* if the pcore is prov to them and now allocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_not_alloc_me, spc, prov_next);
+		TAILQ_INSERT_TAIL(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+	}
+	if (pcoreid == next_pcoreid)
+		next_pcoreid = -1;
+	__spc_set_idle(spc, FALSE);
+}
+
+/* Track the pcore properly when it is deallocated from p. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * */
+void __track_core_dealloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	spc->alloc_proc = 0;
+	/* if the pcore is prov to them and now deallocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+		/* this is the victim list, which can be sorted so that we pick the
+		 * right victim (sort by alloc_proc reverse priority, etc).  In this
+		 * case, the core isn't alloc'd by anyone, so it should be the first
+		 * victim. */
+		TAILQ_INSERT_HEAD(&p->ksched_data.crd.prov_not_alloc_me, spc,
+		                  prov_next);
+	}
+	__spc_set_idle(spc, TRUE);
+}
+
+/* Bulk interface for __track_core_dealloc */
+void __track_core_dealloc_bulk(struct proc *p, uint32_t *pc_arr,
+                               uint32_t nr_cores)
+{
+	for (int i = 0; i < nr_cores; i++)
+		__track_core_dealloc(p, pc_arr[i]);
+}
+
+/* Get an idle core from our pcore list and return its core_id. Don't
+ * consider the chosen core in the future when handing out cores to a
+ * process. This code assumes that the scheduler that uses it holds a lock
+ * for the duration of the call. This will not give out provisioned cores. */
+int __get_any_idle_core(void)
+{
+	struct sched_pcore *spc;
+
+	for (int i = 0; i < num_cores; i++) {
+		spc = pcoreid2spc(i);
+		if (!spc->idle || spc->prov_proc)
+			continue;
+		assert(!spc->alloc_proc);
+		__spc_set_idle(spc, FALSE);
+		return i;
+	}
+	return -1;
+}
+
+/* Same as __get_any_idle_core() except for a specific core id. */
+int __get_specific_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	if (!spc->idle || spc->prov_proc)
+		return -1;
+	assert(!spc->alloc_proc);
+	__spc_set_idle(spc, FALSE);
+	return coreid;
+}
+
+/* Reinsert a core obtained via __get_any_idle_core() or
+ * __get_specific_idle_core() back into the idlecore map. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * This will not give out provisioned cores. */
+void __put_idle_core(int coreid)
+{
+	assert((coreid >= 0) && (coreid < num_cores));
+	__spc_set_idle(pcoreid2spc(coreid), TRUE);
+}
+
+/* One off function to make 'pcoreid' the next core chosen by the core
+ * allocation algorithm (so long as no provisioned cores are still idle).
+ * This code assumes that the scheduler that uses it holds a lock for the
+ * duration of the call. */
+void __next_core_to_alloc(uint32_t pcoreid)
+{
+	if ((pcoreid < num_cores) && pcoreid2spc(pcoreid)->idle) {
+		next_pcoreid = pcoreid;
+		printk("Pcore %d will be given out next (from the idles)\n", pcoreid);
+	}
+}
+
+/* There's no idle list to sort; we always pick by topology. */
+void __sort_idle_cores(void)
+{
+}
+
+/* Print the map of idle cores that are still allocatable through our core
+ * allocation algorithm. */
+void print_idle_core_map(void)
+{
+	struct sched_pcore *spc_i;
+
+	/* not locking, so we can look at this without deadlocking. */
+	printk("Idle cores (unlocked!):\n");
+	for (int i = 0; i < num_cores; i++) {
+		spc_i = pcoreid2spc(i);
+		if (!spc_i->idle)
+			continue;
+		printk("Core %d (numa %d, socket %d, sibling %d), prov to %d (%p)\n",
+		       i, spc_i->numa_id, spc_i->socket_id, spc2pcoreid(spc_i->sibling),
+		       spc_i->prov_proc ? spc_i->prov_proc->pid : 0, spc_i->prov_proc);
+	}
+	for (int i = 0; i < num_numa; i++)
+		printk("NUMA %d: %d idle\n", i, nr_idle_numa[i]);
+	for (int i = 0; i < num_sockets; i++)
+		printk("Socket %d: %d idle\n", i, nr_idle_socket[i]);
+}
@@ -0,0 +1,346 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Core pools.  See corepool.h.
+ *
+ * The pools are on one list, and a pool can only be created under one that
+ * already exists, so parents always come before their children.  Walking the
+ * list backwards is bottom up, and forwards is top down, which is all the
+ * planning needs.  There aren't many pools, so lookups by name are just a walk
+ * down the list. */
+
+#include <corepool.h>
+#include <ksched_policy.h>
+#include <process.h>
+#include <syscall.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+struct core_pool root_core_pool = {
+	.name = "root",
+	.weight = KSCHED_DEFAULT_WEIGHT,
+};
+unsigned int nr_core_pools = 1;
+
+static struct core_pool_tailq all_pools = TAILQ_HEAD_INITIALIZER(all_pools);
+
+/* Something that wants a cut of a pool's cores: a child pool, or the pool's
+ * own members. */
+struct pool_claim {
+	uint32_t					*got;
+	uint32_t					demand;
+	unsigned int				weight;
+};
+
+void corepool_init(void)
+{
+	root_core_pool.max_cores = max_vcores(NULL);
+	TAILQ_INIT(&root_core_pool.mcps);
+	TAILQ_INSERT_TAIL(&all_pools, &root_core_pool, link);
+}
+
+static struct core_pool *__find_pool(const char *name)
+{
+	struct core_pool *cp;
+
+	TAILQ_FOREACH(cp, &all_pools, link) {
+		if (!strcmp(cp->name, name))
+			return cp;
+	}
+	return NULL;
+}
+
+/* New processes go in their parent's pool.  The parent might have died and left
+ * its pool already. */
+void __corepool_add_proc(struct proc *p, struct proc *parent)
+{
+	struct core_pool *cp = &root_core_pool;
+
+	if (parent && parent->ksched_data.pool)
+		cp = parent->ksched_data.pool;
+	p->ksched_data.pool = cp;
+	cp->nr_procs++;
+}
+
+void __corepool_remove_proc(struct proc *p)
+{
+	struct core_pool *cp = p->ksched_data.pool;
+
+	if (!cp)
+		return;
+	cp->nr_procs--;
+	p->ksched_data.pool = NULL;
+}
+
+/* Splits avail among the claims by weight, never giving any more than its
+ * demand. */
+static void waterfill_claims(struct pool_claim *claims, int nr_claims,
+                             uint32_t avail)
+{
+	struct pool_claim *cl, *neediest;
+	uint64_t total_weight;
+	uint32_t given, share;
+
+	while (avail) {
+		total_weight = 0;
+		neediest = NULL;
+		for (int i = 0; i < nr_claims; i++) {
+			cl = &claims[i];
+			if (*cl->got >= cl->demand)
+				continue;
+			total_weight += cl->weight;
+			if (!neediest || ((uint64_t)*cl->got * neediest->weight <
+			                  (uint64_t)*neediest->got * cl->weight))
+				neediest = cl;
+		}
+		if (!total_weight)
+			return;
+		given = 0;
+		for (int i = 0; i < nr_claims; i++) {
+			cl = &claims[i];
+			if (*cl->got >= cl->demand)
+				continue;
+			share = (uint64_t)avail * cl->weight / total_weight;
+			share = MIN(share, cl->demand - *cl->got);
+			*cl->got += share;
+			given += share;
+		}
+		/* Shares all rounded down to 0; one at a time to the neediest */
+		if (!given) {
+			(*neediest->got)++;
+			given = 1;
+		}
+		avail -= given;
+	}
+}
+
+/* Splits cp's entitlement among its children and its own members.  The
+ * children get their mins first, then everyone splits the rest by weight. */
+static void __split_pool(struct core_pool *cp)
+{
+	struct pool_claim claims[CORE_POOL_MAX_CHILDREN + 1];
+	struct core_pool *c;
+	uint32_t avail = cp->entitled;
+	int nr_claims = 0;
+
+	claims[nr_claims++] = (struct pool_claim){&cp->own_share, cp->own_demand,
+	                                          cp->weight};
+	TAILQ_FOREACH(c, &all_pools, link) {
+		if (c->parent != cp)
+			continue;
+		c->entitled = MIN(MIN(c->min_cores, c->demand), avail);
+		avail -= c->entitled;
+		claims[nr_claims++] = (struct pool_claim){&c->entitled, c->demand,
+		                                          c->weight};
+	}
+	waterfill_claims(claims, nr_claims, avail);
+}
+
+void __corepool_plan(struct proc_list *mcps)
+{
+	struct core_pool *cp;
+	struct proc *p;
+
+	TAILQ_FOREACH(cp, &all_pools, link) {
+		TAILQ_INIT(&cp->mcps);
+		cp->demand = 0;
+		cp->own_demand = 0;
+		cp->entitled = 0;
+		cp->own_share = 0;
+	}
+	/* Sort the MCPs into their pools.  They all go back on mcps at the end,
+	 * and no one looks at cur_list while we hold the lock. */
+	while ((p = TAILQ_FIRST(mcps))) {
+		TAILQ_REMOVE(mcps, p, ksched_data.proc_link);
+		cp = p->ksched_data.pool;
+		assert(cp);
+		TAILQ_INSERT_TAIL(&cp->mcps, p, ksched_data.proc_link);
+		cp->own_demand += ksched_mcp_demand(p);
+	}
+	TAILQ_FOREACH_REVERSE(cp, &all_pools, core_pool_tailq, link) {
+		cp->demand = MIN(cp->demand + cp->own_demand, cp->max_cores);
+		if (cp->parent)
+			cp->parent->demand += cp->demand;
+	}
+	root_core_pool.entitled = root_core_pool.demand;
+	TAILQ_FOREACH(cp, &all_pools, link) {
+		__split_pool(cp);
+		ksched_sort_mcps(&cp->mcps);
+		ksched_policy->plan(&cp->mcps, cp->own_share);
+	}
+	TAILQ_FOREACH(cp, &all_pools, link)
+		TAILQ_CONCAT(mcps, &cp->mcps, ksched_data.proc_link);
+	ksched_sort_mcps(mcps);
+}
+
+uint32_t __corepool_room(struct proc *p)
+{
+	struct core_pool *cp;
+	struct proc *p_i;
+	uint32_t room = UINT32_MAX;
+
+	TAILQ_FOREACH(cp, &all_pools, link)
+		cp->nr_alloc = 0;
+	for (int i = 0; i < num_cores; i++) {
+		p_i = get_alloc_proc(i);
+		if (!p_i)
+			continue;
+		for (cp = p_i->ksched_data.pool; cp; cp = cp->parent)
+			cp->nr_alloc++;
+	}
+	for (cp = p->ksched_data.pool; cp; cp = cp->parent) {
+		if (cp->nr_alloc >= cp->max_cores)
+			return 0;
+		room = MIN(room, cp->max_cores - cp->nr_alloc);
+	}
+	return room;
+}
+
+static int __check_limits(uint32_t min_cores, uint32_t max_cores)
+{
+	if ((min_cores > max_cores) || (max_cores > max_vcores(NULL))) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+int __corepool_create(struct core_pool *cp, const char *name,
+                      const char *parent, uint32_t min_cores,
+                      uint32_t max_cores)
+{
+	struct core_pool *parent_cp = __find_pool(parent);
+
+	if (!parent_cp) {
+		set_errno(ENOENT);
+		return -1;
+	}
+	if (__find_pool(name)) {
+		set_errno(EEXIST);
+		return -1;
+	}
+	if (!*name || (strlen(name) >= CORE_POOL_NAMELEN) ||
+	    (parent_cp->depth + 1 >= CORE_POOL_MAX_DEPTH)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	if (parent_cp->nr_children >= CORE_POOL_MAX_CHILDREN) {
+		set_errno(ENOSPC);
+		return -1;
+	}
+	if (__check_limits(min_cores, max_cores))
+		return -1;
+	strlcpy(cp->name, name, sizeof(cp->name));
+	cp->parent = parent_cp;
+	cp->depth = parent_cp->depth + 1;
+	cp->min_cores = min_cores;
+	cp->max_cores = max_cores;
+	cp->weight = KSCHED_DEFAULT_WEIGHT;
+	TAILQ_INIT(&cp->mcps);
+	parent_cp->nr_children++;
+	TAILQ_INSERT_TAIL(&all_pools, cp, link);
+	nr_core_pools++;
+	return 0;
+}
+
+int __corepool_set_limits(const char *name, uint32_t min_cores,
+                          uint32_t max_cores)
+{
+	struct core_pool *cp = __find_pool(name);
+
+	if (!cp) {
+		set_errno(ENOENT);
+		return -1;
+	}
+	/* The root is whatever the ksched has */
+	if (cp == &root_core_pool) {
+		set_errno(EPERM);
+		return -1;
+	}
+	if (__check_limits(min_cores, max_cores))
+		return -1;
+	cp->min_cores = min_cores;
+	cp->max_cores = max_cores;
+	return 0;
+}
+
+int __corepool_set_weight(const char *name, unsigned int weight)
+{
+	struct core_pool *cp = __find_pool(name);
+
+	if (!cp) {
+		set_errno(ENOENT);
+		return -1;
+	}
+	if (!weight || (weight > KSCHED_MAX_WEIGHT)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	cp->weight = weight;
+	return 0;
+}
+
+/* Only empty pools can be removed.  Returns the pool for the caller to free. */
+struct core_pool *__corepool_remove(const char *name)
+{
+	struct core_pool *cp = __find_pool(name);
+
+	if (!cp) {
+		set_errno(ENOENT);
+		return NULL;
+	}
+	if (cp == &root_core_pool) {
+		set_errno(EPERM);
+		return NULL;
+	}
+	if (cp->nr_procs || cp->nr_children) {
+		set_errno(EBUSY);
+		return NULL;
+	}
+	TAILQ_REMOVE(&all_pools, cp, link);
+	cp->parent->nr_children--;
+	nr_core_pools--;
+	return cp;
+}
+
+int __corepool_set_proc(struct proc *p, const char *name, const char *user)
+{
+	struct core_pool *cp = __find_pool(name);
+
+	if (!cp) {
+		set_errno(ENOENT);
+		return -1;
+	}
+	/* Otherwise anyone could escape their pool's max */
+	if (user && (!cp->owner || strcmp(cp->owner, user))) {
+		set_errno(EPERM);
+		return -1;
+	}
+	/* Already gone from the ksched */
+	if (!p->ksched_data.pool) {
+		set_errno(ESRCH);
+		return -1;
+	}
+	p->ksched_data.pool->nr_procs--;
+	p->ksched_data.pool = cp;
+	cp->nr_procs++;
+	return 0;
+}
+
+/* The demand and entitlement are from the last ksched pass.  Returns the length
+ * printed, which is cut short if buf is too small. */
+size_t __corepool_print(char *buf, size_t bufsz)
+{
+	struct core_pool *cp;
+	char *p = buf, *e = buf + bufsz;
+
+	p = seprintf(p, e, "name parent min max weight procs demand entitled\n");
+	TAILQ_FOREACH(cp, &all_pools, link) {
+		p = seprintf(p, e, "%s %s %u %u %u %u %u %u\n", cp->name,
+		             cp->parent ? cp->parent->name : "-", cp->min_cores,
+		             cp->max_cores, cp->weight, cp->nr_procs, cp->demand,
+		             cp->entitled);
+	}
+	return MIN(p - buf, bufsz - 1);
+}
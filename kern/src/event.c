@@ -361,6 +361,14 @@ static void send_indir(struct proc *p, struct event_queue *ev_q,
  * where the kernel suggests, set EVENT_VCORE_APPRO(priate). */
 void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
                 uint32_t vcoreid)
+{
+	send_event_batch(p, ev_q, msg, 1, vcoreid);
+}
+
+/* Sends nr msgs to ev_q, like send_event(), but posts them back to back and
+ * alerts the vcore (IPI, INDIR, wakeup) once for the lot. */
+void send_event_batch(struct proc *p, struct event_queue *ev_q,
+                      struct event_msg *msgs, unsigned int nr, uint32_t vcoreid)
 {
 	uintptr_t old_proc;
 	struct event_mbox *ev_mbox = 0;
@@ -413,7 +421,8 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	 * we'll prefer to send it to whatever vcoreid we determined at this point
 	 * (via APPRO or whatever). */
 	if (ev_q->ev_flags & EVENT_SPAM_PUBLIC) {
-		spam_public_msg(p, msg, vcoreid, ev_q->ev_flags);
+		for (int i = 0; i < nr; i++)
+			spam_public_msg(p, &msgs[i], vcoreid, ev_q->ev_flags);
 		goto wakeup;
 	}
 	/* We aren't spamming and we know the default vcore, and now we need to
@@ -437,7 +446,8 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 		printk("[kernel] Illegal addr for ev_mbox\n");
 		goto out;
 	}
-	post_ev_msg(p, ev_mbox, msg, ev_q->ev_flags);
+	for (int i = 0; i < nr; i++)
+		post_ev_msg(p, ev_mbox, &msgs[i], ev_q->ev_flags);
 	wmb();	/* ensure ev_msg write is before alerting the vcore */
 	/* Prod/alert a vcore with an IPI or INDIR, if desired.  INDIR will also
 	 * call try_notify (IPI) later */
@@ -469,6 +479,20 @@ void send_kernel_event(struct proc *p, struct event_msg *msg, uint32_t vcoreid)
 		send_event(p, ev_q, msg, vcoreid);
 }
 
+/* Batched send_kernel_event().  The msgs must all be the same ev_type. */
+void send_kernel_event_batch(struct proc *p, struct event_msg *msgs,
+                             unsigned int nr, uint32_t vcoreid)
+{
+	struct event_queue *ev_q;
+
+	if (!nr)
+		return;
+	assert(msgs[0].ev_type < MAX_NR_EVENT);
+	ev_q = p->procdata->kernel_evts[msgs[0].ev_type];
+	if (ev_q)
+		send_event_batch(p, ev_q, msgs, nr, vcoreid);
+}
+
 /* Writes the msg to the vcpd mbox of the vcore.  If you want the private mbox,
  * send in the ev_flag EVENT_VCORE_PRIVATE.  If not, the message could
  * be received by other vcores if the given vcore is offline/preempted/etc.
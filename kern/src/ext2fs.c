@@ -733,7 +733,7 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 		} else {
 			memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
 			bh->bh_flags |= BH_DIRTY;
-			atomic_or(&bh->bh_page->pg_flags, PG_DIRTY);
+			pm_page_set_dirty(bh->bh_page);
 		}
 	}
 	retval = bdev_submit_request(bdev, breq);
@@ -39,6 +39,8 @@
 #include <vfs.h>
 #include <devfs.h>
 #include <blockdev.h>
+#include <reclaim.h>
+#include <rcu.h>
 #include <ext2fs.h>
 #include <kthread.h>
 #include <linker_func.h>
@@ -147,6 +149,8 @@ void kernel_init(multiboot_info_t *mboot_info)
 	radix_init();
 	acpiinit();
 	topology_init();
+	kpages_numa_init();
+	kmem_cache_numa_init();
 	percpu_init();
 	kthread_init();					/* might need to tweak when this happens */
 	vmr_init();
@@ -161,11 +165,14 @@ static void __kernel_init_part_deux(void *arg)
 {
 	kernel_msg_init();
 	timer_init();
+	rcu_init();
 	vfs_init();
 	devfs_init();
 	time_init();
 	arch_init();
 	block_init();
+	page_zero_pool_init();
+	reclaim_init();
 	enable_irq();
 	run_linker_funcs();
 	/* reset/init devtab after linker funcs 3 and 4.  these run NIC and medium
@@ -9,6 +9,7 @@
 #include <error.h>
 #include <pmap.h>
 #include <kmalloc.h>
+#include <kmalloc_prof.h>
 #include <stdio.h>
 #include <slab.h>
 #include <assert.h>
@@ -23,6 +24,12 @@ struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
 
 static void __kfree_release(struct kref *kref);
 
+static inline void kmalloc_sample(struct kmalloc_tag *tag, size_t size)
+{
+	if (unlikely(kmalloc_prof_period))
+		kmalloc_prof_alloc(tag, size);
+}
+
 void kmalloc_init(void)
 {
 	char kc_name[KMC_NAME_SZ];
@@ -68,6 +75,7 @@ void *kmalloc(size_t size, int flags)
 		tag->amt_alloc = amt_alloc;
 		tag->canary = KMALLOC_CANARY;
 		kref_init(&tag->kref, __kfree_release, 1);
+		kmalloc_sample(tag, size);
 		return buf + sizeof(struct kmalloc_tag);
 	}
 	// else, alloc from the appropriate cache
@@ -80,6 +88,7 @@ void *kmalloc(size_t size, int flags)
 	tag->my_cache = kmalloc_caches[cache_id];
 	tag->canary = KMALLOC_CANARY;
 	kref_init(&tag->kref, __kfree_release, 1);
+	kmalloc_sample(tag, size);
 	return buf + sizeof(struct kmalloc_tag);
 }
 
@@ -218,6 +227,9 @@ int kmalloc_refcnt(void *buf)
 static void __kfree_release(struct kref *kref)
 {
 	struct kmalloc_tag *tag = container_of(kref, struct kmalloc_tag, kref);
+
+	if (unlikely(tag->flags & KMALLOC_FLAG_SAMPLED))
+		kmalloc_prof_free(tag);
 	if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE)
 		kmem_cache_free(tag->my_cache, tag);
 	else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES)
@@ -0,0 +1,356 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Sampled kmalloc profiler.  See kmalloc_prof.h.
+ *
+ * Each core counts down kmallocs and samples one every kmalloc_prof_period.  A
+ * sample takes a kernel backtrace, the same way the profiler's kernel traces
+ * are collected, and charges it to a call site: a unique backtrace.  Sites are
+ * only freed when the profile is reset.  Every sample is also tracked as live
+ * until its buffer is freed.  The kmalloc tag of a sampled buffer is flagged,
+ * so kfree only looks us up for those.
+ *
+ * A sample stands for the period's worth of allocations, so we scale by the
+ * period when sampling, instead of leaving it to pprof.  That way the period
+ * can change between starts without skewing the profile.
+ *
+ * The off path is a single check of kmalloc_prof_period in kmalloc().  When on,
+ * all but one of every period allocations just decrement a per-core counter. */
+
+#include <kmalloc_prof.h>
+#include <kdebug.h>
+#include <slab.h>
+#include <percpu.h>
+#include <hash.h>
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define KMPROF_SITE_HASH_BITS	10
+#define KMPROF_LIVE_HASH_BITS	12
+/* Four counts and a backtrace, as printed in the heap profile */
+#define KMPROF_SITE_LINE_SZ		(4 * 21 + 10 + MAX_BT_DEPTH * 19 + 2)
+/* Address, size, age, and a backtrace, as printed in the live list */
+#define KMPROF_LIVE_LINE_SZ		(19 + 2 * 21 + 6 + MAX_BT_DEPTH * 19 + 2)
+/* Allocations that might happen while we build a report */
+#define KMPROF_SLACK			64
+
+struct kmprof_site {
+	struct kmprof_site			*next;
+	size_t						alloc_objs;
+	size_t						alloc_bytes;
+	size_t						inuse_objs;
+	size_t						inuse_bytes;
+	size_t						nr_pcs;
+	uintptr_t					pcs[MAX_BT_DEPTH];
+};
+
+struct kmprof_live {
+	struct kmprof_live			*next;
+	struct kmalloc_tag			*tag;
+	size_t						size;
+	unsigned int				weight;		/* the period when sampled */
+	uint64_t					tstamp;
+	struct kmprof_site			*site;
+};
+
+unsigned int kmalloc_prof_period;
+
+static DEFINE_PERCPU(unsigned int, kmprof_countdown);
+/* The spinlock protects the hash tables.  The qlock serializes the control
+ * operations and report builders.  Sites are only freed on a reset, so holding
+ * the qlock keeps them around. */
+static spinlock_t kmprof_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static qlock_t kmprof_qlock = QLOCK_INITIALIZER(kmprof_qlock);
+static struct kmprof_site *site_hash[1 << KMPROF_SITE_HASH_BITS];
+static struct kmprof_live *live_hash[1 << KMPROF_LIVE_HASH_BITS];
+static size_t nr_sites;
+static size_t nr_live;
+static size_t nr_dropped;
+static struct kmem_cache *kmprof_site_cache;
+static struct kmem_cache *kmprof_live_cache;
+
+static unsigned long site_hash_idx(uintptr_t *pcs, size_t nr_pcs)
+{
+	unsigned long h = nr_pcs;
+
+	for (size_t i = 0; i < nr_pcs; i++)
+		h = h * 31 + pcs[i];
+	return hash_long(h, KMPROF_SITE_HASH_BITS);
+}
+
+static struct kmprof_site *__find_site(unsigned long idx, uintptr_t *pcs,
+                                       size_t nr_pcs)
+{
+	struct kmprof_site *site;
+
+	for (site = site_hash[idx]; site; site = site->next) {
+		if ((site->nr_pcs == nr_pcs) &&
+		    !memcmp(site->pcs, pcs, nr_pcs * sizeof(uintptr_t)))
+			return site;
+	}
+	return NULL;
+}
+
+/* Called from kmalloc() when the profiler is on. */
+void kmalloc_prof_alloc(struct kmalloc_tag *tag, size_t size)
+{
+	unsigned int *countdown = PERCPU_VARPTR(kmprof_countdown);
+	unsigned int period = ACCESS_ONCE(kmalloc_prof_period);
+	uintptr_t pcs[MAX_BT_DEPTH];
+	size_t nr_pcs;
+	unsigned long idx;
+	struct kmprof_site *site, *new_site = NULL;
+	struct kmprof_live *live;
+
+	if (!period)
+		return;
+	/* An IRQ handler's kmalloc could race with us.  At worst, we'll lose a
+	 * count or take an extra sample. */
+	if (*countdown > 1) {
+		(*countdown)--;
+		return;
+	}
+	/* Reset first, so the slab allocs below won't sample themselves */
+	*countdown = period;
+	nr_pcs = backtrace_list_here(pcs, MAX_BT_DEPTH);
+	idx = site_hash_idx(pcs, nr_pcs);
+	live = kmem_cache_alloc(kmprof_live_cache, MEM_ATOMIC);
+	if (!live)
+		goto out_dropped;
+	live->tag = tag;
+	live->size = size;
+	live->weight = period;
+	live->tstamp = nsec();
+	spin_lock_irqsave(&kmprof_lock);
+	site = __find_site(idx, pcs, nr_pcs);
+	if (!site) {
+		spin_unlock_irqsave(&kmprof_lock);
+		new_site = kmem_cache_alloc(kmprof_site_cache, MEM_ATOMIC);
+		if (!new_site) {
+			kmem_cache_free(kmprof_live_cache, live);
+			goto out_dropped;
+		}
+		memset(new_site, 0, sizeof(struct kmprof_site));
+		new_site->nr_pcs = nr_pcs;
+		memcpy(new_site->pcs, pcs, nr_pcs * sizeof(uintptr_t));
+		spin_lock_irqsave(&kmprof_lock);
+		/* Someone could have added it while we were unlocked */
+		site = __find_site(idx, pcs, nr_pcs);
+		if (!site) {
+			site = new_site;
+			new_site = NULL;
+			site->next = site_hash[idx];
+			/* Report builders walk the sites without the spinlock */
+			wmb();
+			site_hash[idx] = site;
+			nr_sites++;
+		}
+	}
+	site->alloc_objs += period;
+	site->alloc_bytes += size * period;
+	site->inuse_objs += period;
+	site->inuse_bytes += size * period;
+	live->site = site;
+	idx = hash_ptr(tag, KMPROF_LIVE_HASH_BITS);
+	live->next = live_hash[idx];
+	live_hash[idx] = live;
+	nr_live++;
+	tag->flags |= KMALLOC_FLAG_SAMPLED;
+	spin_unlock_irqsave(&kmprof_lock);
+	if (new_site)
+		kmem_cache_free(kmprof_site_cache, new_site);
+	return;
+out_dropped:
+	spin_lock_irqsave(&kmprof_lock);
+	nr_dropped++;
+	spin_unlock_irqsave(&kmprof_lock);
+}
+
+/* Called when a sampled buffer is freed, even if the profiler was stopped.  The
+ * sample might be gone already, if someone reset the profile. */
+void kmalloc_prof_free(struct kmalloc_tag *tag)
+{
+	struct kmprof_live **pp, *live = NULL;
+
+	spin_lock_irqsave(&kmprof_lock);
+	for (pp = &live_hash[hash_ptr(tag, KMPROF_LIVE_HASH_BITS)]; *pp;
+	     pp = &(*pp)->next) {
+		if ((*pp)->tag == tag) {
+			live = *pp;
+			*pp = live->next;
+			nr_live--;
+			live->site->inuse_objs -= live->weight;
+			live->site->inuse_bytes -= live->size * live->weight;
+			break;
+		}
+	}
+	spin_unlock_irqsave(&kmprof_lock);
+	if (live)
+		kmem_cache_free(kmprof_live_cache, live);
+}
+
+void kmalloc_prof_start(unsigned int period)
+{
+	assert(period);
+	qlock(&kmprof_qlock);
+	if (!kmprof_site_cache) {
+		kmprof_site_cache = kmem_cache_create("kmprof_site",
+		                                      sizeof(struct kmprof_site),
+		                                      __alignof__(struct kmprof_site),
+		                                      0, NULL, 0, 0, NULL);
+		kmprof_live_cache = kmem_cache_create("kmprof_live",
+		                                      sizeof(struct kmprof_live),
+		                                      __alignof__(struct kmprof_live),
+		                                      0, NULL, 0, 0, NULL);
+	}
+	/* The caches need to be visible before kmalloc sees the period */
+	wmb();
+	kmalloc_prof_period = period;
+	qunlock(&kmprof_qlock);
+}
+
+void kmalloc_prof_stop(void)
+{
+	kmalloc_prof_period = 0;
+}
+
+/* Throws away the profile.  Sampled buffers that are still live will be freed
+ * without finding their sample, which is fine. */
+void kmalloc_prof_reset(void)
+{
+	struct kmprof_site *sites = NULL, *site, *site_next;
+	struct kmprof_live *lives = NULL, *live, *live_next;
+
+	qlock(&kmprof_qlock);
+	spin_lock_irqsave(&kmprof_lock);
+	for (int i = 0; i < ARRAY_SIZE(site_hash); i++) {
+		for (site = site_hash[i]; site; site = site_next) {
+			site_next = site->next;
+			site->next = sites;
+			sites = site;
+		}
+		site_hash[i] = NULL;
+	}
+	for (int i = 0; i < ARRAY_SIZE(live_hash); i++) {
+		for (live = live_hash[i]; live; live = live_next) {
+			live_next = live->next;
+			live->next = lives;
+			lives = live;
+		}
+		live_hash[i] = NULL;
+	}
+	nr_sites = 0;
+	nr_live = 0;
+	nr_dropped = 0;
+	spin_unlock_irqsave(&kmprof_lock);
+	for (site = sites; site; site = site_next) {
+		site_next = site->next;
+		kmem_cache_free(kmprof_site_cache, site);
+	}
+	for (live = lives; live; live = live_next) {
+		live_next = live->next;
+		kmem_cache_free(kmprof_live_cache, live);
+	}
+	qunlock(&kmprof_qlock);
+}
+
+static size_t print_pcs(struct sized_alloc *sza, size_t sofar,
+                        struct kmprof_site *site)
+{
+	for (size_t i = 0; i < site->nr_pcs; i++)
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar, " %p",
+		                  site->pcs[i]);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar, "\n");
+	return sofar;
+}
+
+/* Builds a heap profile in pprof's legacy text format, one line per site:
+ *
+ *	in-use objects: in-use bytes [allocated objects: allocated bytes] @ pcs
+ *
+ * The header line has the totals.  Use pprof with the kernel binary to
+ * symbolize it.  The counts are racy, which is fine for a profile. */
+struct sized_alloc *kmalloc_prof_build_heap(void)
+{
+	struct sized_alloc *sza;
+	struct kmprof_site *site;
+	size_t sofar = 0;
+	size_t inuse_objs = 0, inuse_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+
+	qlock(&kmprof_qlock);
+	sza = sized_kzmalloc((ACCESS_ONCE(nr_sites) + KMPROF_SLACK + 1) *
+	                     KMPROF_SITE_LINE_SZ, MEM_WAIT);
+	for (int i = 0; i < ARRAY_SIZE(site_hash); i++) {
+		for (site = ACCESS_ONCE(site_hash[i]); site; site = site->next) {
+			inuse_objs += site->inuse_objs;
+			inuse_bytes += site->inuse_bytes;
+			alloc_objs += site->alloc_objs;
+			alloc_bytes += site->alloc_bytes;
+		}
+	}
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "heap profile: %lu: %lu [%lu: %lu] @ heap\n",
+	                  inuse_objs, inuse_bytes, alloc_objs, alloc_bytes);
+	for (int i = 0; i < ARRAY_SIZE(site_hash); i++) {
+		for (site = ACCESS_ONCE(site_hash[i]); site; site = site->next) {
+			/* More sites could show up while we're printing */
+			if (sza->size - sofar < KMPROF_SITE_LINE_SZ)
+				break;
+			sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+			                  "%lu: %lu [%lu: %lu] @", site->inuse_objs,
+			                  site->inuse_bytes, site->alloc_objs,
+			                  site->alloc_bytes);
+			sofar = print_pcs(sza, sofar, site);
+		}
+	}
+	qunlock(&kmprof_qlock);
+	sza->size = sofar;
+	return sza;
+}
+
+/* Lists the live samples, oldest last within each hash chain:
+ *
+ *	buffer size age-in-usec @ pcs
+ *
+ * Old buffers from a site that keeps allocating are the usual leak suspects. */
+struct sized_alloc *kmalloc_prof_build_live(void)
+{
+	struct sized_alloc *sza;
+	struct kmprof_live *snap, *live;
+	size_t nr_snap = 0, max_snap;
+	size_t sofar = 0;
+	uint64_t now;
+
+	qlock(&kmprof_qlock);
+	max_snap = ACCESS_ONCE(nr_live) + KMPROF_SLACK;
+	snap = kmalloc(max_snap * sizeof(struct kmprof_live), MEM_WAIT);
+	/* Copy the samples out, so we don't print with IRQs disabled.  Their
+	 * sites stay around, since we hold the qlock. */
+	spin_lock_irqsave(&kmprof_lock);
+	for (int i = 0; i < ARRAY_SIZE(live_hash); i++) {
+		for (live = live_hash[i]; live; live = live->next) {
+			if (nr_snap == max_snap)
+				break;
+			snap[nr_snap++] = *live;
+		}
+	}
+	spin_unlock_irqsave(&kmprof_lock);
+	now = nsec();
+	sza = sized_kzmalloc((nr_snap + 1) * KMPROF_LIVE_LINE_SZ, MEM_WAIT);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "# period %u, %lu live samples, %lu dropped\n",
+	                  kmalloc_prof_period, nr_snap, nr_dropped);
+	for (size_t i = 0; i < nr_snap; i++) {
+		live = &snap[i];
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "%p %lu %llu @", (void*)(live->tag + 1), live->size,
+		                  (now - live->tstamp) / 1000);
+		sofar = print_pcs(sza, sofar, live->site);
+	}
+	qunlock(&kmprof_qlock);
+	kfree(snap);
+	sza->size = sofar;
+	return sza;
+}
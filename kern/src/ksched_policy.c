@@ -0,0 +1,193 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * MCP ksched policies.  See ksched_policy.h.
+ *
+ * - FCFS: MCPs get whatever they ask for, in the order they asked.  Nothing is
+ *   entitled to anything, so nothing gets preempted.
+ * - Proportional share: the cores are split among the MCPs that want them by
+ *   weight.  An MCP that wants less than its share gets what it wants, and the
+ *   rest is split among the others (water-filling).
+ * - Deadline: latency-class MCPs come first, earliest latency target first,
+ *   and are entitled to everything they ask for.  The batch MCPs split what is
+ *   left by weight. */
+
+#include <ksched_policy.h>
+#include <process.h>
+#include <stdio.h>
+#include <assert.h>
+
+uint32_t ksched_mcp_demand(struct proc *p)
+{
+	uint32_t amt_wanted;
+
+	/* Unlocked peeks.  WAITING MCPs yielded all of their cores. */
+	if (p->state == PROC_WAITING)
+		return 0;
+	amt_wanted = ACCESS_ONCE(p->procdata->res_req[RES_CORES].amt_wanted);
+	return MIN(amt_wanted, p->procinfo->max_vcores);
+}
+
+static bool is_latency(struct proc *p)
+{
+	return p->ksched_data.latency_usec != 0;
+}
+
+/* Cores granted per unit of weight, scaled to keep some precision */
+static uint64_t grant_per_weight(struct proc *p)
+{
+	return ((uint64_t)p->procinfo->res_grant[RES_CORES] << 16) /
+	       p->ksched_data.weight;
+}
+
+/* Splits up to *avail cores among the MCPs on mcps for which want() is TRUE,
+ * by weight, never giving any more than its demand. */
+static void waterfill(struct proc_list *mcps, bool (*want)(struct proc *p),
+                      uint32_t *avail)
+{
+	struct proc *p, *neediest;
+	uint64_t total_weight, given;
+	uint32_t share;
+
+	while (*avail) {
+		total_weight = 0;
+		neediest = NULL;
+		TAILQ_FOREACH(p, mcps, ksched_data.proc_link) {
+			if (!want(p) || (p->ksched_data.entitled >= p->ksched_data.demand))
+				continue;
+			total_weight += p->ksched_data.weight;
+			if (!neediest || ((uint64_t)p->ksched_data.entitled *
+			                  neediest->ksched_data.weight <
+			                  (uint64_t)neediest->ksched_data.entitled *
+			                  p->ksched_data.weight))
+				neediest = p;
+		}
+		if (!total_weight)
+			return;
+		given = 0;
+		TAILQ_FOREACH(p, mcps, ksched_data.proc_link) {
+			if (!want(p) || (p->ksched_data.entitled >= p->ksched_data.demand))
+				continue;
+			share = (uint64_t)*avail * p->ksched_data.weight / total_weight;
+			share = MIN(share, p->ksched_data.demand - p->ksched_data.entitled);
+			p->ksched_data.entitled += share;
+			given += share;
+		}
+		/* Fewer cores than MCPs that want them: the shares rounded down to 0.
+		 * Hand them out one at a time, to whoever has the least per weight. */
+		if (!given) {
+			neediest->ksched_data.entitled++;
+			given = 1;
+		}
+		*avail -= given;
+	}
+}
+
+static bool want_all(struct proc *p)
+{
+	return TRUE;
+}
+
+static bool want_batch(struct proc *p)
+{
+	return !is_latency(p);
+}
+
+static void reset_plan(struct proc_list *mcps)
+{
+	struct proc *p;
+
+	TAILQ_FOREACH(p, mcps, ksched_data.proc_link) {
+		p->ksched_data.demand = ksched_mcp_demand(p);
+		p->ksched_data.entitled = 0;
+	}
+}
+
+static void fcfs_plan(struct proc_list *mcps, uint32_t avail)
+{
+	reset_plan(mcps);
+}
+
+/* Least served, per unit of weight, goes first. */
+static bool share_before(struct proc *a, struct proc *b)
+{
+	return grant_per_weight(a) < grant_per_weight(b);
+}
+
+static void share_plan(struct proc_list *mcps, uint32_t avail)
+{
+	reset_plan(mcps);
+	waterfill(mcps, want_all, &avail);
+}
+
+static bool deadline_before(struct proc *a, struct proc *b)
+{
+	if (is_latency(a) != is_latency(b))
+		return is_latency(a);
+	if (is_latency(a))
+		return a->ksched_data.latency_usec < b->ksched_data.latency_usec;
+	return share_before(a, b);
+}
+
+/* Expects mcps to be sorted already, so the latency MCPs are first. */
+static void deadline_plan(struct proc_list *mcps, uint32_t avail)
+{
+	struct proc *p;
+
+	reset_plan(mcps);
+	TAILQ_FOREACH(p, mcps, ksched_data.proc_link) {
+		if (!is_latency(p))
+			break;
+		p->ksched_data.entitled = MIN(p->ksched_data.demand, avail);
+		avail -= p->ksched_data.entitled;
+	}
+	waterfill(mcps, want_batch, &avail);
+}
+
+struct ksched_policy ksched_fcfs = {
+	.name = "fcfs",
+	.before = NULL,
+	.plan = fcfs_plan,
+};
+
+struct ksched_policy ksched_share = {
+	.name = "share",
+	.before = share_before,
+	.plan = share_plan,
+};
+
+struct ksched_policy ksched_deadline = {
+	.name = "deadline",
+	.before = deadline_before,
+	.plan = deadline_plan,
+};
+
+#if defined(CONFIG_KSCHED_SHARE)
+struct ksched_policy *ksched_policy = &ksched_share;
+#elif defined(CONFIG_KSCHED_DEADLINE)
+struct ksched_policy *ksched_policy = &ksched_deadline;
+#else
+struct ksched_policy *ksched_policy = &ksched_fcfs;
+#endif
+
+/* Insertion sort; there aren't many MCPs. */
+void ksched_sort_mcps(struct proc_list *mcps)
+{
+	struct proc_list sorter = TAILQ_HEAD_INITIALIZER(sorter);
+	struct proc *p, *p_i;
+
+	if (!ksched_policy->before)
+		return;
+	TAILQ_CONCAT(&sorter, mcps, ksched_data.proc_link);
+	while ((p = TAILQ_FIRST(&sorter))) {
+		TAILQ_REMOVE(&sorter, p, ksched_data.proc_link);
+		TAILQ_FOREACH(p_i, mcps, ksched_data.proc_link) {
+			if (ksched_policy->before(p, p_i))
+				break;
+		}
+		if (p_i)
+			TAILQ_INSERT_BEFORE(p_i, p, ksched_data.proc_link);
+		else
+			TAILQ_INSERT_TAIL(mcps, p, ksched_data.proc_link);
+	}
+}
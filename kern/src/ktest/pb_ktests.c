@@ -50,6 +50,7 @@
 #include <ktest.h>
 #include <smallidpool.h>
 #include <linker_func.h>
+#include <rcu.h>
 
 KTEST_SUITE("POSTBOOT")
 
@@ -1125,13 +1126,51 @@ bool test_radix_tree(void)
 	            !radix_insert(tree, 4095, (void*)0x4095, 0));
 	KT_ASSERT_M("It should be possible to insert a three-tier",
 	            !radix_insert(tree, 4096, (void*)0x4096, 0));
+	KT_ASSERT_M("It should be possible to insert a three-tier",
+	            !radix_insert(tree, 20000, (void*)0x20000, 0));
 	//print_radix_tree(tree);
+
+	void *items[8];
+	unsigned long keys[8];
+	void **slots[8];
+
+	KT_ASSERT_M("Gang lookup should find all items in order",
+	            radix_gang_lookup(tree, items, 0, 8) == 7);
+	KT_ASSERT(items[0] == (void*)0xdeadbeef && items[1] == (void*)0xdeadbeef);
+	KT_ASSERT(items[3] == (void*)0xcafebabe && items[6] == (void*)0x20000);
+	KT_ASSERT_M("Gang lookup should start at first and stop at max",
+	            radix_gang_lookup_slot(tree, slots, keys, 5, 2) == 2);
+	KT_ASSERT(keys[0] == 65 && keys[1] == 4095);
+	KT_ASSERT(*slots[1] == (void*)0x4095);
+
+	KT_ASSERT_M("Nothing should be tagged yet",
+	            !radix_tree_tagged(tree, RADIX_TAG_DIRTY));
+	radix_tag_set(tree, 4, RADIX_TAG_DIRTY);
+	radix_tag_set(tree, 20000, RADIX_TAG_DIRTY);
+	KT_ASSERT(radix_tree_tagged(tree, RADIX_TAG_DIRTY));
+	KT_ASSERT(radix_tag_get(tree, 20000, RADIX_TAG_DIRTY));
+	KT_ASSERT(!radix_tag_get(tree, 4095, RADIX_TAG_DIRTY));
+	KT_ASSERT(!radix_tree_tagged(tree, RADIX_TAG_WRITEBACK));
+	KT_ASSERT_M("Tagged gang lookup should only find tagged items",
+	            radix_tag_gang_lookup_slot(tree, slots, keys, 0, 8,
+	                                       RADIX_TAG_DIRTY) == 2);
+	KT_ASSERT(keys[0] == 4 && keys[1] == 20000);
+	radix_tag_clear(tree, 4, RADIX_TAG_DIRTY);
+	KT_ASSERT(radix_tag_gang_lookup(tree, items, 0, 8, RADIX_TAG_DIRTY) == 1);
+	KT_ASSERT_M("Deleting an item should clear its tags",
+	            radix_delete(tree, 20000) == (void*)0x20000);
+	KT_ASSERT(!radix_tree_tagged(tree, RADIX_TAG_DIRTY));
+
 	radix_delete(tree, 65);
 	radix_delete(tree, 3);
 	radix_delete(tree, 4);
 	radix_delete(tree, 4095);
 	radix_delete(tree, 4096);
+	radix_delete(tree, 0);
+	KT_ASSERT(!radix_gang_lookup(tree, items, 0, 8));
+	KT_ASSERT_M("Empty nodes should be pruned", !tree->root->num_items);
 	//print_radix_tree(tree);
+	radix_tree_destroy(tree);
 
 	return true;
 }
@@ -2193,6 +2232,66 @@ bool test_cmdline_parse(void)
 	return TRUE;
 }
 
+bool test_jumbo_pages(void)
+{
+	struct page *page;
+	size_t before = arena_amt_free(kpages_arena);
+	size_t order = 9;
+
+	page = jumbo_page_alloc(order, TRUE);
+	if (!page)
+		return TRUE;	/* not enough contiguous memory, nothing to test */
+	KT_ASSERT_M("Jumbo head should be a jumbo", page_is_jumbo(page));
+	KT_ASSERT_M("Jumbo has the wrong order", jumbo_page_order(page) == order);
+	KT_ASSERT_M("Jumbo should be zeroed",
+	            !*(uint64_t*)(page2kva(page) + (PGSIZE << order) - 8));
+	/* Split and unsplit, then split for real and free every piece */
+	KT_ASSERT_M("Split failed", !jumbo_page_split(page, 0));
+	KT_ASSERT_M("Pieces should be jumbos", page_is_jumbo(&page[5]));
+	jumbo_page_unsplit(page, 0);
+	KT_ASSERT_M("Unsplit pieces shouldn't be jumbos", !page_is_jumbo(&page[5]));
+	KT_ASSERT_M("Split failed", !jumbo_page_split(page, 0));
+	for (size_t i = 1; i < 1UL << order; i++)
+		page_decref(&page[i]);
+	KT_ASSERT_M("Jumbo freed early", page_is_jumbo(page));
+	page_decref(page);
+	KT_ASSERT_M("Jumbo not freed", !page_is_jumbo(page));
+	KT_ASSERT_M("Jumbo leaked memory",
+	            arena_amt_free(kpages_arena) >= before);
+	return TRUE;
+}
+
+struct rcu_test {
+	struct rcu_head				head;
+	atomic_t					*nr_done;
+};
+
+static void __test_rcu_cb(struct rcu_head *head)
+{
+	struct rcu_test *rt = container_of(head, struct rcu_test, head);
+
+	atomic_inc(rt->nr_done);
+}
+
+bool test_rcu(void)
+{
+	struct rcu_test rts[10];
+	atomic_t nr_done;
+
+	atomic_init(&nr_done, 0);
+	for (int i = 0; i < ARRAY_SIZE(rts); i++) {
+		rts[i].nr_done = &nr_done;
+		call_rcu(&rts[i].head, __test_rcu_cb);
+	}
+	KT_ASSERT_M("Callbacks ran before a grace period",
+	            atomic_read(&nr_done) < ARRAY_SIZE(rts));
+	/* Our callbacks and synchronize's are on the same core, and run in order */
+	synchronize_rcu();
+	KT_ASSERT_M("Callbacks didn't run after a grace period",
+	            atomic_read(&nr_done) == ARRAY_SIZE(rts));
+	return TRUE;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2230,6 +2329,8 @@ static struct ktest ktests[] = {
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
 	KTEST_REG(sort,               CONFIG_TEST_sort),
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
+	KTEST_REG(jumbo_pages,        CONFIG_TEST_jumbo_pages),
+	KTEST_REG(rcu,                CONFIG_TEST_rcu),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 linker_func_1(register_pb_ktests)
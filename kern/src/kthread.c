@@ -222,7 +222,10 @@ void kthread_runnable(struct kthread *kthread)
 			dst++;
 	}
 	#endif
-	/* For lack of anything better, send it to ourselves. (TODO: KSCHED) */
+	/* Pinned kthreads always go home.  For lack of anything better, send the
+	 * rest to ourselves. (TODO: KSCHED) */
+	if (kthread->flags & KTH_PINNED)
+		dst = kthread->pinned_core;
 	send_kernel_message(dst, __launch_kthread, (long)kthread, 0, 0,
 	                    KMSG_ROUTINE);
 }
@@ -300,6 +303,24 @@ void ktask(char *name, void (*fn)(void*), void *arg)
 	                    (long)name, KMSG_ROUTINE);
 }
 
+static void __ktask_pinned_wrapper(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+
+	kth->flags |= KTH_PINNED;
+	kth->pinned_core = core_id();
+	/* The flags get reset when the ktask is done, like KTH_IS_KTASK. */
+	__ktask_wrapper(srcid, a0, a1, a2);
+}
+
+/* Same as ktask(), but it runs on coreid, and whenever it blocks, it wakes up
+ * on coreid. */
+void ktask_pinned(uint32_t coreid, char *name, void (*fn)(void*), void *arg)
+{
+	send_kernel_message(coreid, __ktask_pinned_wrapper, (long)fn, (long)arg,
+	                    (long)name, KMSG_ROUTINE);
+}
+
 /* Semaphores, using kthreads directly */
 static void debug_downed_sem(struct semaphore *sem);
 static void debug_upped_sem(struct semaphore *sem);
@@ -40,12 +40,53 @@ static struct page_map *file2pm(struct file *file)
 	return file->f_mapping;
 }
 
+/* Page shifts of the jumbos we'll use for anonymous memory, largest first. */
+#define MAX_NR_THP_SHIFTS 4
+static int thp_shifts[MAX_NR_THP_SHIFTS];
+static int nr_thp_shifts;
+
+static void thp_init(void)
+{
+#ifdef CONFIG_TRANSPARENT_JUMBOS
+	int shift = arch_max_jumbo_page_shift();
+
+	while ((shift > PGSHIFT) && (nr_thp_shifts < MAX_NR_THP_SHIFTS)) {
+		thp_shifts[nr_thp_shifts++] = shift;
+		shift = arch_smaller_page_shift(shift);
+	}
+#ifndef CONFIG_TRANSPARENT_JUMBOS_1G
+	/* Only use the smallest jumbo */
+	if (nr_thp_shifts > 1) {
+		thp_shifts[0] = thp_shifts[nr_thp_shifts - 1];
+		nr_thp_shifts = 1;
+	}
+#endif
+#endif
+}
+
 void vmr_init(void)
 {
 	vmr_kcache = kmem_cache_create("vm_regions",
 				       sizeof(struct vm_region),
 				       __alignof__(struct dentry), 0, NULL,
 				       0, 0, NULL);
+	thp_init();
+}
+
+/* Returns the shift of the largest jumbo that could map va without going
+ * outside [start, end), or 0 if none fit. */
+static int thp_shift_for(uintptr_t va, uintptr_t start, uintptr_t end)
+{
+	uintptr_t jumbo_start;
+	int shift;
+
+	for (int i = 0; i < nr_thp_shifts; i++) {
+		shift = thp_shifts[i];
+		jumbo_start = ROUNDDOWN(va, 1UL << shift);
+		if ((jumbo_start >= start) && (jumbo_start + (1UL << shift) <= end))
+			return shift;
+	}
+	return 0;
 }
 
 /* For now, the caller will set the prot, flags, file, and offset.  In the
@@ -275,7 +316,7 @@ void unmap_and_destroy_vmrs(struct proc *p)
 
 /* Helper: copies the contents of pages from p to new p.  For pages that aren't
  * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+ * intelligent.  0 on success, -ERROR on failure. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
                       uintptr_t va_end)
 {
@@ -289,6 +330,46 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		     va_end);
 		return -EINVAL;
 	}
+	/* If we can't get a jumbo for the child, it gets regular pages */
+	int copy_jumbo_as_pages(struct proc *new_p, pte_t pte, void *va,
+	                        size_t order)
+	{
+		struct page *pp;
+		int settings = pte_get_settings(pte) & ~PTE_PS;
+
+		for (size_t i = 0; i < (1UL << order); i++) {
+			if (upage_alloc(new_p, &pp, 0))
+				return -ENOMEM;
+			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)) + i * PGSIZE,
+			       PGSIZE);
+			if (page_insert(new_p->env_pgdir, pp, va + i * PGSIZE,
+			                settings)) {
+				page_decref(pp);
+				return -ENOMEM;
+			}
+		}
+		return 0;
+	}
+
+	int copy_jumbo(struct proc *new_p, pte_t pte, void *va)
+	{
+		struct page *pp;
+		pte_t new_pte;
+		size_t order = jumbo_page_order(pa2page(pte_get_paddr(pte)));
+
+		pp = jumbo_page_alloc(order, FALSE);
+		if (!pp)
+			return copy_jumbo_as_pages(new_p, pte, va, order);
+		memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE << order);
+		new_pte = pgdir_walk_jumbo(new_p->env_pgdir, va, order + PGSHIFT, TRUE);
+		if (!pte_walk_okay(new_pte)) {
+			page_decref(pp);
+			return -ENOMEM;
+		}
+		pte_write(new_pte, page2pa(pp), pte_get_settings(pte));
+		return 0;
+	}
+
 	int copy_page(struct proc *p, pte_t pte, void *va, void *arg) {
 		struct proc *new_p = (struct proc*)arg;
 		struct page *pp;
@@ -297,7 +378,8 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		/* pages could be !P, but right now that's only for file backed VMRs
 		 * undergoing page removal, which isn't the caller of copy_pages. */
 		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
+			if (pte_is_jumbo(pte))
+				return copy_jumbo(new_p, pte, va);
 			if (upage_alloc(new_p, &pp, 0))
 				return -ENOMEM;
 			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
@@ -569,6 +651,116 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	return 0;
 }
 
+/* Helper, like map_page_at_addr, but maps the jumbo @page of PGSIZE << order at
+ * addr, which must be aligned to the jumbo's size.  Always takes ownership of
+ * the page.  Returns -EBUSY if part of the jumbo's range is already mapped with
+ * smaller pages, in which case the caller can fall back to regular pages. */
+static int map_jumbo_at_addr(struct proc *p, struct page *page, uintptr_t addr,
+                             int prot, int shift)
+{
+	pte_t pte;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)addr, shift, TRUE);
+	if (!pte_walk_okay(pte)) {
+		spin_unlock(&p->pte_lock);
+		page_decref(page);
+		return -ENOMEM;
+	}
+	if (pte_is_mapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		page_decref(page);
+		/* Either someone else mapped a jumbo here (a legit race, like in
+		 * map_page_at_addr), or there's a page table of smaller pages. */
+		return pte_is_jumbo(pte) ? 0 : -EBUSY;
+	}
+	pte_write(pte, page2pa(page), prot | PTE_PS);
+	spin_unlock(&p->pte_lock);
+	return 0;
+}
+
+/* Helper: returns TRUE if nothing is mapped in the jumbo-sized slot at va.
+ * This is racy (no pte_lock), and is just to avoid allocating and zeroing a
+ * jumbo that map_jumbo_at_addr() will reject. */
+static bool jumbo_slot_is_free(struct proc *p, uintptr_t va, int shift)
+{
+	pte_t pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, shift, FALSE);
+
+	return !pte_walk_okay(pte) || pte_is_unmapped(pte);
+}
+
+/* Helper: tries to back the jumbo-sized slot containing va with a jumbo.  Hold
+ * the vmr lock.  Zeroing a 1 GB jumbo takes a while, so we unlock while we
+ * allocate and zero it, and map_jumbo_at_addr() rechecks the PTE.  Returns 0
+ * on success, -EBUSY if the caller should use regular pages, -EAGAIN if the
+ * VMRs changed while we were unlocked, or some other error. */
+static int try_map_anon_jumbo(struct proc *p, uintptr_t va, int pte_prot,
+                              int shift)
+{
+	struct page *page;
+	int vmr_history = ACCESS_ONCE(p->vmr_history);
+
+	va = ROUNDDOWN(va, 1UL << shift);
+	if (!jumbo_slot_is_free(p, va, shift))
+		return -EBUSY;
+	spin_unlock(&p->vmr_lock);
+	page = jumbo_page_alloc(shift - PGSHIFT, TRUE);
+	spin_lock(&p->vmr_lock);
+	/* Even if we got nothing, the caller's vmr and prot could be stale now, so
+	 * it can't just fall back to regular pages. */
+	if (vmr_history != ACCESS_ONCE(p->vmr_history)) {
+		if (page)
+			page_decref(page);
+		return -EAGAIN;
+	}
+	if (!page)
+		return -EBUSY;
+	return map_jumbo_at_addr(p, page, va, pte_prot, shift);
+}
+
+/* Splits any jumbo mapping that straddles va, so that va starts a page (of
+ * whatever size).  Hold the pte_lock.  Returns 0 or -ENOMEM. */
+static int __split_jumbo_at(struct proc *p, uintptr_t va)
+{
+	pte_t pte;
+	struct page *page;
+	int child_shift;
+
+	while (1) {
+		pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+		if (!pte_walk_okay(pte) || !pte_is_mapped(pte) || !pte_is_jumbo(pte))
+			return 0;
+		page = pa2page(pte_get_paddr(pte));
+		if (ALIGNED(va, PGSIZE << jumbo_page_order(page)))
+			return 0;
+		child_shift = arch_smaller_page_shift(PGSHIFT +
+		                                      jumbo_page_order(page));
+		if (jumbo_page_split(page, child_shift - PGSHIFT))
+			return -ENOMEM;
+		if (pgdir_split_jumbo(p->env_pgdir, (void*)va) != child_shift) {
+			jumbo_page_unsplit(page, child_shift - PGSHIFT);
+			return -ENOMEM;
+		}
+	}
+}
+
+/* Helper: splits jumbos so that [addr, addr + len) can be changed without
+ * touching memory outside the range.  The TLB is fine: the old and new
+ * translations are the same. */
+static int split_jumbos_for_range(struct proc *p, uintptr_t addr, size_t len)
+{
+	int ret;
+
+	if (!nr_thp_shifts)
+		return 0;
+	spin_lock(&p->pte_lock);
+	ret = __split_jumbo_at(p, addr);
+	if (!ret)
+		ret = __split_jumbo_at(p, addr + len);
+	spin_unlock(&p->pte_lock);
+	return ret;
+}
+
 /* Helper: copies *pp's contents to a new page, replacing your page pointer.  If
  * this succeeds, you'll have a non-PM page, which matters for how you put it.*/
 static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
@@ -583,19 +775,35 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 }
 
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
- * mappable, which isn't true if there are concurrent changes to the VMRs. */
+ * mappable, which isn't true if there are concurrent changes to the VMRs.  This
+ * will unlock while it zeroes a jumbo, and bails with -EAGAIN if the VMRs
+ * changed in the meantime. */
 static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                             int pte_prot)
 {
 	struct page *page;
-	int ret;
-	for (long i = 0; i < nr_pgs; i++) {
+	uintptr_t end = va + (nr_pgs << PGSHIFT);
+	int shift, ret;
+
+	while (va < end) {
+		/* Only use jumbos that start at va and fit in the range */
+		shift = thp_shift_for(va, va, end);
+		if (shift) {
+			ret = try_map_anon_jumbo(p, va, pte_prot, shift);
+			if (!ret) {
+				va += 1UL << shift;
+				continue;
+			}
+			if (ret != -EBUSY)
+				return ret;
+		}
 		if (upage_alloc(p, &page, TRUE))
 			return -ENOMEM;
 		/* could imagine doing a memwalk instead of a for loop */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot, TRUE);
+		ret = map_page_at_addr(p, page, va, pte_prot, TRUE);
 		if (ret)
 			return ret;
+		va += PGSIZE;
 	}
 	return 0;
 }
@@ -680,8 +888,10 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 	 * We just need to split on the end points (if they exist), and then remove
 	 * everything in between.  __do_munmap() will do this.  Careful, this means
 	 * an mmap can be an implied munmap() (not my call...). */
-	if (flags & MAP_FIXED)
-		__do_munmap(p, addr, len);
+	if ((flags & MAP_FIXED) && __do_munmap(p, addr, len)) {
+		spin_unlock(&p->vmr_lock);
+		return MAP_FAILED;
+	}
 	vmr = create_vmr(p, addr, len);
 	if (!vmr) {
 		printk("[kernel] do_mmap() aborted for %p + %p!\n", addr, len);
@@ -789,6 +999,10 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	bool shootdown_needed = FALSE;
 	int pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
 	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
+	if (split_jumbos_for_range(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	/* TODO: this is aggressively splitting, when we might not need to if the
 	 * prots are the same as the previous.  Plus, there are three excessive
 	 * scans.  Finally, we might be able to merge when we are done. */
@@ -891,6 +1105,10 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 	struct vm_region *vmr, *next_vmr, *first_vmr;
 	bool shootdown_needed = FALSE;
 
+	if (split_jumbos_for_range(p, addr, len)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
 	/* TODO: this will be a bit slow, since we end up doing three linear
 	 * searches (two in isolate, one in find_first). */
 	isolate_vmrs(p, addr, len);
@@ -1000,6 +1218,7 @@ static int __hpf(struct proc *p, uintptr_t va, int prot, bool file_ok)
 	struct page *a_page;
 	unsigned int f_idx;	/* index of the missing page in the file */
 	int ret = 0;
+	int pte_prot, jumbo_shift;
 	bool first = TRUE;
 	va = ROUNDDOWN(va,PGSIZE);
 
@@ -1017,8 +1236,22 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	if (!vmr->vm_file) {
-		/* No file - just want anonymous memory */
+		/* No file - just want anonymous memory, preferably a jumbo */
+		jumbo_shift = thp_shift_for(va, vmr->vm_base, vmr->vm_end);
+		if (jumbo_shift) {
+			ret = try_map_anon_jumbo(p, va, pte_prot, jumbo_shift);
+			/* we unlocked, and the VMRs changed under us */
+			if (ret == -EAGAIN) {
+				spin_unlock(&p->vmr_lock);
+				goto refault;
+			}
+			if (ret != -EBUSY)
+				goto out;
+			ret = 0;
+		}
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
@@ -1079,8 +1312,6 @@ refault:
 	}
 	/* update the page table TODO: careful with MAP_PRIVATE etc.  might do this
 	 * separately (file, no file) */
-	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
-	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot, page_is_pagemap(a_page));
 	/* fall through, even for errors */
 out_put_pg:
@@ -1171,6 +1402,9 @@ static struct vmap_free_tracker *vmap_to_free;
 static size_t vmap_nr_to_free;
 /* This value tunes the ratio of global TLB shootdowns to __vmap_free()s. */
 #define VMAP_MAX_TO_FREE 1000
+/* vmap_addr_arena only hands out addresses, so it can cache them per core.  The
+ * addresses it caches were unmapped and shot down in __vmap_free(). */
+#define VMAP_QCACHE_MAX (8 * PGSIZE)
 
 /* We don't immediately return the addrs to their source (vmap_addr_arena).
  * Instead, we hold on to them until we have a suitable amount, then free them
@@ -1208,7 +1442,8 @@ void vmap_init(void)
 {
 	vmap_addr_arena = arena_create("vmap_addr", (void*)KERN_DYN_BOT,
 	                               KERN_DYN_TOP - KERN_DYN_BOT,
-	                               PGSIZE, NULL, NULL, NULL, 0, MEM_WAIT);
+	                               PGSIZE, NULL, NULL, NULL, VMAP_QCACHE_MAX,
+	                               MEM_WAIT);
 	vmap_arena = arena_create("vmap", NULL, 0, PGSIZE, arena_alloc, __vmap_free,
 	                          vmap_addr_arena, 0, MEM_WAIT);
 	vmap_to_free = kmalloc(sizeof(struct vmap_free_tracker) * VMAP_MAX_TO_FREE,
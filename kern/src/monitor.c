@@ -24,6 +24,7 @@
 #include <trap.h>
 #include <time.h>
 #include <percpu.h>
+#include <rcu.h>
 
 #include <ros/memlayout.h>
 #include <ros/event.h>
@@ -1130,6 +1131,7 @@ int mon_db(int argc, char **argv, struct hw_trapframe *hw_tf)
 		printk("Usage: db OPTION\n");
 		printk("\tsem: print all semaphore info\n");
 		printk("\taddr: for PID lookup ADDR's file/vmr info\n");
+		printk("\trcu: print RCU grace period info\n");
 		return 1;
 	}
 	if (!strcmp(argv[1], "sem")) {
@@ -1140,6 +1142,8 @@ int mon_db(int argc, char **argv, struct hw_trapframe *hw_tf)
 			return 1;
 		}
 		debug_addr_pid(strtol(argv[2], 0, 10), strtol(argv[3], 0, 16));
+	} else if (!strcmp(argv[1], "rcu")) {
+		print_rcu_info();
 	} else {
 		printk("Bad option\n");
 		return 1;
@@ -38,6 +38,7 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <corerequest.h>
 #include <ip.h>
 
 typedef struct Etherhdr Etherhdr;
@@ -106,16 +107,35 @@ struct medium trexmedium = {
 };
 
 typedef struct Etherrock Etherrock;
+typedef struct Etherreader Etherreader;
+
+/*
+ *  v4 has one reader per receive queue, up to MaxRxQ.  With more than one,
+ *  they fan out the v4 packets by flow, and each is pinned to its own LL
+ *  core.  Those are the cores the ksched keeps for the kernel and never gives
+ *  to MCPs (CONFIG_NR_LL_CORES), so reader wakeups don't steal an MCP's core
+ *  and protocol processing never waits on user code trapping in.  We run at
+ *  most one reader per LL core.
+ */
+struct Etherreader {
+	struct Ipifc *ifc;
+	int q;
+	struct gro gro;
+};
+
 struct Etherrock {
 	struct Fs *f;				/* file system we belong to */
 	struct proc *arpp;			/* arp process */
-	struct proc *read4p;		/* reading process (v4) */
+	struct proc *read4p[MaxRxQ];	/* reading processes (v4) */
 	struct proc *read6p;		/* reading process (v6) */
-	struct chan *mchan4;		/* Data channel for v4 */
+	int nrxq;					/* number of v4 readers */
+	struct chan *mchan4[MaxRxQ];	/* Data channels for v4 */
+	struct queue *inq4[MaxRxQ];	/* their queues, if on #ether, for polling */
 	struct chan *achan;			/* Arp channel */
-	struct chan *cchan4;		/* Control channel for v4 */
+	struct chan *cchan4[MaxRxQ];	/* Control channels for v4 */
 	struct chan *mchan6;		/* Data channel for v6 */
 	struct chan *cchan6;		/* Control channel for v6 */
+	Etherreader readers[MaxRxQ];
 };
 
 /*
@@ -173,9 +193,9 @@ static unsigned int parsefeat(char *ptr)
 static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 {
 	ERRSTACK(1);
-	struct chan *mchan4, *cchan4, *achan, *mchan6, *cchan6;
+	struct chan *mchan4[MaxRxQ], *cchan4[MaxRxQ], *achan, *mchan6, *cchan6;
 	char *addr, *dir, *buf;
-	int fd, cfd, n;
+	int fd, cfd, n, nrxq;
 	char *ptr;
 	Etherrock *er;
 
@@ -184,13 +204,17 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 
 	addr = kmalloc(Maxpath, MEM_WAIT);	//char addr[2*KNAMELEN];
 	dir = kmalloc(Maxpath, MEM_WAIT);	//char addr[2*KNAMELEN];
-	mchan4 = cchan4 = achan = mchan6 = cchan6 = NULL;
+	memset(mchan4, 0, sizeof(mchan4));
+	memset(cchan4, 0, sizeof(cchan4));
+	achan = mchan6 = cchan6 = NULL;
 	buf = NULL;
 	if (waserror()) {
-		if (mchan4 != NULL)
-			cclose(mchan4);
-		if (cchan4 != NULL)
-			cclose(cchan4);
+		for (int i = 0; i < MaxRxQ; i++) {
+			if (mchan4[i] != NULL)
+				cclose(mchan4[i]);
+			if (cchan4[i] != NULL)
+				cclose(cchan4[i]);
+		}
 		if (achan != NULL)
 			cclose(achan);
 		if (mchan6 != NULL)
@@ -205,29 +229,10 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	}
 
 	/*
-	 *  open ip converstation
-	 *
-	 *  the dial will fail if the type is already open on
-	 *  this device.
-	 */
-	snprintf(addr, Maxpath, "%s!0x800", argv[2]);
-	fd = kdial(addr, NULL, dir, &cfd);
-	if (fd < 0)
-		error(EFAIL, "dial 0x800 failed: %s", get_cur_errbuf());
-	mchan4 = commonfdtochan(fd, O_RDWR, 0, 1);
-	cchan4 = commonfdtochan(cfd, O_RDWR, 0, 1);
-	sysclose(fd);
-	sysclose(cfd);
-
-	/*
-	 *  make it non-blocking
-	 */
-	devtab[cchan4->type].write(cchan4, nbmsg, strlen(nbmsg), 0);
-
-	/*
-	 *  get mac address and speed
+	 *  get mac address, speed, and receive queues.  we need the queues
+	 *  before we open the ip conversations.
 	 */
-	snprintf(addr, Maxpath, "%s/stats", dir);
+	snprintf(addr, Maxpath, "%s/stats", argv[2]);
 	fd = sysopen(addr, O_READ);
 	if (fd < 0)
 		error(EFAIL, "can't open ether stats: %s", get_cur_errbuf());
@@ -260,6 +265,34 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	} else {
 		ifc->feat = 0;
 	}
+
+	ptr = strstr(buf, "rxq: ");
+	nrxq = ptr ? atoi(ptr + 5) : 1;
+	nrxq = MAX(MIN(MIN(nrxq, MaxRxQ), nr_ll_cores()), 1);
+
+	/*
+	 *  open ip converstation, one per receive queue.  with more than one,
+	 *  they are a fanout group, and split up the packets by flow.
+	 *
+	 *  the dial will fail if the type is already open on
+	 *  this device.
+	 */
+	snprintf(addr, Maxpath, "%s!0x800", argv[2]);
+	for (int i = 0; i < nrxq; i++) {
+		fd = kdial(addr, nrxq > 1 ? "fanout" : NULL, dir, &cfd);
+		if (fd < 0)
+			error(EFAIL, "dial 0x800 failed: %s", get_cur_errbuf());
+		mchan4[i] = commonfdtochan(fd, O_RDWR, 0, 1);
+		cchan4[i] = commonfdtochan(cfd, O_RDWR, 0, 1);
+		sysclose(fd);
+		sysclose(cfd);
+
+		/*
+		 *  make it non-blocking
+		 */
+		devtab[cchan4[i]->type].write(cchan4[i], nbmsg, strlen(nbmsg), 0);
+	}
+
 	/*
 	 *  open arp conversation
 	 */
@@ -291,8 +324,15 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	devtab[cchan6->type].write(cchan6, nbmsg, strlen(nbmsg), 0);
 
 	er = kzmalloc(sizeof(*er), 0);
-	er->mchan4 = mchan4;
-	er->cchan4 = cchan4;
+	er->nrxq = nrxq;
+	for (int i = 0; i < nrxq; i++) {
+		er->mchan4[i] = mchan4[i];
+		if (!strcmp(devtab[mchan4[i]->type].name, "ether"))
+			er->inq4[i] = netifinq(mchan4[i]->aux, mchan4[i]);
+		er->cchan4[i] = cchan4[i];
+		er->readers[i].ifc = ifc;
+		er->readers[i].q = i;
+	}
 	er->achan = achan;
 	er->mchan6 = mchan6;
 	er->cchan6 = cchan6;
@@ -304,7 +344,13 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	kfree(dir);
 	poperror();
 
-	ktask("etherread4", etherread4, ifc);
+	if (nrxq == 1) {
+		ktask("etherread4", etherread4, &er->readers[0]);
+	} else {
+		/* LL cores are 0 through nr_ll_cores() - 1 */
+		for (int i = 0; i < nrxq; i++)
+			ktask_pinned(i, "etherread4", etherread4, &er->readers[i]);
+	}
 	ktask("recvarpproc", recvarpproc, ifc);
 	ktask("etherread6", etherread6, ifc);
 }
@@ -319,8 +365,10 @@ static void etherunbind(struct Ipifc *ifc)
 
 	// we'll need to tell the ktasks to exit, maybe via flags and a wakeup
 #if 0
-	if (er->read4p)
-		postnote(er->read4p, 1, "unbind", 0);
+	for (int i = 0; i < er->nrxq; i++) {
+		if (er->read4p[i])
+			postnote(er->read4p[i], 1, "unbind", 0);
+	}
 	if (er->read6p)
 		postnote(er->read6p, 1, "unbind", 0);
 	if (er->arpp)
@@ -328,16 +376,22 @@ static void etherunbind(struct Ipifc *ifc)
 #endif
 
 	/* wait for readers to die */
-	while (er->arpp != 0 || er->read4p != 0 || er->read6p != 0)
+	for (int i = 0; i < er->nrxq; i++) {
+		while (er->read4p[i] != 0)
+			cpu_relax();
+	}
+	while (er->arpp != 0 || er->read6p != 0)
 		cpu_relax();
 	kthread_usleep(300 * 1000);
 
-	if (er->mchan4 != NULL)
-		cclose(er->mchan4);
+	for (int i = 0; i < er->nrxq; i++) {
+		if (er->mchan4[i] != NULL)
+			cclose(er->mchan4[i]);
+		if (er->cchan4[i] != NULL)
+			cclose(er->cchan4[i]);
+	}
 	if (er->achan != NULL)
 		cclose(er->achan);
-	if (er->cchan4 != NULL)
-		cclose(er->cchan4);
 	if (er->mchan6 != NULL)
 		cclose(er->mchan6);
 	if (er->cchan6 != NULL)
@@ -409,7 +463,7 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 		case V4:
 			eh->t[0] = 0x08;
 			eh->t[1] = 0x00;
-			devtab[er->mchan4->type].bwrite(er->mchan4, bp, 0);
+			devtab[er->mchan4[0]->type].bwrite(er->mchan4[0], bp, 0);
 			break;
 		case V6:
 			eh->t[0] = 0x86;
@@ -423,26 +477,54 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 }
 
 /*
- *  process to read from the ethernet
+ *  the next packet, if one is already queued.  we go straight to the
+ *  netfile's queue; the data chan is shared with the writers.
+ */
+static struct block *etherpoll(struct queue *q)
+{
+	ERRSTACK(1);
+	struct block *bp;
+
+	if (q == NULL)
+		return NULL;
+	if (waserror()) {
+		poperror();
+		return NULL;
+	}
+	bp = qbread_nonblock(q, 128 * 1024);
+	poperror();
+	return bp;
+}
+
+/*
+ *  process to read from the ethernet.  we sleep for one packet, then take
+ *  whatever else is queued behind it, up to a batch, so gro can coalesce
+ *  them.  anything gro is holding goes up before we sleep again.
  */
 static void etherread4(void *a)
 {
 	ERRSTACK(2);
+	Etherreader *rd = a;
 	struct Ipifc *ifc;
 	struct block *bp;
+	struct chan *mchan;
 	Etherrock *er;
 
-	ifc = a;
+	ifc = rd->ifc;
 	er = ifc->arg;
-	er->read4p = current;	/* hide identity under a rock for unbind */
+	mchan = er->mchan4[rd->q];
+	gro_init(&rd->gro, er->f, ifc);
+	/* hide identity under a rock for unbind */
+	er->read4p[rd->q] = current;
 	if (waserror()) {
-		er->read4p = 0;
+		gro_drop(&rd->gro);
+		er->read4p[rd->q] = 0;
 		poperror();
 		warn("etherread4 returns, probably unexpectedly\n");
 		return;
 	}
 	for (;;) {
-		bp = devtab[er->mchan4->type].bread(er->mchan4, 128 * 1024, 0);
+		bp = devtab[mchan->type].bread(mchan, 128 * 1024, 0);
 		if (!canrlock(&ifc->rwlock)) {
 			freeb(bp);
 			continue;
@@ -451,14 +533,18 @@ static void etherread4(void *a)
 			runlock(&ifc->rwlock);
 			nexterror();
 		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
+		for (int i = 1; bp; i++) {
+			ifc->in++;
+			bp->rp += ifc->m->hsize;
+			if (ifc->lifc == NULL) {
+				freeb(bp);
+			} else {
+				ipifc_trace_block(ifc, bp);
+				gro_input(&rd->gro, bp);
+			}
+			bp = i < GRO_BATCH ? etherpoll(er->inq4[rd->q]) : NULL;
 		}
+		gro_flush(&rd->gro);
 		runlock(&ifc->rwlock);
 		poperror();
 	}
@@ -519,7 +605,8 @@ static void etheraddmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * unused)
 	snprintf(buf, sizeof(buf), "addmulti %E", mac);
 	switch (version) {
 		case V4:
-			devtab[er->cchan4->type].write(er->cchan4, buf, strlen(buf), 0);
+			devtab[er->cchan4[0]->type].write(er->cchan4[0], buf, strlen(buf),
+			                                  0);
 			break;
 		case V6:
 			devtab[er->cchan6->type].write(er->cchan6, buf, strlen(buf), 0);
@@ -540,7 +627,8 @@ static void etherremmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * unused)
 	snprintf(buf, sizeof(buf), "remmulti %E", mac);
 	switch (version) {
 		case V4:
-			devtab[er->cchan4->type].write(er->cchan4, buf, strlen(buf), 0);
+			devtab[er->cchan4[0]->type].write(er->cchan4[0], buf, strlen(buf),
+			                                  0);
 			break;
 		case V6:
 			devtab[er->cchan6->type].write(er->cchan6, buf, strlen(buf), 0);
@@ -0,0 +1,232 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Receive coalescing for TCP/IPv4.  An ether reader hands everything it reads
+ * to gro_input().  In-order data segments of the same connection are glued
+ * onto the first one we're holding, so tcpiput() sees one big segment instead
+ * of a dozen small ones.  The reader calls gro_flush() when it runs out of
+ * packets (or has read a batch), so nothing is held across a sleep.
+ *
+ * A later segment's payload goes on the held block as an extra data buffer,
+ * whose base is the later block itself (like point_to_body() in qio).  That
+ * only works if the later block is an ordinary block_alloc'd block: no free
+ * method and no extras of its own.
+ *
+ * We only hold segments whose checksums we've checked, either the NIC did it
+ * or we do it here, and the held block goes up with Bipck and Btcpck set.  We
+ * only hold segments that are for us, so nothing we glued together gets
+ * forwarded.  Anything we don't coalesce that belongs to a flow we're holding
+ * pushes that flow up first, so TCP still sees everything in order. */
+
+#include <vfs.h>
+#include <kfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <cpio.h>
+#include <pmap.h>
+#include <smp.h>
+#include <ip.h>
+
+enum {
+	GRO_IP4HDR = 20,			/* IPv4 header, no options */
+	GRO_TCPHDR = 20,			/* TCP header, no options */
+	GRO_HDRS = GRO_IP4HDR + GRO_TCPHDR,
+	GRO_IPLEN = 8,				/* start of the TCP pseudo header */
+	GRO_MAXLEN = 0xffff,		/* the most an IP length can say */
+
+	GRO_VIHL = IP_VER4 | 0x05,
+	GRO_DF = 0x4000,
+	GRO_TCPPROTO = 6,
+
+	GRO_ACK = 0x10,
+	GRO_PSH = 0x08,
+};
+
+/* An IPv4 header with a TCP header right behind it */
+struct gro4hdr {
+	uint8_t vihl;
+	uint8_t tos;
+	uint8_t length[2];
+	uint8_t id[2];
+	uint8_t frag[2];
+	uint8_t ttl;
+	uint8_t proto;
+	uint8_t cksum[2];
+	uint8_t src[4];
+	uint8_t dst[4];
+	/* the 4-tuple is src through tcpdport */
+	uint8_t tcpsport[2];
+	uint8_t tcpdport[2];
+	uint8_t tcpseq[4];
+	uint8_t tcpack[4];
+	uint8_t tcpflag[2];
+	uint8_t tcpwin[2];
+	uint8_t tcpcksum[2];
+	uint8_t tcpurg[2];
+	uint8_t tcpopt[];
+};
+
+#define GRO_TUPLE(h)	((h)->src)
+#define GRO_TUPLELEN	12
+
+void gro_init(struct gro *g, struct Fs *f, struct Ipifc *ifc)
+{
+	memset(g, 0, sizeof(struct gro));
+	g->f = f;
+	g->ifc = ifc;
+}
+
+/* Sends the flow's block up and gives up its slot, keeping the others in the
+ * order they started. */
+static void gro_deliver(struct gro *g, struct groflow *fl)
+{
+	struct block *bp = fl->bp;
+	int i = fl - g->flows;
+
+	memmove(fl, fl + 1, (g->nflows - i - 1) * sizeof(struct groflow));
+	g->nflows--;
+	bp->flag |= Bipck | Btcpck;
+	ipiput4(g->f, g->ifc, bp);
+}
+
+void gro_flush(struct gro *g)
+{
+	while (g->nflows)
+		gro_deliver(g, &g->flows[0]);
+}
+
+/* For a reader that's going away: whatever we held never goes up. */
+void gro_drop(struct gro *g)
+{
+	for (int i = 0; i < g->nflows; i++)
+		freeb(g->flows[i].bp);
+	g->nflows = 0;
+}
+
+static struct groflow *gro_find(struct gro *g, struct gro4hdr *h)
+{
+	struct gro4hdr *fh;
+
+	for (int i = 0; i < g->nflows; i++) {
+		fh = (struct gro4hdr *)g->flows[i].bp->rp;
+		if (!memcmp(GRO_TUPLE(fh), GRO_TUPLE(h), GRO_TUPLELEN))
+			return &g->flows[i];
+	}
+	return NULL;
+}
+
+/* Same recipe as tcpiput(): the ttl and IP checksum bytes become the pseudo
+ * header's zero byte and TCP length.  We put them back after. */
+static bool gro_tcpcsum_ok(struct block *bp, struct gro4hdr *h, int length)
+{
+	uint8_t ttl = h->ttl;
+	uint8_t cksum[2] = {h->cksum[0], h->cksum[1]};
+	uint16_t csum;
+
+	h->ttl = 0;
+	hnputs(h->cksum, length - GRO_IP4HDR);
+	csum = ptclcsum(bp, GRO_IPLEN, length - GRO_IPLEN);
+	h->ttl = ttl;
+	h->cksum[0] = cksum[0];
+	h->cksum[1] = cksum[1];
+	return csum == 0;
+}
+
+/* Returns the length of the TCP payload if bp is a plain data segment we could
+ * hold, 0 otherwise.  Sets *hdrlen to the length of both headers. */
+static int gro_payload(struct block *bp, struct gro4hdr *h, int *hdrlen)
+{
+	int length, tcphdrlen;
+
+	if (bp->next || (h->tcpflag[1] & ~GRO_PSH) != GRO_ACK)
+		return 0;
+	tcphdrlen = (h->tcpflag[0] >> 2) & ~3;
+	length = nhgets(h->length);
+	if (tcphdrlen < GRO_TCPHDR || BHLEN(bp) < GRO_IP4HDR + tcphdrlen ||
+	    length != BLEN(bp) || length <= GRO_IP4HDR + tcphdrlen)
+		return 0;
+	if (!(bp->flag & Bipck) && ipcsum(&h->vihl))
+		return 0;
+	/* A zero TCP checksum means there isn't one, like in tcpiput() */
+	if (!(bp->flag & Btcpck) && (h->tcpcksum[0] || h->tcpcksum[1]) &&
+	    !gro_tcpcsum_ok(bp, h, length))
+		return 0;
+	*hdrlen = GRO_IP4HDR + tcphdrlen;
+	return length - *hdrlen;
+}
+
+/* Glues bp's payload onto fl's block, if it's the next segment of the flow and
+ * the headers say the same thing.  Returns TRUE if bp is gone. */
+static bool gro_merge(struct groflow *fl, struct block *bp, struct gro4hdr *h,
+                      int hdrlen, int dlen)
+{
+	struct gro4hdr *fh = (struct gro4hdr *)fl->bp->rp;
+	int flen = nhgets(fh->length);
+
+	if (nhgetl(h->tcpseq) != fl->nxtseq ||
+	    memcmp(h->tcpack, fh->tcpack, sizeof(h->tcpack)) ||
+	    h->tcpflag[0] != fh->tcpflag[0] ||
+	    memcmp(h->tcpopt, fh->tcpopt, hdrlen - GRO_HDRS) ||
+	    flen + dlen > GRO_MAXLEN || bp->free || bp->nr_extra_bufs)
+		return FALSE;
+	if (block_append_extra(fl->bp, (uintptr_t)bp,
+	                       bp->rp + hdrlen - (uint8_t *)bp, dlen, MEM_ATOMIC))
+		return FALSE;
+	hnputs(fh->length, flen + dlen);
+	memcpy(fh->tcpwin, h->tcpwin, sizeof(h->tcpwin));
+	fh->tcpflag[1] |= h->tcpflag[1] & GRO_PSH;
+	fl->nxtseq += dlen;
+	return TRUE;
+}
+
+/* Takes an IPv4 packet, with rp at the IP header.  It goes up now, or it's
+ * held until the next gro_flush(). */
+void gro_input(struct gro *g, struct block *bp)
+{
+	struct gro4hdr *h = (struct gro4hdr *)bp->rp;
+	struct groflow *fl;
+	uint8_t dst[IPaddrlen];
+	int hdrlen, dlen;
+
+	if (BHLEN(bp) < GRO_HDRS || h->proto != GRO_TCPPROTO) {
+		ipiput4(g->f, g->ifc, bp);
+		return;
+	}
+	/* TCP we can't find the ports of.  It could be anyone's. */
+	if (h->vihl != GRO_VIHL || (nhgets(h->frag) & ~GRO_DF)) {
+		gro_flush(g);
+		ipiput4(g->f, g->ifc, bp);
+		return;
+	}
+	fl = gro_find(g, h);
+	dlen = gro_payload(bp, h, &hdrlen);
+	if (!dlen) {
+		if (fl)
+			gro_deliver(g, fl);
+		ipiput4(g->f, g->ifc, bp);
+		return;
+	}
+	if (fl) {
+		if (gro_merge(fl, bp, h, hdrlen, dlen)) {
+			if (h->tcpflag[1] & GRO_PSH)
+				gro_deliver(g, fl);
+			return;
+		}
+		gro_deliver(g, fl);
+	}
+	v4tov6(dst, h->dst);
+	if ((h->tcpflag[1] & GRO_PSH) || !ipforme(g->f, dst)) {
+		ipiput4(g->f, g->ifc, bp);
+		return;
+	}
+	if (g->nflows == GRO_FLOWS)
+		gro_deliver(g, &g->flows[0]);
+	fl = &g->flows[g->nflows++];
+	fl->bp = bp;
+	fl->nxtseq = nhgetl(h->tcpseq) + dlen;
+}
@@ -38,6 +38,8 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <hash.h>
+#include <hash_helper.h>
 #include <ip.h>
 #include <endian.h>
 
@@ -581,22 +583,104 @@ int parsemac(uint8_t * to, char *from, int len)
 }
 
 /*
- *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
+ *  hashing tcp, udp, ... connections.  all of both addresses go in, so
+ *  v6 addresses that only differ up front spread out too.
  */
-uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
+static uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
 {
-	uint32_t ret;
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
-	return ret;
+	uint64_t x = ((uint64_t)sp << 16) | dp;
+	uint32_t sw, dw;
+
+	for (int i = 0; i < IPaddrlen; i += 4) {
+		memcpy(&sw, sa + i, sizeof(sw));
+		memcpy(&dw, da + i, sizeof(dw));
+		x = hash_64(x ^ (((uint64_t)sw << 32) | dw), 64);
+	}
+	/* the multiplies only carry up, fold the top back in for the low bits */
+	x ^= x >> 32;
+	return hash_64(x, 32);
+}
+
+static struct Iphtab *iphtaballoc(struct Ipht *ht, uint32_t nbuckets, int link,
+                                  int flags)
+{
+	struct Iphtab *t;
+
+	t = kzmalloc(sizeof(struct Iphtab) + nbuckets * sizeof(struct Iphash *),
+	             flags);
+	if (t == NULL)
+		return NULL;
+	t->ht = ht;
+	t->mask = nbuckets - 1;
+	t->link = link;
+	return t;
+}
+
+void iphtinit(struct Ipht *ht)
+{
+	for (int i = 0; i < Niphtlocks; i++)
+		spinlock_init(&ht->locks[i]);
+	atomic_init(&ht->nentries, 0);
+	ht->tab = iphtaballoc(ht, 1 << Iphtbits, 0, MEM_WAIT);
+}
+
+static spinlock_t *iphtlock(struct Ipht *ht, uint32_t hv)
+{
+	return &ht->locks[hv & (Niphtlocks - 1)];
+}
+
+static void __iphtab_free(struct rcu_head *head)
+{
+	struct Iphtab *t = container_of(head, struct Iphtab, rcu);
+
+	/* no one is walking the old links anymore, the next grow can have them */
+	ACCESS_ONCE(t->ht->retiring) = FALSE;
+	kfree(t);
+}
+
+/*
+ *  double the table, unless someone beat us to it
+ */
+static void iphtgrow(struct Ipht *ht, uint32_t nbuckets)
+{
+	struct Iphtab *old, *new;
+	struct Iphash *h;
+	uint32_t b;
+
+	new = iphtaballoc(ht, nbuckets * 2, 0, 0);
+	if (new == NULL)
+		return;
+	for (int i = 0; i < Niphtlocks; i++)
+		spin_lock(&ht->locks[i]);
+	old = ht->tab;
+	if (old->mask + 1 != nbuckets || ht->retiring) {
+		for (int i = Niphtlocks - 1; i >= 0; i--)
+			spin_unlock(&ht->locks[i]);
+		kfree(new);
+		return;
+	}
+	new->link = !old->link;
+	for (uint32_t i = 0; i <= old->mask; i++) {
+		for (h = old->tab[i]; h != NULL; h = h->next[old->link]) {
+			b = h->hv & new->mask;
+			h->next[new->link] = new->tab[b];
+			new->tab[b] = h;
+		}
+	}
+	ht->retiring = TRUE;
+	ht->ngrows++;
+	rcu_assign_pointer(ht->tab, new);
+	for (int i = Niphtlocks - 1; i >= 0; i--)
+		spin_unlock(&ht->locks[i]);
+	call_rcu(&old->rcu, __iphtab_free);
 }
 
 void iphtadd(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
+	uint32_t hv, nbuckets;
 	struct Iphash *h;
+	struct Iphtab *t;
+	spinlock_t *lock;
 
 	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
 	h = kzmalloc(sizeof(*h), 0);
@@ -616,28 +700,48 @@ void iphtadd(struct Ipht *ht, struct conv *c)
 		}
 	}
 	h->c = c;
+	h->hv = hv;
+
+	lock = iphtlock(ht, hv);
+	spin_lock(lock);
+	t = ht->tab;
+	h->next[t->link] = t->tab[hv & t->mask];
+	rcu_assign_pointer(t->tab[hv & t->mask], h);
+	nbuckets = t->mask + 1;
+	spin_unlock(lock);
+
+	if (atomic_fetch_and_add(&ht->nentries, 1) + 1 >
+	    HASH_MAX_LOAD_FACTOR(nbuckets) && nbuckets < (1 << Iphtmaxbits) &&
+	    !ACCESS_ONCE(ht->retiring))
+		iphtgrow(ht, nbuckets);
+}
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+static void __iphash_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct Iphash, rcu));
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
 	uint32_t hv;
 	struct Iphash **l, *h;
+	struct Iphtab *t;
+	spinlock_t *lock;
 
 	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
+	lock = iphtlock(ht, hv);
+	spin_lock(lock);
+	t = ht->tab;
+	for (l = &t->tab[hv & t->mask]; (*l) != NULL; l = &(*l)->next[t->link])
 		if ((*l)->c == c) {
 			h = *l;
-			(*l) = h->next;
-			kfree(h);
+			/* h->next stays intact for readers still looking at h */
+			rcu_assign_pointer(*l, h->next[t->link]);
+			call_rcu(&h->rcu, __iphash_free);
+			atomic_dec(&ht->nentries);
 			break;
 		}
-	spin_unlock(&ht->lock);
+	spin_unlock(lock);
 }
 
 /* look for a matching conversation with the following precedence
@@ -652,67 +756,101 @@ struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 {
 	uint32_t hv;
 	struct Iphash *h;
+	struct Iphtab *t;
 	struct conv *c;
 
+	rcu_read_lock();
+	t = rcu_dereference(ht->tab);
+
 	/* exact 4 pair match (connection) */
 	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchexact)
+	for (h = rcu_dereference(t->tab[hv & t->mask]); h != NULL;
+	     h = rcu_dereference(h->next[t->link])) {
+		if (h->match != IPmatchexact || h->hv != hv)
 			continue;
 		c = h->c;
 		if (sp == c->rport && dp == c->lport
 			&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
+			rcu_read_unlock();
 			return c;
 		}
 	}
 
 	/* match local address and port */
 	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = rcu_dereference(t->tab[hv & t->mask]); h != NULL;
+	     h = rcu_dereference(h->next[t->link])) {
 		if (h->match != IPmatchpa)
 			continue;
 		c = h->c;
 		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
+			rcu_read_unlock();
 			return c;
 		}
 	}
 
 	/* match just port */
 	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = rcu_dereference(t->tab[hv & t->mask]); h != NULL;
+	     h = rcu_dereference(h->next[t->link])) {
 		if (h->match != IPmatchport)
 			continue;
 		c = h->c;
 		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
+			rcu_read_unlock();
 			return c;
 		}
 	}
 
 	/* match local address */
 	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = rcu_dereference(t->tab[hv & t->mask]); h != NULL;
+	     h = rcu_dereference(h->next[t->link])) {
 		if (h->match != IPmatchaddr)
 			continue;
 		c = h->c;
 		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
+			rcu_read_unlock();
 			return c;
 		}
 	}
 
 	/* look for something that matches anything */
 	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
+	for (h = rcu_dereference(t->tab[hv & t->mask]); h != NULL;
+	     h = rcu_dereference(h->next[t->link])) {
 		if (h->match != IPmatchany)
 			continue;
 		c = h->c;
-		spin_unlock(&ht->lock);
+		rcu_read_unlock();
 		return c;
 	}
-	spin_unlock(&ht->lock);
+	rcu_read_unlock();
 	return NULL;
 }
+
+char *iphtstats(struct Ipht *ht, char *p, char *e)
+{
+	struct Iphtab *t;
+	struct Iphash *h;
+	uint32_t len, longest = 0, used = 0;
+
+	rcu_read_lock();
+	t = rcu_dereference(ht->tab);
+	for (uint32_t i = 0; i <= t->mask; i++) {
+		len = 0;
+		for (h = rcu_dereference(t->tab[i]); h != NULL;
+		     h = rcu_dereference(h->next[t->link]))
+			len++;
+		if (len)
+			used++;
+		longest = MAX(longest, len);
+	}
+	p = seprintf(p, e, "HashEntries: %ld\n", atomic_read(&ht->nentries));
+	p = seprintf(p, e, "HashBuckets: %u\n", t->mask + 1);
+	p = seprintf(p, e, "HashBucketsUsed: %u\n", used);
+	p = seprintf(p, e, "HashLongestChain: %u\n", longest);
+	p = seprintf(p, e, "HashGrows: %u\n", ht->ngrows);
+	rcu_read_unlock();
+	return p;
+}
@@ -297,6 +297,7 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 			j += snprintf(p + j, READSTR - j, "output errs: %d\n", nif->oerrs);
 			j += snprintf(p + j, READSTR - j, "prom: %d\n", nif->prom);
 			j += snprintf(p + j, READSTR - j, "mbps: %d\n", nif->mbps);
+			j += snprintf(p + j, READSTR - j, "rxq: %d\n", nif->nrxq);
 			j += snprintf(p + j, READSTR - j, "addr: ");
 			for (i = 0; i < nif->alen; i++)
 				j += snprintf(p + j, READSTR - j, "%02.2x", nif->addr[i]);
@@ -346,13 +347,27 @@ struct block *netifbread(struct ether *nif, struct chan *c, long n,
 	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) != Ndataqid)
 		return devbread(c, n, offset);
 
+	if (c->flag & O_NONBLOCK)
+		return qbread_nonblock(nif->f[NETID(c->qid.path)]->in, n);
 	return qbread(nif->f[NETID(c->qid.path)]->in, n);
 }
 
 /*
- *  make sure this type isn't already in use on this device
+ *  the input queue behind an open data file, for kernel readers that want to
+ *  take what's queued without blocking and without touching the chan's flags.
  */
-static int typeinuse(struct ether *nif, int type)
+struct queue *netifinq(struct ether *nif, struct chan *c)
+{
+	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) != Ndataqid)
+		return NULL;
+	return nif->f[NETID(c->qid.path)]->in;
+}
+
+/*
+ *  make sure this type isn't already in use on this device.  fanout files
+ *  can share a type with each other.
+ */
+static int typeinuse(struct ether *nif, int type, int fanout)
 {
 	struct netfile *f, **fp, **efp;
 
@@ -364,12 +379,35 @@ static int typeinuse(struct ether *nif, int type)
 		f = *fp;
 		if (f == 0)
 			continue;
-		if (f->type == type)
+		if (f->type == type && !(fanout && f->fanout))
 			return 1;
 	}
 	return 0;
 }
 
+/*
+ *  number the members of type's fanout group, so etheriq can pick
+ *  a flow's member without looking at all the files.  called with
+ *  nif qlock'd.
+ */
+static void fanoutsync(struct ether *nif, int type)
+{
+	struct netfile *f, **fp, **efp;
+	int n = 0;
+
+	efp = &nif->f[nif->nfile];
+	for (fp = nif->f; fp < efp; fp++) {
+		f = *fp;
+		if (f && f->fanout && f->type == type)
+			f->fanoutid = n++;
+	}
+	for (fp = nif->f; fp < efp; fp++) {
+		f = *fp;
+		if (f && f->fanout && f->type == type)
+			f->nfanout = n;
+	}
+}
+
 /*
  *  the devxxx.c that calls us handles writing data, it knows best
  */
@@ -377,7 +415,7 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 {
 	ERRSTACK(1);
 	struct netfile *f;
-	int type;
+	int type, fanout, oldtype, oldfanout;
 	char *p, buf[64];
 	uint8_t binaddr[Nmaxaddr];
 
@@ -397,10 +435,23 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 
 	f = nif->f[NETID(c->qid.path)];
 	if ((p = matchtoken(buf, "connect")) != 0) {
-		type = strtol(p, 0, 0);	/* allows any base, though usually hex */
-		if (typeinuse(nif, type))
+		/* connect type [fanout] */
+		type = strtol(p, &p, 0);	/* allows any base, though usually hex */
+		while (*p == ' ')
+			p++;
+		fanout = matchtoken(p, "fanout") != 0;
+		if (fanout && type <= 0)
+			error(EINVAL, "can only fan out a single type");
+		if (typeinuse(nif, type, fanout))
 			error(EBUSY, ERROR_FIXME);
+		oldtype = f->type;
+		oldfanout = f->fanout;
+		f->fanout = fanout;
 		f->type = type;
+		if (oldfanout)
+			fanoutsync(nif, oldtype);
+		if (fanout)
+			fanoutsync(nif, type);
 		if (f->type < 0)
 			nif->all++;
 	} else if (matchtoken(buf, "promiscuous")) {
@@ -526,6 +577,12 @@ void netifclose(struct ether *nif, struct chan *c)
 			--(nif->all);
 			qunlock(&nif->qlock);
 		}
+		if (f->fanout) {
+			qlock(&nif->qlock);
+			f->fanout = 0;
+			fanoutsync(nif, f->type);
+			qunlock(&nif->qlock);
+		}
 		f->owner[0] = 0;
 		f->type = 0;
 		f->bridge = 0;
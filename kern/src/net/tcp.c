@@ -90,10 +90,23 @@ enum {
 	MSS_LENGTH = 4,	/* Mean segment size */
 	WSOPT = 3,
 	WS_LENGTH = 3,	/* Bits to scale window size by */
+	SACKPERMOPT = 4,
+	SACKPERM_LENGTH = 2,	/* SACK permitted, SYN only */
+	SACKOPT = 5,
+	SACK_HDRLEN = 2,	/* SACK option, before the blocks */
+	SACK_BLKLEN = 8,	/* one left/right edge pair */
+	TSOPT = 8,
+	TS_LENGTH = 10,	/* Timestamp value and echo reply */
+	TS_PADDED = 12,	/* what timestamps cost every segment */
+	MAXSACK = 4,	/* SACK blocks that fit in a header */
+	SACK_ROOM = (SACK_HDRLEN + MAXSACK * SACK_BLKLEN + 3) & ~3,
+	NSNDSACK = 8,	/* SACK scoreboard size */
+	PAWS_IDLE = 24 * 24 * 60 * 60 * 1000,	/* ms until ts_recent is stale */
 	MSL2 = 10,
 	MSPTICK = 50,	/* Milliseconds per timer tick */
 	DEF_MSS = 1460,	/* Default mean segment */
 	DEF_MSS6 = 1280,	/* Default mean segment (min) for v6 */
+	MIN_MSS = 88,	/* Smallest peer mss we honor; room for our options */
 	DEF_RTT = 500,	/* Default round trip */
 	DEF_KAT = 120000,	/* Default time (ms) between keep alives */
 	TCP_LISTEN = 0,	/* Listen connection */
@@ -138,18 +151,45 @@ char *tcpstates[] = {
 	"Closing", "Last_ack", "Time_wait"
 };
 
+/*
+ *  Timers live on hashed, hierarchical timing wheels, one per core.  Level 0
+ *  has a slot per tick, and each level above has a slot per wrap of the one
+ *  below.  When a level wraps, the next slot of the level above gets cascaded
+ *  down.  Starting and stopping a timer is O(1), and a tick only looks at the
+ *  timers that expire (and the occasional cascade).  Timers further out than
+ *  the wheel can reach wait in the last slot of the top level and get
+ *  cascaded back around until they are in range.
+ */
+enum {
+	TW_BITS = 6,
+	TW_SIZE = 1 << TW_BITS,
+	TW_MASK = TW_SIZE - 1,
+	TW_LEVELS = 4,
+};
+
+struct tcp_wheel;
+
 typedef struct Tcptimer Tcptimer;
 struct Tcptimer {
 	Tcptimer *next;
 	Tcptimer *prev;
 	Tcptimer *readynext;
+	Tcptimer **head;			/* wheel slot we're on */
+	struct tcp_wheel *wheel;	/* set while TcptimerON */
 	int state;
 	uint64_t start;
-	uint64_t count;
+	uint64_t count;				/* ticks left, as of the last halt */
+	uint64_t expires;			/* tick we fire on */
 	void (*func) (void *);
 	void *arg;
 };
 
+struct tcp_wheel {
+	spinlock_t lock;
+	uint64_t next;				/* next tick to run */
+	Tcptimer *slots[TW_LEVELS][TW_SIZE];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /*
  *  v4 and v6 pseudo headers used for
  *  checksuming tcp
@@ -204,6 +244,12 @@ struct Tcp6hdr {
  *  a packet in ntohtcp{4,6}() and stuck into
  *  a packet in htontcp{4,6}().
  */
+typedef struct Sackblk Sackblk;
+struct Sackblk {
+	uint32_t left;				/* first seq in the block */
+	uint32_t right;				/* seq just past the block */
+};
+
 typedef struct Tcp Tcp;
 struct Tcp {
 	uint16_t source;
@@ -216,6 +262,12 @@ struct Tcp {
 	uint16_t urg;
 	uint16_t mss;				/* max segment size option (if not zero) */
 	uint16_t len;				/* size of data */
+	uint8_t sackok;				/* SACK permitted option (SYN only) */
+	uint8_t nsack;				/* number of SACK blocks */
+	Sackblk sack[MAXSACK];
+	uint8_t tsok;				/* timestamp option present */
+	uint32_t tsval;				/* sender's timestamp */
+	uint32_t tsecr;				/* timestamp echoed back */
 };
 
 /*
@@ -250,6 +302,7 @@ struct Tcpctl {
 		uint32_t dupacks;		/* number of duplicate acks rcvd */
 		int recovery;			/* loss recovery flag */
 		uint32_t rxt;			/* right window marker for recovery */
+		uint32_t hole;			/* next seq to resend in recovery */
 	} snd;
 	struct {
 		uint32_t nxt;			/* Receive pointer to next uint8_t slot */
@@ -258,12 +311,13 @@ struct Tcpctl {
 		int blocked;
 		int una;				/* unacked data segs */
 		int scale;				/* how much to left shift window in rcved packets */
+		uint32_t lastoo;		/* seq of the latest out of order segment */
 	} rcv;
 	uint32_t iss;				/* Initial sequence number */
 	int sawwsopt;				/* true if we saw a wsopt on the incoming SYN */
 	uint32_t cwind;				/* Congestion window */
 	int scale;					/* desired snd.scale */
-	uint16_t ssthresh;			/* Slow start threshold */
+	uint32_t ssthresh;			/* Slow start threshold */
 	int resent;					/* Bytes just resent */
 	int irs;					/* Initial received squence */
 	uint16_t mss;				/* Mean segment size */
@@ -286,12 +340,46 @@ struct Tcpctl {
 	int nochecksum;				/* non-zero means don't send checksums */
 	int flgcnt;					/* number of flags in the sequence (FIN,SEQ) */
 
+	/* SACK (RFC 2018) and timestamps (RFC 7323), if both ends agreed */
+	int sackok;
+	int tsok;
+	uint32_t tsrecent;			/* latest timestamp from the other end */
+	uint64_t tsrecentage;		/* when we got it */
+	Sackblk sacked[NSNDSACK];	/* what the other end has past snd.una */
+	int nsacked;
+	uint32_t sackedbytes;
+
+	struct Tcpcc *cc;			/* congestion control */
+	struct {
+		uint32_t wmax;			/* window before the last loss */
+		uint32_t origin;		/* window the curve plateaus at */
+		uint32_t k;				/* ms from epoch to the plateau */
+		uint64_t epoch;			/* start of this growth period (ms) */
+	} cubic;
+
 	union {
 		Tcp4hdr tcp4hdr;
 		Tcp6hdr tcp6hdr;
 	} protohdr;					/* prototype header */
 };
 
+/*
+ *  Congestion control.  Each conversation points at one of these, picked with
+ *  the "cc" ctl, and new calls get their listener's.  Slow start is the same
+ *  for all of them.  Past ssthresh, avoid() says how many bytes to open cwind
+ *  by for acked bytes of new acks.  After a loss, ssthresh() says what to cut
+ *  the window to.
+ */
+typedef struct Tcpcc Tcpcc;
+struct Tcpcc {
+	char *name;
+	void (*init)(Tcpctl *);
+	uint32_t (*avoid)(Tcpctl *, uint32_t acked);
+	uint32_t (*ssthresh)(Tcpctl *);
+};
+
+static Tcpcc tcpnewreno, tcpcubic;
+
 /*
  *  New calls are put in limbo rather than having a conversation structure
  *  allocated.  Thus, a SYN attack results in lots of limbo'd calls but not
@@ -318,6 +406,9 @@ struct Limbo {
 	uint16_t mss;				/* mss from the other end */
 	uint16_t rcvscale;			/* how much to scale rcvd windows */
 	uint16_t sndscale;			/* how much to scale sent windows */
+	uint8_t sackok;				/* SYN had SACK permitted */
+	uint8_t tsok;				/* SYN had a timestamp */
+	uint32_t tsrecent;			/* and this was it */
 	uint64_t lastsend;			/* last time we sent a synack */
 	uint8_t version;			/* v4 or v6 */
 	uint8_t rexmits;			/* number of retransmissions */
@@ -345,6 +436,8 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	PawsDrops,
+	SackRetrans,
 
 	Nstats
 };
@@ -365,13 +458,14 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[PawsDrops] "PawsDrops",
+	[SackRetrans] "SackRetrans",
 };
 
 typedef struct Tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
-	qlock_t tl;
-	Tcptimer *timers;
+	/* Timer wheels, one per core */
+	struct tcp_wheel *wheels;
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
@@ -469,6 +563,8 @@ static void tcpconnect(struct conv *c, char **argv, int argc)
 	tcpstart(c, TCP_CONNECT);
 }
 
+static uint64_t tcptimer_count(Tcptimer *t);
+
 static int tcpstate(struct conv *c, char *state, int n)
 {
 	Tcpctl *s;
@@ -476,14 +572,20 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d mdev %d "
+					"cwin %u swin %u>>%d rwin %u>>%d "
+					"timer.start %llu timer.count %llu rerecv %d "
+					"katimer.start %llu katimer.count %llu "
+					"cc %s ssthresh %u sacked %u\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
 					s->srtt, s->mdev,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->snd.scale, s->timer.start, tcptimer_count(&s->timer),
+					s->rerecv, s->katimer.start,
+					tcptimer_count(&s->katimer), s->cc ? s->cc->name : "none",
+					s->ssthresh, s->sackedbytes);
 }
 
 static int tcpinuse(struct conv *c)
@@ -650,94 +752,200 @@ static void tcpcreate(struct conv *c)
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
-static void timerstate(struct tcppriv *priv, Tcptimer * t, int newstate)
+/* Returns the slot for a timer expiring on tick expires */
+static Tcptimer **tw_slot(struct tcp_wheel *w, uint64_t expires)
 {
-	if (newstate != TcptimerON) {
-		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
-		}
-	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
-		}
+	uint64_t delta = expires - w->next;
+	int lvl;
+
+	if ((int64_t)delta < 0)
+		return &w->slots[0][w->next & TW_MASK];
+	if (delta >= 1ULL << (TW_BITS * TW_LEVELS)) {
+		delta = (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+		expires = w->next + delta;
+	}
+	for (lvl = 0; lvl < TW_LEVELS - 1; lvl++) {
+		if (delta < 1ULL << (TW_BITS * (lvl + 1)))
+			break;
+	}
+	return &w->slots[lvl][(expires >> (TW_BITS * lvl)) & TW_MASK];
+}
+
+static void tw_add(struct tcp_wheel *w, Tcptimer *t)
+{
+	Tcptimer **head = tw_slot(w, t->expires);
+
+	t->head = head;
+	t->prev = NULL;
+	t->next = *head;
+	if (t->next)
+		t->next->prev = t;
+	*head = t;
+}
+
+static void tw_del(Tcptimer *t)
+{
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		*t->head = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	t->head = NULL;
+}
+
+/* Moves the timers in lvl's current slot down to where they belong now */
+static void tw_cascade(struct tcp_wheel *w, int lvl)
+{
+	Tcptimer **slot = &w->slots[lvl][(w->next >> (TW_BITS * lvl)) & TW_MASK];
+	Tcptimer *t, *tn;
+
+	t = *slot;
+	*slot = NULL;
+	for (; t != NULL; t = tn) {
+		tn = t->next;
+		tw_add(w, t);
+	}
+}
+
+/* Runs one tick, putting the timers that expire on ready.  Called with the
+ * wheel locked. */
+static Tcptimer *tw_tick(struct tcp_wheel *w, Tcptimer *ready)
+{
+	Tcptimer **slot, *t, *tn;
+
+	for (int lvl = 1; lvl < TW_LEVELS; lvl++) {
+		if (w->next & ((1ULL << (TW_BITS * lvl)) - 1))
+			break;
+		tw_cascade(w, lvl);
+	}
+	slot = &w->slots[0][w->next & TW_MASK];
+	t = *slot;
+	*slot = NULL;
+	for (; t != NULL; t = tn) {
+		tn = t->next;
+		t->next = t->prev = NULL;
+		t->head = NULL;
+		t->wheel = NULL;
+		t->count = 0;
+		t->state = TcptimerDONE;
+		t->readynext = ready;
+		ready = t;
+	}
+	w->next++;
+	return ready;
+}
+
+/* Returns the wheel t is on, locked, or NULL if it isn't on one.  The expiry
+ * code can take t off its wheel at any time. */
+static struct tcp_wheel *tcptimer_lock(Tcptimer *t)
+{
+	struct tcp_wheel *w;
+
+	for (;;) {
+		w = ACCESS_ONCE(t->wheel);
+		if (w == NULL)
+			return NULL;
+		spin_lock(&w->lock);
+		if (t->wheel == w)
+			return w;
+		spin_unlock(&w->lock);
+	}
+}
+
+static uint64_t tcptimer_count(Tcptimer *t)
+{
+	struct tcp_wheel *w;
+	uint64_t count;
+
+	w = tcptimer_lock(t);
+	if (w == NULL)
+		return t->count;
+	count = t->expires + 1 - w->next;
+	spin_unlock(&w->lock);
+	return count;
+}
+
+/* Takes t off its wheel, if it's on one, and saves how long it had left. */
+static void tcptimer_off(Tcptimer *t)
+{
+	struct tcp_wheel *w;
+
+	w = tcptimer_lock(t);
+	if (w != NULL) {
+		t->count = t->expires + 1 - w->next;
+		tw_del(t);
+		t->wheel = NULL;
 	}
-	t->state = newstate;
+	t->state = TcptimerOFF;
+	if (w != NULL)
+		spin_unlock(&w->lock);
 }
 
 void tcpackproc(void *a)
 {
 	ERRSTACK(1);
-	Tcptimer *t, *tp, *timeo;
+	Tcptimer *t, *timeo;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
+	struct tcp_wheel *w;
+	uint64_t lasttick, ticks;
 
 	tcp = a;
 	priv = tcp->priv;
 
+	lasttick = NOW;
 	for (;;) {
 		kthread_usleep(MSPTICK * 1000);
 
-		qlock(&priv->tl);
-		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
-			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
+		/* Catch up on any ticks we slept through, so timers don't stretch
+		 * when we're busy. */
+		ticks = (NOW - lasttick) / MSPTICK;
+		lasttick += ticks * MSPTICK;
+
+		for (int i = 0; i < num_cores; i++) {
+			w = &priv->wheels[i];
+			timeo = NULL;
+			spin_lock(&w->lock);
+			for (uint64_t j = 0; j < ticks; j++)
+				timeo = tw_tick(w, timeo);
+			spin_unlock(&w->lock);
+
+			for (t = timeo; t != NULL; t = t->readynext) {
+				if (t->state == TcptimerDONE && t->func != NULL) {
+					/* discard error style */
+					if (!waserror())
+						(*t->func) (t->arg);
+					poperror();
 				}
 			}
 		}
-		qunlock(&priv->tl);
-
-		loop = 0;
-		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
-			if (t->state == TcptimerDONE && t->func != NULL) {
-				/* discard error style */
-				if (!waserror())
-					(*t->func) (t->arg);
-				poperror();
-			}
-		}
 
 		limborexmit(tcp);
 	}
 }
 
+/*
+ *  Timers go on the wheel of the core that starts them.  Callers hold the
+ *  conv's qlock, so no one else starts or stops the same timer.
+ */
 void tcpgo(struct tcppriv *priv, Tcptimer * t)
 {
+	struct tcp_wheel *w;
+
 	if (t == NULL || t->start == 0)
 		return;
 
-	qlock(&priv->tl);
+	tcptimer_off(t);
+	w = &priv->wheels[core_id()];
+	spin_lock(&w->lock);
 	t->count = t->start;
-	timerstate(priv, t, TcptimerON);
-	qunlock(&priv->tl);
+	t->expires = w->next + t->start - 1;
+	t->wheel = w;
+	t->state = TcptimerON;
+	tw_add(w, t);
+	spin_unlock(&w->lock);
 }
 
 void tcphalt(struct tcppriv *priv, Tcptimer * t)
@@ -745,9 +953,7 @@ void tcphalt(struct tcppriv *priv, Tcptimer * t)
 	if (t == NULL)
 		return;
 
-	qlock(&priv->tl);
-	timerstate(priv, t, TcptimerOFF);
-	qunlock(&priv->tl);
+	tcptimer_off(t);
 }
 
 int backoff(int n)
@@ -830,6 +1036,129 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 	return mtu;
 }
 
+static void newreno_init(Tcpctl *tcb)
+{
+}
+
+/* a segment per round trip */
+static uint32_t newreno_avoid(Tcpctl *tcb, uint32_t acked)
+{
+	return ((uint32_t)tcb->mss * tcb->mss) / tcb->cwind;
+}
+
+/* half of what's in flight */
+static uint32_t newreno_ssthresh(Tcpctl *tcb)
+{
+	return MAX((tcb->snd.nxt - tcb->snd.una) / 2, 2 * (uint32_t)tcb->mss);
+}
+
+static Tcpcc tcpnewreno = {
+	.name = "newreno",
+	.init = newreno_init,
+	.avoid = newreno_avoid,
+	.ssthresh = newreno_ssthresh,
+};
+
+/*
+ *  CUBIC (RFC 8312).  After a loss, the window follows a cubic curve of the
+ *  time since the loss.  The curve rises fast, levels off around the window
+ *  we lost at (wmax), and then probes past it.  It doesn't depend on the round
+ *  trip time, so long fat pipes get back up to speed as fast as short ones.
+ *  Where plain Reno would grow faster (short, slow links), we grow like Reno.
+ */
+enum {
+	CUBIC_C = 4,	/* tenths, how steep the curve is */
+	CUBIC_BETA = 7,	/* tenths, of the window we keep after a loss */
+	CUBIC_MAXT = 1000000,	/* ms past which the curve is off the charts */
+};
+
+/* integer cube root, Hacker's Delight style */
+static uint32_t cuberoot(uint64_t x)
+{
+	uint64_t y = 0, b;
+	int s;
+
+	for (s = 63; s >= 0; s -= 3) {
+		y <<= 1;
+		b = 3 * y * (y + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			y++;
+		}
+	}
+	return y;
+}
+
+static void cubic_init(Tcpctl *tcb)
+{
+	memset(&tcb->cubic, 0, sizeof(tcb->cubic));
+}
+
+static uint32_t cubic_avoid(Tcpctl *tcb, uint32_t acked)
+{
+	uint64_t now = NOW;
+	int64_t t, target, reno;
+	uint32_t rtt;
+
+	if (tcb->cubic.epoch == 0) {
+		tcb->cubic.epoch = now;
+		if (tcb->cwind < tcb->cubic.wmax) {
+			/* K = cbrt((wmax - cwind) / C), in segments and seconds */
+			tcb->cubic.k = cuberoot((uint64_t)(tcb->cubic.wmax - tcb->cwind)
+			                        * 10 * 1000 / (CUBIC_C * tcb->mss)
+			                        * 1000000);
+			tcb->cubic.origin = tcb->cubic.wmax;
+		} else {
+			tcb->cubic.k = 0;
+			tcb->cubic.origin = tcb->cwind;
+		}
+	}
+	rtt = MAX(tcb->srtt >> LOGAGAIN, 1);
+
+	/* aim for where the curve will be a round trip from now */
+	t = (int64_t)(now + rtt - tcb->cubic.epoch) - tcb->cubic.k;
+	t = MIN(MAX(t, (int64_t)-CUBIC_MAXT), (int64_t)CUBIC_MAXT);
+	target = tcb->cubic.origin +
+	         CUBIC_C * t * t * t / 10000000 * tcb->mss / 1000;
+
+	/* what Reno would have by now, 3(1 - beta)/(1 + beta) a round trip */
+	reno = (int64_t)tcb->cubic.wmax * CUBIC_BETA / 10 +
+	       (int64_t)(now - tcb->cubic.epoch) * 9 * tcb->mss / (17 * rtt);
+	target = MAX(target, reno);
+
+	if (target <= tcb->cwind)
+		return 0;
+	/* close the gap over the next window, at most 1.5x per round trip */
+	return MIN((uint64_t)(target - tcb->cwind) * acked / tcb->cwind,
+	           (uint64_t)acked / 2);
+}
+
+static uint32_t cubic_ssthresh(Tcpctl *tcb)
+{
+	uint32_t cwind = tcb->cwind;
+
+	tcb->cubic.epoch = 0;
+	/* losing short of the last wmax means others want room; give it up */
+	if (cwind < tcb->cubic.wmax)
+		tcb->cubic.wmax = (uint64_t)cwind * (10 + CUBIC_BETA) / 20;
+	else
+		tcb->cubic.wmax = cwind;
+	return MAX((uint32_t)((uint64_t)cwind * CUBIC_BETA / 10),
+	           2 * (uint32_t)tcb->mss);
+}
+
+static Tcpcc tcpcubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.avoid = cubic_avoid,
+	.ssthresh = cubic_ssthresh,
+};
+
+static Tcpcc *tcpccs[] = {
+	&tcpnewreno,
+	&tcpcubic,
+};
+
 void inittcpctl(struct conv *s, int mode)
 {
 	Tcpctl *tcb;
@@ -841,7 +1170,9 @@ void inittcpctl(struct conv *s, int mode)
 
 	memset(tcb, 0, sizeof(Tcpctl));
 
-	tcb->ssthresh = 65535;
+	tcb->ssthresh = UINT32_MAX;
+	tcb->cc = &tcpcubic;
+	tcb->cc->init(tcb);
 	tcb->srtt = tcp_irtt << LOGAGAIN;
 	tcb->mdev = 0;
 
@@ -964,26 +1295,138 @@ static char *tcpflag(uint16_t flag)
 	return buf;
 }
 
+/*
+ *  bytes of options in tcph's header, padded out to a 32 bit boundary.
+ *  MSS, window scale and SACK permitted only go on SYNs.
+ */
+static uint16_t tcpoptlen(Tcp *tcph)
+{
+	uint16_t optlen = 0;
+
+	if (tcph->flags & SYN) {
+		if (tcph->mss)
+			optlen += MSS_LENGTH;
+		if (tcph->ws)
+			optlen += WS_LENGTH;
+		if (tcph->sackok)
+			optlen += SACKPERM_LENGTH;
+	}
+	if (tcph->tsok)
+		optlen += TS_LENGTH;
+	if (tcph->nsack)
+		optlen += SACK_HDRLEN + tcph->nsack * SACK_BLKLEN;
+	return (optlen + 3) & ~3;
+}
+
+static void tcpputopts(Tcp *tcph, uint8_t *opt, uint16_t optlen)
+{
+	uint8_t *end = opt + optlen;
+	int i;
+
+	if (tcph->flags & SYN) {
+		if (tcph->mss != 0) {
+			*opt++ = MSSOPT;
+			*opt++ = MSS_LENGTH;
+			hnputs(opt, tcph->mss);
+			opt += 2;
+		}
+		if (tcph->ws != 0) {
+			*opt++ = WSOPT;
+			*opt++ = WS_LENGTH;
+			*opt++ = tcph->ws;
+		}
+		if (tcph->sackok) {
+			*opt++ = SACKPERMOPT;
+			*opt++ = SACKPERM_LENGTH;
+		}
+	}
+	if (tcph->tsok) {
+		*opt++ = TSOPT;
+		*opt++ = TS_LENGTH;
+		hnputl(opt, tcph->tsval);
+		hnputl(opt + 4, tcph->tsecr);
+		opt += 8;
+	}
+	if (tcph->nsack) {
+		*opt++ = SACKOPT;
+		*opt++ = SACK_HDRLEN + tcph->nsack * SACK_BLKLEN;
+		for (i = 0; i < tcph->nsack; i++) {
+			hnputl(opt, tcph->sack[i].left);
+			hnputl(opt + 4, tcph->sack[i].right);
+			opt += SACK_BLKLEN;
+		}
+	}
+	while (opt < end)
+		*opt++ = NOOPOPT;
+}
+
+static void tcpgetopts(Tcp *tcph, uint8_t *optr, int n)
+{
+	uint16_t optlen;
+	int i;
+
+	tcph->mss = 0;
+	tcph->ws = 0;
+	tcph->sackok = 0;
+	tcph->nsack = 0;
+	tcph->tsok = 0;
+	while (n > 0 && *optr != EOLOPT) {
+		if (*optr == NOOPOPT) {
+			n--;
+			optr++;
+			continue;
+		}
+		if (n < 2)
+			break;
+		optlen = optr[1];
+		if (optlen < 2 || optlen > n)
+			break;
+		switch (*optr) {
+			case MSSOPT:
+				if (optlen == MSS_LENGTH)
+					tcph->mss = nhgets(optr + 2);
+				break;
+			case WSOPT:
+				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
+					tcph->ws = HaveWS | *(optr + 2);
+				break;
+			case SACKPERMOPT:
+				if (optlen == SACKPERM_LENGTH)
+					tcph->sackok = 1;
+				break;
+			case SACKOPT:
+				if ((optlen - SACK_HDRLEN) % SACK_BLKLEN)
+					break;
+				for (i = 0; i < (optlen - SACK_HDRLEN) / SACK_BLKLEN &&
+					 i < MAXSACK; i++) {
+					tcph->sack[i].left = nhgetl(optr + 2 + i * SACK_BLKLEN);
+					tcph->sack[i].right = nhgetl(optr + 6 + i * SACK_BLKLEN);
+				}
+				tcph->nsack = i;
+				break;
+			case TSOPT:
+				if (optlen == TS_LENGTH) {
+					tcph->tsok = 1;
+					tcph->tsval = nhgetl(optr + 2);
+					tcph->tsecr = nhgetl(optr + 6);
+				}
+				break;
+		}
+		n -= optlen;
+		optr += optlen;
+	}
+}
+
 struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 					   Tcpctl * tcb)
 {
 	int dlen;
 	Tcp6hdr *h;
 	uint16_t csum;
-	uint16_t hdrlen, optpad = 0;
-	uint8_t *opt;
+	uint16_t hdrlen, optlen;
 
-	hdrlen = TCP6_HDRSIZE;
-	if (tcph->flags & SYN) {
-		if (tcph->mss)
-			hdrlen += MSS_LENGTH;
-		if (tcph->ws)
-			hdrlen += WS_LENGTH;
-		optpad = hdrlen & 3;
-		if (optpad)
-			optpad = 4 - optpad;
-		hdrlen += optpad;
-	}
+	optlen = tcpoptlen(tcph);
+	hdrlen = TCP6_HDRSIZE + optlen;
 
 	if (data) {
 		dlen = blocklen(data);
@@ -1015,22 +1458,8 @@ struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 	hnputs(h->tcpwin, tcph->wnd >> (tcb != NULL ? tcb->snd.scale : 0));
 	hnputs(h->tcpurg, tcph->urg);
 
-	if (tcph->flags & SYN) {
-		opt = h->tcpopt;
-		if (tcph->mss != 0) {
-			*opt++ = MSSOPT;
-			*opt++ = MSS_LENGTH;
-			hnputs(opt, tcph->mss);
-			opt += 2;
-		}
-		if (tcph->ws != 0) {
-			*opt++ = WSOPT;
-			*opt++ = WS_LENGTH;
-			*opt++ = tcph->ws;
-		}
-		while (optpad-- > 0)
-			*opt++ = NOOPOPT;
-	}
+	if (optlen)
+		tcpputopts(tcph, h->tcpopt, optlen);
 
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
@@ -1054,20 +1483,10 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	int dlen;
 	Tcp4hdr *h;
 	uint16_t csum;
-	uint16_t hdrlen, optpad = 0;
-	uint8_t *opt;
+	uint16_t hdrlen, optlen;
 
-	hdrlen = TCP4_HDRSIZE;
-	if (tcph->flags & SYN) {
-		if (tcph->mss)
-			hdrlen += MSS_LENGTH;
-		if (tcph->ws)
-			hdrlen += WS_LENGTH;
-		optpad = hdrlen & 3;
-		if (optpad)
-			optpad = 4 - optpad;
-		hdrlen += optpad;
-	}
+	optlen = tcpoptlen(tcph);
+	hdrlen = TCP4_HDRSIZE + optlen;
 
 	if (data) {
 		dlen = blocklen(data);
@@ -1095,22 +1514,8 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	hnputs(h->tcpwin, tcph->wnd >> (tcb != NULL ? tcb->snd.scale : 0));
 	hnputs(h->tcpurg, tcph->urg);
 
-	if (tcph->flags & SYN) {
-		opt = h->tcpopt;
-		if (tcph->mss != 0) {
-			*opt++ = MSSOPT;
-			*opt++ = MSS_LENGTH;
-			hnputs(opt, tcph->mss);
-			opt += 2;
-		}
-		if (tcph->ws != 0) {
-			*opt++ = WSOPT;
-			*opt++ = WS_LENGTH;
-			*opt++ = tcph->ws;
-		}
-		while (optpad-- > 0)
-			*opt++ = NOOPOPT;
-	}
+	if (optlen)
+		tcpputopts(tcph, h->tcpopt, optlen);
 
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
@@ -1128,10 +1533,7 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 int ntohtcp6(Tcp * tcph, struct block **bpp)
 {
 	Tcp6hdr *h;
-	uint8_t *optr;
 	uint16_t hdrlen;
-	uint16_t optlen;
-	int n;
 
 	*bpp = pullupblock(*bpp, TCP6_PKT + TCP6_HDRSIZE);
 	if (*bpp == NULL)
@@ -1151,48 +1553,22 @@ int ntohtcp6(Tcp * tcph, struct block **bpp)
 	tcph->flags = h->tcpflag[1];
 	tcph->wnd = nhgets(h->tcpwin);
 	tcph->urg = nhgets(h->tcpurg);
-	tcph->mss = 0;
-	tcph->ws = 0;
 	tcph->len = nhgets(h->ploadlen) - hdrlen;
 
 	*bpp = pullupblock(*bpp, hdrlen + TCP6_PKT);
 	if (*bpp == NULL)
 		return -1;
 
-	optr = h->tcpopt;
-	n = hdrlen - TCP6_HDRSIZE;
-	while (n > 0 && *optr != EOLOPT) {
-		if (*optr == NOOPOPT) {
-			n--;
-			optr++;
-			continue;
-		}
-		optlen = optr[1];
-		if (optlen < 2 || optlen > n)
-			break;
-		switch (*optr) {
-			case MSSOPT:
-				if (optlen == MSS_LENGTH)
-					tcph->mss = nhgets(optr + 2);
-				break;
-			case WSOPT:
-				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
-					tcph->ws = HaveWS | *(optr + 2);
-				break;
-		}
-		n -= optlen;
-		optr += optlen;
-	}
+	/* the pullup can move the header */
+	h = (Tcp6hdr *) ((*bpp)->rp);
+	tcpgetopts(tcph, h->tcpopt, hdrlen - TCP6_HDRSIZE);
 	return hdrlen;
 }
 
 int ntohtcp4(Tcp * tcph, struct block **bpp)
 {
 	Tcp4hdr *h;
-	uint8_t *optr;
 	uint16_t hdrlen;
-	uint16_t optlen;
-	int n;
 
 	*bpp = pullupblock(*bpp, TCP4_PKT + TCP4_HDRSIZE);
 	if (*bpp == NULL)
@@ -1213,38 +1589,15 @@ int ntohtcp4(Tcp * tcph, struct block **bpp)
 	tcph->flags = h->tcpflag[1];
 	tcph->wnd = nhgets(h->tcpwin);
 	tcph->urg = nhgets(h->tcpurg);
-	tcph->mss = 0;
-	tcph->ws = 0;
 	tcph->len = nhgets(h->length) - (hdrlen + TCP4_PKT);
 
 	*bpp = pullupblock(*bpp, hdrlen + TCP4_PKT);
 	if (*bpp == NULL)
 		return -1;
 
-	optr = h->tcpopt;
-	n = hdrlen - TCP4_HDRSIZE;
-	while (n > 0 && *optr != EOLOPT) {
-		if (*optr == NOOPOPT) {
-			n--;
-			optr++;
-			continue;
-		}
-		optlen = optr[1];
-		if (optlen < 2 || optlen > n)
-			break;
-		switch (*optr) {
-			case MSSOPT:
-				if (optlen == MSS_LENGTH)
-					tcph->mss = nhgets(optr + 2);
-				break;
-			case WSOPT:
-				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
-					tcph->ws = HaveWS | *(optr + 2);
-				break;
-		}
-		n -= optlen;
-		optr += optlen;
-	}
+	/* the pullup can move the header */
+	h = (Tcp4hdr *) ((*bpp)->rp);
+	tcpgetopts(tcph, h->tcpopt, hdrlen - TCP4_HDRSIZE);
 	return hdrlen;
 }
 
@@ -1334,6 +1687,9 @@ sndrst(struct Proto *tcp, uint8_t * source, uint8_t * dest,
 	seg->urg = 0;
 	seg->mss = 0;
 	seg->ws = 0;
+	seg->sackok = 0;
+	seg->nsack = 0;
+	seg->tsok = 0;
 	switch (version) {
 		case V4:
 			hbp = htontcp4(seg, NULL, &ph4, NULL);
@@ -1375,6 +1731,9 @@ static void tcphangup(struct conv *s)
 			seg.urg = 0;
 			seg.mss = 0;
 			seg.ws = 0;
+			seg.sackok = 0;
+			seg.nsack = 0;
+			seg.tsok = 0;
 			switch (s->ipversion) {
 				case V4:
 					tcb->protohdr.tcp4hdr.vihl = IP_VER4;
@@ -1449,6 +1808,13 @@ int sndsynack(struct Proto *tcp, Limbo * lp)
 		lp->sndscale = 0;
 	}
 
+	/* same for SACK and timestamps */
+	seg.sackok = lp->sackok;
+	seg.nsack = 0;
+	seg.tsok = lp->tsok;
+	seg.tsval = NOW;
+	seg.tsecr = lp->tsrecent;
+
 	switch (lp->version) {
 		case V4:
 			hbp = htontcp4(&seg, NULL, &ph4, NULL);
@@ -1520,6 +1886,9 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 		lp->rport = seg->source;
 		lp->mss = seg->mss;
 		lp->rcvscale = seg->ws;
+		lp->sackok = seg->sackok;
+		lp->tsok = seg->tsok;
+		lp->tsrecent = seg->tsval;
 		lp->irs = seg->seq;
 		urandom_read(&lp->iss, sizeof(lp->iss));
 	}
@@ -1701,11 +2070,21 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 
 	/* our sending max segment size cannot be bigger than what he asked for */
 	if (lp->mss != 0 && lp->mss < tcb->mss)
-		tcb->mss = lp->mss;
+		tcb->mss = MAX(lp->mss, MIN_MSS);
 
 	/* window scaling */
 	tcpsetscale(new, tcb, lp->rcvscale, lp->sndscale);
 
+	/* SACK and timestamps, if the SYN asked.  timestamps come out of every
+	 * segment we send. */
+	tcb->sackok = lp->sackok;
+	tcb->tsok = lp->tsok;
+	if (tcb->tsok) {
+		tcb->tsrecent = lp->tsrecent;
+		tcb->tsrecentage = NOW;
+		tcb->mss -= TS_PADDED;
+	}
+
 	/* the congestion window always starts out as a single segment */
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->mss;
@@ -1800,9 +2179,307 @@ void tcpsynackrtt(struct conv *s)
 	tcphalt(tpriv, &tcb->rtt_timer);
 }
 
+/*
+ *  describe the resequence queue as SACK blocks, at most max of them.  the
+ *  block with the latest segment goes first (RFC 2018), then the rest in
+ *  order.
+ */
+static int tcpsackblocks(Tcpctl *tcb, Sackblk *sb, int max)
+{
+	Reseq *rp;
+	uint32_t left, right;
+	int n = 0;
+
+	rp = tcb->reseq;
+	while (rp != NULL) {
+		left = rp->seg.seq;
+		right = left + rp->length;
+		for (rp = rp->next; rp != NULL && seq_le(rp->seg.seq, right);
+			 rp = rp->next) {
+			if (seq_gt(rp->seg.seq + rp->length, right))
+				right = rp->seg.seq + rp->length;
+		}
+		if (seq_le(right, tcb->rcv.nxt) || left == right)
+			continue;
+		if (n > 0 && seq_within(tcb->rcv.lastoo, left, right - 1)) {
+			if (n == max)
+				n--;
+			memmove(&sb[1], &sb[0], n * sizeof(Sackblk));
+			sb[0].left = left;
+			sb[0].right = right;
+			n++;
+		} else if (n < max) {
+			sb[n].left = left;
+			sb[n].right = right;
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ *  the most data we can put in a segment, after leaving room for the SACK
+ *  blocks tcpsetopts() adds while our resequence queue isn't empty.
+ *  timestamps are already taken out of tcb->mss.
+ */
+static uint32_t tcpsndmss(Tcpctl *tcb)
+{
+	if (tcb->sackok && tcb->reseq != NULL)
+		return tcb->mss - SACK_ROOM;
+	return tcb->mss;
+}
+
+/*
+ *  timestamps and SACK blocks for a segment we're about to send.  we offer
+ *  both on our SYN, and answer a SYN with whatever it offered.
+ */
+static void tcpsetopts(Tcpctl *tcb, Tcp *seg)
+{
+	seg->sackok = 0;
+	seg->nsack = 0;
+	if (seg->flags & SYN) {
+		if (seg->flags & ACK) {
+			seg->sackok = tcb->sackok;
+			seg->tsok = tcb->tsok;
+		} else {
+			seg->sackok = 1;
+			seg->tsok = 1;
+		}
+	} else {
+		seg->tsok = tcb->tsok;
+		if (tcb->sackok && tcb->reseq != NULL)
+			seg->nsack = tcpsackblocks(tcb, seg->sack,
+									   tcb->tsok ? MAXSACK - 1 : MAXSACK);
+	}
+	if (seg->tsok) {
+		seg->tsval = NOW;
+		seg->tsecr = tcb->tsrecent;
+	}
+}
+
+/*
+ *  drop scoreboard blocks the cumulative ack has passed and recount what's
+ *  left
+ */
+static void tcpsackprune(Tcpctl *tcb)
+{
+	Sackblk *sb;
+	uint32_t bytes = 0;
+	int i, n = 0;
+
+	for (i = 0; i < tcb->nsacked; i++) {
+		sb = &tcb->sacked[i];
+		if (seq_le(sb->right, tcb->snd.una))
+			continue;
+		if (seq_lt(sb->left, tcb->snd.una))
+			sb->left = tcb->snd.una;
+		tcb->sacked[n++] = *sb;
+		bytes += sb->right - sb->left;
+	}
+	tcb->nsacked = n;
+	tcb->sackedbytes = bytes;
+}
+
+/*
+ *  add [left, right) to the scoreboard, which stays sorted with no overlaps.
+ *  if it's full, we forget the highest block, which is the least useful.
+ */
+static void tcpsackadd(Tcpctl *tcb, uint32_t left, uint32_t right)
+{
+	int i, j;
+
+	for (i = 0; i < tcb->nsacked; i++)
+		if (seq_ge(tcb->sacked[i].right, left))
+			break;
+	for (j = i; j < tcb->nsacked; j++) {
+		if (seq_gt(tcb->sacked[j].left, right))
+			break;
+		if (seq_lt(tcb->sacked[j].left, left))
+			left = tcb->sacked[j].left;
+		if (seq_gt(tcb->sacked[j].right, right))
+			right = tcb->sacked[j].right;
+	}
+	if (i == j) {
+		if (tcb->nsacked == NSNDSACK) {
+			if (i == NSNDSACK)
+				return;
+			tcb->nsacked--;
+		}
+		memmove(&tcb->sacked[i + 1], &tcb->sacked[i],
+				(tcb->nsacked - i) * sizeof(Sackblk));
+		tcb->nsacked++;
+	} else {
+		memmove(&tcb->sacked[i + 1], &tcb->sacked[j],
+				(tcb->nsacked - j) * sizeof(Sackblk));
+		tcb->nsacked -= j - i - 1;
+	}
+	tcb->sacked[i].left = left;
+	tcb->sacked[i].right = right;
+}
+
+static void tcpsackupdate(Tcpctl *tcb, Tcp *seg)
+{
+	Sackblk *sb;
+	int i;
+
+	for (i = 0; i < seg->nsack; i++) {
+		sb = &seg->sack[i];
+		/* D-SACKs and garbage */
+		if (!seq_lt(sb->left, sb->right) || seq_le(sb->left, seg->ack) ||
+			seq_gt(sb->right, tcb->snd.nxt))
+			continue;
+		tcpsackadd(tcb, sb->left, sb->right);
+	}
+	tcpsackprune(tcb);
+}
+
+/*
+ *  resend data that has been sent before, without moving snd.ptr.
+ *  called with s qlocked.
+ */
+static void tcpsendseg(struct conv *s, uint32_t seq, uint32_t len)
+{
+	Tcp seg;
+	Tcpctl *tcb;
+	struct block *hbp, *bp;
+	struct tcppriv *tpriv;
+	uint32_t off;
+
+	tcb = (Tcpctl *) s->ptcl;
+	tpriv = s->p->priv;
+
+	/* just data; SYNs and FINs are left to the timer */
+	off = seq - tcb->snd.una;
+	if (off >= qlen(s->wq))
+		return;
+	len = MIN(len, qlen(s->wq) - off);
+
+	seg.source = s->lport;
+	seg.dest = s->rport;
+	seg.flags = ACK;
+	seg.seq = seq;
+	seg.ack = tcb->rcv.nxt;
+	seg.wnd = tcb->rcv.wnd;
+	seg.urg = 0;
+	seg.mss = 0;
+	seg.ws = 0;
+	tcpsetopts(tcb, &seg);
+
+	tcphalt(tpriv, &tcb->acktimer);
+	tcb->rcv.una = 0;
+	tcb->resent += len;
+	tcb->flags |= RETRAN;
+	tpriv->stats[RetransSegs]++;
+	netlog(s->p->f, Logtcprxmt, "resend %lu len %lu una %lu\n", seq, len,
+		   tcb->snd.una);
+
+	bp = qcopy(s->wq, len, off);
+	if (s->ipversion == V4) {
+		tcb->protohdr.tcp4hdr.vihl = IP_VER4;
+		hbp = htontcp4(&seg, bp, &tcb->protohdr.tcp4hdr, tcb);
+		if (hbp == NULL) {
+			freeblist(bp);
+			return;
+		}
+		ipoput4(s->p->f, hbp, 0, s->ttl, s->tos, s);
+	} else {
+		tcb->protohdr.tcp6hdr.vcf[0] = IP_VER6;
+		hbp = htontcp6(&seg, bp, &tcb->protohdr.tcp6hdr, tcb);
+		if (hbp == NULL) {
+			freeblist(bp);
+			return;
+		}
+		ipoput6(s->p->f, hbp, 0, s->ttl, s->tos, s);
+	}
+}
+
+/*
+ *  resend up to a segment of the next hole at or past snd.hole.  with SACK,
+ *  the holes are the gaps below the highest block in the scoreboard.
+ *  without it, the only hole we know about is at snd.una (NewReno).
+ */
+static void tcpholexmit(struct conv *s)
+{
+	Tcpctl *tcb;
+	uint32_t seq, end;
+	int i;
+
+	tcb = (Tcpctl *) s->ptcl;
+	seq = tcb->snd.hole;
+	if (seq_lt(seq, tcb->snd.una))
+		seq = tcb->snd.una;
+	for (i = 0; i < tcb->nsacked; i++) {
+		if (seq_lt(seq, tcb->sacked[i].left))
+			break;
+		if (seq_lt(seq, tcb->sacked[i].right))
+			seq = tcb->sacked[i].right;
+	}
+	if (i < tcb->nsacked)
+		end = tcb->sacked[i].left;
+	else if (tcb->nsacked == 0 && seq == tcb->snd.una)
+		end = tcb->snd.nxt;
+	else
+		return;
+	end = MIN(end, seq + tcpsndmss(tcb));
+	if (!seq_lt(seq, end))
+		return;
+	tcpsendseg(s, seq, end - seq);
+	tcb->snd.hole = end;
+	if (tcb->nsacked) {
+		struct tcppriv *tpriv = s->p->priv;
+
+		tpriv->stats[SackRetrans]++;
+	}
+}
+
+/*
+ *  three dupacks, or enough SACKed past snd.una, and we call it a loss: cut
+ *  the window and resend the first hole.  the other holes go out as the acks
+ *  keep coming.
+ */
+static void tcpfastrxmit(struct conv *s)
+{
+	Tcpctl *tcb;
+
+	tcb = (Tcpctl *) s->ptcl;
+	tcb->snd.recovery = 1;
+	tcb->snd.rxt = tcb->snd.nxt;
+	tcb->snd.hole = tcb->snd.una;
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
+	tcb->cwind = tcb->ssthresh;
+	netlog(s->p->f, Logtcprxmt, "fast rxt %lu, nxt %lu, cwin %u\n",
+		   tcb->snd.una, tcb->snd.nxt, tcb->cwind);
+	tcpholexmit(s);
+}
+
+static void tcprttupdate(Tcpctl *tcb, int rtt)
+{
+	int delta;
+
+	tcb->backoff = 0;
+	tcb->backedoff = 0;
+	if (rtt <= 0)
+		rtt = 1;	/* otherwise all close systems will rexmit in 0 time */
+	if (tcb->srtt == 0) {
+		tcb->srtt = rtt << LOGAGAIN;
+		tcb->mdev = rtt << LOGDGAIN;
+	} else {
+		delta = rtt - (tcb->srtt >> LOGAGAIN);
+		tcb->srtt += delta;
+		if (tcb->srtt <= 0)
+			tcb->srtt = 1;
+
+		delta = abs(delta) - (tcb->mdev >> LOGDGAIN);
+		tcb->mdev += delta;
+		if (tcb->mdev <= 0)
+			tcb->mdev = 1;
+	}
+	tcpsettimer(tcb);
+}
+
 void update(struct conv *s, Tcp * seg)
 {
-	int rtt, delta;
+	int rtt;
 	Tcpctl *tcb;
 	uint32_t acked;
 	uint32_t expand;
@@ -1817,6 +2494,9 @@ void update(struct conv *s, Tcp * seg)
 		return;
 	}
 
+	if (tcb->sackok && seg->nsack)
+		tcpsackupdate(tcb, seg);
+
 	/* added by Dong Lin for fast retransmission */
 	if (seg->ack == tcb->snd.una
 		&& tcb->snd.una != tcb->snd.nxt
@@ -1826,21 +2506,20 @@ void update(struct conv *s, Tcp * seg)
 		netlog(s->p->f, Logtcprxmt, "dupack %lu ack %lu sndwnd %d advwin %d\n",
 			   tcb->snd.dupacks, seg->ack, tcb->snd.wnd, seg->wnd);
 
-		if (++tcb->snd.dupacks == TCPREXMTTHRESH) {
-			/*
-			 *  tahoe tcp rxt the packet, half sshthresh,
-			 *  and set cwnd to one packet
-			 */
-			tcb->snd.recovery = 1;
-			tcb->snd.rxt = tcb->snd.nxt;
-			netlog(s->p->f, Logtcprxmt, "fast rxt %lu, nxt %lu\n", tcb->snd.una,
-				   tcb->snd.nxt);
-			tcprxmit(s);
-		} else {
-			/* do reno tcp here. */
+		if (tcb->snd.recovery) {
+			/* each dupack means a segment left the network */
+			if (tcb->nsacked)
+				tcpholexmit(s);
+		} else if (++tcb->snd.dupacks == TCPREXMTTHRESH) {
+			tcpfastrxmit(s);
 		}
 	}
 
+	/* window updates can hide dupacks, but not what the SACKs say */
+	if (!tcb->snd.recovery && seg->ack == tcb->snd.una &&
+		tcb->sackedbytes >= TCPREXMTTHRESH * tcb->mss)
+		tcpfastrxmit(s);
+
 	/*
 	 *  update window
 	 */
@@ -1862,8 +2541,8 @@ void update(struct conv *s, Tcp * seg)
 	}
 
 	/*
-	 *  any positive ack turns off fast rxt,
-	 *  (should we do new-reno on partial acks?)
+	 *  any positive ack past the recovery point turns off fast rxt.
+	 *  partial acks resend the next hole, down at done.
 	 */
 	if (!tcb->snd.recovery || seq_ge(seg->ack, tcb->snd.rxt)) {
 		tcb->snd.dupacks = 0;
@@ -1890,7 +2569,7 @@ void update(struct conv *s, Tcp * seg)
 			if (acked < expand)
 				expand = acked;
 		} else
-			expand = ((int)tcb->mss * tcb->mss) / tcb->cwind;
+			expand = tcb->cc->avoid(tcb, acked);
 
 		if (tcb->cwind + expand < tcb->cwind)
 			expand = tcb->snd.wnd - tcb->cwind;
@@ -1899,31 +2578,18 @@ void update(struct conv *s, Tcp * seg)
 		tcb->cwind += expand;
 	}
 
-	/* Adjust the timers according to the round trip time */
-	if (tcb->rtt_timer.state == TcptimerON && seq_ge(seg->ack, tcb->rttseq)) {
+	/* Adjust the timers according to the round trip time.  An echoed
+	 * timestamp times every ack, even for resent data.
+	 */
+	if (tcb->tsok && seg->tsok && seg->tsecr) {
+		tcphalt(tpriv, &tcb->rtt_timer);
+		tcprttupdate(tcb, (uint32_t)NOW - seg->tsecr);
+	} else if (tcb->rtt_timer.state == TcptimerON &&
+			   seq_ge(seg->ack, tcb->rttseq)) {
 		tcphalt(tpriv, &tcb->rtt_timer);
 		if ((tcb->flags & RETRAN) == 0) {
-			tcb->backoff = 0;
-			tcb->backedoff = 0;
 			rtt = tcb->rtt_timer.start - tcb->rtt_timer.count;
-			if (rtt == 0)
-				rtt = 1;	/* otherwise all close systems will rexmit in 0 time */
-			rtt *= MSPTICK;
-			if (tcb->srtt == 0) {
-				tcb->srtt = rtt << LOGAGAIN;
-				tcb->mdev = rtt << LOGDGAIN;
-			} else {
-				delta = rtt - (tcb->srtt >> LOGAGAIN);
-				tcb->srtt += delta;
-				if (tcb->srtt <= 0)
-					tcb->srtt = 1;
-
-				delta = abs(delta) - (tcb->mdev >> LOGDGAIN);
-				tcb->mdev += delta;
-				if (tcb->mdev <= 0)
-					tcb->mdev = 1;
-			}
-			tcpsettimer(tcb);
+			tcprttupdate(tcb, rtt * MSPTICK);
 		}
 	}
 
@@ -1946,6 +2612,10 @@ done:
 	tcb->flags &= ~RETRAN;
 	tcb->backoff = 0;
 	tcb->backedoff = 0;
+
+	tcpsackprune(tcb);
+	if (tcb->snd.recovery)
+		tcpholexmit(s);
 }
 
 void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
@@ -2186,6 +2856,26 @@ reset:
 		}
 	}
 
+	/*
+	 *  PAWS (RFC 7323): a timestamp older than the last one we saw means an
+	 *  old duplicate from a wrapped sequence space.  ack it and drop it.
+	 */
+	if (tcb->tsok && seg.tsok && (seg.flags & RST) == 0) {
+		if (seq_lt(seg.tsval, tcb->tsrecent) &&
+			NOW - tcb->tsrecentage < PAWS_IDLE) {
+			tpriv->stats[PawsDrops]++;
+			netlog(f, Logtcp, "paws drop %lu tsval %lu recent %lu\n", seg.seq,
+				   seg.tsval, tcb->tsrecent);
+			freeblist(bp);
+			tcb->flags |= FORCE;
+			goto output;
+		}
+		if (seq_le(seg.seq, tcb->rcv.nxt)) {
+			tcb->tsrecent = seg.tsval;
+			tcb->tsrecentage = NOW;
+		}
+	}
+
 	/* Cut the data to fit the receive window */
 	if (tcptrim(tcb, &seg, &bp, &length) == -1) {
 		netlog(f, Logtcp, "tcp len < 0, %lu %d\n", seg.seq, length);
@@ -2219,6 +2909,7 @@ reset:
 	if (seg.seq != tcb->rcv.nxt)
 		if (length != 0 || (seg.flags & (SYN | FIN))) {
 			update(s, &seg);
+			tcb->rcv.lastoo = seg.seq;
 			if (addreseq(tcb, tpriv, &seg, bp, length) < 0)
 				printd("reseq %I.%d -> %I.%d\n", s->raddr, s->rport, s->laddr,
 					   s->lport);
@@ -2339,9 +3030,12 @@ reset:
 						 *  control working since it needs an ack every
 						 *  2 max segs worth.  This is not quite that,
 						 *  but under a real stream is equivalent since
-						 *  every packet has a max seg in it.
+						 *  every packet has a max seg in it.  a
+						 *  segment gro glued together counts as
+						 *  however many max segs are in it.
 						 */
-						if (++(tcb->rcv.una) >= 2)
+						tcb->rcv.una += 1 + (length - 1) / tcb->mss;
+						if (tcb->rcv.una >= 2)
 							tcb->flags |= FORCE;
 					}
 					tcb->rcv.nxt += length;
@@ -2452,7 +3146,7 @@ void tcpoutput(struct conv *s)
 	Tcpctl *tcb;
 	struct block *hbp, *bp;
 	int sndcnt, n;
-	uint32_t ssize, dsize, usable, sent;
+	uint32_t ssize, dsize, usable, sent, inflight, mss;
 	struct Fs *f;
 	struct tcppriv *tpriv;
 	uint8_t version;
@@ -2498,17 +3192,27 @@ void tcpoutput(struct conv *s)
 			usable = tcb->cwind;
 			if (tcb->snd.wnd < usable)
 				usable = tcb->snd.wnd;
-			usable -= sent;
+			/* what the other end SACKed isn't in the network anymore */
+			inflight = sent;
+			if (tcb->sackedbytes < sent)
+				inflight -= tcb->sackedbytes;
+			if (usable > inflight)
+				usable -= inflight;
+			else
+				usable = 0;
 		}
+
+		mss = tcpsndmss(tcb);
+
 		ssize = sndcnt - sent;
 		if (ssize && usable < 2)
 			netlog(s->p->f, Logtcp, "throttled snd.wnd %lu cwind %lu\n",
 				   tcb->snd.wnd, tcb->cwind);
 		if (usable < ssize)
 			ssize = usable;
-		if (ssize > tcb->mss) {
+		if (ssize > mss) {
 			if ((tcb->flags & TSO) == 0) {
-				ssize = tcb->mss;
+				ssize = mss;
 			} else {
 				int segs, window;
 
@@ -2525,8 +3229,8 @@ void tcpoutput(struct conv *s)
 				 * next multiple of 4, to ensure we
 				 * still yeild.
 				 */
-				segs = ssize / tcb->mss;
-				ssize = segs * tcb->mss;
+				segs = ssize / mss;
+				ssize = segs * mss;
 				msgs += segs;
 				if (segs > 3)
 					msgs = (msgs + 4) & ~3;
@@ -2579,6 +3283,7 @@ void tcpoutput(struct conv *s)
 		seg.seq = tcb->snd.ptr;
 		seg.ack = tcb->rcv.nxt;
 		seg.wnd = tcb->rcv.wnd;
+		tcpsetopts(tcb, &seg);
 
 		/* Pull out data to send */
 		bp = NULL;
@@ -2588,9 +3293,9 @@ void tcpoutput(struct conv *s)
 				seg.flags |= FIN;
 				dsize--;
 			}
-			if (BLEN(bp) > tcb->mss) {
+			if (BLEN(bp) > mss) {
 				bp->flag |= Btso;
-				bp->mss = tcb->mss;
+				bp->mss = mss;
 			}
 		}
 
@@ -2652,7 +3357,7 @@ void tcpoutput(struct conv *s)
 			 *  transmission time dominates RTT
 			 */
 			if (tcb->rtt_timer.state != TcptimerON)
-				if (ssize == tcb->mss) {
+				if (ssize == mss) {
 					tcpgo(tpriv, &tcb->rtt_timer);
 					tcb->rttseq = tcb->snd.ptr;
 				}
@@ -2718,6 +3423,7 @@ void tcpsendka(struct conv *s)
 		dbp = block_alloc(1, MEM_WAIT);
 		dbp->wp++;
 	}
+	tcpsetopts(tcb, &seg);
 
 	if (isv4(s->raddr)) {
 		/* Build header, link data and compute cksum */
@@ -2820,15 +3526,20 @@ void tcprxmit(struct conv *s)
 	tcb->snd.ptr = tcb->snd.una;
 
 	/*
-	 *  We should be halving the slow start threshhold (down to one
-	 *  mss) but leaving it at mss seems to work well enough
+	 *  cut ssthresh on the first timeout, unless fast recovery already did.
+	 *  the rest of the backoffs are for the same loss.
 	 */
-	tcb->ssthresh = tcb->mss;
+	if (tcb->backoff <= 1 && !tcb->snd.recovery)
+		tcb->ssthresh = tcb->cc->ssthresh(tcb);
+	tcb->snd.recovery = 0;
 
 	/*
-	 *  pull window down to a single packet
+	 *  pull window down to a single packet and resend everything.  the
+	 *  other end may have reneged on what it SACKed.
 	 */
 	tcb->cwind = tcb->mss;
+	tcb->nsacked = 0;
+	tcb->sackedbytes = 0;
 	tcpoutput(s);
 }
 
@@ -2899,7 +3610,16 @@ void procsyn(struct conv *s, Tcp * seg)
 
 	/* our sending max segment size cannot be bigger than what he asked for */
 	if (seg->mss != 0 && seg->mss < tcb->mss)
-		tcb->mss = seg->mss;
+		tcb->mss = MAX(seg->mss, MIN_MSS);
+
+	/* we offer SACK and timestamps on our SYN; use what they offer back */
+	tcb->sackok = seg->sackok;
+	tcb->tsok = seg->tsok;
+	if (tcb->tsok) {
+		tcb->tsrecent = seg->tsval;
+		tcb->tsrecentage = NOW;
+		tcb->mss -= TS_PADDED;
+	}
 
 	/* the congestion window always starts out as a single segment */
 	tcb->snd.wnd = seg->wnd;
@@ -3115,6 +3835,24 @@ static void tcpporthogdefensectl(char *val)
 		error(EINVAL, "unknown value for tcpporthogdefense");
 }
 
+/* called with c qlocked */
+static void tcpsetcc(struct conv *c, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+	int i;
+
+	if (n != 2)
+		error(EINVAL, "usage: cc newreno|cubic");
+	for (i = 0; i < ARRAY_SIZE(tcpccs); i++) {
+		if (strcmp(f[1], tcpccs[i]->name) == 0) {
+			tcb->cc = tcpccs[i];
+			tcb->cc->init(tcb);
+			return;
+		}
+	}
+	error(EINVAL, "unknown congestion control %s", f[1]);
+}
+
 /* called with c qlocked */
 static void tcpctl(struct conv *c, char **f, int n)
 {
@@ -3126,6 +3864,8 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 1 && strcmp(f[0], "cc") == 0)
+		tcpsetcc(c, f, n);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3141,6 +3881,7 @@ int tcpstats(struct Proto *tcp, char *buf, int len)
 	e = p + len;
 	for (i = 0; i < Nstats; i++)
 		p = seprintf(p, e, "%s: %u\n", statnames[i], priv->stats[i]);
+	p = iphtstats(&priv->ht, p, e);
 	return p - buf;
 }
 
@@ -3210,8 +3951,12 @@ void tcpinit(struct Fs *fs)
 
 	tcp = kzmalloc(sizeof(struct Proto), 0);
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
-	qlock_init(&tpriv->tl);
+	tpriv->wheels = kzmalloc_align(sizeof(struct tcp_wheel) * num_cores,
+	                               MEM_WAIT, ARCH_CL_SIZE);
+	for (int i = 0; i < num_cores; i++)
+		spinlock_init(&tpriv->wheels[i].lock);
 	qlock_init(&tpriv->apl);
+	iphtinit(&tpriv->ht);
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -9,6 +9,19 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <rendez.h>
+#include <reclaim.h>
+#include <arch/topology.h>
+
+/* Helper, frees a single page back to its NUMA domain's arena. */
+static void page_free_kva(void *kva)
+{
+	struct arena *arena = kpages_arena;
+
+	if (kpages_numa_arenas)
+		arena = kpages_numa_arenas[paddr_numa_id(PADDR(kva))];
+	arena_free(arena, kva, PGSIZE);
+}
 
 /* Helper, allocates a free page. */
 static struct page *get_a_free_page(void)
@@ -21,6 +34,157 @@ static struct page *get_a_free_page(void)
 	return kva2page(addr);
 }
 
+/* Pools of pre-zeroed pages, one per NUMA domain.  The page_zeroer ktask keeps
+ * them topped up to ZPOOL_HIGH, zeroing with non-temporal stores, and
+ * upage_alloc() takes from its domain's pool (or any pool) before zeroing on
+ * the faulting core.  Allocators wake the zeroer when their pool drops below
+ * ZPOOL_LOW.  The pages are linked through pg_link, which free pages don't
+ * otherwise use. */
+#define ZPOOL_HIGH				512
+#define ZPOOL_LOW				128
+#define ZPOOL_BATCH				32
+#define ZPOOL_BACKOFF_USEC		10000
+
+struct zpage_pool {
+	spinlock_t					lock;
+	page_list_t					pages;
+	unsigned int				nr_pages;
+	unsigned long				nr_hits;
+	unsigned long				nr_misses;
+};
+
+static struct zpage_pool *zpools;
+static struct rendez zpool_rv;
+
+static struct page *__zpool_get(struct zpage_pool *zp)
+{
+	struct page *pg;
+
+	spin_lock_irqsave(&zp->lock);
+	pg = BSD_LIST_FIRST(&zp->pages);
+	if (pg) {
+		BSD_LIST_REMOVE(pg, pg_link);
+		zp->nr_pages--;
+		zp->nr_hits++;
+	} else {
+		zp->nr_misses++;
+	}
+	spin_unlock_irqsave(&zp->lock);
+	return pg;
+}
+
+/* Returns a zeroed page, preferring the calling core's domain, or NULL. */
+static struct page *zpool_get_page(void)
+{
+	struct zpage_pool *zp;
+	struct page *pg;
+	int node;
+
+	if (!zpools)
+		return NULL;
+	node = core_numa_id(core_id());
+	zp = &zpools[node];
+	pg = __zpool_get(zp);
+	for (int i = 0; !pg && (i < num_numa); i++) {
+		if (i != node)
+			pg = __zpool_get(&zpools[i]);
+	}
+	if (zp->nr_pages < ZPOOL_LOW)
+		rendez_wakeup(&zpool_rv);
+	return pg;
+}
+
+static int zpools_need_pages(void *arg)
+{
+	/* Under memory pressure, the reclaimer is draining the pools.  We'll get
+	 * woken up again by allocators once it's over. */
+	if (mem_below_watermark(RECLAIM_WMARK_LOW))
+		return FALSE;
+	for (int i = 0; i < num_numa; i++) {
+		if (zpools[i].nr_pages < ZPOOL_LOW)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Zeros up to ZPOOL_BATCH pages into each domain's pool, taking them from that
+ * domain's kpages arena.  Returns FALSE if we couldn't add any pages, e.g. the
+ * domains that need pages are out of memory. */
+static bool zpools_fill_batch(void)
+{
+	struct zpage_pool *zp;
+	void *kva;
+	int nr_added = 0;
+
+	for (int node = 0; node < num_numa; node++) {
+		zp = &zpools[node];
+		for (int i = 0; (i < ZPOOL_BATCH) && (zp->nr_pages < ZPOOL_HIGH); i++) {
+			kva = arena_alloc(kpages_numa_arenas[node], PGSIZE, MEM_ATOMIC);
+			if (!kva)
+				break;
+			clear_page_nocache(kva);
+			spin_lock_irqsave(&zp->lock);
+			BSD_LIST_INSERT_HEAD(&zp->pages, kva2page(kva), pg_link);
+			zp->nr_pages++;
+			spin_unlock_irqsave(&zp->lock);
+			nr_added++;
+		}
+	}
+	return nr_added > 0;
+}
+
+static bool zpools_full(void)
+{
+	for (int i = 0; i < num_numa; i++) {
+		if (zpools[i].nr_pages < ZPOOL_HIGH)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void page_zeroer(void *arg)
+{
+	while (1) {
+		rendez_sleep(&zpool_rv, zpools_need_pages, NULL);
+		/* Yield between batches, so we only soak up time that no one else
+		 * wants on this core. */
+		while (!zpools_full() && !mem_below_watermark(RECLAIM_WMARK_LOW)) {
+			if (!zpools_fill_batch()) {
+				/* A pool is low, but its domain has no memory to spare.
+				 * Back off, instead of spinning on zpools_need_pages(). */
+				kthread_usleep(ZPOOL_BACKOFF_USEC);
+				break;
+			}
+			kthread_yield();
+		}
+	}
+}
+
+void page_zero_pool_init(void)
+{
+	zpools = kzmalloc(sizeof(struct zpage_pool) * num_numa, MEM_WAIT);
+	for (int i = 0; i < num_numa; i++) {
+		spinlock_init_irqsave(&zpools[i].lock);
+		BSD_LIST_INIT(&zpools[i].pages);
+	}
+	rendez_init(&zpool_rv);
+	ktask("page_zeroer", page_zeroer, NULL);
+}
+
+/* Gives the zeroed pages back to the allocator.  The zeroer will refill the
+ * pools the next time someone allocates from them. */
+void page_zero_pool_drain(void)
+{
+	struct page *pg;
+
+	if (!zpools)
+		return;
+	for (int i = 0; i < num_numa; i++) {
+		while ((pg = __zpool_get(&zpools[i])))
+			page_decref(pg);
+	}
+}
+
 /**
  * @brief Allocates a physical page from a pool of unused physical memory.
  *
@@ -34,8 +198,16 @@ static struct page *get_a_free_page(void)
  */
 error_t upage_alloc(struct proc *p, page_t **page, bool zero)
 {
-	struct page *pg = get_a_free_page();
+	struct page *pg;
 
+	if (zero) {
+		pg = zpool_get_page();
+		if (pg) {
+			*page = pg;
+			return 0;
+		}
+	}
+	pg = get_a_free_page();
 	if (!pg)
 		return -ENOMEM;
 	*page = pg;
@@ -109,10 +281,167 @@ void free_cont_pages(void *buf, size_t order)
 	arena_xfree(kpages_arena, buf, PGSIZE << order);
 }
 
+/* Jumbo pages for user memory.  A jumbo is a naturally aligned allocation of
+ * PGSIZE << order, tracked by a struct jumbo_page hanging off the pg_private of
+ * its head page (which is flagged PG_JUMBO).  While it is mapped whole, its
+ * only reference is the jumbo PTE, and page_decref() on the head frees it.
+ *
+ * When a mapping needs to split a jumbo (e.g. munmap of part of it), the jumbo
+ * is split into 1 << (order - child_order) pieces, each of which is a reference
+ * on its parent.  Order-0 pieces are just the individual struct pages, all
+ * pointing at the parent.  Larger pieces (a 1 GB jumbo split into 2 MB jumbos)
+ * get their own struct jumbo_page.  The memory goes back to the arena in one
+ * piece once every piece has been page_decref()d. */
+struct jumbo_page {
+	void						*kva;
+	size_t						order;
+	atomic_t					nr_pieces;
+	struct jumbo_page			*parent;
+};
+
+static void __jumbo_set_pages(struct jumbo_page *jp, size_t nr_pages)
+{
+	struct page *page = kva2page(jp->kva);
+
+	for (size_t i = 0; i < nr_pages; i++) {
+		page[i].pg_private = jp;
+		atomic_or(&page[i].pg_flags, PG_JUMBO);
+	}
+}
+
+/* Allocates a jumbo page of PGSIZE << order, returning its head page. */
+struct page *jumbo_page_alloc(size_t order, bool zero)
+{
+	struct jumbo_page *jp;
+	void *kva;
+
+	jp = kmalloc(sizeof(struct jumbo_page), MEM_ATOMIC);
+	if (!jp)
+		return NULL;
+	kva = get_cont_pages(order, MEM_ATOMIC);
+	if (!kva) {
+		kfree(jp);
+		return NULL;
+	}
+	if (zero)
+		memset(kva, 0, PGSIZE << order);
+	jp->kva = kva;
+	jp->order = order;
+	atomic_init(&jp->nr_pieces, 1);
+	jp->parent = NULL;
+	__jumbo_set_pages(jp, 1);
+	return kva2page(kva);
+}
+
+size_t jumbo_page_order(struct page *page)
+{
+	struct jumbo_page *jp = page->pg_private;
+
+	assert(page_is_jumbo(page));
+	return jp->order;
+}
+
+/* Splits the jumbo whose head is @page into pieces of PGSIZE << child_order.
+ * The caller's reference on the jumbo becomes a reference on each piece.
+ * Returns 0 or -ENOMEM, in which case the jumbo is untouched. */
+int jumbo_page_split(struct page *page, size_t child_order)
+{
+	struct jumbo_page *jp = page->pg_private;
+	struct jumbo_page *child, *children = NULL;
+	size_t nr_pieces;
+
+	assert(page_is_jumbo(page));
+	assert(page2kva(page) == jp->kva);
+	assert(child_order < jp->order);
+	nr_pieces = 1UL << (jp->order - child_order);
+	if (!child_order) {
+		atomic_set(&jp->nr_pieces, nr_pieces);
+		__jumbo_set_pages(jp, nr_pieces);
+		return 0;
+	}
+	/* Splits happen with the mm locks held, so we can't block.  Get all of the
+	 * children first, temporarily chained through their parent pointers. */
+	for (size_t i = 0; i < nr_pieces; i++) {
+		child = kmalloc(sizeof(struct jumbo_page), MEM_ATOMIC);
+		if (!child) {
+			while ((child = children)) {
+				children = child->parent;
+				kfree(child);
+			}
+			return -ENOMEM;
+		}
+		child->parent = children;
+		children = child;
+	}
+	atomic_set(&jp->nr_pieces, nr_pieces);
+	for (size_t i = 0; i < nr_pieces; i++) {
+		child = children;
+		children = child->parent;
+		child->kva = jp->kva + (i << (child_order + PGSHIFT));
+		child->order = child_order;
+		atomic_init(&child->nr_pieces, 1);
+		child->parent = jp;
+		__jumbo_set_pages(child, 1);
+	}
+	return 0;
+}
+
+/* Undoes jumbo_page_split(@page, @child_order), so long as none of the pieces
+ * were freed or split since. */
+void jumbo_page_unsplit(struct page *page, size_t child_order)
+{
+	struct jumbo_page *jp = page->pg_private;
+	struct page *piece;
+	size_t nr_pieces;
+
+	if (child_order)
+		jp = jp->parent;
+	nr_pieces = 1UL << (jp->order - child_order);
+	for (size_t i = 0; i < nr_pieces; i++) {
+		piece = &page[i << child_order];
+		if (child_order)
+			kfree(piece->pg_private);
+		if (i) {
+			piece->pg_private = NULL;
+			atomic_and(&piece->pg_flags, ~PG_JUMBO);
+		}
+	}
+	page->pg_private = jp;
+	atomic_set(&jp->nr_pieces, 1);
+}
+
+static void jumbo_page_put(struct jumbo_page *jp)
+{
+	struct jumbo_page *parent;
+	struct page *page;
+
+	while (jp) {
+		if (!atomic_sub_and_test(&jp->nr_pieces, 1))
+			return;
+		parent = jp->parent;
+		if (!parent) {
+			/* Only the root clears flags, so every page it ever flagged
+			 * (through its pieces too) is clean before the arena sees it. */
+			page = kva2page(jp->kva);
+			for (size_t i = 0; i < (1UL << jp->order); i++) {
+				atomic_and(&page[i].pg_flags, ~PG_JUMBO);
+				page[i].pg_private = NULL;
+			}
+			free_cont_pages(jp->kva, jp->order);
+		}
+		kfree(jp);
+		jp = parent;
+	}
+}
+
 /* Frees the page */
 void page_decref(page_t *page)
 {
-	kpages_free(page2kva(page), PGSIZE);
+	if (page_is_jumbo(page)) {
+		jumbo_page_put(page->pg_private);
+		return;
+	}
+	page_free_kva(page2kva(page));
 }
 
 /* Attempts to get a lock on the page for IO operations.  If it is already
@@ -6,11 +6,19 @@
  * Analagous to Linux's "struct address space" */
 
 #include <pmap.h>
+#include <blockdev.h>
 #include <atomic.h>
 #include <radix.h>
 #include <kref.h>
 #include <assert.h>
 #include <stdio.h>
+#include <kthread.h>
+
+/* All PMs, so the reclaimer can find clean pages to drop.  PMs are removed in
+ * pm_destroy(), which syncs with the reclaimer via this lock. */
+static TAILQ_HEAD(page_map_tailq, page_map) all_page_maps =
+                                      TAILQ_HEAD_INITIALIZER(all_page_maps);
+static spinlock_t all_page_maps_lock = SPINLOCK_INITIALIZER;
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -46,6 +54,9 @@ void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr)
 #endif
 #define PM_REFCNT_SHIFT (PM_FLAGS_SHIFT + 1)
 
+/* How many slots we grab at a time with gang lookups */
+#define PM_GANG_NR 16
+
 #define PM_REMOVAL (1UL << PM_FLAGS_SHIFT)
 
 static bool pm_slot_check_removal(void *slot_val)
@@ -103,6 +114,80 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
 	atomic_set(&pm->pm_removal, 0);
+	spin_lock(&all_page_maps_lock);
+	TAILQ_INSERT_TAIL(&all_page_maps, pm, pm_link);
+	spin_unlock(&all_page_maps_lock);
+}
+
+/* Frees the buffer heads hanging off an unused, clean page. */
+static void __pm_free_bhs(struct page *page)
+{
+	struct buffer_head *bh, *next;
+
+	for (bh = page->pg_private; bh; bh = next) {
+		next = bh->bh_next;
+		kmem_cache_free(bh_kcache, bh);
+	}
+	page->pg_private = 0;
+}
+
+/* How long pm_destroy() sleeps between checks for pages still in use */
+#define PM_DESTROY_WAIT_USEC 1000
+
+/* Call this before freeing the memory holding the PM.  Once this returns, the
+ * reclaimer won't look at the PM.  Any pages left in the PM are dropped, so the
+ * owner should have written back anything it cares about.  There shouldn't be
+ * any users of the PM left, but if a page still has a slot ref, we wait for it
+ * to be put instead of freeing the page out from under its user.  This can
+ * block. */
+void pm_destroy(struct page_map *pm)
+{
+	void **slots[PM_GANG_NR];
+	unsigned long keys[PM_GANG_NR];
+	struct page *page;
+	unsigned long i;
+	int nr_found, nr_busy;
+	bool warned = FALSE;
+
+	spin_lock(&all_page_maps_lock);
+	TAILQ_REMOVE(&all_page_maps, pm, pm_link);
+	spin_unlock(&all_page_maps_lock);
+	spin_lock(&pm->pm_lock);
+	while (1) {
+		i = 0;
+		nr_busy = 0;
+		while ((nr_found = radix_gang_lookup_slot(&pm->pm_tree, slots, keys,
+		                                          i, PM_GANG_NR))) {
+			i = keys[nr_found - 1] + 1;
+			for (int j = 0; j < nr_found; j++) {
+				if (pm_slot_check_refcnt(*slots[j])) {
+					nr_busy++;
+					continue;
+				}
+				page = pm_slot_get_page(*slots[j]);
+				radix_delete(&pm->pm_tree, keys[j]);
+				if (!page)
+					continue;
+				if (atomic_read(&page->pg_flags) & PG_BUFFER)
+					__pm_free_bhs(page);
+				atomic_set(&page->pg_flags, 0);
+				page_decref(page);
+				pm->pm_num_pages--;
+			}
+		}
+		if (!nr_busy)
+			break;
+		if (!warned) {
+			warn("Destroying PM %p with %d pages in use, waiting", pm,
+			     nr_busy);
+			warned = TRUE;
+		}
+		spin_unlock(&pm->pm_lock);
+		kthread_usleep(PM_DESTROY_WAIT_USEC);
+		spin_lock(&pm->pm_lock);
+	}
+	spin_unlock(&pm->pm_lock);
+	radix_tree_destroy(&pm->pm_tree);
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -112,30 +197,38 @@ static struct page *pm_find_page(struct page_map *pm, unsigned long index)
 	void **tree_slot;
 	void *old_slot_val, *slot_val;
 	struct page *page = 0;
-	/* Read walking the PM tree TODO: (RCU) */
-	spin_lock(&pm->pm_lock);
-	/* We're syncing with removal.  The deal is that if we grab the page (and
-	 * we'd only do that if the page != 0), we up the slot ref and clear
-	 * removal.  A remover will only remove it if removal is still set.  If we
-	 * grab and release while removal is in progress, even though we no longer
-	 * hold the ref, we have unset removal.  Also, to prevent removal where we
-	 * get a page well before the removal process, the removal won't even bother
-	 * when the slot refcnt is upped. */
+	/* Read walking the PM tree is lockless; see radix.h.  The slot for index
+	 * stays valid while we're in the RCU read-side critical section, even if
+	 * the page is removed concurrently, and our slot ref keeps the page (and
+	 * thus the slot's node) in the tree after that.  We're syncing
+	 * with removal.  The deal is that if we grab the page (and we'd only do
+	 * that if the page != 0), we up the slot ref and clear removal.  A remover
+	 * will only remove it if removal is still set.  If we grab and release
+	 * while removal is in progress, even though we no longer hold the ref, we
+	 * have unset removal.  Also, to prevent removal where we get a page well
+	 * before the removal process, the removal won't even bother when the slot
+	 * refcnt is upped. */
+	rcu_read_lock();
 	tree_slot = radix_lookup_slot(&pm->pm_tree, index);
 	if (!tree_slot)
-		goto out;
+		goto out_unlock;
 	do {
 		old_slot_val = ACCESS_ONCE(*tree_slot);
 		slot_val = old_slot_val;
 		page = pm_slot_get_page(slot_val);
 		if (!page)
-			goto out;
+			goto out_unlock;
 		slot_val = pm_slot_clear_removal(slot_val);
 		slot_val = pm_slot_inc_refcnt(slot_val);	/* not a page kref */
 	} while (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val));
-	assert(page->pg_tree_slot == tree_slot);
-out:
-	spin_unlock(&pm->pm_lock);
+	rcu_read_unlock();
+	/* The inserter sets pg_tree_slot right after the page shows up in the
+	 * tree.  Our slot ref keeps the page from being removed in the meantime. */
+	while (ACCESS_ONCE(page->pg_tree_slot) != tree_slot)
+		cpu_relax();
+	return page;
+out_unlock:
+	rcu_read_unlock();
 	return page;
 }
 
@@ -158,8 +251,8 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	spin_lock(&pm->pm_lock);
 	page->pg_mapping = pm;	/* debugging */
 	page->pg_index = index;
-	/* no one should be looking at the tree slot til we stop write locking.  the
-	 * only other one who looks is removal, who requires a PM write lock. */
+	/* the only other ones who look at the tree slot are removal, who requires
+	 * a PM write lock, and lockless lookups, who wait til we set it. */
 	page->pg_tree_slot = (void*)0xdeadbeef;	/* poison */
 	slot_val = pm_slot_inc_refcnt(slot_val);
 	/* passing the page ref from the caller to the slot */
@@ -171,7 +264,7 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 		spin_unlock(&pm->pm_lock);
 		return ret;
 	}
-	page->pg_tree_slot = tree_slot;
+	ACCESS_ONCE(page->pg_tree_slot) = tree_slot;
 	pm->pm_num_pages++;
 	spin_unlock(&pm->pm_lock);
 	return 0;
@@ -186,6 +279,21 @@ void pm_put_page(struct page *page)
 	atomic_add((atomic_t*)tree_slot, -(1UL << PM_REFCNT_SHIFT));
 }
 
+/* Marks a PM page dirty and tags it in the PM's tree, so removal and writeback
+ * only need to look at the dirty pages.  The caller needs to keep the page in
+ * the PM, usually with a slot ref. */
+void pm_page_set_dirty(struct page *page)
+{
+	struct page_map *pm = page->pg_mapping;
+
+	if (atomic_read(&page->pg_flags) & PG_DIRTY)
+		return;
+	spin_lock(&pm->pm_lock);
+	atomic_or(&page->pg_flags, PG_DIRTY);
+	radix_tag_set(&pm->pm_tree, page->pg_index, RADIX_TAG_DIRTY);
+	spin_unlock(&pm->pm_lock);
+}
+
 /* Makes sure the index'th page of the mapped object is loaded in the page cache
  * and returns its location via **pp.
  *
@@ -331,8 +439,12 @@ static int __pm_mark_dirty_pgs_unmap(struct proc *p, pte_t pte, void *va,
 	page = pa2page(pte_get_paddr(pte));
 	/* need to check for removal again, just like in mark_not_present */
 	if (atomic_read(&page->pg_flags) & PG_REMOVAL) {
-		if (pte_is_dirty(pte))
+		/* we hold the PM lock, so we can tag directly */
+		if (pte_is_dirty(pte)) {
 			atomic_or(&page->pg_flags, PG_DIRTY);
+			radix_tag_set(&page->pg_mapping->pm_tree, page->pg_index,
+			              RADIX_TAG_DIRTY);
+		}
 		pte_clear(pte);
 	}
 	return 0;
@@ -363,7 +475,7 @@ int pm_remove_contig(struct page_map *pm, unsigned long index,
                      unsigned long nr_pgs)
 {
 	unsigned long i;
-	int nr_removed = 0;
+	int nr_removed = 0, nr_found;
 	void **tree_slot;
 	void *old_slot_val, *slot_val;
 	struct vm_region *vmr_i;
@@ -372,6 +484,8 @@ int pm_remove_contig(struct page_map *pm, unsigned long index,
 	#define PTR_ARR_LEN 10
 	void *ptr_store[PTR_ARR_LEN];
 	int ptr_free_idx = 0;
+	void **gang_slots[PTR_ARR_LEN];
+	unsigned long gang_keys[PTR_ARR_LEN];
 	struct page *page;
 	/* could also call a simpler remove if nr_pgs == 1 */
 	if (!nr_pgs)
@@ -500,40 +614,52 @@ next_loop_mark_rm:
 			vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_unmap);
 		spin_unlock(&vmr_i->vm_proc->pte_lock);
 	}
-	/* Now we'll go through from the PM again and deal with pages are dirty. */
+	/* Now we'll go through from the PM again and deal with pages are dirty.
+	 * Dirty pages are tagged, so we only look at those.  We grab at most as
+	 * many as we have room for in the WB array. */
 	i = index;
 handle_dirty:
-	for (/* i set already */; i < index + nr_pgs; i++) {
+	while ((i < index + nr_pgs) && (ptr_free_idx < PTR_ARR_LEN)) {
 		/* TODO: consider putting in the pinned check & advance again.  Careful,
 		 * since we could unlock on a handle_dirty loop, and skipping could skip
 		 * over a new VMR, but those pages would still be marked for removal.
 		 * It's not wrong, currently, to have spurious REMOVALs. */
-		tree_slot = radix_lookup_slot(&pm->pm_tree, i);
-		if (!tree_slot)
-			continue;
-		page = pm_slot_get_page(*tree_slot);
-		if (!page)
-			continue;
-		/* only operate on pages we marked earlier */
-		if (!(atomic_read(&page->pg_flags) & PG_REMOVAL))
-			continue;
-		/* if someone has used it since we grabbed it, we lost the race and
-		 * won't remove it later.  no sense writing it back now either. */
-		if (!pm_slot_check_removal(*tree_slot)) {
-			/* since we set PG_REMOVAL, we're the ones to clear it */
-			atomic_and(&page->pg_flags, ~PG_REMOVAL);
-			continue;
+		nr_found = radix_tag_gang_lookup_slot(&pm->pm_tree, gang_slots,
+		                                      gang_keys, i,
+		                                      PTR_ARR_LEN - ptr_free_idx,
+		                                      RADIX_TAG_DIRTY);
+		if (!nr_found) {
+			i = index + nr_pgs;
+			break;
 		}
-		/* this dirty flag could also be set by write()s, not just VMRs */
-		if (atomic_read(&page->pg_flags) & PG_DIRTY) {
-			/* need to bail out.  after we WB, we'll restart this big loop where
-			 * we left off ('i' is still set) */
-			if (ptr_free_idx == PTR_ARR_LEN)
+		for (int j = 0; j < nr_found; j++) {
+			if (gang_keys[j] >= index + nr_pgs) {
+				i = index + nr_pgs;
 				break;
-			ptr_store[ptr_free_idx++] = page;
-			/* once we've decided to WB, we can clear the dirty flag.  might
+			}
+			i = gang_keys[j] + 1;
+			tree_slot = gang_slots[j];
+			page = pm_slot_get_page(*tree_slot);
+			if (!page)
+				continue;
+			/* only operate on pages we marked earlier */
+			if (!(atomic_read(&page->pg_flags) & PG_REMOVAL))
+				continue;
+			/* if someone has used it since we grabbed it, we lost the race and
+			 * won't remove it later.  no sense writing it back now either. */
+			if (!pm_slot_check_removal(*tree_slot)) {
+				/* since we set PG_REMOVAL, we're the ones to clear it */
+				atomic_and(&page->pg_flags, ~PG_REMOVAL);
+				continue;
+			}
+			/* this dirty flag could also be set by write()s, not just VMRs.
+			 * once we've decided to WB, we can clear the dirty flag.  might
 			 * have an extra WB later, but we won't miss new data */
-			atomic_and(&page->pg_flags, ~PG_DIRTY);
+			radix_tag_clear(&pm->pm_tree, gang_keys[j], RADIX_TAG_DIRTY);
+			if (atomic_read(&page->pg_flags) & PG_DIRTY) {
+				ptr_store[ptr_free_idx++] = page;
+				atomic_and(&page->pg_flags, ~PG_DIRTY);
+			}
 		}
 	}
 	/* we're unlocking, meaning VMRs and the radix tree can be changed, but we
@@ -550,49 +676,136 @@ handle_dirty:
 		goto handle_dirty;
 	/* TODO: RCU - we need a write lock here (the current spinlock is fine) */
 	/* All dirty pages were WB, anything left as REMOVAL can be removed */
-	for (i = index; i < index + nr_pgs; i++) {
-		/* TODO: consider putting in the pinned check & advance again */
-		tree_slot = radix_lookup_slot(&pm->pm_tree, i);
-		if (!tree_slot)
-			continue;
-		old_slot_val = ACCESS_ONCE(*tree_slot);
-		slot_val = old_slot_val;
-		page = pm_slot_get_page(*tree_slot);
-		if (!page)
-			continue;
-		if (!(atomic_read(&page->pg_flags) & PG_REMOVAL))
-			continue;
-		/* syncing with lookups, writebacks, etc.  if someone has used it since
-		 * we started removing, they would have cleared the slot's REMOVAL (but
-		 * not PG_REMOVAL), though the refcnt could be back down to 0 again. */
-		if (!pm_slot_check_removal(slot_val)) {
-			/* since we set PG_REMOVAL, we're the ones to clear it */
-			atomic_and(&page->pg_flags, ~PG_REMOVAL);
-			continue;
+	i = index;
+	while (i < index + nr_pgs) {
+		nr_found = radix_gang_lookup_slot(&pm->pm_tree, gang_slots, gang_keys,
+		                                  i, PTR_ARR_LEN);
+		if (!nr_found)
+			break;
+		i = gang_keys[nr_found - 1] + 1;
+		for (int j = 0; j < nr_found; j++) {
+			/* TODO: consider putting in the pinned check & advance again */
+			if (gang_keys[j] >= index + nr_pgs)
+				break;
+			tree_slot = gang_slots[j];
+			old_slot_val = ACCESS_ONCE(*tree_slot);
+			slot_val = old_slot_val;
+			page = pm_slot_get_page(slot_val);
+			if (!page)
+				continue;
+			if (!(atomic_read(&page->pg_flags) & PG_REMOVAL))
+				continue;
+			/* syncing with lookups, writebacks, etc.  if someone has used it
+			 * since we started removing, they would have cleared the slot's
+			 * REMOVAL (but not PG_REMOVAL), though the refcnt could be back
+			 * down to 0 again. */
+			if (!pm_slot_check_removal(slot_val)) {
+				/* since we set PG_REMOVAL, we're the ones to clear it */
+				atomic_and(&page->pg_flags, ~PG_REMOVAL);
+				continue;
+			}
+			if (pm_slot_check_refcnt(slot_val))
+				warn("Unexpected refcnt in PM remove!");
+			/* Note that we keep slot REMOVAL set, so the radix tree thinks
+			 * it's still an item (artifact of that implementation). */
+			slot_val = pm_slot_set_page(slot_val, 0);
+			if (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val)) {
+				atomic_and(&page->pg_flags, ~PG_REMOVAL);
+				continue;
+			}
+			/* at this point, we're free at last!  When we update the radix
+			 * tree, it still thinks it has an item.  This is fine.  Lookups
+			 * will now fail (since the page is 0), and insertions will block on
+			 * the write lock.*/
+			atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
+			page_decref(page);
+			nr_removed++;
+			radix_delete(&pm->pm_tree, gang_keys[j]);
 		}
-		if (pm_slot_check_refcnt(slot_val))
-			warn("Unexpected refcnt in PM remove!");
-		/* Note that we keep slot REMOVAL set, so the radix tree thinks it's
-		 * still an item (artifact of that implementation). */
-		slot_val = pm_slot_set_page(slot_val, 0);
-		if (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val)) {
-			atomic_and(&page->pg_flags, ~PG_REMOVAL);
-			continue;
+	}
+	pm->pm_num_pages -= nr_removed;
+	spin_unlock(&pm->pm_lock);
+	atomic_set(&pm->pm_removal, 0);
+	return nr_removed;
+}
+
+/* Drops up to nr_wanted clean, unused pages from pm.  Returns the number of
+ * pages freed.
+ *
+ * This is a lightweight version of pm_remove_contig() for the reclaimer: we
+ * skip PMs that are mmapped (which would need unmaps and shootdowns), pages
+ * that anyone holds a slot ref on, and dirty pages (which would need a
+ * writeback).  Holding the PM lock keeps out inserters and other removers, and
+ * lookups race with us on the slot CAS, just like with pm_remove_contig. */
+static unsigned long __pm_reclaim_clean(struct page_map *pm,
+                                        unsigned long nr_wanted)
+{
+	unsigned long nr_removed = 0;
+	unsigned long i = 0;
+	void **slots[PM_GANG_NR];
+	unsigned long keys[PM_GANG_NR];
+	int nr_found;
+	void *slot_val;
+	struct page *page;
+
+	if (atomic_swap(&pm->pm_removal, 1))
+		return 0;
+	spin_lock(&pm->pm_lock);
+	if (!TAILQ_EMPTY(&pm->pm_vmrs))
+		goto out;
+	while (nr_removed < nr_wanted) {
+		nr_found = radix_gang_lookup_slot(&pm->pm_tree, slots, keys, i,
+		                                  MIN(PM_GANG_NR,
+		                                      nr_wanted - nr_removed));
+		if (!nr_found)
+			break;
+		i = keys[nr_found - 1] + 1;
+		for (int j = 0; j < nr_found; j++) {
+			slot_val = ACCESS_ONCE(*slots[j]);
+			page = pm_slot_get_page(slot_val);
+			if (!page)
+				continue;
+			if (pm_slot_check_refcnt(slot_val))
+				continue;
+			if (atomic_read(&page->pg_flags) &
+			    (PG_DIRTY | PG_REMOVAL | PG_LOCKED))
+				continue;
+			/* A concurrent lookup would have changed the refcnt */
+			if (!atomic_cas_ptr(slots[j], slot_val,
+			                    pm_slot_set_page(slot_val, 0)))
+				continue;
+			if (atomic_read(&page->pg_flags) & PG_BUFFER)
+				__pm_free_bhs(page);
+			atomic_set(&page->pg_flags, 0);
+			page_decref(page);
+			radix_delete(&pm->pm_tree, keys[j]);
+			nr_removed++;
 		}
-		/* at this point, we're free at last!  When we update the radix tree, it
-		 * still thinks it has an item.  This is fine.  Lookups will now fail
-		 * (since the page is 0), and insertions will block on the write lock.*/
-		atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
-		page_decref(page);
-		nr_removed++;
-		radix_delete(&pm->pm_tree, i);
 	}
 	pm->pm_num_pages -= nr_removed;
+out:
 	spin_unlock(&pm->pm_lock);
 	atomic_set(&pm->pm_removal, 0);
 	return nr_removed;
 }
 
+/* Drops up to nr_wanted clean pages from the page cache, across all PMs.
+ * Returns the number of pages freed. */
+unsigned long pm_reclaim_clean(unsigned long nr_wanted)
+{
+	struct page_map *pm_i;
+	unsigned long nr_removed = 0;
+
+	spin_lock(&all_page_maps_lock);
+	TAILQ_FOREACH(pm_i, &all_page_maps, pm_link) {
+		if (nr_removed >= nr_wanted)
+			break;
+		nr_removed += __pm_reclaim_clean(pm_i, nr_wanted - nr_removed);
+	}
+	spin_unlock(&all_page_maps_lock);
+	return nr_removed;
+}
+
 void print_page_map_info(struct page_map *pm)
 {
 	struct vm_region *vmr_i;
@@ -22,7 +22,9 @@
 #include <mm.h>
 #include <multiboot.h>
 #include <arena.h>
+#include <slab.h>
 #include <init.h>
+#include <arch/topology.h>
 
 physaddr_t max_pmem = 0;	/* Total amount of physical memory (bytes) */
 physaddr_t max_paddr = 0;	/* Maximum addressable physical address */
@@ -46,6 +48,13 @@ static void adjust_max_pmem(struct multiboot_mmap_entry *entry, void *data)
 	max_pmem = MAX(max_pmem, (size_t)(entry->addr + entry->len));
 }
 
+/* Single pages are by far the most common kpages allocation (page faults, the
+ * page cache, etc), so their qcache starts out with the biggest magazines. */
+static void kpages_tune_qcache(struct arena *kpages)
+{
+	kmem_cache_set_magsize(&kpages->qcaches[0], KMC_MAG_MAX_SZ);
+}
+
 static void kpages_arena_init(void)
 {
 	void *kpages_pg;
@@ -53,6 +62,85 @@ static void kpages_arena_init(void)
 	kpages_pg = arena_alloc(base_arena, PGSIZE, MEM_WAIT);
 	kpages_arena = arena_builder(kpages_pg, "kpages", PGSIZE, arena_alloc,
 	                             arena_free, base_arena, 8 * PGSIZE);
+	kpages_tune_qcache(kpages_arena);
+}
+
+/* Moves every free segment of base_arena within [start, end) to node_base.
+ * The segments stay allocated in base_arena forever.  We ask for the biggest
+ * chunks first, so that we only need a handful of segments per range. */
+static void steal_base_range(struct arena *node_base, uintptr_t start,
+                             uintptr_t end)
+{
+	void *seg;
+
+	for (size_t size = 1UL << LOG2_DOWN(end - start); size >= PGSIZE;
+	     size >>= 1) {
+		while ((seg = arena_xalloc(base_arena, size, PGSIZE, 0, 0,
+		                           (void*)start, (void*)end, MEM_ATOMIC)))
+			arena_add(node_base, seg, size, MEM_WAIT);
+	}
+}
+
+/* Builds domain @numa_id's base and kpages arenas.  Returns FALSE if there
+ * was no free memory in that domain. */
+static bool build_numa_arenas(int numa_id)
+{
+	char name[ARENA_NAME_SZ];
+	physaddr_t start, end;
+	struct arena *node_base = NULL;
+	void *pg;
+	int range_id;
+
+	for (int i = 0; numa_mem_range(i, &range_id, &start, &end); i++) {
+		if (range_id != numa_id)
+			continue;
+		end = MIN(end, max_paddr);
+		if (start >= end)
+			continue;
+		if (!node_base) {
+			/* The arena itself lives in a page from its own domain. */
+			pg = arena_xalloc(base_arena, PGSIZE, PGSIZE, 0, 0,
+			                  KADDR_NOCHECK(start), KADDR_NOCHECK(end),
+			                  MEM_ATOMIC);
+			if (!pg)
+				continue;
+			snprintf(name, sizeof(name), "base_%d", numa_id);
+			node_base = arena_builder(pg, name, PGSIZE, NULL, NULL, NULL, 0);
+		}
+		steal_base_range(node_base, (uintptr_t)KADDR_NOCHECK(start),
+		                 (uintptr_t)KADDR_NOCHECK(end));
+	}
+	if (!node_base)
+		return FALSE;
+	base_numa_arenas[numa_id] = node_base;
+	pg = arena_alloc(node_base, PGSIZE, MEM_WAIT);
+	snprintf(name, sizeof(name), "kpages_%d", numa_id);
+	kpages_numa_arenas[numa_id] = arena_builder(pg, name, PGSIZE, arena_alloc,
+	                                            arena_free, node_base,
+	                                            8 * PGSIZE);
+	kpages_tune_qcache(kpages_numa_arenas[numa_id]);
+	printk("NUMA domain %d base arena total mem: %lu\n", numa_id,
+	       arena_amt_total(node_base));
+	return TRUE;
+}
+
+/* Sets up the per-NUMA-domain arenas, once we know the topology.  Domain 0
+ * keeps base_arena and kpages_arena.  Domains without any memory we know about
+ * share domain 0's arenas. */
+void kpages_numa_init(void)
+{
+	base_numa_arenas = base_zalloc(NULL, num_numa * sizeof(struct arena*),
+	                               MEM_WAIT);
+	kpages_numa_arenas = base_zalloc(NULL, num_numa * sizeof(struct arena*),
+	                                 MEM_WAIT);
+	base_numa_arenas[0] = base_arena;
+	kpages_numa_arenas[0] = kpages_arena;
+	for (int i = 1; i < num_numa; i++) {
+		if (!build_numa_arenas(i)) {
+			base_numa_arenas[i] = base_arena;
+			kpages_numa_arenas[i] = kpages_arena;
+		}
+	}
 }
 
 /**
@@ -244,7 +332,7 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
  * of the pte for this page.  This is used by page_remove
  * but should not be used by other callers.
  *
- * For jumbos, right now this returns the first Page* in the 4MB range
+ * For jumbo pages, this returns the Page* for va within the jumbo.
  *
  * @param[in]  pgdir     the page directory from which we should do the lookup
  * @param[in]  va        the virtual address of the page we are looking up
@@ -256,11 +344,17 @@ int page_insert(pgdir_t pgdir, struct page *page, void *va, int perm)
 page_t *page_lookup(pgdir_t pgdir, void *va, pte_t *pte_store)
 {
 	pte_t pte = pgdir_walk(pgdir, va, 0);
+	page_t *page;
+
 	if (!pte_walk_okay(pte) || !pte_is_mapped(pte))
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
-	return pa2page(pte_get_paddr(pte));
+	page = pa2page(pte_get_paddr(pte));
+	if (pte_is_jumbo(pte) && page_is_jumbo(page))
+		page += ((uintptr_t)va & ((PGSIZE << jumbo_page_order(page)) - 1)) >>
+		        PGSHIFT;
+	return page;
 }
 
 /**
@@ -12,11 +12,11 @@
 #include <trap.h>
 #include <umem.h>
 #include <schedule.h>
+#include <sched_trace.h>
 #include <manager.h>
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
-#include <hashtable.h>
 #include <slab.h>
 #include <sys/queue.h>
 #include <frontend.h>
@@ -43,8 +43,13 @@ static void restore_vc_fp_state(struct preempt_data *vcpd);
 #define PID_MAX 32767 // goes from 0 to 32767, with 0 reserved
 static DECL_BITMASK(pid_bmask, PID_MAX + 1);
 spinlock_t pid_bmask_lock = SPINLOCK_INITIALIZER;
-struct hashtable *pid_hash;
-spinlock_t pid_hash_lock; // initialized in proc_init
+
+/* PID hash.  Writers hold the lock, and lookups use RCU.  Procs are freed after
+ * a grace period, so a reader can always try to kref_get_not_zero() a proc it
+ * found in the hash. */
+#define PID_HASH_SZ 256
+static struct proc *pid_hash[PID_HASH_SZ];
+static spinlock_t pid_hash_lock = SPINLOCK_INITIALIZER;
 
 /* Finds the next free entry (zero) entry in the pid_bitmask.  Set means busy.
  * PID 0 is reserved (in proc_init).  A return value of 0 is a failure (and
@@ -176,65 +181,102 @@ int __proc_set_state(struct proc *p, uint32_t state)
 	return 0;
 }
 
+static struct proc **pid_hash_bucket(pid_t pid)
+{
+	return &pid_hash[pid % PID_HASH_SZ];
+}
+
+static void pid_hash_add(struct proc *p)
+{
+	struct proc **bucket = pid_hash_bucket(p->pid);
+
+	spin_lock(&pid_hash_lock);
+	p->pid_hash_next = *bucket;
+	rcu_assign_pointer(*bucket, p);
+	spin_unlock(&pid_hash_lock);
+}
+
+/* Returns TRUE if p was in the hash.  We leave p's pid_hash_next alone, since
+ * readers could still be looking at p. */
+static bool pid_hash_remove(struct proc *p)
+{
+	struct proc **pp;
+	bool found = FALSE;
+
+	spin_lock(&pid_hash_lock);
+	for (pp = pid_hash_bucket(p->pid); *pp; pp = &(*pp)->pid_hash_next) {
+		if (*pp == p) {
+			rcu_assign_pointer(*pp, p->pid_hash_next);
+			found = TRUE;
+			break;
+		}
+	}
+	spin_unlock(&pid_hash_lock);
+	return found;
+}
+
+/* Calls func on every proc in the PID hash, with the hash locked.  Procs could
+ * be dying (refcnt == 0). */
+void pid_for_each(void (*func)(void *item, void *opaque), void *opaque)
+{
+	struct proc *p;
+
+	spin_lock(&pid_hash_lock);
+	for (int i = 0; i < PID_HASH_SZ; i++) {
+		for (p = pid_hash[i]; p; p = p->pid_hash_next)
+			func(p, opaque);
+	}
+	spin_unlock(&pid_hash_lock);
+}
+
 /* Returns a pointer to the proc with the given pid, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0).  The
+ * lookup is under RCU, so p won't be freed between finding it and the
+ * get_not_zero(). */
 struct proc *pid2proc(pid_t pid)
 {
-	spin_lock(&pid_hash_lock);
-	struct proc *p = hashtable_search(pid_hash, (void*)(long)pid);
-	if (p)
+	struct proc *p;
+
+	rcu_read_lock();
+	for (p = rcu_dereference(*pid_hash_bucket(pid)); p;
+	     p = rcu_dereference(p->pid_hash_next)) {
+		if (p->pid != pid)
+			continue;
 		if (!kref_get_not_zero(&p->p_kref, 1))
 			p = 0;
-	spin_unlock(&pid_hash_lock);
+		break;
+	}
+	rcu_read_unlock();
 	return p;
 }
 
 /* Used by devproc for successive reads of the proc table.
  * Returns a pointer to the nth proc, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0). */
 struct proc *pid_nth(unsigned int n)
 {
 	struct proc *p;
-	spin_lock(&pid_hash_lock);
-	if (!hashtable_count(pid_hash)) {
-		spin_unlock(&pid_hash_lock);
-		return NULL;
-	}
-	struct hashtable_itr *iter = hashtable_iterator(pid_hash);
-	p = hashtable_iterator_value(iter);
 
-	while (p) {
-		/* if this process is not valid, it doesn't count,
-		 * so continue
-		 */
-
-		if (kref_get_not_zero(&p->p_kref, 1)) {
+	spin_lock(&pid_hash_lock);
+	for (int i = 0; i < PID_HASH_SZ; i++) {
+		for (p = pid_hash[i]; p; p = p->pid_hash_next) {
+			/* if this process is not valid, it doesn't count, so continue */
+			if (!kref_get_not_zero(&p->p_kref, 1))
+				continue;
 			/* this one counts */
-			if (! n){
+			if (!n) {
 				printd("pid_nth: at end, p %p\n", p);
-				break;
+				spin_unlock(&pid_hash_lock);
+				return p;
 			}
 			kref_put(&p->p_kref);
 			n--;
 		}
-		if (!hashtable_iterator_advance(iter)) {
-			p = NULL;
-			break;
-		}
-		p = hashtable_iterator_value(iter);
 	}
-
 	spin_unlock(&pid_hash_lock);
-	kfree(iter);
-	return p;
+	return NULL;
 }
 
 /* Performs any initialization related to processes, such as create the proc
@@ -250,10 +292,6 @@ void proc_init(void)
 				       0, NULL);
 	/* Init PID mask and hash.  pid 0 is reserved. */
 	SET_BITMASK_BIT(pid_bmask, 0);
-	spinlock_init(&pid_hash_lock);
-	spin_lock(&pid_hash_lock);
-	pid_hash = create_hashtable(100, __generic_hash, __generic_eq);
-	spin_unlock(&pid_hash_lock);
 	schedule_init();
 
 	atomic_init(&num_envs, 0);
@@ -473,9 +511,7 @@ void __proc_ready(struct proc *p)
 	/* Tell the ksched about us.  TODO: do we need to worry about the ksched
 	 * doing stuff to us before we're added to the pid_hash? */
 	__sched_proc_register(p);
-	spin_lock(&pid_hash_lock);
-	hashtable_insert(pid_hash, (void*)(long)p->pid, p);
-	spin_unlock(&pid_hash_lock);
+	pid_hash_add(p);
 }
 
 /* Creates a process from the specified file, argvs, and envps. */
@@ -500,13 +536,17 @@ static int __cb_assert_no_pg(struct proc *p, pte_t pte, void *va, void *arg)
 	return 0;
 }
 
+static void __proc_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(proc_cache, container_of(head, struct proc, rcu));
+}
+
 /* This is called by kref_put(), once the last reference to the process is
  * gone.  Don't call this otherwise (it will panic).  It will clean up the
  * address space and deallocate any other used memory. */
 static void __proc_free(struct kref *kref)
 {
 	struct proc *p = container_of(kref, struct proc, p_kref);
-	void *hash_ret;
 	physaddr_t pa;
 
 	printd("[PID %d] freeing proc: %d\n", current ? current->pid : 0, p->pid);
@@ -530,11 +570,8 @@ static void __proc_free(struct kref *kref)
 	unmap_and_destroy_vmrs(p);
 	frontend_proc_free(p);	/* TODO: please remove me one day */
 	/* Remove us from the pid_hash and give our PID back (in that order). */
-	spin_lock(&pid_hash_lock);
-	hash_ret = hashtable_remove(pid_hash, (void*)(long)p->pid);
-	spin_unlock(&pid_hash_lock);
 	/* might not be in the hash/ready, if we failed during proc creation */
-	if (hash_ret)
+	if (pid_hash_remove(p))
 		put_free_pid(p->pid);
 	else
 		printd("[kernel] pid %d not in the PID hash in %s\n", p->pid,
@@ -554,8 +591,8 @@ static void __proc_free(struct kref *kref)
 
 	atomic_dec(&num_envs);
 
-	/* Dealloc the struct proc */
-	kmem_cache_free(proc_cache, p);
+	/* Dealloc the struct proc, once pid2proc() readers are done with it */
+	call_rcu(&p->rcu, __proc_free_rcu);
 }
 
 /* Whether or not actor can control target.  TODO: do something reasonable here.
@@ -646,6 +683,7 @@ void proc_run_s(struct proc *p)
 			__map_vcore(p, 0, coreid);
 			vcore_account_online(p, 0);
 			__seq_end_write(&p->procinfo->coremap_seqctr);
+			sched_trace(SCHED_TR_SCP_RUN, coreid, p->pid, 0, 0);
 			/* incref, since we're saving a reference in owning proc later */
 			proc_incref(p, 1);
 			/* lock was protecting the state and VC mapping, not pcpui stuff */
@@ -690,32 +728,44 @@ void proc_run_s(struct proc *p)
 	}
 }
 
+/* How many preempt messages __send_bulkp_events() posts at a time */
+#define BULKP_EV_BATCH			32
+
 /* Helper: sends preempt messages to all vcores on the bulk preempt list, and
  * moves them to the inactive list. */
 static void __send_bulkp_events(struct proc *p)
 {
 	struct vcore *vc_i, *vc_temp;
-	struct event_msg preempt_msg = {0};
+	struct event_msg preempt_msgs[BULKP_EV_BATCH] = {{0}};
+	unsigned int nr_msgs = 0;
 	/* Whenever we send msgs with the proc locked, we need at least 1 online */
 	assert(!TAILQ_EMPTY(&p->online_vcs));
 	/* Send preempt messages for any left on the BP list.  No need to set any
 	 * flags, it all was done on the real preempt.  Now we're just telling the
-	 * process about any that didn't get restarted and are still preempted. */
+	 * process about any that didn't get restarted and are still preempted.
+	 *
+	 * We post the messages in batches, so the process gets one alert per
+	 * batch instead of one per vcore. */
 	TAILQ_FOREACH_SAFE(vc_i, &p->bulk_preempted_vcs, list, vc_temp) {
+		preempt_msgs[nr_msgs].ev_type = EV_VCORE_PREEMPT;
+		/* arg2 is 32 bits */
+		preempt_msgs[nr_msgs].ev_arg2 = vcore2vcoreid(p, vc_i);
 		/* Note that if there are no active vcores, send_k_e will post to our
 		 * own vcore, the last of which will be put on the inactive list and be
 		 * the first to be started.  We could have issues with deadlocking,
 		 * since send_k_e() could grab the proclock (if there are no active
 		 * vcores) */
-		preempt_msg.ev_type = EV_VCORE_PREEMPT;
-		preempt_msg.ev_arg2 = vcore2vcoreid(p, vc_i);	/* arg2 is 32 bits */
-		send_kernel_event(p, &preempt_msg, 0);
+		if (++nr_msgs == BULKP_EV_BATCH) {
+			send_kernel_event_batch(p, preempt_msgs, nr_msgs, 0);
+			nr_msgs = 0;
+		}
 		/* TODO: we may want a TAILQ_CONCAT_HEAD, or something that does that.
 		 * We need a loop for the messages, but not necessarily for the list
 		 * changes.  */
 		TAILQ_REMOVE(&p->bulk_preempted_vcs, vc_i, list);
 		TAILQ_INSERT_HEAD(&p->inactive_vcs, vc_i, list);
 	}
+	send_kernel_event_batch(p, preempt_msgs, nr_msgs, 0);
 }
 
 /* Run an _M.  Can be called safely on one that is already running.  Hold the
@@ -730,6 +780,7 @@ static void __send_bulkp_events(struct proc *p)
 void __proc_run_m(struct proc *p)
 {
 	struct vcore *vc_i;
+	struct kmsg_batch kb;
 	switch (p->state) {
 		case (PROC_WAITING):
 		case (PROC_DYING):
@@ -748,13 +799,14 @@ void __proc_run_m(struct proc *p)
 				proc_incref(p, p->procinfo->num_vcores * 2);
 				/* Send kernel messages to all online vcores (which were added
 				 * to the list and mapped in __proc_give_cores()), making them
-				 * turn online */
+				 * turn online.  They all get woken with one batch of IPIs. */
+				kmsg_batch_init(&kb);
 				TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-					send_kernel_message(vc_i->pcoreid, __startcore, (long)p,
-					                    (long)vcore2vcoreid(p, vc_i),
-					                    (long)vc_i->nr_preempts_sent,
-					                    KMSG_ROUTINE);
+					kmsg_batch_add(&kb, vc_i->pcoreid, __startcore, (long)p,
+					               (long)vcore2vcoreid(p, vc_i),
+					               (long)vc_i->nr_preempts_sent, KMSG_ROUTINE);
 				}
+				kmsg_batch_send(&kb);
 			} else {
 				warn("Tried to proc_run() an _M with no vcores!");
 			}
@@ -810,6 +862,7 @@ void proc_restartcore(void)
 
 	assert(!pcpui->cur_kthread->sysc);
 	process_routine_kmsg();
+	rcu_report_qs();
 	/* If there is no owning process, just idle, since we don't know what to do.
 	 * This could be because the process had been restarted a long time ago and
 	 * has since left the core, or due to a KMSG like __preempt or __death. */
@@ -1001,6 +1054,7 @@ int proc_change_to_m(struct proc *p)
 			__unmap_vcore(p, 0);
 			vcore_account_offline(p, 0);
 			__seq_end_write(&p->procinfo->coremap_seqctr);
+			sched_trace(SCHED_TR_SCP_STOP, core_id(), p->pid, 0, 0);
 			/* change to runnable_m (it's TF is already saved) */
 			__proc_set_state(p, PROC_RUNNABLE_M);
 			p->procinfo->is_mcp = TRUE;
@@ -1130,6 +1184,7 @@ void __proc_save_context_s(struct proc *p)
 	__unmap_vcore(p, 0);
 	__seq_end_write(&p->procinfo->coremap_seqctr);
 	vcore_account_offline(p, 0);
+	sched_trace(SCHED_TR_SCP_STOP, core_id(), p->pid, 0, 0);
 }
 
 /* Yields the calling core.  Must be called locally (not async) for now.
@@ -1280,6 +1335,7 @@ void proc_yield(struct proc *p, bool being_nice)
 	p->procinfo->res_grant[RES_CORES] = p->procinfo->num_vcores;
 	__seq_end_write(&p->procinfo->coremap_seqctr);
 	vcore_account_offline(p, vcoreid);
+	sched_trace(SCHED_TR_VC_YIELD, pcoreid, p->pid, vcoreid, 0);
 	/* No more vcores?  Then we wait on an event */
 	if (p->procinfo->num_vcores == 0) {
 		/* consider a ksched op to tell it about us WAITING */
@@ -1421,6 +1477,8 @@ void __proc_preempt_warn(struct proc *p, uint32_t vcoreid, uint64_t when)
 	/* danger with doing this unlocked: preempt_pending is set, but never 0'd,
 	 * since it is unmapped and not dealt with (TODO)*/
 	p->procinfo->vcoremap[vcoreid].preempt_pending = when;
+	sched_trace(SCHED_TR_PREEMPT_WARN, get_pcoreid(p, vcoreid), p->pid, vcoreid,
+	            when);
 
 	/* Send the event (which internally checks to see how they want it) */
 	local_msg.ev_type = EV_PREEMPT_PENDING;
@@ -1506,6 +1564,44 @@ bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec)
 	return retval;
 }
 
+/* Warns p that it will lose pcoreid in usec, without preempting.  The caller
+ * preempts later if p doesn't yield the core by then.  Returns TRUE if the core
+ * belonged to the proc (and thus was warned). */
+bool proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t usec)
+{
+	uint64_t warn_time = read_tsc() + usec2tsc(usec);
+	bool retval = FALSE;
+
+	spin_lock(&p->proc_lock);
+	if ((p->state == PROC_RUNNING_M) && is_mapped_vcore(p, pcoreid)) {
+		__proc_preempt_warn(p, get_vcoreid(p, pcoreid), warn_time);
+		retval = TRUE;
+	}
+	spin_unlock(&p->proc_lock);
+	return retval;
+}
+
+#ifdef CONFIG_PREEMPT_WARN_CTL
+/* Warns p that it will lose vcoreid in usec, like proc_preempt_warn_core().
+ * Nothing preempts the vcore afterwards; this is for testing how quickly p
+ * yields.  Returns TRUE if the vcore was mapped (and thus was warned). */
+bool proc_preempt_warn_vcore(struct proc *p, uint32_t vcoreid, uint64_t usec)
+{
+	uint64_t warn_time = read_tsc() + usec2tsc(usec);
+	bool retval = FALSE;
+
+	if (vcoreid >= MAX_NUM_CORES)
+		return FALSE;
+	spin_lock(&p->proc_lock);
+	if ((p->state == PROC_RUNNING_M) && vcore_is_mapped(p, vcoreid)) {
+		__proc_preempt_warn(p, vcoreid, warn_time);
+		retval = TRUE;
+	}
+	spin_unlock(&p->proc_lock);
+	return retval;
+}
+#endif /* CONFIG_PREEMPT_WARN_CTL */
+
 /* Warns and preempts all from p.  No delaying / alarming, or anything.  The
  * warning will be for u usec from now. */
 void proc_preempt_all(struct proc *p, uint64_t usec)
@@ -1591,6 +1687,7 @@ static bool __proc_give_a_pcore(struct proc *p, uint32_t pcore,
 	TAILQ_REMOVE(vc_list, new_vc, list);
 	TAILQ_INSERT_TAIL(&p->online_vcs, new_vc, list);
 	__map_vcore(p, vcore2vcoreid(p, new_vc), pcore);
+	sched_trace(SCHED_TR_GRANT, pcore, p->pid, vcore2vcoreid(p, new_vc), 0);
 	if (vc)
 		*vc = new_vc;
 	return TRUE;
@@ -1620,19 +1717,23 @@ static void __proc_give_cores_running(struct proc *p, uint32_t *pc_arr,
                                       uint32_t num)
 {
 	struct vcore *vc_i;
+	struct kmsg_batch kb;
 	/* Up the refcnt, since num cores are going to start using this
 	 * process and have it loaded in their owning_proc and 'current'. */
 	proc_incref(p, num * 2);	/* keep in sync with __startcore */
+	kmsg_batch_init(&kb);
 	__seq_start_write(&p->procinfo->coremap_seqctr);
 	p->procinfo->num_vcores += num;
 	assert(TAILQ_EMPTY(&p->bulk_preempted_vcs));
 	for (int i = 0; i < num; i++) {
 		assert(__proc_give_a_pcore(p, pc_arr[i], &p->inactive_vcs, &vc_i));
-		send_kernel_message(pc_arr[i], __startcore, (long)p,
-		                    (long)vcore2vcoreid(p, vc_i),
-		                    (long)vc_i->nr_preempts_sent, KMSG_ROUTINE);
+		kmsg_batch_add(&kb, pc_arr[i], __startcore, (long)p,
+		               (long)vcore2vcoreid(p, vc_i),
+		               (long)vc_i->nr_preempts_sent, KMSG_ROUTINE);
 	}
 	__seq_end_write(&p->procinfo->coremap_seqctr);
+	/* One multicast IPI wakes all of the new cores */
+	kmsg_batch_send(&kb);
 }
 
 /* Gives process p the additional num cores listed in pcorelist.  If the proc is
@@ -1736,6 +1837,7 @@ void __proc_take_corelist(struct proc *p, uint32_t *pc_arr, uint32_t num,
 		if (p->state == PROC_RUNNING_M)
 			__proc_revoke_core(p, vcoreid, preempt);
 		__unmap_vcore(p, vcoreid);
+		sched_trace(SCHED_TR_REVOKE, pc_arr[i], p->pid, vcoreid, preempt);
 		/* Change lists for the vcore.  Note, the vcore is already unmapped
 		 * and/or the messages are already in flight.  The only code that looks
 		 * at the lists without holding the lock is event code. */
@@ -1774,6 +1876,8 @@ uint32_t __proc_take_allcores(struct proc *p, uint32_t *pc_arr, bool preempt)
 	TAILQ_FOREACH_SAFE(vc_i, &p->online_vcs, list, vc_temp) {
 		/* TODO: we may want a TAILQ_CONCAT_HEAD, or something that does that */
 		TAILQ_REMOVE(&p->online_vcs, vc_i, list);
+		sched_trace(SCHED_TR_REVOKE, vc_i->pcoreid, p->pid,
+		            vcore2vcoreid(p, vc_i), preempt);
 		/* Put the cores on the appropriate list */
 		if (preempt)
 			TAILQ_INSERT_HEAD(&p->bulk_preempted_vcs, vc_i, list);
@@ -2111,6 +2215,8 @@ int proc_change_to_vcore(struct proc *p, uint32_t new_vcoreid,
 	__map_vcore(p, new_vcoreid, pcoreid);
 	__seq_end_write(&p->procinfo->coremap_seqctr);
 	vcore_account_offline(p, caller_vcoreid);
+	sched_trace(SCHED_TR_VC_YIELD, pcoreid, p->pid, caller_vcoreid, 0);
+	sched_trace(SCHED_TR_GRANT, pcoreid, p->pid, new_vcoreid, 0);
 	/* Send either a PREEMPT msg or a CHECK_MSGS msg.  If they said to
 	 * enable_my_notif, then all userspace needs is to check messages, not a
 	 * full preemption recovery. */
@@ -2140,6 +2246,100 @@ out_locked:
 	return retval;
 }
 
+/* Directed yield: the calling vcore yields, and gives its pcore straight to
+ * new_vcoreid, which must be unmapped (fresh or preempted).  Unlike a yield,
+ * the pcore never goes back to the ksched, so the process keeps its core count
+ * and amt_wanted doesn't matter.  Unlike change_to, the caller is not left
+ * looking preempted: it restarts fresh at vcore_entry() the next time it is
+ * started, and no one needs to recover it.
+ *
+ * Will return (if it returns at all; on success the caller is gone):
+ * 		-EBUSY if the target vcore is already mapped
+ * 		-EAGAIN if we failed for some other reason and need to try again, such
+ * 		as the caller having a notif_pending or being preempted.
+ * 		-ECANCELED if our pcore is being taken from us.  Yield it instead.
+ * 		-EINVAL some userspace bug */
+int proc_handoff_vcore(struct proc *p, uint32_t new_vcoreid)
+{
+	uint32_t caller_vcoreid, pcoreid = core_id();
+	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
+	struct preempt_data *caller_vcpd;
+	struct vcore *caller_vc, *new_vc;
+	int retval = -EAGAIN;
+
+	if (new_vcoreid >= p->procinfo->max_vcores)
+		return -EINVAL;
+	spin_lock(&p->proc_lock);
+	if (vcore_is_mapped(p, new_vcoreid)) {
+		retval = -EBUSY;
+		goto out_locked;
+	}
+	/* Same deal as change_to: only RUNNING_M can move vcores around */
+	switch (p->state) {
+		case (PROC_RUNNING_M):
+			break;
+		case (PROC_RUNNING_S):
+		case (PROC_DYING):
+		case (PROC_DYING_ABORT):
+		case (PROC_RUNNABLE_M):
+			goto out_locked;
+		default:
+			panic("Weird state(%s) in %s()", procstate2str(p->state),
+			      __FUNCTION__);
+	}
+	caller_vcoreid = pcpui->owning_vcoreid;
+	caller_vc = vcoreid2vcore(p, caller_vcoreid);
+	caller_vcpd = &p->procdata->vcore_preempt_data[caller_vcoreid];
+	if (caller_vc->nr_preempts_sent != caller_vc->nr_preempts_done)
+		goto out_locked;
+	assert(is_mapped_vcore(p, pcoreid));
+	assert(caller_vcoreid == get_vcoreid(p, pcoreid));
+	if (!caller_vcpd->notif_disabled) {
+		retval = -EINVAL;
+		printk("[kernel] You tried to hand off a vcore from uthread ctx\n");
+		goto out_locked;
+	}
+	/* The ksched warned us it wants this pcore back.  Handing it off would
+	 * just get the new vcore preempted. */
+	if (caller_vc->preempt_pending) {
+		retval = -ECANCELED;
+		goto out_locked;
+	}
+	/* Like a yield, we can't leave with a message pending.  Once we're off the
+	 * online list, new messages will go to the other vcores, including the new
+	 * one. */
+	TAILQ_REMOVE(&p->online_vcs, caller_vc, list);
+	wrmb();	/* prev write must hit before reading notif_pending */
+	if (caller_vcpd->notif_pending) {
+		TAILQ_INSERT_TAIL(&p->online_vcs, caller_vc, list);
+		goto out_locked;
+	}
+	TAILQ_INSERT_HEAD(&p->inactive_vcs, caller_vc, list);
+	new_vc = vcoreid2vcore(p, new_vcoreid);
+	TAILQ_REMOVE(&p->inactive_vcs, new_vc, list);
+	TAILQ_INSERT_TAIL(&p->online_vcs, new_vc, list);
+	/* Next time the caller starts, it starts fresh */
+	caller_vcpd->notif_disabled = FALSE;
+	arch_finalize_ctx(pcpui->cur_ctx);
+	__seq_start_write(&p->procinfo->coremap_seqctr);
+	__unmap_vcore(p, caller_vcoreid);
+	__map_vcore(p, new_vcoreid, pcoreid);
+	__seq_end_write(&p->procinfo->coremap_seqctr);
+	vcore_account_offline(p, caller_vcoreid);
+	sched_trace(SCHED_TR_VC_YIELD, pcoreid, p->pid, caller_vcoreid, 0);
+	sched_trace(SCHED_TR_GRANT, pcoreid, p->pid, new_vcoreid, 0);
+	/* Same as change_to: the core is still ours, and __set_curctx loads the new
+	 * vcore once any __preempt for it has finished. */
+	pcpui->owning_vcoreid = new_vcoreid;
+	pcpui->cur_ctx = 0;
+	send_kernel_message(pcoreid, __set_curctx, (long)p, (long)new_vcoreid,
+	                    (long)new_vc->nr_preempts_sent, KMSG_ROUTINE);
+	retval = 0;
+out_locked:
+	spin_unlock(&p->proc_lock);
+	return retval;
+}
+
 /* Kernel message handler to start a process's context on this core, when the
  * core next considers running a process.  Tightly coupled with __proc_run_m().
  * Interrupts are disabled. */
@@ -2172,6 +2372,7 @@ void __startcore(uint32_t srcid, long a0, long a1, long a2)
 	/* Now that we sorted refcnts and know p / which vcore it should be, set up
 	 * pcpui->cur_ctx so that it will run that particular vcore */
 	__set_curctx_to_vcoreid(p_to_run, vcoreid, old_nr_preempts_sent);
+	sched_trace(SCHED_TR_VC_START, coreid, p_to_run->pid, vcoreid, 0);
 }
 
 /* Kernel message handler to load a proc's vcore context on this core.  Similar
@@ -2184,6 +2385,7 @@ void __set_curctx(uint32_t srcid, long a0, long a1, long a2)
 	uint32_t vcoreid = (uint32_t)a1;
 	uint32_t old_nr_preempts_sent = (uint32_t)a2;
 	__set_curctx_to_vcoreid(p, vcoreid, old_nr_preempts_sent);
+	sched_trace(SCHED_TR_VC_START, core_id(), p->pid, vcoreid, 0);
 }
 
 /* Bail out if it's the wrong process, or if they no longer want a notif.  Try
@@ -2215,6 +2417,7 @@ void __notify(uint32_t srcid, long a0, long a1, long a2)
 	if (vcpd->notif_disabled)
 		return;
 	vcpd->notif_disabled = TRUE;
+	sched_trace(SCHED_TR_NOTIFY, coreid, p->pid, vcoreid, 0);
 	/* save the old ctx in the uthread slot, build and pop a new one.  Note that
 	 * silly state isn't our business for a notification. */
 	copy_current_ctx_to(&vcpd->uthread_ctx);
@@ -2267,6 +2470,7 @@ void __preempt(uint32_t srcid, long a0, long a1, long a2)
 	/* either __preempt or proc_yield() ends the preempt phase. */
 	p->procinfo->vcoremap[vcoreid].preempt_pending = 0;
 	vcore_account_offline(p, vcoreid);
+	sched_trace(SCHED_TR_VC_PREEMPT, coreid, p->pid, vcoreid, 0);
 	wmb();	/* make sure everything else hits before we finish the preempt */
 	/* up the nr_done, which signals the next __startcore for this vc */
 	p->procinfo->vcoremap[vcoreid].nr_preempts_done++;
@@ -2290,6 +2494,7 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
 		printd("[kernel] death on physical core %d for process %d's vcore %d\n",
 		       coreid, p->pid, vcoreid);
 		vcore_account_offline(p, vcoreid);	/* in case anyone is counting */
+		sched_trace(SCHED_TR_VC_DEATH, coreid, p->pid, vcoreid, 0);
 		/* We won't restart the process later.  current gets cleared later when
 		 * we notice there is no owning_proc and we have nothing to do
 		 * (smp_idle, restartcore, etc). */
@@ -2324,9 +2529,7 @@ void print_allpids(void)
 	printk("     PID Name %-*s State      Parent    \n",
 	       PROC_PROGNAME_SZ - 5, "");
 	printk("------------------------------%s\n", dashes);
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, print_proc_state, NULL);
-	spin_unlock(&pid_hash_lock);
+	pid_for_each(print_proc_state, NULL);
 }
 
 void proc_get_set(struct process_set *pset)
@@ -2357,9 +2560,7 @@ void proc_get_set(struct process_set *pset)
 		if (!pset->procs)
 			error(-ENOMEM, ERROR_FIXME);
 
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, enum_proc, pset);
-		spin_unlock(&pid_hash_lock);
+		pid_for_each(enum_proc, pset);
 
 	} while (pset->num_processes == pset->size);
 }
@@ -2464,7 +2665,7 @@ void check_my_owner(void)
 			if (vc_i->pcoreid == core_id()) {
 				/* Immediate message was sent, we should get it when we enable
 				 * interrupts, which should cause us to skip cpu_halt() */
-				if (!STAILQ_EMPTY(&pcpui->immed_amsgs))
+				if (!kmsg_queue_empty(&pcpui->immed_amsgs))
 					continue;
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
@@ -2477,8 +2678,6 @@ void check_my_owner(void)
 	}
 	assert(!irq_is_enabled());
 	if (!booting && !pcpui->owning_proc) {
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, shazbot, NULL);
-		spin_unlock(&pid_hash_lock);
+		pid_for_each(shazbot, NULL);
 	}
 }
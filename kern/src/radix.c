@@ -2,7 +2,8 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Radix Trees!  Just the basics, doesn't do tagging or anything fancy. */
+ * Radix Trees!  Lockless lookups, gang lookups, and tags.  See radix.h for the
+ * rules on concurrency. */
 
 #include <ros/errno.h>
 #include <radix.h>
@@ -10,11 +11,13 @@
 #include <string.h>
 #include <stdio.h>
 
+#define RNODE_MASK (NR_RNODE_SLOTS - 1)
+#define BITS_PER_TAG_LONG (sizeof(unsigned long) * 8)
+
 struct kmem_cache *radix_kcache;
 static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
                                               unsigned long key,
                                               bool extend);
-static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot);
 
 /* Initializes the radix tree system, mostly just builds the kcache */
 void radix_init(void)
@@ -28,20 +31,105 @@ void radix_init(void)
 /* Initializes a tree dynamically */
 void radix_tree_init(struct radix_tree *tree)
 {
+	tree->seq = SEQCTR_INITIALIZER;
 	tree->root = 0;
 	tree->depth = 0;
 	tree->upper_bound = 0;
 }
 
-/* Will clean up all the memory associated with a tree.  Shouldn't be necessary
- * if you delete all of the items, which you should do anyways since they are
- * usually void*.  Might expand this to have a function to call on every leaf
- * slot. */
+static void __radix_free_node(struct radix_node *r_node)
+{
+	if (!r_node->leaf) {
+		for (int i = 0; i < NR_RNODE_SLOTS; i++) {
+			if (r_node->items[i])
+				__radix_free_node(r_node->items[i]);
+		}
+	}
+	kmem_cache_free(radix_kcache, r_node);
+}
+
+/* Will clean up all the memory associated with a tree.  Any items still in the
+ * tree are the caller's problem (they are usually void*), so delete them first.
+ * There must not be any lockless readers. */
 void radix_tree_destroy(struct radix_tree *tree)
 {
-	/* Currently, we may have a root node, even if all the elements were removed
-	 */
-	panic("Not implemented");
+	if (tree->root)
+		__radix_free_node(tree->root);
+	radix_tree_init(tree);
+}
+
+/* Tag helpers.  Tags are only changed by the (single) writer. */
+static bool __tag_get(struct radix_node *r_node, int tag, int idx)
+{
+	return r_node->tags[tag][idx / BITS_PER_TAG_LONG] &
+	       (1UL << (idx % BITS_PER_TAG_LONG));
+}
+
+static void __tag_set(struct radix_node *r_node, int tag, int idx)
+{
+	r_node->tags[tag][idx / BITS_PER_TAG_LONG] |=
+	       1UL << (idx % BITS_PER_TAG_LONG);
+}
+
+static void __tag_clear(struct radix_node *r_node, int tag, int idx)
+{
+	r_node->tags[tag][idx / BITS_PER_TAG_LONG] &=
+	       ~(1UL << (idx % BITS_PER_TAG_LONG));
+}
+
+static bool __tag_any(struct radix_node *r_node, int tag)
+{
+	for (int i = 0; i < RNODE_TAG_LONGS; i++) {
+		if (r_node->tags[tag][i])
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Returns r_node's index in its parent's items */
+static int __node_offset(struct radix_node *r_node)
+{
+	return (void**)r_node->my_slot - r_node->parent->items;
+}
+
+/* Sets tag for idx in r_node, and for r_node in all of its ancestors. */
+static void __tag_set_path(struct radix_node *r_node, int idx, int tag)
+{
+	while (!__tag_get(r_node, tag, idx)) {
+		__tag_set(r_node, tag, idx);
+		if (!r_node->parent)
+			break;
+		idx = __node_offset(r_node);
+		r_node = r_node->parent;
+	}
+}
+
+/* Clears tag for idx in r_node, and for any ancestors that no longer have any
+ * items with the tag. */
+static void __tag_clear_path(struct radix_node *r_node, int idx, int tag)
+{
+	__tag_clear(r_node, tag, idx);
+	while (!__tag_any(r_node, tag) && r_node->parent) {
+		idx = __node_offset(r_node);
+		r_node = r_node->parent;
+		__tag_clear(r_node, tag, idx);
+	}
+}
+
+static unsigned long __radix_bound(unsigned int depth)
+{
+	if (LOG_RNODE_SLOTS * depth >= sizeof(unsigned long) * 8)
+		return ~0UL;
+	return 1UL << (LOG_RNODE_SLOTS * depth);
+}
+
+static struct radix_node *__radix_new_node(void)
+{
+	struct radix_node *r_node = kmem_cache_alloc(radix_kcache, 0);
+
+	if (r_node)
+		memset(r_node, 0, sizeof(struct radix_node));
+	return r_node;
 }
 
 /* Attempts to insert an item in the tree at the given key.  ENOMEM if we ran
@@ -56,13 +144,16 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 	/* Is the tree tall enough?  if not, it needs to grow a level.  This will
 	 * also create the initial node (upper bound starts at 0). */
 	while (key >= tree->upper_bound) {
-		r_node = kmem_cache_alloc(radix_kcache, 0);
+		r_node = __radix_new_node();
 		if (!r_node)
 			return -ENOMEM;
-		memset(r_node, 0, sizeof(struct radix_node));
 		if (tree->root) {
 			/* tree->root is the old root, now a child of the future root */
 			r_node->items[0] = tree->root;
+			for (int i = 0; i < RADIX_NR_TAGS; i++) {
+				if (__tag_any(tree->root, i))
+					__tag_set(r_node, i, 0);
+			}
 			tree->root->parent = r_node;
 			tree->root->my_slot = (struct radix_node**)&r_node->items[0];
 			r_node->num_items = 1;
@@ -71,61 +162,76 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 			r_node->leaf = TRUE;
 			r_node->parent = 0;
 		}
-		tree->root = r_node;
 		r_node->my_slot = &tree->root;
+		/* Lockless readers need to see the root and depth change together */
+		__seq_start_write(&tree->seq);
+		tree->root = r_node;
 		tree->depth++;
-		tree->upper_bound = 1ULL << (LOG_RNODE_SLOTS * tree->depth);
+		tree->upper_bound = __radix_bound(tree->depth);
+		__seq_end_write(&tree->seq);
 	}
 	assert(tree->root);
 	/* the tree now thinks it is tall enough, so find the last node, insert in
 	 * it, etc */
 	r_node = __radix_lookup_node(tree, key, TRUE);
-	assert(r_node);		/* we want an ENOMEM actually, but i want to see this */
-	slot = &r_node->items[key & (NR_RNODE_SLOTS - 1)];
+	if (!r_node)
+		return -ENOMEM;
+	slot = &r_node->items[key & RNODE_MASK];
 	if (*slot)
 		return -EEXIST;
-	*slot = item;
+	/* Lockless readers need to see an initialized item */
+	wmb();
+	ACCESS_ONCE(*slot) = item;
 	r_node->num_items++;
 	if (slot_p)
 		*slot_p = slot;
 	return 0;
 }
 
-/* Removes an item from it's parent's structure, freeing the parent if there is
- * nothing left, potentially recursively. */
-static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot)
-{
-	assert(*slot);		/* make sure there is something there */
-	*slot = 0;
-	r_node->num_items--;
-	/* this check excludes the root, but the if else handles it.  For now, once
-	 * we have a root, we'll always keep it (will need some changing in
-	 * radix_insert() */
-	if (!r_node->num_items && r_node->parent) {
-		if (r_node->parent)
-			__radix_remove_slot(r_node->parent, r_node->my_slot);
-		else			/* we're the last node, attached to the actual tree */
-			*(r_node->my_slot) = 0;
-		kmem_cache_free(radix_kcache, r_node);
+static void __radix_free_node_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(radix_kcache, container_of(head, struct radix_node, rcu));
+}
+
+/* Unlinks r_node, which has no items, and any of its ancestors that are left
+ * empty.  The root stays, even if it is empty.  Lockless readers could still be
+ * looking at the nodes, so they are freed after a grace period.  Since a node's
+ * tags are cleared along with its last item, there are no tags to fix up. */
+static void __radix_prune(struct radix_node *r_node)
+{
+	struct radix_node *parent;
+
+	while (!r_node->num_items && r_node->parent) {
+		parent = r_node->parent;
+		ACCESS_ONCE(*r_node->my_slot) = 0;
+		parent->num_items--;
+		call_rcu(&r_node->rcu, __radix_free_node_rcu);
+		r_node = parent;
 	}
 }
 
-/* Removes a key/item from the tree, returning that item (the void*).  If it
- * detects a radix_node is now unused, it will dealloc that node.  Though the
- * tree will still think it is tall enough to handle its old upper_bound.  It
- * won't "shrink". */
+/* Removes a key/item from the tree, returning that item (the void*).  Any tags
+ * on the item are cleared, and any nodes left empty are pruned.  The tree won't
+ * "shrink" in depth. */
 void *radix_delete(struct radix_tree *tree, unsigned long key)
 {
 	printd("RADIX: delete %d\n", key);
 	void **slot;
 	void *retval;
+	int idx = key & RNODE_MASK;
 	struct radix_node *r_node = __radix_lookup_node(tree, key, 0);
 	if (!r_node)
 		return 0;
-	slot = &r_node->items[key & (NR_RNODE_SLOTS - 1)];
+	slot = &r_node->items[idx];
 	retval = *slot;
 	if (retval) {
-		__radix_remove_slot(r_node, (struct radix_node**)slot);
+		for (int i = 0; i < RADIX_NR_TAGS; i++) {
+			if (__tag_get(r_node, i, idx))
+				__tag_clear_path(r_node, idx, i);
+		}
+		ACCESS_ONCE(*slot) = 0;
+		r_node->num_items--;
+		__radix_prune(r_node);
 	} else {
 		/* it's okay to delete an empty, but i want to know about it for now */
 		warn("Tried to remove a non-existant item from a radix tree!");
@@ -137,10 +243,15 @@ void *radix_delete(struct radix_tree *tree, unsigned long key)
 void *radix_lookup(struct radix_tree *tree, unsigned long key)
 {
 	printd("RADIX: lookup %d\n", key);
-	void **slot = radix_lookup_slot(tree, key);
-	if (!slot)
-		return 0;
-	return *slot;
+	void **slot;
+	void *item = 0;
+
+	rcu_read_lock();
+	slot = radix_lookup_slot(tree, key);
+	if (slot)
+		item = ACCESS_ONCE(*slot);
+	rcu_read_unlock();
+	return item;
 }
 
 /* Returns a pointer to the radix_node holding a given key.  0 if there is no
@@ -151,65 +262,161 @@ void *radix_lookup(struct radix_tree *tree, unsigned long key)
  * ......444444333333222222111111
  *
  * If an interior node of the tree is missing, this will add one if it was
- * directed to extend the tree. */
+ * directed to extend the tree.  Only the writer can extend.  Lockless readers
+ * need to check the tree's seq ctr, since the root and depth could change. */
 static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
                                               unsigned long key, bool extend)
 {
 	printd("RADIX: lookup_node %d, %d\n", key, extend);
 	unsigned long idx;
-	struct radix_node *child_node, *r_node = tree->root;
-	if (key	>= tree->upper_bound) {
+	struct radix_node *child_node, *r_node = ACCESS_ONCE(tree->root);
+	unsigned int depth = ACCESS_ONCE(tree->depth);
+
+	if (key >= ACCESS_ONCE(tree->upper_bound) || !r_node) {
 		if (extend)
 			warn("Bound (%d) not set for key %d!\n", tree->upper_bound, key);
 		return 0;
 	}
-	for (int i = tree->depth; i > 1; i--) {	 /* i = ..., 4, 3, 2 */
-		idx = (key >> (LOG_RNODE_SLOTS * (i - 1))) & (NR_RNODE_SLOTS - 1);
+	for (int i = depth; i > 1; i--) {	 /* i = ..., 4, 3, 2 */
+		idx = (key >> (LOG_RNODE_SLOTS * (i - 1))) & RNODE_MASK;
+		child_node = ACCESS_ONCE(r_node->items[idx]);
 		/* There might not be a node at this part of the tree */
-		if (!r_node->items[idx]) {
-			if (!extend) {
+		if (!child_node) {
+			if (!extend)
 				return 0;
-			} else {
-				/* so build one, possibly returning 0 if we couldn't */
-				child_node = kmem_cache_alloc(radix_kcache, 0);
-				if (!child_node)
-					return 0;
-				r_node->items[idx] = child_node;
-				memset(child_node, 0, sizeof(struct radix_node));
-				/* when we are on the last iteration (i == 2), the child will be
-				 * a leaf. */
-				child_node->leaf = (i == 2) ? TRUE : FALSE;
-				child_node->parent = r_node;
-				child_node->my_slot = (struct radix_node**)&r_node->items[idx];
-				r_node->num_items++;
-				r_node = (struct radix_node*)r_node->items[idx];
-			}
-		} else {
-			r_node = (struct radix_node*)r_node->items[idx];
+			/* so build one, possibly returning 0 if we couldn't */
+			child_node = __radix_new_node();
+			if (!child_node)
+				return 0;
+			/* when we are on the last iteration (i == 2), the child will be
+			 * a leaf. */
+			child_node->leaf = (i == 2) ? TRUE : FALSE;
+			child_node->parent = r_node;
+			child_node->my_slot = (struct radix_node**)&r_node->items[idx];
+			/* Lockless readers need to see an initialized node */
+			wmb();
+			ACCESS_ONCE(r_node->items[idx]) = child_node;
+			r_node->num_items++;
 		}
+		r_node = child_node;
 	}
 	return r_node;
 }
 
 /* Returns a pointer to the slot for the given key.  0 if there is no such slot,
- * etc */
+ * etc.  Lockless callers must be in an RCU read-side critical section for as
+ * long as they use the slot, since its node could be pruned. */
 void **radix_lookup_slot(struct radix_tree *tree, unsigned long key)
 {
 	printd("RADIX: lookup slot %d\n", key);
-	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	struct radix_node *r_node;
+	seq_ctr_t seq;
+
+	rcu_read_lock();
+	do {
+		seq = ACCESS_ONCE(tree->seq);
+		rmb();
+		r_node = __radix_lookup_node(tree, key, FALSE);
+	} while (seqctr_retry(seq, ACCESS_ONCE(tree->seq)));
+	rcu_read_unlock();
 	if (!r_node)
 		return 0;
-	key = key & (NR_RNODE_SLOTS - 1);
-	return &r_node->items[key];
+	return &r_node->items[key & RNODE_MASK];
+}
+
+struct gang_lookup {
+	void						**items;
+	void						***slots;
+	unsigned long				*keys;
+	unsigned int				max_items;
+	unsigned int				nr_found;
+	int							tag;		/* -1 for all items */
+};
+
+/* Helper for gang lookups.  Collects items from r_node's subtree with keys >=
+ * first, in key order.  The node is at 'level', with 1 being the leaves, and
+ * its first key is 'base'.  Returns TRUE when we've found enough. */
+static bool __gang_lookup(struct radix_node *r_node, unsigned int level,
+                          unsigned long base, unsigned long first,
+                          struct gang_lookup *gl)
+{
+	unsigned int shift = LOG_RNODE_SLOTS * (level - 1);
+	unsigned long child_base;
+	void *child;
+	int idx = 0;
+
+	if (first > base)
+		idx = (first - base) >> shift;
+	for (/* idx set */; idx < NR_RNODE_SLOTS; idx++) {
+		if ((gl->tag >= 0) && !__tag_get(r_node, gl->tag, idx))
+			continue;
+		child = ACCESS_ONCE(r_node->items[idx]);
+		if (!child)
+			continue;
+		child_base = base + ((unsigned long)idx << shift);
+		if (level > 1) {
+			if (__gang_lookup(child, level - 1, child_base, first, gl))
+				return TRUE;
+			continue;
+		}
+		if (gl->items)
+			gl->items[gl->nr_found] = child;
+		if (gl->slots)
+			gl->slots[gl->nr_found] = &r_node->items[idx];
+		if (gl->keys)
+			gl->keys[gl->nr_found] = child_base;
+		if (++gl->nr_found == gl->max_items)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static int __radix_gang_lookup(struct radix_tree *tree, struct gang_lookup *gl,
+                               unsigned long first)
+{
+	struct radix_node *root;
+	unsigned int depth;
+	seq_ctr_t seq;
+
+	if (!gl->max_items)
+		return 0;
+	rcu_read_lock();
+	do {
+		seq = ACCESS_ONCE(tree->seq);
+		rmb();
+		gl->nr_found = 0;
+		root = ACCESS_ONCE(tree->root);
+		depth = ACCESS_ONCE(tree->depth);
+		if (root && (first < ACCESS_ONCE(tree->upper_bound)))
+			__gang_lookup(root, depth, 0, first, gl);
+	} while (seqctr_retry(seq, ACCESS_ONCE(tree->seq)));
+	rcu_read_unlock();
+	return gl->nr_found;
 }
 
+/* Finds up to max_items items with keys >= first, in key order.  Returns the
+ * number found. */
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	struct gang_lookup gl = {.items = results, .max_items = max_items,
+	                         .tag = -1};
+
+	return __radix_gang_lookup(tree, &gl, first);
 }
 
+/* Like radix_gang_lookup, but returns the slots and keys of the items.  keys
+ * can be 0.  Like radix_lookup_slot, lockless callers need to be in an RCU
+ * read-side critical section while they use the slots. */
+int radix_gang_lookup_slot(struct radix_tree *tree, void ***slots,
+                           unsigned long *keys, unsigned long first,
+                           unsigned int max_items)
+{
+	struct gang_lookup gl = {.slots = slots, .keys = keys,
+	                         .max_items = max_items, .tag = -1};
+
+	return __radix_gang_lookup(tree, &gl, first);
+}
 
 int radix_grow(struct radix_tree *tree, unsigned long max)
 {
@@ -223,36 +430,66 @@ int radix_preload(struct radix_tree *tree, int flags)
 	return -1; /* TODO! */
 }
 
-
+/* Tags the item at key.  Returns the item, or 0 if there was no item. */
 void *radix_tag_set(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	int idx = key & RNODE_MASK;
+
+	if (!r_node || !r_node->items[idx])
+		return 0;
+	__tag_set_path(r_node, idx, tag);
+	return r_node->items[idx];
 }
 
+/* Clears the tag for key.  Returns the item, or 0 if there was no item. */
 void *radix_tag_clear(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	int idx = key & RNODE_MASK;
+
+	if (!r_node || !r_node->items[idx])
+		return 0;
+	if (__tag_get(r_node, tag, idx))
+		__tag_clear_path(r_node, idx, tag);
+	return r_node->items[idx];
 }
 
 int radix_tag_get(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	int idx = key & RNODE_MASK;
+
+	if (!r_node || !r_node->items[idx])
+		return FALSE;
+	return __tag_get(r_node, tag, idx);
 }
 
+/* Returns TRUE if any item in the tree has tag. */
 int radix_tree_tagged(struct radix_tree *tree, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	return tree->root && __tag_any(tree->root, tag);
 }
 
+/* Finds up to max_items items with tag and keys >= first, in key order.
+ * Returns the number found. */
 int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
                           unsigned long first, unsigned int max_items, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	struct gang_lookup gl = {.items = results, .max_items = max_items,
+	                         .tag = tag};
+
+	return __radix_gang_lookup(tree, &gl, first);
+}
+
+int radix_tag_gang_lookup_slot(struct radix_tree *tree, void ***slots,
+                               unsigned long *keys, unsigned long first,
+                               unsigned int max_items, int tag)
+{
+	struct gang_lookup gl = {.slots = slots, .keys = keys,
+	                         .max_items = max_items, .tag = tag};
+
+	return __radix_gang_lookup(tree, &gl, first);
 }
 
 void print_radix_tree(struct radix_tree *tree)
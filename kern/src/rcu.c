@@ -0,0 +1,273 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Read-copy-update.  See rcu.h for the rules.
+ *
+ * There is one grace period (GP) in flight at a time, driven by the rcu_gp
+ * ktask.  When a core has callbacks, the ktask starts a GP: it takes every
+ * core's new callbacks, then bumps rcu_gp_num.  Cores report a quiescent state
+ * (QS) by copying rcu_gp_num into their gp_seen.  Once every core has seen the
+ * new GP, it is over, and each core runs its callbacks that were waiting on it.
+ *
+ * Cores that are halted or running userspace don't report on their own, so
+ * after a short wait, the ktask sends them a routine kernel message.  They'll
+ * run it from smp_idle() or on their way back to userspace, both of which are
+ * QSs. */
+
+#include <rcu.h>
+#include <percpu.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <smp.h>
+#include <trap.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* How long we wait for cores to report on their own before kicking them */
+#define RCU_GP_POLL_USEC		1000
+
+struct rcu_cb_list {
+	struct rcu_head				*head;
+	struct rcu_head				**tail;
+};
+
+struct rcu_pcpui {
+	spinlock_t					lock;
+	struct rcu_cb_list			next_cbs;	/* waiting for a GP to start */
+	struct rcu_cb_list			wait_cbs;	/* waiting for the current GP */
+	struct rcu_cb_list			done_cbs;	/* ready to run */
+	unsigned long				gp_seen;	/* last GP we had a QS in */
+	unsigned long				gp_kicked;	/* last GP we got kicked for */
+	unsigned long				nr_cbs_run;
+};
+
+static DEFINE_PERCPU(struct rcu_pcpui, rcu_pcpuis);
+
+static unsigned long rcu_gp_num;		/* the current or most recent GP */
+static unsigned long rcu_gp_completed;
+static unsigned long rcu_nr_kicks;
+static struct rendez rcu_gp_rv;
+static bool rcu_ready;
+
+static void cbl_init(struct rcu_cb_list *cbl)
+{
+	cbl->head = NULL;
+	cbl->tail = &cbl->head;
+}
+
+static bool cbl_empty(struct rcu_cb_list *cbl)
+{
+	return !cbl->head;
+}
+
+static void cbl_add(struct rcu_cb_list *cbl, struct rcu_head *head)
+{
+	head->next = NULL;
+	*cbl->tail = head;
+	cbl->tail = &head->next;
+}
+
+/* Moves all of from's callbacks to the end of to. */
+static void cbl_splice(struct rcu_cb_list *to, struct rcu_cb_list *from)
+{
+	if (cbl_empty(from))
+		return;
+	*to->tail = from->head;
+	to->tail = from->tail;
+	cbl_init(from);
+}
+
+/* Called when the calling core holds no RCU references, e.g. at the top of its
+ * stack.  Cheap when there is no GP waiting on us. */
+void rcu_report_qs(void)
+{
+	struct rcu_pcpui *rpi;
+	unsigned long gp;
+
+	if (!rcu_ready)
+		return;
+	rpi = PERCPU_VARPTR(rcu_pcpuis);
+	gp = ACCESS_ONCE(rcu_gp_num);
+	if (rpi->gp_seen == gp)
+		return;
+	/* Our reads from before the QS need to be done before the GP thread sees
+	 * our report.  Our reads after need to come after we saw the new GP. */
+	mb();
+	ACCESS_ONCE(rpi->gp_seen) = gp;
+}
+
+static void __rcu_kick_handler(uint32_t srcid, long a0, long a1, long a2)
+{
+	rcu_report_qs();
+}
+
+static void __rcu_do_callbacks(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct rcu_pcpui *rpi = PERCPU_VARPTR(rcu_pcpuis);
+	struct rcu_cb_list cbs;
+	struct rcu_head *head, *next;
+
+	cbl_init(&cbs);
+	spin_lock_irqsave(&rpi->lock);
+	cbl_splice(&cbs, &rpi->done_cbs);
+	spin_unlock_irqsave(&rpi->lock);
+	for (head = cbs.head; head; head = next) {
+		next = head->next;
+		head->func(head);
+		rpi->nr_cbs_run++;
+	}
+	rcu_report_qs();
+}
+
+/* Queues func to run on this core after a grace period.  Safe to call from IRQ
+ * context, though func will run from a routine kernel message. */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	struct rcu_pcpui *rpi;
+	bool was_empty;
+	int8_t irq_state = 0;
+
+	assert(rcu_ready);
+	head->func = func;
+	/* Disabling IRQs keeps us on this core, so we don't need PERCPU_VARPTR's
+	 * core_id() to stay the same across the lock. */
+	disable_irqsave(&irq_state);
+	rpi = PERCPU_VARPTR(rcu_pcpuis);
+	spin_lock(&rpi->lock);
+	was_empty = cbl_empty(&rpi->next_cbs);
+	cbl_add(&rpi->next_cbs, head);
+	spin_unlock(&rpi->lock);
+	enable_irqsave(&irq_state);
+	if (was_empty)
+		rendez_wakeup(&rcu_gp_rv);
+}
+
+struct sync_rcu {
+	struct rcu_head				head;
+	struct semaphore			sem;
+};
+
+static void __sync_rcu_cb(struct rcu_head *head)
+{
+	struct sync_rcu *sr = container_of(head, struct sync_rcu, head);
+
+	sem_up(&sr->sem);
+}
+
+/* Blocks until a full grace period has passed, meaning any readers that could
+ * see something we unlinked before calling this are done. */
+void synchronize_rcu(void)
+{
+	struct sync_rcu sr;
+
+	sem_init(&sr.sem, 0);
+	call_rcu(&sr.head, __sync_rcu_cb);
+	sem_down(&sr.sem);
+}
+
+static int __rcu_cbs_pending(void *arg)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (!cbl_empty(&_PERCPU_VARPTR(rcu_pcpuis, i)->next_cbs))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void rcu_start_gp(void)
+{
+	struct rcu_pcpui *rpi;
+
+	for (int i = 0; i < num_cores; i++) {
+		rpi = _PERCPU_VARPTR(rcu_pcpuis, i);
+		spin_lock_irqsave(&rpi->lock);
+		cbl_splice(&rpi->wait_cbs, &rpi->next_cbs);
+		spin_unlock_irqsave(&rpi->lock);
+	}
+	/* The callbacks' objects were unlinked before their call_rcu().  Readers
+	 * that see the new GP must not be able to find them. */
+	mb();
+	ACCESS_ONCE(rcu_gp_num) = rcu_gp_num + 1;
+	mb();
+}
+
+/* Returns TRUE once every core passed a QS in the current GP.  If kick, we'll
+ * poke the stragglers. */
+static bool rcu_gp_done(bool kick)
+{
+	unsigned long gp = rcu_gp_num;
+	struct rcu_pcpui *rpi;
+	bool done = TRUE;
+
+	for (int i = 0; i < num_cores; i++) {
+		rpi = _PERCPU_VARPTR(rcu_pcpuis, i);
+		if (ACCESS_ONCE(rpi->gp_seen) == gp)
+			continue;
+		done = FALSE;
+		if (kick && (rpi->gp_kicked != gp)) {
+			rpi->gp_kicked = gp;
+			rcu_nr_kicks++;
+			send_kernel_message(i, __rcu_kick_handler, 0, 0, 0, KMSG_ROUTINE);
+		}
+	}
+	return done;
+}
+
+static void rcu_finish_gp(void)
+{
+	struct rcu_pcpui *rpi;
+	bool has_cbs;
+
+	mb();
+	rcu_gp_completed = rcu_gp_num;
+	for (int i = 0; i < num_cores; i++) {
+		rpi = _PERCPU_VARPTR(rcu_pcpuis, i);
+		spin_lock_irqsave(&rpi->lock);
+		cbl_splice(&rpi->done_cbs, &rpi->wait_cbs);
+		has_cbs = !cbl_empty(&rpi->done_cbs);
+		spin_unlock_irqsave(&rpi->lock);
+		if (has_cbs)
+			send_kernel_message(i, __rcu_do_callbacks, 0, 0, 0, KMSG_ROUTINE);
+	}
+}
+
+static void rcu_gp_ktask(void *arg)
+{
+	while (1) {
+		rendez_sleep(&rcu_gp_rv, __rcu_cbs_pending, NULL);
+		rcu_start_gp();
+		/* Give the cores a chance to report on their own first */
+		for (bool kick = FALSE; !rcu_gp_done(kick); kick = TRUE)
+			kthread_usleep(RCU_GP_POLL_USEC);
+		rcu_finish_gp();
+	}
+}
+
+void rcu_init(void)
+{
+	struct rcu_pcpui *rpi;
+
+	for (int i = 0; i < num_cores; i++) {
+		rpi = _PERCPU_VARPTR(rcu_pcpuis, i);
+		spinlock_init_irqsave(&rpi->lock);
+		cbl_init(&rpi->next_cbs);
+		cbl_init(&rpi->wait_cbs);
+		cbl_init(&rpi->done_cbs);
+	}
+	rendez_init(&rcu_gp_rv);
+	rcu_ready = TRUE;
+	ktask("rcu_gp", rcu_gp_ktask, NULL);
+}
+
+void print_rcu_info(void)
+{
+	struct rcu_pcpui *rpi;
+
+	printk("RCU: GP %lu, completed %lu, kicks %lu\n", rcu_gp_num,
+	       rcu_gp_completed, rcu_nr_kicks);
+	for (int i = 0; i < num_cores; i++) {
+		rpi = _PERCPU_VARPTR(rcu_pcpuis, i);
+		printk("\tCore %3d: seen GP %lu, %lu callbacks run\n", i, rpi->gp_seen,
+		       rpi->nr_cbs_run);
+	}
+}
@@ -0,0 +1,239 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Memory reclaim.
+ *
+ * Free memory is whatever the base arenas have left; everything above them
+ * (kpages, the qcaches, slabs, page caches, etc) looks allocated from there.
+ * A lot of that is cached and can be given back:
+ * - the pre-zeroed page pools
+ * - slab depots and empty slabs, for every kmem_cache
+ * - the arenas' qcaches, which return segments to their arenas
+ * - clean, unused pages in the page cache
+ *
+ * We do this in order, from the cheapest to recreate to the most expensive,
+ * and stop once we've freed enough.  The reclaimer ktask does this in the
+ * background when we drop below the low watermark, and runs until we're above
+ * the high watermark.  Allocators poke it with reclaim_check().  Base arenas
+ * that are out of memory call mem_reclaim() directly, which is the last thing
+ * we try before failing an allocation.
+ *
+ * Reclaiming must not allocate while holding the reclaim_qlock: an allocation
+ * that fails calls back into mem_reclaim().  In case something below us does,
+ * the kthread that is reclaiming is flagged KTH_IN_RECLAIM, and those nested
+ * calls give up instead of blocking on the reclaim_qlock. */
+
+#include <reclaim.h>
+#include <arena.h>
+#include <kmalloc.h>
+#include <slab.h>
+#include <page_alloc.h>
+#include <pagemap.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <smp.h>
+#include <trap.h>
+#include <arch/topology.h>
+#include <stdio.h>
+#include <assert.h>
+
+/* Watermarks, as a fraction of the memory in the base arenas.  For instance,
+ * we start reclaiming when less than 1/128th of memory is free. */
+#define RECLAIM_MIN_SHIFT		8
+#define RECLAIM_LOW_SHIFT		7
+#define RECLAIM_HIGH_SHIFT		6
+/* How often the reclaimer checks the watermarks, if no one pokes it */
+#define RECLAIM_PERIOD_USEC		1000000
+/* Minimum number of page cache pages to drop per reclaim */
+#define RECLAIM_PM_BATCH		64
+
+static size_t watermarks[RECLAIM_NR_WMARKS];
+static struct rendez reclaim_rv;
+static qlock_t reclaim_qlock = QLOCK_INITIALIZER(reclaim_qlock);
+static bool reclaim_ready;
+
+static size_t amt_reclaimed;
+
+/* Some NUMA domains share base_arena (e.g. domains without memory). */
+static bool is_numa_base(int i)
+{
+	return !i || (base_numa_arenas[i] != base_arena);
+}
+
+size_t mem_amt_free(void)
+{
+	size_t amt = 0;
+
+	if (!base_numa_arenas)
+		return arena_amt_free(base_arena);
+	for (int i = 0; i < num_numa; i++) {
+		if (is_numa_base(i))
+			amt += arena_amt_free(base_numa_arenas[i]);
+	}
+	return amt;
+}
+
+static size_t mem_amt_total(void)
+{
+	size_t amt = 0;
+
+	if (!base_numa_arenas)
+		return arena_amt_total(base_arena);
+	for (int i = 0; i < num_numa; i++) {
+		if (is_numa_base(i))
+			amt += arena_amt_total(base_numa_arenas[i]);
+	}
+	return amt;
+}
+
+size_t mem_watermark(int wmark)
+{
+	return watermarks[wmark];
+}
+
+size_t mem_amt_reclaimed(void)
+{
+	return amt_reclaimed;
+}
+
+bool mem_below_watermark(int wmark)
+{
+	if (!reclaim_ready)
+		return FALSE;
+	return mem_amt_free() < watermarks[wmark];
+}
+
+static int __reclaim_needed(void *arg)
+{
+	return mem_below_watermark(RECLAIM_WMARK_LOW);
+}
+
+/* Wakes the reclaimer if we're running low.  Safe to call from IRQ context. */
+void reclaim_check(void)
+{
+	if (mem_below_watermark(RECLAIM_WMARK_LOW))
+		rendez_wakeup(&reclaim_rv);
+}
+
+/* Gives back the cached free pages in the zero page pools. */
+static void reclaim_free_pages(void)
+{
+	page_zero_pool_drain();
+}
+
+/* Reaps every cache.  The regular caches go first, since their slabs free into
+ * the qcaches of arenas like kpages.  Then the qcaches give their segments back
+ * to their arenas, children before parents.
+ *
+ * The cache and arena lists are protected by a qlock, which our caller might
+ * hold if it is out of memory.  In that case we skip the slabs. */
+static void reclaim_slabs(void)
+{
+	struct kmem_cache *kc_i;
+	struct arena *a_i;
+
+	if (!canqlock(&arenas_and_slabs_lock))
+		return;
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link) {
+		if (!(kc_i->flags & KMC_QCACHE))
+			kmem_cache_reap(kc_i);
+	}
+	TAILQ_FOREACH_REVERSE(a_i, &all_arenas, arena_tailq, next)
+		arena_reap_qcaches(a_i);
+	qunlock(&arenas_and_slabs_lock);
+}
+
+static bool reclaimed_enough(size_t start, size_t goal)
+{
+	size_t now = mem_amt_free();
+
+	return (now > start) && (now - start >= goal);
+}
+
+/* Reclaims memory until we've freed at least goal bytes or run out of things to
+ * try.  Returns the amount freed.  Hold the reclaim_qlock, and don't allocate
+ * while holding it. */
+static size_t __mem_reclaim(size_t goal)
+{
+	size_t start = mem_amt_free();
+	size_t end;
+
+	reclaim_free_pages();
+	if (reclaimed_enough(start, goal))
+		goto out;
+	reclaim_slabs();
+	if (reclaimed_enough(start, goal))
+		goto out;
+	pm_reclaim_clean(MAX(goal >> PGSHIFT, RECLAIM_PM_BATCH));
+	/* Dropping page cache pages refilled the slabs and qcaches */
+	reclaim_slabs();
+out:
+	end = mem_amt_free();
+	if (end <= start)
+		return 0;
+	amt_reclaimed += end - start;
+	return end - start;
+}
+
+/* Attempts to free at least goal bytes of memory.  Returns the amount freed,
+ * which may be less than goal (or 0).  If we can't block, we just kick the
+ * reclaimer. */
+size_t mem_reclaim(size_t goal, int flags)
+{
+	struct kthread *kth;
+	size_t ret;
+
+	if (!reclaim_ready)
+		return 0;
+	if ((flags & MEM_ATOMIC) || !can_block(&per_cpu_info[core_id()])) {
+		rendez_wakeup(&reclaim_rv);
+		return 0;
+	}
+	kth = per_cpu_info[core_id()].cur_kthread;
+	/* We ran out while reclaiming, and might hold the reclaim_qlock */
+	if (kth->flags & KTH_IN_RECLAIM)
+		return 0;
+	kth->flags |= KTH_IN_RECLAIM;
+	qlock(&reclaim_qlock);
+	ret = __mem_reclaim(goal);
+	qunlock(&reclaim_qlock);
+	kth->flags &= ~KTH_IN_RECLAIM;
+	return ret;
+}
+
+static void reclaimer(void *arg)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+	size_t high;
+
+	kth->flags |= KTH_IN_RECLAIM;
+	while (1) {
+		rendez_sleep_timeout(&reclaim_rv, __reclaim_needed, NULL,
+		                     RECLAIM_PERIOD_USEC);
+		if (!mem_below_watermark(RECLAIM_WMARK_LOW))
+			continue;
+		qlock(&reclaim_qlock);
+		while (mem_below_watermark(RECLAIM_WMARK_HIGH)) {
+			high = watermarks[RECLAIM_WMARK_HIGH];
+			if (!__mem_reclaim(high - MIN(high, mem_amt_free())))
+				break;
+			kthread_yield();
+		}
+		qunlock(&reclaim_qlock);
+		if (mem_below_watermark(RECLAIM_WMARK_MIN))
+			warn_once("Free memory (%lu) below the min watermark (%lu)!",
+			          mem_amt_free(), watermarks[RECLAIM_WMARK_MIN]);
+	}
+}
+
+void reclaim_init(void)
+{
+	size_t total = mem_amt_total();
+
+	watermarks[RECLAIM_WMARK_MIN] = total >> RECLAIM_MIN_SHIFT;
+	watermarks[RECLAIM_WMARK_LOW] = total >> RECLAIM_LOW_SHIFT;
+	watermarks[RECLAIM_WMARK_HIGH] = total >> RECLAIM_HIGH_SHIFT;
+	rendez_init(&reclaim_rv);
+	reclaim_ready = TRUE;
+	ktask("reclaimer", reclaimer, NULL);
+}
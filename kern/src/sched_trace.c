@@ -0,0 +1,145 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * ksched and vcore event tracer.  See sched_trace.h.
+ *
+ * Each core has its own overwriting trace_ring, so recording an event is a
+ * fetch-and-add on a core-local counter and a 32 byte store.  The rings are
+ * allocated the first time tracing starts, and never freed.  Events are
+ * recorded on whatever core notices them (e.g. a grant is recorded on the
+ * ksched's core), so the rings aren't ordered with respect to each other; the
+ * snapshot sorts them by TSC.
+ *
+ * Reading while tracing is on can catch a slot that is being written; stop
+ * first for a clean trace. */
+
+#include <sched_trace.h>
+#include <trace.h>
+#include <percpu.h>
+#include <page_alloc.h>
+#include <arch/arch.h>
+#include <ros/procinfo.h>
+#include <sort.h>
+#include <smp.h>
+#include <string.h>
+#include <assert.h>
+
+#define SCHED_TRACE_RING_SZ		(64 * 1024)
+
+bool sched_trace_on;
+
+static DEFINE_PERCPU(struct trace_ring, sched_trace_ring);
+static qlock_t sched_trace_qlock = QLOCK_INITIALIZER(sched_trace_qlock);
+
+void __sched_trace(uint16_t type, uint32_t pcoreid, uint32_t pid,
+                   uint32_t vcoreid, uint64_t arg)
+{
+	struct trace_ring *tr = PERCPU_VARPTR(sched_trace_ring);
+	struct sched_trace_event *ev;
+
+	if (!tr->tr_buf)
+		return;
+	ev = get_trace_slot_overwrite(tr);
+	ev->arg = arg;
+	ev->pid = pid;
+	ev->vcoreid = vcoreid;
+	ev->type = type;
+	ev->pcoreid = pcoreid;
+	ev->srccore = core_id();
+	ev->tsc = read_tsc();
+}
+
+void sched_trace_start(void)
+{
+	struct trace_ring *tr;
+
+	qlock(&sched_trace_qlock);
+	for (int i = 0; i < num_cores; i++) {
+		tr = _PERCPU_VARPTR(sched_trace_ring, i);
+		if (tr->tr_buf)
+			continue;
+		trace_ring_init(tr, kpages_zalloc(SCHED_TRACE_RING_SZ, MEM_WAIT),
+		                SCHED_TRACE_RING_SZ, sizeof(struct sched_trace_event));
+	}
+	/* The rings need to be visible before anyone sees sched_trace_on */
+	wmb();
+	sched_trace_on = TRUE;
+	qunlock(&sched_trace_qlock);
+}
+
+void sched_trace_stop(void)
+{
+	sched_trace_on = FALSE;
+}
+
+void sched_trace_reset(void)
+{
+	struct trace_ring *tr;
+
+	qlock(&sched_trace_qlock);
+	for (int i = 0; i < num_cores; i++) {
+		tr = _PERCPU_VARPTR(sched_trace_ring, i);
+		if (tr->tr_buf)
+			trace_ring_reset_and_clear(tr);
+	}
+	qunlock(&sched_trace_qlock);
+}
+
+/* Events recorded since the last reset, including those overwritten. */
+size_t sched_trace_nr_events(void)
+{
+	size_t ret = 0;
+
+	for (int i = 0; i < num_cores; i++)
+		ret += ACCESS_ONCE(_PERCPU_VARPTR(sched_trace_ring, i)->tr_next);
+	return ret;
+}
+
+static int tsc_cmp(const void *a, const void *b)
+{
+	const struct sched_trace_event *ea = a, *eb = b;
+
+	if (ea->tsc < eb->tsc)
+		return -1;
+	return ea->tsc > eb->tsc;
+}
+
+struct sized_alloc *sched_trace_build(void)
+{
+	struct sized_alloc *sza;
+	struct sched_trace_hdr *hdr;
+	struct sched_trace_event *evs, *ev;
+	struct trace_ring *tr;
+	size_t max_evs = 0, nr_evs = 0, nr_lost = 0;
+
+	qlock(&sched_trace_qlock);
+	for (int i = 0; i < num_cores; i++)
+		max_evs += _PERCPU_VARPTR(sched_trace_ring, i)->tr_max;
+	sza = sized_kzmalloc(sizeof(struct sched_trace_hdr) +
+	                     max_evs * sizeof(struct sched_trace_event), MEM_WAIT);
+	hdr = sza->buf;
+	evs = (struct sched_trace_event*)(hdr + 1);
+	for (int i = 0; i < num_cores; i++) {
+		tr = _PERCPU_VARPTR(sched_trace_ring, i);
+		if (ACCESS_ONCE(tr->tr_next) > tr->tr_max)
+			nr_lost += ACCESS_ONCE(tr->tr_next) - tr->tr_max;
+		for (int j = 0; j < tr->tr_max; j++) {
+			ev = __get_tr_slot(tr, j);
+			/* Never used since the last reset */
+			if (!ev->tsc)
+				continue;
+			evs[nr_evs++] = *ev;
+		}
+	}
+	qunlock(&sched_trace_qlock);
+	sort(evs, nr_evs, sizeof(struct sched_trace_event), tsc_cmp);
+	hdr->magic = SCHED_TRACE_MAGIC;
+	hdr->version = SCHED_TRACE_VERSION;
+	hdr->tsc_freq = __proc_global_info.tsc_freq;
+	hdr->nr_cores = num_cores;
+	hdr->nr_events = nr_evs;
+	hdr->nr_lost = nr_lost;
+	sza->size = sizeof(struct sched_trace_hdr) +
+	            nr_evs * sizeof(struct sched_trace_event);
+	return sza;
+}
@@ -16,11 +16,16 @@
 #include <alarm.h>
 #include <sys/queue.h>
 #include <arsc_server.h>
+#include <percpu.h>
+#include <ksched_policy.h>
+#include <corepool.h>
+#include <kmalloc.h>
+#include <ns.h>
 
 /* Process Lists.  'unrunnable' is a holding list for SCPs that are running or
- * waiting or otherwise not considered for sched decisions. */
+ * waiting or otherwise not considered for sched decisions.  Runnable SCPs are
+ * on the per-core scp_rqs. */
 struct proc_list unrunnable_scps = TAILQ_HEAD_INITIALIZER(unrunnable_scps);
-struct proc_list runnable_scps = TAILQ_HEAD_INITIALIZER(runnable_scps);
 /* mcp lists.  we actually could get by with one list and a TAILQ_CONCAT, but
  * I'm expecting to want the flexibility of the pointers later. */
 struct proc_list all_mcps_1 = TAILQ_HEAD_INITIALIZER(all_mcps_1);
@@ -36,6 +41,13 @@ static void switch_lists(struct proc *p, struct proc_list *old,
                          struct proc_list *new);
 static void __run_mcp_ksched(void *arg);	/* don't call directly */
 static uint32_t get_cores_needed(struct proc *p);
+static void __scp_tick(struct alarm_waiter *waiter);
+static void __scp_rq_reclaim(uint32_t pcoreid);
+static bool __scp_rq_reclaim_any(void);
+static void __ksched_tick_kick(void);
+static void __preempt_alarm(struct alarm_waiter *waiter);
+static bool __preempt_warning_done(struct proc *p, uint32_t pcoreid);
+static void __force_expired_preempts(void);
 
 /* Locks / sync tools */
 
@@ -65,17 +77,86 @@ struct poke_tracker ksched_poker = POKE_INITIALIZER(__run_mcp_ksched);
 //spinlock_t alloc_lock = SPINLOCK_INITIALIZER;
 spinlock_t sched_lock = SPINLOCK_INITIALIZER;
 
-/* Alarm struct, for our example 'timer tick' */
+/* Alarm struct, for our example 'timer tick'.  The tick stops when there's
+ * nothing for it to do, so an idle machine isn't woken up every tick. */
 struct alarm_waiter ksched_waiter;
+static bool ksched_tick_armed;
 
 #define TIMER_TICK_USEC 10000 	/* 10msec */
 
-/* Helper: Sets up a timer tick on the calling core to go off 10 msec from now.
- * This assumes the calling core is an LL core, etc. */
-static void set_ksched_alarm(void)
+/* Per-core SCP run queues.  The mgmt core always runs SCPs.  When every core
+ * running SCPs is busy, a waking SCP borrows a core from the idle core pool,
+ * and idle cores steal from the other run queues from cpu_bored().  Borrowed
+ * cores go back to the pool once they run out of SCPs, and the MCP ksched takes
+ * them back whenever it needs them (MCPs come first on CG cores, so MCPs keep
+ * their provisioned cores).
+ *
+ * These are protected by the sched_lock, like the other proc lists. */
+struct scp_rq {
+	struct proc_list			runnable;
+	unsigned int				nr_runnable;
+	uint32_t					coreid;
+	bool						active;		/* running SCPs */
+	bool						tick_armed;
+	struct alarm_waiter			tick;		/* only on borrowed cores */
+	unsigned long				nr_borrows;
+	unsigned long				nr_steals;
+	/* For predicting how long the core will idle */
+	uint64_t					last_idle_ticks;
+	uint64_t					avg_idle_usec;
+};
+
+static DEFINE_PERCPU(struct scp_rq, scp_rqs);
+static unsigned int nr_runnable_scps;
+
+/* How long an MCP has to yield a core the ksched wants back for another MCP,
+ * before we preempt it. */
+#define PREEMPT_GRACE_USEC 1000
+
+/* Cores the MCP ksched warned it is taking back, one per pcore.  The victim
+ * gets a preempt_pending warning and can yield the core by the deadline.  If it
+ * doesn't, the deadline alarm marks the warning expired, and the next ksched
+ * pass preempts the core.  Only the ksched preempts, so it remains the only
+ * preemptor.
+ *
+ * The procs are weak refs.  victim is only used while it still has the core
+ * allocated, same as in __core_request().  These are protected by the
+ * sched_lock. */
+struct preempt_warning {
+	struct proc					*victim;
+	struct proc					*for_proc;
+	uint64_t					warn_time;
+	uint64_t					deadline;
+	bool						pending;
+	bool						expired;
+	bool						alarm_armed;
+	struct alarm_waiter			alarm;
+};
+
+static DEFINE_PERCPU(struct preempt_warning, preempt_warnings);
+static unsigned long nr_preempt_warns;
+static unsigned long nr_preempt_yields;
+static unsigned long nr_preempt_forced;
+static uint64_t preempt_yield_usec;		/* total, for the average */
+
+/* Helper: Sets up the timer tick on core 0 to go off 10 msec from now, unless
+ * it is already set.  Anything that gives the tick work calls this.  Hold the
+ * sched_lock. */
+static void __ksched_tick_kick(void)
 {
+	if (ksched_tick_armed)
+		return;
+	ksched_tick_armed = TRUE;
 	set_awaiter_rel(&ksched_waiter, TIMER_TICK_USEC);
-	set_alarm(&per_cpu_info[core_id()].tchain, &ksched_waiter);
+	set_alarm(&per_cpu_info[0].tchain, &ksched_waiter);
+}
+
+/* The tick gives MCPs a chance to get cores they asked for and time-slices the
+ * SCPs waiting on the mgmt core.  Hold the sched_lock. */
+static bool __ksched_tick_needed(void)
+{
+	return !TAILQ_EMPTY(primary_mcps) || !TAILQ_EMPTY(secondary_mcps) ||
+	       _PERCPU_VARPTR(scp_rqs, 0)->nr_runnable;
 }
 
 /* Need a kmsg to just run the sched, but not to rearm */
@@ -92,11 +173,19 @@ static void __ksched_tick(struct alarm_waiter *waiter)
 {
 	/* TODO: imagine doing some accounting here */
 	run_scheduler();
+	spin_lock(&sched_lock);
+	if (!__ksched_tick_needed()) {
+		/* Whoever gives us work next will restart us */
+		ksched_tick_armed = FALSE;
+		spin_unlock(&sched_lock);
+		return;
+	}
 	/* Set our alarm to go off, incrementing from our last tick (instead of
 	 * setting it relative to now, since some time has passed since the alarm
 	 * first went off.  Note, this may be now or in the past! */
 	set_awaiter_inc(&ksched_waiter, TIMER_TICK_USEC);
 	set_alarm(&per_cpu_info[core_id()].tchain, &ksched_waiter);
+	spin_unlock(&sched_lock);
 }
 
 void schedule_init(void)
@@ -104,8 +193,19 @@ void schedule_init(void)
 	spin_lock(&sched_lock);
 	assert(!core_id());		/* want the alarm on core0 for now */
 	init_awaiter(&ksched_waiter, __ksched_tick);
-	set_ksched_alarm();
+	__ksched_tick_kick();
 	corealloc_init();
+	corepool_init();
+	for (int i = 0; i < num_cores; i++) {
+		struct scp_rq *rq = _PERCPU_VARPTR(scp_rqs, i);
+
+		TAILQ_INIT(&rq->runnable);
+		rq->coreid = i;
+		init_awaiter(&rq->tick, __scp_tick);
+		init_awaiter(&_PERCPU_VARPTR(preempt_warnings, i)->alarm,
+		             __preempt_alarm);
+	}
+	PERCPU_VARPTR(scp_rqs)->active = TRUE;
 	spin_unlock(&sched_lock);
 
 #ifdef CONFIG_ARSC_SERVER
@@ -122,6 +222,8 @@ static void add_to_list(struct proc *p, struct proc_list *new)
 	assert(!(p->ksched_data.cur_list));
 	TAILQ_INSERT_TAIL(new, p, ksched_data.proc_link);
 	p->ksched_data.cur_list = new;
+	if (new != &unrunnable_scps)
+		__ksched_tick_kick();
 }
 
 static void remove_from_list(struct proc *p, struct proc_list *old)
@@ -138,9 +240,31 @@ static void switch_lists(struct proc *p, struct proc_list *old,
 	add_to_list(p, new);
 }
 
+static void scp_rq_add(struct scp_rq *rq, struct proc *p)
+{
+	add_to_list(p, &rq->runnable);
+	p->ksched_data.scp_rq = rq;
+	rq->nr_runnable++;
+	nr_runnable_scps++;
+}
+
+static void scp_rq_remove(struct proc *p)
+{
+	struct scp_rq *rq = p->ksched_data.scp_rq;
+
+	remove_from_list(p, &rq->runnable);
+	p->ksched_data.scp_rq = 0;
+	rq->nr_runnable--;
+	nr_runnable_scps--;
+}
+
 /* Removes from whatever list p is on */
 static void remove_from_any_list(struct proc *p)
 {
+	if (p->ksched_data.scp_rq) {
+		scp_rq_remove(p);
+		return;
+	}
 	if (p->ksched_data.cur_list) {
 		TAILQ_REMOVE(p->ksched_data.cur_list, p, ksched_data.proc_link);
 		p->ksched_data.cur_list = 0;
@@ -159,13 +283,19 @@ static void remove_from_any_list(struct proc *p)
  *   DYING */
 void __sched_proc_register(struct proc *p)
 {
+	struct proc *parent = p->ppid ? pid2proc(p->ppid) : NULL;
+
 	assert(!proc_is_dying(p));		/* shouldn't be able to happen yet */
 	/* one ref for the proc's existence, cradle-to-grave */
 	proc_incref(p, 1);	/* need at least this OR the 'one for existing' */
 	spin_lock(&sched_lock);
 	corealloc_proc_init(p);
+	p->ksched_data.weight = KSCHED_DEFAULT_WEIGHT;
+	__corepool_add_proc(p, parent);
 	add_to_list(p, &unrunnable_scps);
 	spin_unlock(&sched_lock);
+	if (parent)
+		proc_decref(parent);
 }
 
 /* Returns 0 if it succeeded, an error code otherwise. */
@@ -210,6 +340,7 @@ void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 	remove_from_any_list(p);
 	if (nr_cores)
 		__track_core_dealloc_bulk(p, pc_arr, nr_cores);
+	__corepool_remove_proc(p);
 	spin_unlock(&sched_lock);
 	/* Drop the cradle-to-the-grave reference, jet-li */
 	proc_decref(p);
@@ -229,9 +360,69 @@ void __sched_mcp_wakeup(struct proc *p)
 	poke(&ksched_poker, p);
 }
 
+/* How busy an SCP core is: its queue, plus whoever it is running.  The
+ * owning_proc peek is unlocked, which is fine for a heuristic. */
+static unsigned int scp_rq_load(struct scp_rq *rq)
+{
+	struct proc *owner = ACCESS_ONCE(per_cpu_info[rq->coreid].owning_proc);
+
+	return rq->nr_runnable + !!owner;
+}
+
+static void __scp_rq_activate(struct scp_rq *rq)
+{
+	assert(!rq->active);
+	rq->active = TRUE;
+	rq->nr_borrows++;
+}
+
+/* Picks the least loaded SCP core.  If they are all busy and can_borrow, we'll
+ * try to borrow an idle core instead.  The mgmt core is always active, so this
+ * always returns something. */
+static struct scp_rq *__pick_scp_rq(bool can_borrow)
+{
+	struct scp_rq *rq, *best = NULL;
+	unsigned int load, best_load = 0;
+	int coreid;
+
+	for (int i = 0; i < num_cores; i++) {
+		rq = _PERCPU_VARPTR(scp_rqs, i);
+		if (!rq->active)
+			continue;
+		load = scp_rq_load(rq);
+		if (!best || (load < best_load)) {
+			best = rq;
+			best_load = load;
+		}
+	}
+	assert(best);
+	if (best_load && can_borrow) {
+		coreid = __get_any_idle_core();
+		if (coreid >= 0) {
+			best = _PERCPU_VARPTR(scp_rqs, coreid);
+			__scp_rq_activate(best);
+		}
+	}
+	return best;
+}
+
+/* Gets rq's core to look at its queue, in case it is halted.  Otherwise it'll
+ * get to it on its next tick.
+ *
+ * FYI, a POKE on x86 might lose a rare race with halt code, since the poke
+ * handler does not abort halts.  if this happens, the next timer IRQ would wake
+ * up the core. */
+static void scp_rq_kick(struct scp_rq *rq)
+{
+	if (rq->coreid != core_id())
+		send_ipi(rq->coreid, I_POKE_CORE);
+}
+
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_scp_wakeup(struct proc *p)
 {
+	struct scp_rq *rq;
+
 	spin_lock(&sched_lock);
 	if (proc_is_dying(p)) {
 		spin_unlock(&sched_lock);
@@ -239,25 +430,10 @@ void __sched_scp_wakeup(struct proc *p)
 	}
 	/* might not be on a list if it is new.  o/w, it should be unrunnable */
 	remove_from_any_list(p);
-	add_to_list(p, &runnable_scps);
+	rq = __pick_scp_rq(TRUE);
+	scp_rq_add(rq, p);
 	spin_unlock(&sched_lock);
-	/* we could be on a CG core, and all the mgmt cores could be halted.  if we
-	 * don't tell one of them about the new proc, they will sleep until the
-	 * timer tick goes off. */
-	if (!management_core()) {
-		/* TODO: pick a better core and only send if halted.
-		 *
-		 * FYI, a POKE on x86 might lose a rare race with halt code, since the
-		 * poke handler does not abort halts.  if this happens, the next timer
-		 * IRQ would wake up the core.
-		 *
-		 * ideally, we'd know if a specific mgmt core is sleeping and wake it
-		 * up.  o/w, we could interrupt an already-running mgmt core that won't
-		 * get to our new proc anytime soon.  also, by poking core 0, a
-		 * different mgmt core could remain idle (and this process would sleep)
-		 * until its tick goes off */
-		send_ipi(0, I_POKE_CORE);
-	}
+	scp_rq_kick(rq);
 }
 
 /* Callback to return a core to the ksched, which tracks it as idle and
@@ -267,72 +443,195 @@ void __sched_scp_wakeup(struct proc *p)
  * a scheduling decision (or at least plan to). */
 void __sched_put_idle_core(struct proc *p, uint32_t coreid)
 {
+	bool resched;
+
 	spin_lock(&sched_lock);
+	resched = __preempt_warning_done(p, coreid);
 	__track_core_dealloc(p, coreid);
 	spin_unlock(&sched_lock);
+	/* We hold p's proclock, so we can't run the ksched here */
+	if (resched)
+		send_kernel_message(core_id(), __just_sched, 0, 0, 0, KMSG_ROUTINE);
 }
 
 /* Callback, bulk interface for put_idle. The proclock is held for this. */
 void __sched_put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 {
+	bool resched = FALSE;
+
 	spin_lock(&sched_lock);
+	for (int i = 0; i < num; i++)
+		resched |= __preempt_warning_done(p, pc_arr[i]);
 	__track_core_dealloc_bulk(p, pc_arr, num);
 	spin_unlock(&sched_lock);
-	/* could trigger a sched decision here */
+	if (resched)
+		send_kernel_message(core_id(), __just_sched, 0, 0, 0, KMSG_ROUTINE);
 }
 
-/* mgmt/LL cores should call this to schedule the calling core and give it to an
- * SCP.  will also prune the dead SCPs from the list.  hold the lock before
- * calling.  returns TRUE if it scheduled a proc. */
-static bool __schedule_scp(void)
+/* Takes the SCP running on the calling core off the core and puts it on the
+ * tail of rq.  Returns FALSE if it is dying, in which case there's probably a
+ * KMSG to clean it up waiting on this core.  Hold the sched_lock. */
+static bool __deschedule_scp(struct scp_rq *rq)
 {
+	uint32_t pcoreid = core_id();
+	struct proc *owner = per_cpu_info[pcoreid].owning_proc;
+
 	// TODO: sort out lock ordering (proc_run_s also locks)
+	spin_lock(&owner->proc_lock);
+	if (proc_is_dying(owner)) {
+		spin_unlock(&owner->proc_lock);
+		return FALSE;
+	}
+	__proc_set_state(owner, PROC_RUNNABLE_S);
+	/* Saving FP state aggressively.  Odds are, the SCP was hit by an IRQ and
+	 * has a HW ctx, in which case we must save. */
+	__proc_save_fpu_s(owner);
+	__proc_save_context_s(owner);
+	spin_unlock(&owner->proc_lock);
+	remove_from_list(owner, &unrunnable_scps);
+	scp_rq_add(rq, owner);
+	clear_owning_proc(pcoreid);
+	/* Note we abandon core.  It's not strictly necessary.  If we didn't, the
+	 * TLB would still be loaded with the old one, til we proc_run_s, and the
+	 * various paths in proc_run_s would pick it up.  This way is a bit safer
+	 * for future changes, but has an extra (empty) TLB flush.  */
+	abandon_core();
+	return TRUE;
+}
+
+/* Finds the next SCP for rq's core: the head of its own queue, or if the core
+ * isn't running anything, the head of the busiest other queue. */
+static struct proc *__scp_rq_next(struct scp_rq *rq, bool idle)
+{
+	struct scp_rq *rq_i, *victim = NULL;
+
+	if (rq->nr_runnable)
+		return TAILQ_FIRST(&rq->runnable);
+	if (!idle || !nr_runnable_scps)
+		return NULL;
+	for (int i = 0; i < num_cores; i++) {
+		rq_i = _PERCPU_VARPTR(scp_rqs, i);
+		if (rq_i->nr_runnable > (victim ? victim->nr_runnable : 0))
+			victim = rq_i;
+	}
+	if (!victim)
+		return NULL;
+	rq->nr_steals++;
+	return TAILQ_FIRST(&victim->runnable);
+}
+
+/* SCP cores call this to schedule the calling core and give it to an SCP.  hold
+ * the lock before calling.  returns TRUE if it scheduled a proc. */
+static bool __schedule_scp(void)
+{
 	struct proc *p;
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
+	struct scp_rq *rq = PERCPU_VARPTR(scp_rqs);
+
+	if (!rq->active)
+		return FALSE;
 	/* if there are any runnables, run them here and put any currently running
-	 * SCP on the tail of the runnable queue. */
-	if ((p = TAILQ_FIRST(&runnable_scps))) {
-		/* someone is currently running, dequeue them */
-		if (pcpui->owning_proc) {
-			spin_lock(&pcpui->owning_proc->proc_lock);
-			/* process might be dying, with a KMSG to clean it up waiting on
-			 * this core.  can't do much, so we'll attempt to restart */
-			if (proc_is_dying(pcpui->owning_proc)) {
-				send_kernel_message(core_id(), __just_sched, 0, 0, 0,
-				                    KMSG_ROUTINE);
-				spin_unlock(&pcpui->owning_proc->proc_lock);
-				return FALSE;
-			}
-			printd("Descheduled %d in favor of %d\n", pcpui->owning_proc->pid,
-			       p->pid);
-			__proc_set_state(pcpui->owning_proc, PROC_RUNNABLE_S);
-			/* Saving FP state aggressively.  Odds are, the SCP was hit by an
-			 * IRQ and has a HW ctx, in which case we must save. */
-			__proc_save_fpu_s(pcpui->owning_proc);
-			__proc_save_context_s(pcpui->owning_proc);
-			vcore_account_offline(pcpui->owning_proc, 0);
-			__seq_start_write(&p->procinfo->coremap_seqctr);
-			__unmap_vcore(p, 0);
-			__seq_end_write(&p->procinfo->coremap_seqctr);
-			spin_unlock(&pcpui->owning_proc->proc_lock);
-			/* round-robin the SCPs (inserts at the end of the queue) */
-			switch_lists(pcpui->owning_proc, &unrunnable_scps, &runnable_scps);
-			clear_owning_proc(pcoreid);
-			/* Note we abandon core.  It's not strictly necessary.  If
-			 * we didn't, the TLB would still be loaded with the old
-			 * one, til we proc_run_s, and the various paths in
-			 * proc_run_s would pick it up.  This way is a bit safer for
-			 * future changes, but has an extra (empty) TLB flush.  */
-			abandon_core();
+	 * SCP on the tail of our runnable queue. */
+	p = __scp_rq_next(rq, !pcpui->owning_proc);
+	if (!p)
+		return FALSE;
+	/* someone is currently running, dequeue them */
+	if (pcpui->owning_proc) {
+		if (!__deschedule_scp(rq)) {
+			/* can't do much, so we'll attempt to restart */
+			send_kernel_message(pcoreid, __just_sched, 0, 0, 0, KMSG_ROUTINE);
+			return FALSE;
 		}
-		/* Run the new proc */
-		switch_lists(p, &runnable_scps, &unrunnable_scps);
-		printd("PID of the SCP i'm running: %d\n", p->pid);
-		proc_run_s(p);	/* gives it core we're running on */
-		return TRUE;
+		printd("Descheduled in favor of %d\n", p->pid);
+	}
+	/* Run the new proc */
+	scp_rq_remove(p);
+	add_to_list(p, &unrunnable_scps);
+	printd("PID of the SCP i'm running: %d\n", p->pid);
+	proc_run_s(p);	/* gives it core we're running on */
+	/* The mgmt core's SCPs are time-sliced by the ksched tick */
+	if (!management_core() && !rq->tick_armed) {
+		rq->tick_armed = TRUE;
+		set_awaiter_rel(&rq->tick, TIMER_TICK_USEC);
+		set_alarm(&pcpui->tchain, &rq->tick);
+	}
+	return TRUE;
+}
+
+/* RKM alarm, time-slicing the SCPs on a borrowed core.  It stops once the core
+ * stops running SCPs. */
+static void __scp_tick(struct alarm_waiter *waiter)
+{
+	struct scp_rq *rq = container_of(waiter, struct scp_rq, tick);
+
+	assert(rq == PERCPU_VARPTR(scp_rqs));
+	spin_lock(&sched_lock);
+	if (!rq->active) {
+		rq->tick_armed = FALSE;
+		spin_unlock(&sched_lock);
+		return;
 	}
-	return FALSE;
+	__schedule_scp();
+	set_awaiter_inc(&rq->tick, TIMER_TICK_USEC);
+	set_alarm(&per_cpu_info[core_id()].tchain, &rq->tick);
+	spin_unlock(&sched_lock);
+}
+
+/* Sent to a core the MCP ksched took back.  If it is still running an SCP, we
+ * move it to another SCP core. */
+static void __scp_evict(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *owner = per_cpu_info[core_id()].owning_proc;
+	struct scp_rq *rq;
+
+	spin_lock(&sched_lock);
+	if (!PERCPU_VARPTR(scp_rqs)->active && owner && !__proc_is_mcp(owner)) {
+		rq = __pick_scp_rq(FALSE);
+		if (__deschedule_scp(rq))
+			scp_rq_kick(rq);
+	}
+	spin_unlock(&sched_lock);
+}
+
+/* Takes a borrowed core back from the SCPs and puts it back in the idle pool.
+ * Its queued SCPs move to the other SCP cores.  Whoever it is running gets
+ * evicted by a routine KMSG, which the core will handle before any KMSGs that
+ * start an MCP there. */
+static void __scp_rq_reclaim(uint32_t pcoreid)
+{
+	struct scp_rq *rq = _PERCPU_VARPTR(scp_rqs, pcoreid);
+	struct scp_rq *new_rq;
+	struct proc *p;
+
+	assert(rq->active && !is_ll_core(pcoreid));
+	rq->active = FALSE;
+	while ((p = TAILQ_FIRST(&rq->runnable))) {
+		scp_rq_remove(p);
+		new_rq = __pick_scp_rq(FALSE);
+		scp_rq_add(new_rq, p);
+		scp_rq_kick(new_rq);
+	}
+	send_kernel_message(pcoreid, __scp_evict, 0, 0, 0, KMSG_ROUTINE);
+	__put_idle_core(pcoreid);
+}
+
+/* Reclaims the least loaded borrowed core, if there are any. */
+static bool __scp_rq_reclaim_any(void)
+{
+	struct scp_rq *rq, *best = NULL;
+
+	for (int i = 0; i < num_cores; i++) {
+		rq = _PERCPU_VARPTR(scp_rqs, i);
+		if (!rq->active || is_ll_core(i))
+			continue;
+		if (!best || (scp_rq_load(rq) < scp_rq_load(best)))
+			best = rq;
+	}
+	if (!best)
+		return FALSE;
+	__scp_rq_reclaim(best->coreid);
+	return TRUE;
 }
 
 /* Returns how many new cores p needs.  This doesn't lock the proc, so your
@@ -382,6 +681,10 @@ static void __run_mcp_ksched(void *arg)
 	struct proc_list *temp_mcp_list;
 	/* locking to protect the MCP lists' integrity and membership */
 	spin_lock(&sched_lock);
+	__force_expired_preempts();
+	/* Every MCP is on the primary list now.  The core pools and the policy
+	 * decide who goes first and how many cores each is entitled to. */
+	__corepool_plan(primary_mcps);
 	/* 2-pass scheme: check each proc on the primary list (FCFS).  if they need
 	 * nothing, put them on the secondary list.  if they need something, rip
 	 * them off the list, service them, and if they are still not dying, put
@@ -447,7 +750,7 @@ void run_scheduler(void)
 	/* MCP scheduling: post work, then poke.  for now, i just want the func to
 	 * run again, so merely a poke is sufficient. */
 	poke(&ksched_poker, 0);
-	if (management_core()) {
+	if (PERCPU_VARPTR(scp_rqs)->active) {
 		spin_lock(&sched_lock);
 		__schedule_scp();
 		spin_unlock(&sched_lock);
@@ -466,17 +769,54 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 	poke(&ksched_poker, p);
 }
 
+/* Guesses how long the calling core will idle: about as long as it has been
+ * idling lately, but no longer than until its next alarm. */
+static uint64_t predict_idle_usec(struct scp_rq *rq)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	uint64_t idle_ticks = pcpui->state_ticks[CPU_STATE_IDLE];
+	uint64_t last_usec = 0, next_alarm, now;
+
+	/* We halt once per call, so this is how long the last halt lasted.  The
+	 * ticks go backwards if someone reset them. */
+	if (idle_ticks >= rq->last_idle_ticks)
+		last_usec = tsc2usec(idle_ticks - rq->last_idle_ticks);
+	rq->last_idle_ticks = idle_ticks;
+	rq->avg_idle_usec = (7 * rq->avg_idle_usec + last_usec) / 8;
+	/* Unlocked peek; it's just a guess */
+	next_alarm = ACCESS_ONCE(pcpui->tchain.earliest_time);
+	if (next_alarm == ALARM_POISON_TIME)
+		return rq->avg_idle_usec;
+	now = read_tsc();
+	if (next_alarm <= now)
+		return 0;
+	return MIN(rq->avg_idle_usec, tsc2usec(next_alarm - now));
+}
+
 /* The calling cpu/core has nothing to do and plans to idle/halt.  This is an
  * opportunity to pick the nature of that halting (low power state, etc), or
- * provide some other work (_Ss on LL cores).  Note that interrupts are
- * disabled, and if you return, the core will cpu_halt(). */
+ * provide some other work (_Ss).  Idle cores borrow themselves to steal SCPs,
+ * and borrowed cores with nothing left to run go back to the idle pool.  Note
+ * that interrupts are disabled, and if you return, the core will cpu_halt(). */
 void cpu_bored(void)
 {
+	uint32_t pcoreid = core_id();
+	struct scp_rq *rq = PERCPU_VARPTR(scp_rqs);
 	bool new_proc = FALSE;
-	if (!management_core())
-		return;
+
+	/* unlocked peek, so idle cores don't all grab the lock on every IRQ */
+	if (!rq->active && !ACCESS_ONCE(nr_runnable_scps))
+		goto out_halt;
 	spin_lock(&sched_lock);
+	if (!rq->active && nr_runnable_scps &&
+	    (__get_specific_idle_core(pcoreid) == pcoreid))
+		__scp_rq_activate(rq);
 	new_proc = __schedule_scp();
+	if (!new_proc && rq->active && !management_core() &&
+	    !per_cpu_info[pcoreid].owning_proc) {
+		rq->active = FALSE;
+		__put_idle_core(pcoreid);
+	}
 	spin_unlock(&sched_lock);
 	/* if we just scheduled a proc, we need to manually restart it, instead of
 	 * returning.  if we return, the core will halt. */
@@ -486,6 +826,10 @@ void cpu_bored(void)
 	}
 	/* Could drop into the monitor if there are no processes at all.  For now,
 	 * the 'call of the giraffe' suffices. */
+out_halt:
+	/* The longer we expect to idle, the deeper we can sleep.  The hint is only
+	 * for the cpu_halt() after we return. */
+	cpu_idle_hint(predict_idle_usec(rq));
 }
 
 /* Available resources changed (plus or minus).  Some parts of the kernel may
@@ -521,6 +865,215 @@ void put_idle_core(int coreid)
 	spin_unlock(&sched_lock);
 }
 
+/* Preempts pcoreid from proc_to_preempt for the MCP ksched.  We unlock the
+ * ksched lock while preempting.  Afterwards, the core will be track_dealloc'd
+ * and on the idle list, regardless of whether we had to preempt or not. */
+static void __preempt_pcore(struct proc *proc_to_preempt, uint32_t pcoreid)
+{
+	bool success;
+
+	/* need to keep a valid, external ref when we unlock */
+	proc_incref(proc_to_preempt, 1);
+	spin_unlock(&sched_lock);
+	/* sending no warning time for now - just an immediate preempt. */
+	success = proc_preempt_core(proc_to_preempt, pcoreid, 0);
+	/* reaquire locks to protect provisioning and idle lists */
+	spin_lock(&sched_lock);
+	if (success) {
+		/* we preempted it before the proc could yield or die.
+		 * alloc_proc should not have changed (it'll change in death and
+		 * idle CBs).  the core is not on the idle core list.  (if we
+		 * ever have proc alloc lists, it'll still be on the old proc's
+		 * list). */
+		assert(get_alloc_proc(pcoreid));
+		/* regardless of whether or not it is still prov to p, we need
+		 * to note its dealloc.  we are doing some excessive checking of
+		 * p == prov_proc, but using this helper is a lot clearer. */
+		__track_core_dealloc(proc_to_preempt, pcoreid);
+	} else {
+		/* the preempt failed, which should only happen if the pcore was
+		 * unmapped (could be dying, could be yielding, but NOT
+		 * preempted).  whoever unmapped it also triggered (or will soon
+		 * trigger) a track_core_dealloc and put it on the idle list.
+		 * Our signal for this is get_alloc_proc() being 0. We need to
+		 * spin and let whoever is trying to free the core grab the
+		 * ksched lock.  We could use an 'ignore_next_idle' flag per
+		 * sched_pcore, but it's not critical anymore.
+		 *
+		 * Note, we're relying on us being the only preemptor - if the
+		 * core was unmapped by *another* preemptor, there would be no
+		 * way of knowing the core was made idle *yet* (the success
+		 * branch in another thread).  likewise, if there were another
+		 * allocator, the pcore could have been put on the idle list and
+		 * then quickly removed/allocated. */
+		cmb();
+		while (get_alloc_proc(pcoreid)) {
+			/* this loop should be very rare */
+			spin_unlock(&sched_lock);
+			udelay(1);
+			spin_lock(&sched_lock);
+		}
+	}
+	/* no longer need to keep p_to_pre alive */
+	proc_decref(proc_to_preempt);
+}
+
+/* RKM alarm for a preempt warning's deadline.  We don't preempt from here,
+ * since the ksched is the only preemptor; we just tell it to. */
+static void __preempt_alarm(struct alarm_waiter *waiter)
+{
+	struct preempt_warning *pw = container_of(waiter, struct preempt_warning,
+	                                          alarm);
+	bool resched = FALSE;
+
+	spin_lock(&sched_lock);
+	if (!pw->pending) {
+		pw->alarm_armed = FALSE;
+	} else if (read_tsc() < pw->deadline) {
+		/* The core was warned again since we set the alarm */
+		set_awaiter_abs(&pw->alarm, pw->deadline);
+		set_alarm(&per_cpu_info[core_id()].tchain, &pw->alarm);
+	} else {
+		pw->expired = TRUE;
+		pw->alarm_armed = FALSE;
+		resched = TRUE;
+	}
+	spin_unlock(&sched_lock);
+	if (resched)
+		run_scheduler();
+}
+
+/* Called when p gives pcoreid back to us.  Returns TRUE if it was yielding it
+ * in response to our warning, so the ksched can give it to whoever was
+ * waiting.  Hold the sched_lock. */
+static bool __preempt_warning_done(struct proc *p, uint32_t pcoreid)
+{
+	struct preempt_warning *pw = _PERCPU_VARPTR(preempt_warnings, pcoreid);
+
+	if (!pw->pending || (pw->victim != p))
+		return FALSE;
+	pw->pending = FALSE;
+	/* Dying isn't yielding, but someone still wants the core */
+	if (!proc_is_dying(p)) {
+		nr_preempt_yields++;
+		preempt_yield_usec += tsc2usec(read_tsc() - pw->warn_time);
+	}
+	return TRUE;
+}
+
+/* Number of cores we warned someone about on behalf of p, which are on the way
+ * back to the idle pool. */
+static uint32_t __nr_preempts_for(struct proc *p)
+{
+	uint32_t nr = 0;
+
+	for (int i = 0; i < num_cores; i++) {
+		if (_PERCPU_VARPTR(preempt_warnings, i)->pending &&
+		    (_PERCPU_VARPTR(preempt_warnings, i)->for_proc == p))
+			nr++;
+	}
+	return nr;
+}
+
+/* Warns victim that we're taking pcoreid back for p.  It'll come back to the
+ * idle pool when the victim yields it, or when we preempt it after the
+ * deadline.  Like __preempt_pcore(), we unlock the ksched lock for a bit. */
+static void __warn_pcore(struct proc *p, struct proc *victim, uint32_t pcoreid)
+{
+	struct preempt_warning *pw = _PERCPU_VARPTR(preempt_warnings, pcoreid);
+
+	assert(!pw->pending);
+	pw->victim = victim;
+	pw->for_proc = p;
+	pw->warn_time = read_tsc();
+	pw->deadline = pw->warn_time + usec2tsc(PREEMPT_GRACE_USEC);
+	pw->pending = TRUE;
+	pw->expired = FALSE;
+	nr_preempt_warns++;
+	if (!pw->alarm_armed) {
+		pw->alarm_armed = TRUE;
+		set_awaiter_abs(&pw->alarm, pw->deadline);
+		set_alarm(&per_cpu_info[core_id()].tchain, &pw->alarm);
+	}
+	proc_incref(victim, 1);
+	spin_unlock(&sched_lock);
+	/* If this fails, the core was already on its way back (yield or death), and
+	 * __preempt_warning_done() will clear the warning. */
+	proc_preempt_warn_core(victim, pcoreid, PREEMPT_GRACE_USEC);
+	spin_lock(&sched_lock);
+	proc_decref(victim);
+}
+
+/* Preempts the cores whose owners didn't yield them in time.  Hold the sched
+ * lock, which we'll unlock while preempting. */
+static void __force_expired_preempts(void)
+{
+	struct preempt_warning *pw;
+
+	for (int i = 0; i < num_cores; i++) {
+		pw = _PERCPU_VARPTR(preempt_warnings, i);
+		if (!pw->pending || !pw->expired)
+			continue;
+		pw->pending = FALSE;
+		/* If it's not the victim's anymore, it came back on its own */
+		if (get_alloc_proc(i) != pw->victim)
+			continue;
+		nr_preempt_forced++;
+		__preempt_pcore(pw->victim, i);
+	}
+}
+
+/* Finds a core to take from whichever MCP (other than p) is furthest above its
+ * entitlement.  Returns FALSE if they are all within their entitlements. */
+static bool __pick_victim_core(struct proc *p, struct proc **victim_p,
+                               uint32_t *pcoreid_p)
+{
+	struct proc *p_i, *victim = NULL;
+	int victim_pcoreid = -1;
+	long excess, max_excess = 0;
+
+	TAILQ_FOREACH(p_i, primary_mcps, ksched_data.proc_link)
+		p_i->ksched_data.nr_alloc = 0;
+	TAILQ_FOREACH(p_i, secondary_mcps, ksched_data.proc_link)
+		p_i->ksched_data.nr_alloc = 0;
+	/* Only MCPs have allocated cores.  Ones that aren't on a list are either
+	 * p, or dying. */
+	/* Cores we already warned someone about are as good as gone */
+	for (int i = 0; i < num_cores; i++) {
+		p_i = get_alloc_proc(i);
+		if (p_i && (p_i != p) && p_i->ksched_data.cur_list &&
+		    !_PERCPU_VARPTR(preempt_warnings, i)->pending)
+			p_i->ksched_data.nr_alloc++;
+	}
+	for (int l = 0; l < 2; l++) {
+		TAILQ_FOREACH(p_i, l ? secondary_mcps : primary_mcps,
+		              ksched_data.proc_link) {
+			excess = (long)p_i->ksched_data.nr_alloc -
+			         (long)p_i->ksched_data.entitled;
+			if (excess > max_excess) {
+				victim = p_i;
+				max_excess = excess;
+			}
+		}
+	}
+	if (!victim)
+		return FALSE;
+	/* Rather not take the victim's provisioned cores, which it would just take
+	 * back. */
+	for (int i = 0; i < num_cores; i++) {
+		if ((get_alloc_proc(i) != victim) ||
+		    _PERCPU_VARPTR(preempt_warnings, i)->pending)
+			continue;
+		victim_pcoreid = i;
+		if (get_prov_proc(i) != victim)
+			break;
+	}
+	assert(victim_pcoreid >= 0);
+	*victim_p = victim;
+	*pcoreid_p = victim_pcoreid;
+	return TRUE;
+}
+
 /* This deals with a request for more cores.  The amt of new cores needed is
  * passed in.  The ksched lock is held, but we are free to unlock if we want
  * (and we must, if calling out of the ksched to anything high-level).
@@ -536,9 +1089,10 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 	uint32_t corelist[num_cores];
 	uint32_t pcoreid;
 	struct proc *proc_to_preempt;
-	bool success;
 	/* we come in holding the ksched lock, and we hold it here to protect
 	 * allocations and provisioning. */
+	/* Idle cores are lent across pools, but never past a pool's max */
+	amt_needed = MIN(amt_needed, __corepool_room(p));
 	/* get all available cores from their prov_not_alloc list.  the list might
 	 * change when we unlock (new cores added to it, or the entire list emptied,
 	 * but no core allocations will happen (we hold the poke)). */
@@ -547,9 +1101,26 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		 * provisioned to p, and it might not be. */
 		pcoreid = __find_best_core_to_alloc(p);
 		/* If no core is returned, we know that there are no more cores to give
-		 * out, so we exit the loop. */
-		if (pcoreid == -1)
+		 * out, so we exit the loop.  MCPs come before SCPs on CG cores, so we
+		 * first take back any the SCPs borrowed. */
+		if (pcoreid == -1) {
+			if (__scp_rq_reclaim_any())
+				continue;
+			/* Still nothing idle.  If p is below its entitlement, the policy
+			 * lets it take a core from someone above theirs.  We warn them,
+			 * and the core comes back later, either when they yield it or
+			 * when we preempt it. */
+			if ((p->procinfo->res_grant[RES_CORES] + nr_to_grant +
+			     __nr_preempts_for(p) < p->ksched_data.entitled) &&
+			    __pick_victim_core(p, &proc_to_preempt, &pcoreid)) {
+				__warn_pcore(p, proc_to_preempt, pcoreid);
+				continue;
+			}
 			break;
+		}
+		/* Provisioned cores can be lent to the SCPs too */
+		if (_PERCPU_VARPTR(scp_rqs, pcoreid)->active)
+			__scp_rq_reclaim(pcoreid);
 		/* If the pcore chosen currently has a proc allocated to it, we know
 		 * it must be provisioned to p, but not allocated to it. We need to try
 		 * to preempt. After this block, the core will be track_dealloc'd and
@@ -558,50 +1129,7 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			proc_to_preempt = get_alloc_proc(pcoreid);
 			/* would break both preemption and maybe the later decref */
 			assert(proc_to_preempt != p);
-			/* need to keep a valid, external ref when we unlock */
-			proc_incref(proc_to_preempt, 1);
-			spin_unlock(&sched_lock);
-			/* sending no warning time for now - just an immediate preempt. */
-			success = proc_preempt_core(proc_to_preempt, pcoreid, 0);
-			/* reaquire locks to protect provisioning and idle lists */
-			spin_lock(&sched_lock);
-			if (success) {
-				/* we preempted it before the proc could yield or die.
-				 * alloc_proc should not have changed (it'll change in death and
-				 * idle CBs).  the core is not on the idle core list.  (if we
-				 * ever have proc alloc lists, it'll still be on the old proc's
-				 * list). */
-				assert(get_alloc_proc(pcoreid));
-				/* regardless of whether or not it is still prov to p, we need
-				 * to note its dealloc.  we are doing some excessive checking of
-				 * p == prov_proc, but using this helper is a lot clearer. */
-				__track_core_dealloc(proc_to_preempt, pcoreid);
-			} else {
-				/* the preempt failed, which should only happen if the pcore was
-				 * unmapped (could be dying, could be yielding, but NOT
-				 * preempted).  whoever unmapped it also triggered (or will soon
-				 * trigger) a track_core_dealloc and put it on the idle list.
-				 * Our signal for this is get_alloc_proc() being 0. We need to
-				 * spin and let whoever is trying to free the core grab the
-				 * ksched lock.  We could use an 'ignore_next_idle' flag per
-				 * sched_pcore, but it's not critical anymore.
-				 *
-				 * Note, we're relying on us being the only preemptor - if the
-				 * core was unmapped by *another* preemptor, there would be no
-				 * way of knowing the core was made idle *yet* (the success
-				 * branch in another thread).  likewise, if there were another
-				 * allocator, the pcore could have been put on the idle list and
-				 * then quickly removed/allocated. */
-				cmb();
-				while (get_alloc_proc(pcoreid)) {
-					/* this loop should be very rare */
-					spin_unlock(&sched_lock);
-					udelay(1);
-					spin_lock(&sched_lock);
-				}
-			}
-			/* no longer need to keep p_to_pre alive */
-			proc_decref(proc_to_preempt);
+			__preempt_pcore(proc_to_preempt, pcoreid);
 			/* might not be prov to p anymore (rare race). pcoreid is idle - we
 			 * might get it later, or maybe we'll give it to its rightful proc*/
 			if (get_prov_proc(pcoreid) != p)
@@ -679,19 +1207,138 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 	return 0;
 }
 
+int ksched_set_weight(struct proc *p, unsigned int weight)
+{
+	if (!weight || (weight > KSCHED_MAX_WEIGHT)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	spin_lock(&sched_lock);
+	p->ksched_data.weight = weight;
+	spin_unlock(&sched_lock);
+	poke_ksched(p, RES_CORES);
+	return 0;
+}
+
+int ksched_set_latency(struct proc *p, unsigned int latency_usec)
+{
+	if (latency_usec > KSCHED_MAX_LATENCY_USEC) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	spin_lock(&sched_lock);
+	p->ksched_data.latency_usec = latency_usec;
+	spin_unlock(&sched_lock);
+	poke_ksched(p, RES_CORES);
+	return 0;
+}
+
+static int __corepool_done(int ret)
+{
+	spin_unlock(&sched_lock);
+	if (!ret)
+		poke(&ksched_poker, 0);
+	return ret;
+}
+
+int corepool_create(const char *name, const char *parent, uint32_t min_cores,
+                    uint32_t max_cores)
+{
+	struct core_pool *cp = kzmalloc(sizeof(struct core_pool), MEM_WAIT);
+	int ret;
+
+	kstrdup(&cp->owner, current->user.name);
+	spin_lock(&sched_lock);
+	ret = __corepool_create(cp, name, parent, min_cores, max_cores);
+	__corepool_done(ret);
+	if (ret) {
+		kfree(cp->owner);
+		kfree(cp);
+	}
+	return ret;
+}
+
+int corepool_set_limits(const char *name, uint32_t min_cores,
+                        uint32_t max_cores)
+{
+	spin_lock(&sched_lock);
+	return __corepool_done(__corepool_set_limits(name, min_cores, max_cores));
+}
+
+int corepool_set_weight(const char *name, unsigned int weight)
+{
+	spin_lock(&sched_lock);
+	return __corepool_done(__corepool_set_weight(name, weight));
+}
+
+int corepool_remove(const char *name)
+{
+	struct core_pool *cp;
+
+	spin_lock(&sched_lock);
+	cp = __corepool_remove(name);
+	spin_unlock(&sched_lock);
+	if (!cp)
+		return -1;
+	kfree(cp->owner);
+	kfree(cp);
+	return 0;
+}
+
+int corepool_set_proc(struct proc *p, const char *name, const char *user)
+{
+	spin_lock(&sched_lock);
+	return __corepool_done(__corepool_set_proc(p, name, user));
+}
+
+struct sized_alloc *corepool_build_status(void)
+{
+	struct sized_alloc *sza;
+	/* Room for a few pools made while we weren't looking */
+	size_t bufsz = (ACCESS_ONCE(nr_core_pools) + 9) * CORE_POOL_LINE_SZ;
+
+	sza = sized_kzmalloc(bufsz, MEM_WAIT);
+	spin_lock(&sched_lock);
+	sza->size = __corepool_print(sza->buf, bufsz);
+	spin_unlock(&sched_lock);
+	return sza;
+}
+
 /************** Debugging **************/
 void sched_diag(void)
 {
 	struct proc *p;
+	struct scp_rq *rq;
+
 	spin_lock(&sched_lock);
-	TAILQ_FOREACH(p, &runnable_scps, ksched_data.proc_link)
-		printk("Runnable _S PID: %d\n", p->pid);
+	for (int i = 0; i < num_cores; i++) {
+		rq = _PERCPU_VARPTR(scp_rqs, i);
+		if (!rq->active && !rq->nr_runnable)
+			continue;
+		printk("SCP core %d: %s, %u runnable, %lu borrows, %lu steals\n", i,
+		       rq->active ? "active" : "inactive", rq->nr_runnable,
+		       rq->nr_borrows, rq->nr_steals);
+		TAILQ_FOREACH(p, &rq->runnable, ksched_data.proc_link)
+			printk("\tRunnable _S PID: %d\n", p->pid);
+	}
 	TAILQ_FOREACH(p, &unrunnable_scps, ksched_data.proc_link)
 		printk("Unrunnable _S PID: %d\n", p->pid);
+	printk("MCP policy: %s, tick %s\n", ksched_policy->name,
+	       ksched_tick_armed ? "on" : "off");
+	printk("Preempt warnings: %lu, yielded: %lu (avg %llu usec), forced: %lu\n",
+	       nr_preempt_warns, nr_preempt_yields,
+	       nr_preempt_yields ? preempt_yield_usec / nr_preempt_yields : 0,
+	       nr_preempt_forced);
 	TAILQ_FOREACH(p, primary_mcps, ksched_data.proc_link)
-		printk("Primary MCP PID: %d\n", p->pid);
+		printk("Primary MCP PID: %d, pool %s, weight %u, latency %u usec, "
+		       "entitled %u\n",
+		       p->pid, p->ksched_data.pool->name, p->ksched_data.weight,
+		       p->ksched_data.latency_usec, p->ksched_data.entitled);
 	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link)
-		printk("Secondary MCP PID: %d\n", p->pid);
+		printk("Secondary MCP PID: %d, pool %s, weight %u, latency %u usec, "
+		       "entitled %u\n",
+		       p->pid, p->ksched_data.pool->name, p->ksched_data.weight,
+		       p->ksched_data.latency_usec, p->ksched_data.entitled);
 	spin_unlock(&sched_lock);
 	return;
 }
@@ -713,9 +1360,7 @@ void print_all_resources(void)
 	{
 		print_resources((struct proc*)item);
 	}
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, __print_resources, NULL);
-	spin_unlock(&pid_hash_lock);
+	pid_for_each(__print_resources, NULL);
 }
 
 void next_core_to_alloc(uint32_t pcoreid)
@@ -86,6 +86,7 @@
 #include <kmalloc.h>
 #include <hash.h>
 #include <arena.h>
+#include <arch/topology.h>
 
 #define SLAB_POISON ((void*)0xdead1111)
 
@@ -98,10 +99,14 @@ unsigned int resize_threshold = 1;
 struct kmem_cache_tailq all_kmem_caches =
 		TAILQ_HEAD_INITIALIZER(all_kmem_caches);
 
+/* Set once we know the NUMA layout and have the per-domain kpages arenas. */
+static bool kmc_numa_ready;
+
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
-static bool kmem_cache_grow(struct kmem_cache *cp);
-static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags);
+static bool kmem_cache_grow(struct kmem_cache *cp, int node);
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int node,
+                                    int flags);
 static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
@@ -127,6 +132,23 @@ static struct kmem_pcpu_cache *get_my_pcpu_cache(struct kmem_cache *kc)
 	return &kc->pcpu_caches[core_id()];
 }
 
+/* The NUMA domain of the calling core, as far as kc is concerned. */
+static int get_my_node(struct kmem_cache *kc)
+{
+	if (kc->nr_nodes == 1)
+		return 0;
+	return core_numa_id(core_id());
+}
+
+/* The NUMA domain of buf's memory.  Only NUMA-aware caches have more than one
+ * node, and those pull from kpages, so buf is a KERNBASE address. */
+static int get_obj_node(struct kmem_cache *kc, void *buf)
+{
+	if (kc->nr_nodes == 1)
+		return 0;
+	return paddr_numa_id(PADDR(buf));
+}
+
 /* In our current model, there is one pcc per core.  If we had multiple cores
  * that could use the pcc, such as with per-NUMA caches, then we'd need a
  * spinlock.  Since we do allocations from IRQ context, we still need to disable
@@ -145,8 +167,10 @@ static void lock_depot(struct kmem_depot *depot)
 {
 	uint64_t time;
 
-	if (spin_trylock_irqsave(&depot->lock))
+	if (spin_trylock_irqsave(&depot->lock)) {
+		depot->nr_lock_acquires++;
 		return;
+	}
 	/* The lock is contended.  When we finally get the lock, we'll up the
 	 * contention count and see if we've had too many contentions over time.
 	 *
@@ -162,6 +186,8 @@ static void lock_depot(struct kmem_depot *depot)
 	 * might then think the burst wasn't big enough. */
 	time = nsec();
 	spin_lock_irqsave(&depot->lock);
+	depot->nr_lock_acquires++;
+	depot->nr_lock_contended++;
 	/* If there are no not-empty mags, we're probably fighting for the lock not
 	 * because the magazines aren't big enough, but because there aren't enough
 	 * mags in the system yet. */
@@ -174,7 +200,10 @@ static void lock_depot(struct kmem_depot *depot)
 	depot->busy_count++;
 	if (depot->busy_count > resize_threshold) {
 		depot->busy_count = 0;
-		depot->magsize = MIN(KMC_MAG_MAX_SZ, depot->magsize + 1);
+		if (depot->magsize < KMC_MAG_MAX_SZ) {
+			depot->magsize++;
+			depot->nr_magsize_grows++;
+		}
 		/* That's all we do - the pccs will eventually notice and up their
 		 * magazine sizes. */
 	}
@@ -195,6 +224,9 @@ static void depot_init(struct kmem_depot *depot)
 	depot->nr_empty = 0;
 	depot->busy_count = 0;
 	depot->busy_start = 0;
+	depot->nr_lock_acquires = 0;
+	depot->nr_lock_contended = 0;
+	depot->nr_magsize_grows = 0;
 }
 
 static bool mag_is_empty(struct kmem_magazine *mag)
@@ -213,10 +245,9 @@ static void __swap_mags(struct kmem_pcpu_cache *pcc)
 }
 
 /* Helper, returns a magazine to the depot.  Hold the depot lock. */
-static void __return_to_depot(struct kmem_cache *kc, struct kmem_magazine *mag)
+static void __return_to_depot(struct kmem_depot *depot,
+                              struct kmem_magazine *mag)
 {
-	struct kmem_depot *depot = &kc->depot;
-
 	if (mag_is_empty(mag)) {
 		SLIST_INSERT_HEAD(&depot->empty, mag, link);
 		depot->nr_empty++;
@@ -248,13 +279,70 @@ static struct kmem_pcpu_cache *build_pcpu_caches(void)
 	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
 		pcc[i].irq_state = 0;
 		pcc[i].magsize = KMC_MAG_MIN_SZ;
-		pcc[i].loaded = __kmem_alloc_from_slab(kmem_magazine_cache, MEM_WAIT);
-		pcc[i].prev = __kmem_alloc_from_slab(kmem_magazine_cache, MEM_WAIT);
+		pcc[i].loaded = __kmem_alloc_from_slab(kmem_magazine_cache, 0,
+		                                       MEM_WAIT);
+		pcc[i].prev = __kmem_alloc_from_slab(kmem_magazine_cache, 0, MEM_WAIT);
 		pcc[i].nr_allocs_ever = 0;
+		pcc[i].nr_frees_ever = 0;
+		pcc[i].nr_alloc_misses = 0;
+		pcc[i].nr_free_misses = 0;
 	}
 	return pcc;
 }
 
+static void kmem_node_init(struct kmem_node *kn, struct arena *source)
+{
+	depot_init(&kn->depot);
+	kn->source = source;
+	TAILQ_INIT(&kn->full_slab_list);
+	TAILQ_INIT(&kn->partial_slab_list);
+	TAILQ_INIT(&kn->empty_slab_list);
+	kn->amt_imported = 0;
+}
+
+/* Only caches that pull from kpages get per-domain nodes.  Everyone else (base
+ * arena users, qcaches, vmap, etc) either can't or shouldn't know about the
+ * domains of their source's resources. */
+static bool __use_numa_nodes(struct kmem_cache *kc)
+{
+	return kmc_numa_ready && (num_numa > 1) && (kc->source == kpages_arena) &&
+	       !(kc->flags & KMC_QCACHE);
+}
+
+/* Switches kc from its single static node to one node per NUMA domain.  Node 0
+ * takes over the static node's slabs and magazines, which is fine even if some
+ * of those objects are from other domains: we just lose a little locality. */
+static void build_numa_nodes(struct kmem_cache *kc)
+{
+	struct kmem_node *nodes, *old = kc->static_node;
+
+	if (!__use_numa_nodes(kc))
+		return;
+	nodes = base_alloc(NULL, sizeof(struct kmem_node) * num_numa, MEM_WAIT);
+	for (int i = 0; i < num_numa; i++)
+		kmem_node_init(&nodes[i], kpages_numa_arenas[i]);
+	spin_lock_irqsave(&kc->cache_lock);
+	lock_depot(&old->depot);
+	TAILQ_CONCAT(&nodes[0].full_slab_list, &old->full_slab_list, link);
+	TAILQ_CONCAT(&nodes[0].partial_slab_list, &old->partial_slab_list, link);
+	TAILQ_CONCAT(&nodes[0].empty_slab_list, &old->empty_slab_list, link);
+	nodes[0].amt_imported = old->amt_imported;
+	old->amt_imported = 0;
+	nodes[0].depot.not_empty = old->depot.not_empty;
+	nodes[0].depot.empty = old->depot.empty;
+	nodes[0].depot.magsize = old->depot.magsize;
+	nodes[0].depot.nr_empty = old->depot.nr_empty;
+	nodes[0].depot.nr_not_empty = old->depot.nr_not_empty;
+	SLIST_INIT(&old->depot.not_empty);
+	SLIST_INIT(&old->depot.empty);
+	old->depot.nr_empty = 0;
+	old->depot.nr_not_empty = 0;
+	kc->nodes = nodes;
+	kc->nr_nodes = num_numa;
+	unlock_depot(&old->depot);
+	spin_unlock_irqsave(&kc->cache_lock);
+}
+
 void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                          size_t obj_size, int align, int flags,
                          struct arena *source,
@@ -277,9 +365,9 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->flags = flags;
 	/* We might want some sort of per-call site NUMA-awareness in the future. */
 	kc->source = source ? source : kpages_arena;
-	TAILQ_INIT(&kc->full_slab_list);
-	TAILQ_INIT(&kc->partial_slab_list);
-	TAILQ_INIT(&kc->empty_slab_list);
+	kmem_node_init(&kc->static_node[0], kc->source);
+	kc->nodes = kc->static_node;
+	kc->nr_nodes = 1;
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->priv = priv;
@@ -294,7 +382,7 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	 * assume we're importing from a PGSIZE-aligned source arena. */
 	if ((obj_size > SLAB_LARGE_CUTOFF) || (flags & KMC_NOTOUCH))
 		kc->flags |= __KMC_USE_BUFCTL;
-	depot_init(&kc->depot);
+	build_numa_nodes(kc);
 	/* We do this last, since this will all into the magazine cache - which we
 	 * could be creating on this call! */
 	kc->pcpu_caches = build_pcpu_caches();
@@ -335,6 +423,19 @@ void kmem_cache_init(void)
 	                    NULL, NULL, NULL);
 }
 
+/* Called once the per-domain kpages arenas exist.  Caches created from here on
+ * will get their NUMA nodes during creation. */
+void kmem_cache_numa_init(void)
+{
+	struct kmem_cache *kc_i;
+
+	kmc_numa_ready = TRUE;
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
+		build_numa_nodes(kc_i);
+	qunlock(&arenas_and_slabs_lock);
+}
+
 /* Cache management */
 struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
                                      int align, int flags,
@@ -356,24 +457,25 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
 static void drain_pcpu_caches(struct kmem_cache *kc)
 {
 	struct kmem_pcpu_cache *pcc;
+	struct kmem_depot *depot;
 
 	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
 		pcc = &kc->pcpu_caches[i];
+		depot = &kc->nodes[kc->nr_nodes == 1 ? 0 : core_numa_id(i)].depot;
 		lock_pcu_cache(pcc);
-		lock_depot(&kc->depot);
-		__return_to_depot(kc, pcc->loaded);
-		__return_to_depot(kc, pcc->prev);
-		unlock_depot(&kc->depot);
+		lock_depot(depot);
+		__return_to_depot(depot, pcc->loaded);
+		__return_to_depot(depot, pcc->prev);
+		unlock_depot(depot);
 		pcc->loaded = SLAB_POISON;
 		pcc->prev = SLAB_POISON;
 		unlock_pcu_cache(pcc);
 	}
 }
 
-static void depot_destroy(struct kmem_cache *kc)
+static void depot_destroy(struct kmem_cache *kc, struct kmem_depot *depot)
 {
 	struct kmem_magazine *mag_i;
-	struct kmem_depot *depot = &kc->depot;
 
 	lock_depot(depot);
 	while ((mag_i = SLIST_FIRST(&depot->not_empty))) {
@@ -387,8 +489,11 @@ static void depot_destroy(struct kmem_cache *kc)
 
 static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 {
+	struct arena *source = cp->nodes[a_slab->node].source;
+
 	if (!__use_bufctls(cp)) {
-		arena_free(cp->source, ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
+		arena_free(source, ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
+		cp->nodes[a_slab->node].amt_imported -= PGSIZE;
 	} else {
 		struct kmem_bufctl *i, *temp;
 		void *buf_start = (void*)SIZE_MAX;
@@ -400,7 +505,8 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 			 * init the freelist when we reuse the slab. */
 			kmem_cache_free(kmem_bufctl_cache, i);
 		}
-		arena_free(cp->source, buf_start, cp->import_amt);
+		arena_free(source, buf_start, cp->import_amt);
+		cp->nodes[a_slab->node].amt_imported -= cp->import_amt;
 		kmem_cache_free(kmem_slab_cache, a_slab);
 	}
 }
@@ -410,26 +516,33 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 void kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
+	struct kmem_node *kn;
 
 	qlock(&arenas_and_slabs_lock);
 	TAILQ_REMOVE(&all_kmem_caches, cp, all_kmc_link);
 	qunlock(&arenas_and_slabs_lock);
 	del_importing_slab(cp->source, cp);
 	drain_pcpu_caches(cp);
-	depot_destroy(cp);
+	for (int i = 0; i < cp->nr_nodes; i++)
+		depot_destroy(cp, &cp->nodes[i].depot);
 	spin_lock_irqsave(&cp->cache_lock);
-	assert(TAILQ_EMPTY(&cp->full_slab_list));
-	assert(TAILQ_EMPTY(&cp->partial_slab_list));
-	/* Clean out the empty list.  We can't use a regular FOREACH here, since the
-	 * link element is stored in the slab struct, which is stored on the page
-	 * that we are freeing. */
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
-	while (a_slab) {
-		next = TAILQ_NEXT(a_slab, link);
-		kmem_slab_destroy(cp, a_slab);
-		a_slab = next;
+	for (int i = 0; i < cp->nr_nodes; i++) {
+		kn = &cp->nodes[i];
+		assert(TAILQ_EMPTY(&kn->full_slab_list));
+		assert(TAILQ_EMPTY(&kn->partial_slab_list));
+		/* Clean out the empty list.  We can't use a regular FOREACH here, since
+		 * the link element is stored in the slab struct, which is stored on the
+		 * page that we are freeing. */
+		a_slab = TAILQ_FIRST(&kn->empty_slab_list);
+		while (a_slab) {
+			next = TAILQ_NEXT(a_slab, link);
+			kmem_slab_destroy(cp, a_slab);
+			a_slab = next;
+		}
 	}
 	spin_unlock_irqsave(&cp->cache_lock);
+	if (cp->nodes != cp->static_node)
+		base_free(NULL, cp->nodes, sizeof(struct kmem_node) * cp->nr_nodes);
 	kmem_cache_free(kmem_cache_cache, cp);
 }
 
@@ -498,29 +611,48 @@ static struct kmem_bufctl *__yank_bufctl(struct kmem_cache *cp, void *buf)
 	return bc_i;
 }
 
-/* Alloc, bypassing the magazines and depot */
-static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
+/* Helper: finds a slab with a free object on @node, growing the cache if
+ * needed, and makes sure it is on the partial list.  Hold the cache lock. */
+static struct kmem_slab *__get_partial_slab(struct kmem_cache *cp, int node)
+{
+	struct kmem_node *kn = &cp->nodes[node];
+	struct kmem_slab *a_slab;
+
+	a_slab = TAILQ_FIRST(&kn->partial_slab_list);
+	if (a_slab)
+		return a_slab;
+	// TODO: think about non-sleeping flags
+	if (TAILQ_EMPTY(&kn->empty_slab_list) && !kmem_cache_grow(cp, node))
+		return NULL;
+	// move to partial list
+	a_slab = TAILQ_FIRST(&kn->empty_slab_list);
+	TAILQ_REMOVE(&kn->empty_slab_list, a_slab, link);
+	TAILQ_INSERT_HEAD(&kn->partial_slab_list, a_slab, link);
+	return a_slab;
+}
+
+/* Alloc, bypassing the magazines and depot.  We prefer objects from @node, but
+ * will take them from any other node before giving up. */
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int node, int flags)
 {
 	void *retval = NULL;
+	struct kmem_node *kn;
+	struct kmem_slab *a_slab;
+
 	spin_lock_irqsave(&cp->cache_lock);
-	// look at partial list
-	struct kmem_slab *a_slab = TAILQ_FIRST(&cp->partial_slab_list);
-	// 	if none, go to empty list and get an empty and make it partial
+	a_slab = __get_partial_slab(cp, node);
+	for (int i = 0; !a_slab && (i < cp->nr_nodes); i++) {
+		if (i != node)
+			a_slab = __get_partial_slab(cp, i);
+	}
 	if (!a_slab) {
-		// TODO: think about non-sleeping flags
-		if (TAILQ_EMPTY(&cp->empty_slab_list) &&
-			!kmem_cache_grow(cp)) {
-			spin_unlock_irqsave(&cp->cache_lock);
-			if (flags & MEM_ERROR)
-				error(ENOMEM, ERROR_FIXME);
-			else
-				panic("[German Accent]: OOM for a small slab growth!!!");
-		}
-		// move to partial list
-		a_slab = TAILQ_FIRST(&cp->empty_slab_list);
-		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
-		TAILQ_INSERT_HEAD(&cp->partial_slab_list, a_slab, link);
+		spin_unlock_irqsave(&cp->cache_lock);
+		if (flags & MEM_ERROR)
+			error(ENOMEM, ERROR_FIXME);
+		else
+			panic("[German Accent]: OOM for a small slab growth!!!");
 	}
+	kn = &cp->nodes[a_slab->node];
 	// have a partial now (a_slab), get an item, return item
 	if (!__use_bufctls(cp)) {
 		retval = a_slab->free_small_obj;
@@ -538,8 +670,8 @@ static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
 	a_slab->num_busy_obj++;
 	// Check if we are full, if so, move to the full list
 	if (a_slab->num_busy_obj == a_slab->num_total_obj) {
-		TAILQ_REMOVE(&cp->partial_slab_list, a_slab, link);
-		TAILQ_INSERT_HEAD(&cp->full_slab_list, a_slab, link);
+		TAILQ_REMOVE(&kn->partial_slab_list, a_slab, link);
+		TAILQ_INSERT_HEAD(&kn->full_slab_list, a_slab, link);
 	}
 	cp->nr_cur_alloc++;
 	spin_unlock_irqsave(&cp->cache_lock);
@@ -556,16 +688,17 @@ static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
 void *kmem_cache_alloc(struct kmem_cache *kc, int flags)
 {
 	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
-	struct kmem_depot *depot = &kc->depot;
+	int node = get_my_node(kc);
+	struct kmem_depot *depot = &kc->nodes[node].depot;
 	struct kmem_magazine *mag;
 	void *ret;
 
 	lock_pcu_cache(pcc);
+	pcc->nr_allocs_ever++;
 try_alloc:
 	if (pcc->loaded->nr_rounds) {
 		ret = pcc->loaded->rounds[pcc->loaded->nr_rounds - 1];
 		pcc->loaded->nr_rounds--;
-		pcc->nr_allocs_ever++;
 		unlock_pcu_cache(pcc);
 		return ret;
 	}
@@ -573,13 +706,14 @@ try_alloc:
 		__swap_mags(pcc);
 		goto try_alloc;
 	}
+	pcc->nr_alloc_misses++;
 	/* Note the lock ordering: pcc -> depot */
 	lock_depot(depot);
 	mag = SLIST_FIRST(&depot->not_empty);
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->not_empty, link);
 		depot->nr_not_empty--;
-		__return_to_depot(kc, pcc->prev);
+		__return_to_depot(depot, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
 		pcc->loaded = mag;
@@ -587,7 +721,7 @@ try_alloc:
 	}
 	unlock_depot(depot);
 	unlock_pcu_cache(pcc);
-	return __kmem_alloc_from_slab(kc, flags);
+	return __kmem_alloc_from_slab(kc, node, flags);
 }
 
 /* Returns an object to the slab layer.  Caller must deconstruct the objects.
@@ -596,6 +730,7 @@ static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
+	struct kmem_node *kn;
 
 	spin_lock_irqsave(&cp->cache_lock);
 	if (!__use_bufctls(cp)) {
@@ -614,25 +749,75 @@ static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 	}
 	a_slab->num_busy_obj--;
 	cp->nr_cur_alloc--;
+	kn = &cp->nodes[a_slab->node];
 	// if it was full, move it to partial
 	if (a_slab->num_busy_obj + 1 == a_slab->num_total_obj) {
-		TAILQ_REMOVE(&cp->full_slab_list, a_slab, link);
-		TAILQ_INSERT_HEAD(&cp->partial_slab_list, a_slab, link);
+		TAILQ_REMOVE(&kn->full_slab_list, a_slab, link);
+		TAILQ_INSERT_HEAD(&kn->partial_slab_list, a_slab, link);
 	} else if (!a_slab->num_busy_obj) {
 		// if there are none, move to from partial to empty
-		TAILQ_REMOVE(&cp->partial_slab_list, a_slab, link);
-		TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+		TAILQ_REMOVE(&kn->partial_slab_list, a_slab, link);
+		TAILQ_INSERT_HEAD(&kn->empty_slab_list, a_slab, link);
 	}
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
+/* Frees buf to the depot of @node, which is not our node.  Our pcpu cache only
+ * holds objects from our own node, so remote objects skip it and go back to
+ * their home node, where that node's cores will get them. */
+static void kmem_free_to_node(struct kmem_cache *kc, int node, void *buf)
+{
+	struct kmem_depot *depot = &kc->nodes[node].depot;
+	struct kmem_magazine *mag;
+
+try_free:
+	lock_depot(depot);
+	mag = SLIST_FIRST(&depot->not_empty);
+	if (mag && (mag->nr_rounds < depot->magsize)) {
+		mag->rounds[mag->nr_rounds] = buf;
+		mag->nr_rounds++;
+		unlock_depot(depot);
+		return;
+	}
+	mag = SLIST_FIRST(&depot->empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		mag->rounds[mag->nr_rounds] = buf;
+		mag->nr_rounds++;
+		__return_to_depot(depot, mag);
+		unlock_depot(depot);
+		return;
+	}
+	unlock_depot(depot);
+	mag = kmem_cache_alloc(kmem_magazine_cache, MEM_ATOMIC);
+	if (mag) {
+		assert(mag->nr_rounds == 0);
+		lock_depot(depot);
+		SLIST_INSERT_HEAD(&depot->empty, mag, link);
+		depot->nr_empty++;
+		unlock_depot(depot);
+		goto try_free;
+	}
+	if (kc->dtor)
+		kc->dtor(buf, kc->priv);
+	__kmem_free_to_slab(kc, buf);
+}
+
 void kmem_cache_free(struct kmem_cache *kc, void *buf)
 {
 	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
-	struct kmem_depot *depot = &kc->depot;
+	int node = get_my_node(kc);
+	int obj_node = get_obj_node(kc, buf);
+	struct kmem_depot *depot = &kc->nodes[node].depot;
 	struct kmem_magazine *mag;
 
+	if (obj_node != node) {
+		kmem_free_to_node(kc, obj_node, buf);
+		return;
+	}
 	lock_pcu_cache(pcc);
+	pcc->nr_frees_ever++;
 try_free:
 	if (pcc->loaded->nr_rounds < pcc->magsize) {
 		pcc->loaded->rounds[pcc->loaded->nr_rounds] = buf;
@@ -647,6 +832,7 @@ try_free:
 		__swap_mags(pcc);
 		goto try_free;
 	}
+	pcc->nr_free_misses++;
 	lock_depot(depot);
 	/* Here's where the resize magic happens.  We'll start using it for the next
 	 * magazine. */
@@ -655,7 +841,7 @@ try_free:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->empty, link);
 		depot->nr_empty--;
-		__return_to_depot(kc, pcc->prev);
+		__return_to_depot(depot, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
 		pcc->loaded = mag;
@@ -689,8 +875,9 @@ try_free:
  * Grab the cache lock before calling this.
  *
  * TODO: think about page colouring issues with kernel memory allocation. */
-static bool kmem_cache_grow(struct kmem_cache *cp)
+static bool kmem_cache_grow(struct kmem_cache *cp, int node)
 {
+	struct kmem_node *kn = &cp->nodes[node];
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
 
@@ -700,9 +887,10 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		/* Careful, this assumes our source is a PGSIZE-aligned allocator.  We
 		 * could use xalloc to enforce the alignment, but that'll bypass the
 		 * qcaches, which we don't want.  Caller beware. */
-		a_page = arena_alloc(cp->source, PGSIZE, MEM_ATOMIC);
+		a_page = arena_alloc(kn->source, PGSIZE, MEM_ATOMIC);
 		if (!a_page)
 			return FALSE;
+		kn->amt_imported += PGSIZE;
 		// the slab struct is stored at the end of the page
 		a_slab = (struct kmem_slab*)(a_page + PGSIZE
 		                             - sizeof(struct kmem_slab));
@@ -725,11 +913,12 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab = kmem_cache_alloc(kmem_slab_cache, 0);
 		if (!a_slab)
 			return FALSE;
-		buf = arena_alloc(cp->source, cp->import_amt, MEM_ATOMIC);
+		buf = arena_alloc(kn->source, cp->import_amt, MEM_ATOMIC);
 		if (!buf) {
 			kmem_cache_free(kmem_slab_cache, a_slab);
 			return FALSE;
 		}
+		kn->amt_imported += cp->import_amt;
 		a_slab->num_busy_obj = 0;
 		a_slab->num_total_obj = cp->import_amt / cp->obj_size;
 		BSD_LIST_INIT(&a_slab->bufctl_freelist);
@@ -742,26 +931,76 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 			buf += cp->obj_size;
 		}
 	}
+	a_slab->node = node;
 	// add a_slab to the empty_list
-	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+	TAILQ_INSERT_HEAD(&kn->empty_slab_list, a_slab, link);
 
 	return TRUE;
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+/* Gives all of the depot's magazines back: the objects go back to the slab
+ * layer and the magazines go back to the magazine cache.  The pcpu caches keep
+ * their magazines.  We pull the mags off the depot first, since draining takes
+ * the cache lock and possibly calls back into the slab allocator. */
+static void depot_reap(struct kmem_cache *kc, struct kmem_depot *depot)
+{
+	struct kmem_mag_slist mags = SLIST_HEAD_INITIALIZER(mags);
+	struct kmem_magazine *mag_i;
+
+	lock_depot(depot);
+	while ((mag_i = SLIST_FIRST(&depot->not_empty))) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		SLIST_INSERT_HEAD(&mags, mag_i, link);
+	}
+	while ((mag_i = SLIST_FIRST(&depot->empty))) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		SLIST_INSERT_HEAD(&mags, mag_i, link);
+	}
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	unlock_depot(depot);
+	while ((mag_i = SLIST_FIRST(&mags))) {
+		SLIST_REMOVE_HEAD(&mags, link);
+		drain_mag(kc, mag_i);
+		kmem_cache_free(kmem_magazine_cache, mag_i);
+	}
+}
+
+/* This deallocs every slab from the empty list, after emptying the depot into
+ * the slabs.  TODO: think a bit more about this.  We can do things like not
+ * free all of the empty lists to prevent thrashing.  See 3.4 in the paper. */
 void kmem_cache_reap(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 
+	for (int i = 0; i < cp->nr_nodes; i++)
+		depot_reap(cp, &cp->nodes[i].depot);
 	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_lock_irqsave(&cp->cache_lock);
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
-	while (a_slab) {
-		next = TAILQ_NEXT(a_slab, link);
-		kmem_slab_destroy(cp, a_slab);
-		a_slab = next;
+	for (int i = 0; i < cp->nr_nodes; i++) {
+		a_slab = TAILQ_FIRST(&cp->nodes[i].empty_slab_list);
+		while (a_slab) {
+			next = TAILQ_NEXT(a_slab, link);
+			kmem_slab_destroy(cp, a_slab);
+			a_slab = next;
+		}
+		TAILQ_INIT(&cp->nodes[i].empty_slab_list);
 	}
 	spin_unlock_irqsave(&cp->cache_lock);
 }
+
+/* Sets the magazine size for a cache we know will be busy, instead of waiting
+ * for depot contention to grow it.  Like a resize, the pcpu caches pick it up
+ * the next time they go to the depot. */
+void kmem_cache_set_magsize(struct kmem_cache *kc, unsigned int magsize)
+{
+	struct kmem_depot *depot;
+
+	magsize = MIN(MAX(magsize, KMC_MAG_MIN_SZ), KMC_MAG_MAX_SZ);
+	for (int i = 0; i < kc->nr_nodes; i++) {
+		depot = &kc->nodes[i].depot;
+		spin_lock_irqsave(&depot->lock);
+		depot->magsize = magsize;
+		spin_unlock_irqsave(&depot->lock);
+	}
+}
@@ -20,6 +20,7 @@
 #include <kmalloc.h>
 #include <core_set.h>
 #include <completion.h>
+#include <rcu.h>
 
 struct all_cpu_work {
 	struct completion comp;
@@ -69,6 +70,7 @@ static void __attribute__((noreturn)) __smp_idle(void *arg)
 	while (1) {
 		disable_irq();
 		process_routine_kmsg();
+		rcu_report_qs();
 		try_run_proc();
 		cpu_bored();		/* call out to the ksched */
 		/* cpu_halt() atomically turns on interrupts and halts the core.
@@ -109,10 +111,8 @@ void smp_percpu_init(void)
 	kthread->flags = KTH_KTASK_FLAGS;
 	per_cpu_info[coreid].spare = 0;
 	/* Init relevant lists */
-	spinlock_init_irqsave(&per_cpu_info[coreid].immed_amsg_lock);
-	STAILQ_INIT(&per_cpu_info[coreid].immed_amsgs);
-	spinlock_init_irqsave(&per_cpu_info[coreid].routine_amsg_lock);
-	STAILQ_INIT(&per_cpu_info[coreid].routine_amsgs);
+	kmsg_queue_init(&per_cpu_info[coreid].immed_amsgs);
+	kmsg_queue_init(&per_cpu_info[coreid].routine_amsgs);
 	/* Initialize the per-core timer chain */
 	init_timer_chain(&per_cpu_info[coreid].tchain, set_pcpu_alarm_interrupt);
 	/* Init generic tracing ring */
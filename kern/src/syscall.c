@@ -713,6 +713,12 @@ static int sys_change_vcore(struct proc *p, uint32_t vcoreid,
 	return proc_change_to_vcore(p, vcoreid, enable_my_notif);
 }
 
+static int sys_handoff_vcore(struct proc *p, uint32_t vcoreid)
+{
+	/* Same as change_vcore, we leave errno alone */
+	return proc_handoff_vcore(p, vcoreid);
+}
+
 static ssize_t sys_fork(env_t* e)
 {
 	uintptr_t temp;
@@ -1285,8 +1291,9 @@ static int sys_halt_core(struct proc *p, unsigned long usec)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct preempt_data *vcpd;
-	/* The user can only halt CG cores!  (ones it owns) */
-	if (management_core())
+	/* The user can only halt CG cores!  (ones it owns).  SCPs don't own theirs,
+	 * even when they are running on a CG core. */
+	if (!__proc_is_mcp(p))
 		return -1;
 	disable_irq();
 	/* both for accounting and possible RKM optimizations */
@@ -2454,6 +2461,7 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_proc_destroy] = {(syscall_t)sys_proc_destroy, "proc_destroy"},
 	[SYS_yield] = {(syscall_t)sys_proc_yield, "proc_yield"},
 	[SYS_change_vcore] = {(syscall_t)sys_change_vcore, "change_vcore"},
+	[SYS_handoff_vcore] = {(syscall_t)sys_handoff_vcore, "handoff_vcore"},
 	[SYS_fork] = {(syscall_t)sys_fork, "fork"},
 	[SYS_exec] = {(syscall_t)sys_exec, "exec"},
 	[SYS_waitpid] = {(syscall_t)sys_waitpid, "waitpid"},
@@ -115,10 +115,64 @@ void kernel_msg_init(void)
 	                                     ARCH_CL_SIZE, 0, NULL, 0, 0, NULL);
 }
 
-uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
-                             long arg2, int type)
+void kmsg_queue_init(struct kmsg_queue *q)
+{
+	q->incoming = NULL;
+	STAILQ_INIT(&q->ready);
+	q->nr_msgs = 0;
+	q->nr_refills = 0;
+}
+
+/* Pushes k_msg onto q's incoming stack.  Returns TRUE if the stack was empty,
+ * i.e. no one has IPI'd q's owner for the messages already on it.  If it wasn't
+ * empty, our CAS succeeded before the owner took the old contents, so the owner
+ * will get ours with them. */
+static bool kmsg_queue_push(struct kmsg_queue *q, struct kernel_message *k_msg)
+{
+	struct kernel_message *old;
+
+	do {
+		old = ACCESS_ONCE(q->incoming);
+		k_msg->link.stqe_next = old;
+	} while (!atomic_cas_ptr((void**)&q->incoming, old, k_msg));
+	return !old;
+}
+
+/* Pops the oldest message off our own q, or returns 0 if there are none.  IRQs
+ * must be disabled. */
+static struct kernel_message *kmsg_queue_pop(struct kmsg_queue *q)
+{
+	struct kernel_message *kmsg, *next;
+
+	if (STAILQ_EMPTY(&q->ready)) {
+		/* Lockless peek, so we don't write the cacheline for nothing */
+		if (!ACCESS_ONCE(q->incoming))
+			return 0;
+		do {
+			kmsg = ACCESS_ONCE(q->incoming);
+		} while (!atomic_cas_ptr((void**)&q->incoming, kmsg, NULL));
+		/* incoming is newest first; inserting each at the head of ready puts
+		 * them back in the order they were sent. */
+		while (kmsg) {
+			next = kmsg->link.stqe_next;
+			STAILQ_INSERT_HEAD(&q->ready, kmsg, link);
+			kmsg = next;
+		}
+		q->nr_refills++;
+	}
+	kmsg = STAILQ_FIRST(&q->ready);
+	STAILQ_REMOVE_HEAD(&q->ready, link);
+	q->nr_msgs++;
+	return kmsg;
+}
+
+/* Queues the message on dst.  Returns TRUE if dst needs an IPI for it. */
+static bool __queue_kernel_message(uint32_t dst, amr_t pc, long arg0,
+                                   long arg1, long arg2, int type)
 {
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	kernel_message_t *k_msg;
+	bool was_empty;
 	assert(pc);
 	// note this will be freed on the destination core
 	k_msg = kmem_cache_alloc(kernel_msg_cache, 0);
@@ -130,26 +184,58 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 	k_msg->arg2 = arg2;
 	switch (type) {
 		case KMSG_IMMEDIATE:
-			spin_lock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].immed_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
+			was_empty = kmsg_queue_push(&per_cpu_info[dst].immed_amsgs, k_msg);
 			break;
 		case KMSG_ROUTINE:
-			spin_lock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].routine_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
+			was_empty = kmsg_queue_push(&per_cpu_info[dst].routine_amsgs,
+			                            k_msg);
 			break;
 		default:
 			panic("Unknown type of kernel message!");
 	}
-	/* since we touched memory the other core will touch (the lock), we don't
-	 * need an wmb_f() */
+	/* the CAS is a full barrier, so we don't need an wmb_f() */
+	pcpui->nr_kmsgs_sent++;
 	/* if we're sending a routine message locally, we don't want/need an IPI */
-	if ((dst != k_msg->srcid) || (type == KMSG_IMMEDIATE))
+	if ((dst == k_msg->srcid) && (type == KMSG_ROUTINE))
+		return FALSE;
+	if (!was_empty) {
+		pcpui->nr_kmsg_ipis_suppressed++;
+		return FALSE;
+	}
+	pcpui->nr_kmsg_ipis++;
+	return TRUE;
+}
+
+uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
+                             long arg2, int type)
+{
+	if (__queue_kernel_message(dst, pc, arg0, arg1, arg2, type))
 		send_ipi(dst, I_KERNEL_MSG);
 	return 0;
 }
 
+void kmsg_batch_init(struct kmsg_batch *kb)
+{
+	core_set_init(&kb->ipi_cores);
+}
+
+/* Queues a message like send_kernel_message(), but holds off on the IPI until
+ * kmsg_batch_send().  Messages to a given core still run in the order they were
+ * queued. */
+void kmsg_batch_add(struct kmsg_batch *kb, uint32_t dst, amr_t pc, long arg0,
+                    long arg1, long arg2, int type)
+{
+	if (__queue_kernel_message(dst, pc, arg0, arg1, arg2, type))
+		core_set_setcpu(&kb->ipi_cores, dst);
+}
+
+/* Sends the IPIs for every message in the batch, then resets it. */
+void kmsg_batch_send(struct kmsg_batch *kb)
+{
+	send_ipi_set(&kb->ipi_cores, I_KERNEL_MSG);
+	core_set_init(&kb->ipi_cores);
+}
+
 /* Kernel message IPI/IRQ handler.
  *
  * This processes immediate messages, and that's it (it used to handle routines
@@ -162,44 +248,27 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	struct kernel_message *kmsg_i, *temp;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->immed_amsgs))
-		return;
-	/* The lock serves as a cmb to force a re-read of the head of the list */
-	spin_lock_irqsave(&pcpui->immed_amsg_lock);
-	STAILQ_FOREACH_SAFE(kmsg_i, &pcpui->immed_amsgs, link, temp) {
-		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg_i->pc);
-		kmsg_i->pc(kmsg_i->srcid, kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
-		STAILQ_REMOVE(&pcpui->immed_amsgs, kmsg_i, kernel_message, link);
-		kmem_cache_free(kernel_msg_cache, (void*)kmsg_i);
+	struct kernel_message *kmsg;
+
+	while ((kmsg = kmsg_queue_pop(&pcpui->immed_amsgs))) {
+		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg->pc);
+		kmsg->pc(kmsg->srcid, kmsg->arg0, kmsg->arg1, kmsg->arg2);
+		kmem_cache_free(kernel_msg_cache, (void*)kmsg);
 	}
-	spin_unlock_irqsave(&pcpui->immed_amsg_lock);
 }
 
 bool has_routine_kmsg(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	/* lockless peek */
-	return !STAILQ_EMPTY(&pcpui->routine_amsgs);
+	return !kmsg_queue_empty(&pcpui->routine_amsgs);
 }
 
 /* Helper function, gets the next routine KMSG (RKM).  Returns 0 if the list was
- * empty. */
+ * empty.  IRQs are disabled by our caller. */
 static kernel_message_t *get_next_rkmsg(struct per_cpu_info *pcpui)
 {
-	struct kernel_message *kmsg;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->routine_amsgs))
-		return 0;
-	/* The lock serves as a cmb to force a re-read of the head of the list.
-	 * IRQs are disabled by our caller. */
-	spin_lock(&pcpui->routine_amsg_lock);
-	kmsg = STAILQ_FIRST(&pcpui->routine_amsgs);
-	if (kmsg)
-		STAILQ_REMOVE_HEAD(&pcpui->routine_amsgs, link);
-	spin_unlock(&pcpui->routine_amsg_lock);
-	return kmsg;
+	return kmsg_queue_pop(&pcpui->routine_amsgs);
 }
 
 /* Runs routine kernel messages.  This might not return.  In the past, this
@@ -261,58 +330,52 @@ void process_routine_kmsg(void)
 void print_kmsgs(uint32_t coreid)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
-	void __print_kmsgs(struct kernel_msg_list *list, char *type)
+	void __print_kmsg(struct kernel_message *kmsg_i, char *type)
 	{
 		char *fn_name;
+
+		fn_name = get_fn_name((long)kmsg_i->pc);
+		printk("%s KMSG on %d from %d to run %p(%s)(%p, %p, %p)\n", type,
+		       kmsg_i->dstid, kmsg_i->srcid, kmsg_i->pc, fn_name,
+		       kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
+		kfree(fn_name);
+	}
+	void __print_kmsgs(struct kmsg_queue *q, char *type)
+	{
 		struct kernel_message *kmsg_i;
-		STAILQ_FOREACH(kmsg_i, list, link) {
-			fn_name = get_fn_name((long)kmsg_i->pc);
-			printk("%s KMSG on %d from %d to run %p(%s)(%p, %p, %p)\n", type,
-			       kmsg_i->dstid, kmsg_i->srcid, kmsg_i->pc, fn_name,
-			       kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
-			kfree(fn_name);
-		}
+
+		STAILQ_FOREACH(kmsg_i, &q->ready, link)
+			__print_kmsg(kmsg_i, type);
+		/* Newest first, so these print in reverse */
+		for (kmsg_i = ACCESS_ONCE(q->incoming); kmsg_i;
+		     kmsg_i = kmsg_i->link.stqe_next)
+			__print_kmsg(kmsg_i, type);
 	}
 	__print_kmsgs(&pcpui->immed_amsgs, "Immedte");
 	__print_kmsgs(&pcpui->routine_amsgs, "Routine");
 }
 
-/* Debugging stuff */
+/* Debugging stuff.  Also racy: it peeks at other cores' queues. */
 void kmsg_queue_stat(void)
 {
-	struct kernel_message *kmsg;
-	bool immed_emp, routine_emp;
-	for (int i = 0; i < num_cores; i++) {
-		spin_lock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		immed_emp = STAILQ_EMPTY(&per_cpu_info[i].immed_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		spin_lock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		routine_emp = STAILQ_EMPTY(&per_cpu_info[i].routine_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		printk("Core %d's immed_emp: %d, routine_emp %d\n", i, immed_emp,
-               routine_emp);
-		if (!immed_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].immed_amsgs);
-			printk("Immed msg on core %d:\n", i);
-			printk("\tsrc:  %d\n", kmsg->srcid);
-			printk("\tdst:  %d\n", kmsg->dstid);
-			printk("\tpc:   %p\n", kmsg->pc);
-			printk("\targ0: %p\n", kmsg->arg0);
-			printk("\targ1: %p\n", kmsg->arg1);
-			printk("\targ2: %p\n", kmsg->arg2);
-		}
-		if (!routine_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].routine_amsgs);
-			printk("Routine msg on core %d:\n", i);
-			printk("\tsrc:  %d\n", kmsg->srcid);
-			printk("\tdst:  %d\n", kmsg->dstid);
-			printk("\tpc:   %p\n", kmsg->pc);
-			printk("\targ0: %p\n", kmsg->arg0);
-			printk("\targ1: %p\n", kmsg->arg1);
-			printk("\targ2: %p\n", kmsg->arg2);
-		}
+	struct per_cpu_info *pcpui;
+	struct kmsg_queue *immed, *routine;
 
+	for (int i = 0; i < num_cores; i++) {
+		pcpui = &per_cpu_info[i];
+		immed = &pcpui->immed_amsgs;
+		routine = &pcpui->routine_amsgs;
+		printk("Core %d's immed_emp: %d, routine_emp %d\n", i,
+		       kmsg_queue_empty(immed), kmsg_queue_empty(routine));
+		printk("\tsent: %lu, IPIs: %lu, IPIs suppressed: %lu\n",
+		       pcpui->nr_kmsgs_sent, pcpui->nr_kmsg_ipis,
+		       pcpui->nr_kmsg_ipis_suppressed);
+		printk("\tran immed: %lu (%lu refills), routine: %lu (%lu refills)\n",
+		       immed->nr_msgs, immed->nr_refills, routine->nr_msgs,
+		       routine->nr_refills);
 	}
+	for (int i = 0; i < num_cores; i++)
+		print_kmsgs(i);
 }
 
 void print_kctx_depths(const char *str)
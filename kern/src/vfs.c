@@ -1134,6 +1134,7 @@ void inode_release(struct kref *kref)
 	kref_put(&inode->i_sb->s_kref);
 	/* TODO: clean this up */
 	assert(inode->i_mapping == &inode->i_pm);
+	pm_destroy(inode->i_mapping);
 	kmem_cache_free(inode_kcache, inode);
 }
 
@@ -1329,7 +1330,7 @@ ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
 			memcpy(page2kva(page) + page_off, buf, copy_amt);
 		buf += copy_amt;
 		page_off = 0;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_set_dirty(page);
 		pm_put_page(page);	/* it's still in the cache, we just don't need it */
 	}
 	assert(buf == buf_end);
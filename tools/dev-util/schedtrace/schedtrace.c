@@ -0,0 +1,357 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Converts a #sched/trace snapshot into Chrome trace JSON, which you can load
+ * in chrome://tracing or Perfetto.
+ *
+ * 	echo start > '#sched/ctl'
+ * 	(run something)
+ * 	echo stop > '#sched/ctl'
+ * 	schedtrace -o trace.json
+ *
+ * There is one row per pcore, showing which vcore or SCP was running on it.
+ * Each process gets a group with one row per vcore, with slices for when it
+ * was running, when it was mapped to a pcore but not running yet (granted), and
+ * when it was unmapped.  Grants, revocations, preemption warnings and
+ * notifications are instant events on the vcore's row.
+ *
+ * The input can also be a copy of #sched/trace, so this works off-box too. */
+
+#include <ros/sched_trace.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PCORE_PID			0
+
+struct pcore_state {
+	bool						running;
+	double						start;
+	uint32_t					pid;
+	uint32_t					vcoreid;
+	bool						scp;
+};
+
+enum {
+	VC_UNMAPPED,
+	VC_GRANTED,
+	VC_RUNNING,
+};
+
+struct vcore_state {
+	uint32_t					pid;
+	uint32_t					vcoreid;
+	int							state;
+	double						start;
+};
+
+static FILE *out;
+static bool first_event = true;
+static uint64_t tsc_freq;
+static uint64_t tsc_base;
+static struct pcore_state *pcores;
+static uint32_t nr_pcores;
+static struct vcore_state *vcores;
+static size_t nr_vcores, max_vcores;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-o OUTFILE] [TRACEFILE]\n", prog);
+	fprintf(stderr,
+	        "  TRACEFILE defaults to #sched/trace, OUTFILE to stdout\n");
+	exit(1);
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	void *ret = realloc(ptr, size);
+
+	if (!ret) {
+		fprintf(stderr, "Out of memory (%zu bytes)\n", size);
+		exit(1);
+	}
+	return ret;
+}
+
+/* The synthetic files don't have a length, so we read until EOF. */
+static void *read_all(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	size_t cap = 64 * 1024, amt = 0, ret;
+	char *buf;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	buf = xrealloc(NULL, cap);
+	while ((ret = fread(buf + amt, 1, cap - amt, f)) > 0) {
+		amt += ret;
+		if (amt == cap) {
+			cap *= 2;
+			buf = xrealloc(buf, cap);
+		}
+	}
+	if (ferror(f)) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+	*len = amt;
+	return buf;
+}
+
+static double tsc2usec(uint64_t tsc)
+{
+	return (double)(tsc - tsc_base) * 1000000.0 / tsc_freq;
+}
+
+static void emit_sep(void)
+{
+	fprintf(out, first_event ? "\n" : ",\n");
+	first_event = false;
+}
+
+static void emit_name(const char *what, uint32_t pid, uint32_t tid,
+                      const char *fmt, uint32_t id)
+{
+	emit_sep();
+	fprintf(out, "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+	        "\"args\":{\"name\":\"", what, pid, tid);
+	fprintf(out, fmt, id);
+	fprintf(out, "\"}}");
+}
+
+static void emit_slice(uint32_t pid, uint32_t tid, const char *name,
+                       double start, double end)
+{
+	emit_sep();
+	fprintf(out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+	        "\"ts\":%.3f,\"dur\":%.3f}", name, pid, tid, start, end - start);
+}
+
+static void emit_instant(uint32_t pid, uint32_t tid, const char *name,
+                         double ts, struct sched_trace_event *ev)
+{
+	emit_sep();
+	fprintf(out, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,"
+	        "\"tid\":%u,\"ts\":%.3f,\"args\":{\"pcore\":%u,\"src_core\":%u",
+	        name, pid, tid, ts, ev->pcoreid, ev->srccore);
+	if (ev->type == SCHED_TR_REVOKE)
+		fprintf(out, ",\"preempt\":%s", ev->arg ? "true" : "false");
+	if (ev->type == SCHED_TR_PREEMPT_WARN)
+		fprintf(out, ",\"deadline_us\":%.3f", tsc2usec(ev->arg));
+	fprintf(out, "}}");
+}
+
+static struct vcore_state *get_vcore(uint32_t pid, uint32_t vcoreid)
+{
+	struct vcore_state *vc;
+	bool new_pid = true;
+
+	for (size_t i = 0; i < nr_vcores; i++) {
+		if (vcores[i].pid != pid)
+			continue;
+		if (vcores[i].vcoreid == vcoreid)
+			return &vcores[i];
+		new_pid = false;
+	}
+	if (nr_vcores == max_vcores) {
+		max_vcores = max_vcores ? max_vcores * 2 : 64;
+		vcores = xrealloc(vcores, max_vcores * sizeof(struct vcore_state));
+	}
+	vc = &vcores[nr_vcores++];
+	vc->pid = pid;
+	vc->vcoreid = vcoreid;
+	vc->state = VC_UNMAPPED;
+	/* We don't know what it was doing before the trace started */
+	vc->start = -1;
+	emit_name("thread_name", pid, vcoreid, "vcore %u", vcoreid);
+	if (new_pid)
+		emit_name("process_name", pid, 0, "proc %u", pid);
+	return vc;
+}
+
+static const char *vc_state_name(int state)
+{
+	switch (state) {
+	case VC_UNMAPPED:
+		return "unmapped";
+	case VC_GRANTED:
+		return "granted";
+	case VC_RUNNING:
+		return "running";
+	}
+	return "?";
+}
+
+/* Ends whatever vc was doing and starts new_state.  Slices from before the
+ * trace started are dropped. */
+static void vc_change(struct vcore_state *vc, int new_state, double ts)
+{
+	if (vc->state == new_state)
+		return;
+	if (vc->start >= 0)
+		emit_slice(vc->pid, vc->vcoreid, vc_state_name(vc->state), vc->start,
+		           ts);
+	vc->state = new_state;
+	vc->start = ts;
+}
+
+static void pcore_stop(uint32_t pcoreid, double ts)
+{
+	struct pcore_state *pc = &pcores[pcoreid];
+	char name[64];
+
+	if (!pc->running)
+		return;
+	if (pc->scp)
+		snprintf(name, sizeof(name), "SCP %u", pc->pid);
+	else
+		snprintf(name, sizeof(name), "%u.vc%u", pc->pid, pc->vcoreid);
+	emit_slice(PCORE_PID, pcoreid, name, pc->start, ts);
+	pc->running = false;
+}
+
+static void pcore_start(uint32_t pcoreid, double ts, uint32_t pid,
+                        uint32_t vcoreid, bool scp)
+{
+	struct pcore_state *pc = &pcores[pcoreid];
+
+	pcore_stop(pcoreid, ts);
+	pc->running = true;
+	pc->start = ts;
+	pc->pid = pid;
+	pc->vcoreid = vcoreid;
+	pc->scp = scp;
+}
+
+static void handle_event(struct sched_trace_event *ev)
+{
+	double ts = tsc2usec(ev->tsc);
+	struct vcore_state *vc;
+
+	if (ev->pcoreid >= nr_pcores) {
+		fprintf(stderr, "Bad pcoreid %u, skipping\n", ev->pcoreid);
+		return;
+	}
+	vc = get_vcore(ev->pid, ev->vcoreid);
+	switch (ev->type) {
+	case SCHED_TR_GRANT:
+		emit_instant(ev->pid, ev->vcoreid, "grant", ts, ev);
+		vc_change(vc, VC_GRANTED, ts);
+		break;
+	case SCHED_TR_REVOKE:
+		emit_instant(ev->pid, ev->vcoreid, "revoke", ts, ev);
+		vc_change(vc, VC_UNMAPPED, ts);
+		break;
+	case SCHED_TR_PREEMPT_WARN:
+		emit_instant(ev->pid, ev->vcoreid, "preempt warning", ts, ev);
+		break;
+	case SCHED_TR_NOTIFY:
+		emit_instant(ev->pid, ev->vcoreid, "notify", ts, ev);
+		break;
+	case SCHED_TR_VC_START:
+		vc_change(vc, VC_RUNNING, ts);
+		pcore_start(ev->pcoreid, ts, ev->pid, ev->vcoreid, false);
+		break;
+	case SCHED_TR_SCP_RUN:
+		vc_change(vc, VC_RUNNING, ts);
+		pcore_start(ev->pcoreid, ts, ev->pid, ev->vcoreid, true);
+		break;
+	case SCHED_TR_VC_YIELD:
+	case SCHED_TR_VC_DEATH:
+	case SCHED_TR_SCP_STOP:
+		vc_change(vc, VC_UNMAPPED, ts);
+		pcore_stop(ev->pcoreid, ts);
+		break;
+	case SCHED_TR_VC_PREEMPT:
+		/* Already unmapped by the revoke */
+		pcore_stop(ev->pcoreid, ts);
+		break;
+	default:
+		fprintf(stderr, "Unknown event type %u, skipping\n", ev->type);
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *in_path = "#sched/trace";
+	struct sched_trace_hdr *hdr;
+	struct sched_trace_event *evs;
+	size_t len;
+	double end = 0;
+	int opt;
+
+	out = stdout;
+	while ((opt = getopt(argc, argv, "o:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			out = fopen(optarg, "w");
+			if (!out) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		in_path = argv[optind++];
+	if (optind < argc)
+		usage(argv[0]);
+
+	hdr = read_all(in_path, &len);
+	if (len < sizeof(*hdr) || hdr->magic != SCHED_TRACE_MAGIC) {
+		fprintf(stderr, "%s is not a sched trace\n", in_path);
+		exit(1);
+	}
+	if (hdr->version != SCHED_TRACE_VERSION) {
+		fprintf(stderr, "%s has version %u, we want %u\n", in_path,
+		        hdr->version, SCHED_TRACE_VERSION);
+		exit(1);
+	}
+	if (len < sizeof(*hdr) + hdr->nr_events * sizeof(*evs)) {
+		fprintf(stderr, "%s is truncated\n", in_path);
+		exit(1);
+	}
+	if (!hdr->tsc_freq) {
+		fprintf(stderr, "%s has no TSC frequency\n", in_path);
+		exit(1);
+	}
+	if (hdr->nr_lost)
+		fprintf(stderr, "Warning: %llu events were overwritten\n",
+		        (unsigned long long)hdr->nr_lost);
+	evs = (struct sched_trace_event*)(hdr + 1);
+	tsc_freq = hdr->tsc_freq;
+	tsc_base = hdr->nr_events ? evs[0].tsc : 0;
+	nr_pcores = hdr->nr_cores;
+	pcores = xrealloc(NULL, nr_pcores * sizeof(struct pcore_state));
+	memset(pcores, 0, nr_pcores * sizeof(struct pcore_state));
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	emit_name("process_name", PCORE_PID, 0, "pcores", 0);
+	for (uint32_t i = 0; i < nr_pcores; i++)
+		emit_name("thread_name", PCORE_PID, i, "pcore %u", i);
+	for (uint32_t i = 0; i < hdr->nr_events; i++)
+		handle_event(&evs[i]);
+	/* Close anything still open at the end of the trace */
+	if (hdr->nr_events)
+		end = tsc2usec(evs[hdr->nr_events - 1].tsc);
+	for (uint32_t i = 0; i < nr_pcores; i++)
+		pcore_stop(i, end);
+	for (size_t i = 0; i < nr_vcores; i++) {
+		if (vcores[i].state != VC_UNMAPPED)
+			vc_change(&vcores[i], VC_UNMAPPED, end);
+	}
+	fprintf(out, "\n]}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
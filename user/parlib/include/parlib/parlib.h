@@ -47,6 +47,7 @@ int         sys_halt_core(unsigned long usec);
 void*		sys_init_arsc();
 int         sys_block(unsigned long usec);
 int         sys_change_vcore(uint32_t vcoreid, bool enable_my_notif);
+int         sys_handoff_vcore(uint32_t vcoreid);
 int         sys_change_to_m(void);
 int         sys_poke_ksched(int pid, unsigned int res_type);
 int         sys_abort_sysc(struct syscall *sysc);
@@ -98,27 +98,13 @@ int sys_block(unsigned long usec)
 	return ros_syscall(SYS_block, usec, 0, 0, 0, 0, 0);
 }
 
-/* enable_my_notif tells the kernel whether or not it is okay to turn on notifs
- * when our calling vcore 'yields'.  This controls whether or not the vcore will
- * get started from vcore_entry() or not, and whether or not remote cores need
- * to sys_change_vcore to preempt-recover the calling vcore.  Only set this to
- * FALSE if you are unable to handle starting fresh at vcore_entry().  One
- * example of this is in mcs_pdr_locks.
- *
- * Will return:
- * 		0 if we successfully changed to the target vcore.
- * 		-EBUSY if the target vcore is already mapped (a good kind of failure)
- * 		-EAGAIN if we failed for some other reason and need to try again.  For
- * 		example, the caller could be preempted, and we never even attempted to
- * 		change.
- * 		-EINVAL some userspace bug */
-int sys_change_vcore(uint32_t vcoreid, bool enable_my_notif)
+/* Syscalls that might not return, made from vcore context.  Since we might be
+ * starting up on a fresh stack, we need to use some non-stack memory for the
+ * struct sysc.  Our vcore could get restarted before the syscall finishes
+ * (after unlocking the proc, before finish_sysc()), and the act of finishing
+ * would write onto our stack.  Thus we use the per-vcore struct. */
+static int __vcore_one_syscall(unsigned int num, long arg0, long arg1)
 {
-	/* Since we might be asking to start up on a fresh stack (if
-	 * enable_my_notif), we need to use some non-stack memory for the struct
-	 * sysc.  Our vcore could get restarted before the syscall finishes (after
-	 * unlocking the proc, before finish_sysc()), and the act of finishing would
-	 * write onto our stack.  Thus we use the per-vcore struct. */
 	int flags;
 	/* Need to wait while a previous syscall is not done or locked.  Since this
 	 * should only be called from VC ctx, we'll just spin.  Should be extremely
@@ -127,14 +113,13 @@ int sys_change_vcore(uint32_t vcoreid, bool enable_my_notif)
 		cpu_relax();
 		flags = atomic_read(&__vcore_one_sysc.flags);
 	} while (!(flags & SC_DONE) || flags & SC_K_LOCK);
-	__vcore_one_sysc.num = SYS_change_vcore;
-	__vcore_one_sysc.arg0 = vcoreid;
-	__vcore_one_sysc.arg1 = enable_my_notif;
+	__vcore_one_sysc.num = num;
+	__vcore_one_sysc.arg0 = arg0;
+	__vcore_one_sysc.arg1 = arg1;
 	/* keep in sync with glibc sysdeps/ros/syscall.c */
 	__ros_arch_syscall((long)&__vcore_one_sysc, 1);
-	/* If we returned, either we wanted to (!enable_my_notif) or we failed.
-	 * Need to wait til the sysc is finished to find out why.  Again, its okay
-	 * to just spin. */
+	/* If we returned, either we wanted to or we failed.  Need to wait til the
+	 * sysc is finished to find out why.  Again, its okay to just spin. */
 	do {
 		cpu_relax();
 		flags = atomic_read(&__vcore_one_sysc.flags);
@@ -142,6 +127,39 @@ int sys_change_vcore(uint32_t vcoreid, bool enable_my_notif)
 	return __vcore_one_sysc.retval;
 }
 
+/* enable_my_notif tells the kernel whether or not it is okay to turn on notifs
+ * when our calling vcore 'yields'.  This controls whether or not the vcore will
+ * get started from vcore_entry() or not, and whether or not remote cores need
+ * to sys_change_vcore to preempt-recover the calling vcore.  Only set this to
+ * FALSE if you are unable to handle starting fresh at vcore_entry().  One
+ * example of this is in mcs_pdr_locks.
+ *
+ * Will return:
+ * 		0 if we successfully changed to the target vcore.
+ * 		-EBUSY if the target vcore is already mapped (a good kind of failure)
+ * 		-EAGAIN if we failed for some other reason and need to try again.  For
+ * 		example, the caller could be preempted, and we never even attempted to
+ * 		change.
+ * 		-EINVAL some userspace bug */
+int sys_change_vcore(uint32_t vcoreid, bool enable_my_notif)
+{
+	return __vcore_one_syscall(SYS_change_vcore, vcoreid, enable_my_notif);
+}
+
+/* Gives our pcore straight to vcoreid, which must be offline, without going
+ * through the ksched.  We yield, like in sys_yield, and will start fresh at
+ * vcore_entry() when we come back.  Must be called from vcore context.
+ *
+ * Will return:
+ * 		-EBUSY if the target vcore is already mapped
+ * 		-EAGAIN if we had a notif or preempt coming in, check your events
+ * 		-ECANCELED if we are being preempted
+ * 		-EINVAL some userspace bug */
+int sys_handoff_vcore(uint32_t vcoreid)
+{
+	return __vcore_one_syscall(SYS_handoff_vcore, vcoreid, 0);
+}
+
 int sys_change_to_m(void)
 {
 	return ros_syscall(SYS_change_to_m, 0, 0, 0, 0, 0, 0);
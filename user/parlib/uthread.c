@@ -21,6 +21,7 @@ __thread struct uthread *current_uthread = 0;
 /* ev_q for all preempt messages (handled here to keep 2LSs from worrying
  * extensively about the details.  Will call out when necessary. */
 static struct event_queue *preempt_ev_q;
+static struct event_queue *preempt_warn_ev_q;
 
 /* Helpers: */
 #define UTH_TLSDESC_NOTLS (void*)(-1)
@@ -34,6 +35,8 @@ static void handle_vc_preempt(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data);
 static void handle_vc_indir(struct event_msg *ev_msg, unsigned int ev_type,
                             void *data);
+static void handle_preempt_pending(struct event_msg *ev_msg,
+                                   unsigned int ev_type, void *data);
 static void __ros_uth_syscall_blockon(struct syscall *sysc);
 
 /* Helper, initializes a fresh uthread to be thread0. */
@@ -130,6 +133,16 @@ void uthread_mcp_init()
 	register_kevent_q(preempt_ev_q, EV_CHECK_MSGS);
 	printd("[user] registered %08p (flags %08p) for preempt messages\n",
 	       preempt_ev_q, preempt_ev_q->ev_flags);
+	/* Preemption warnings go to the vcore that is about to be preempted, and
+	 * only that one.  The IPI gets it into vcore context as soon as it has
+	 * notifs enabled, which is a safe point to yield.  The yield itself happens
+	 * in __check_preempt_pending(), once we are done handling events.  APPRO
+	 * makes the kernel use the warned vcore instead of the ev_q's ev_vcore. */
+	register_ev_handler(EV_PREEMPT_PENDING, handle_preempt_pending, 0);
+	preempt_warn_ev_q = get_eventq_slim();
+	preempt_warn_ev_q->ev_flags = EVENT_IPI | EVENT_VCORE_APPRO |
+	                              EVENT_VCORE_PRIVATE;
+	register_kevent_q(preempt_warn_ev_q, EV_PREEMPT_PENDING);
 	/* Get ourselves into _M mode.  Could consider doing this elsewhere... */
 	vcore_change_to_m();
 }
@@ -1013,6 +1026,14 @@ out_we_returned:
 	ev_we_returned(were_handling_remotes);
 }
 
+/* The kernel warned us that it wants this vcore's core back.  We can't yield
+ * from an event handler, since handlers must return.  The vcore will yield once
+ * it is done with its events, in __check_preempt_pending(). */
+static void handle_preempt_pending(struct event_msg *ev_msg,
+                                   unsigned int ev_type, void *data)
+{
+}
+
 /* This handles a preemption message.  When this is done, either we recovered,
  * or recovery *for our message* isn't needed. */
 static void handle_vc_preempt(struct event_msg *ev_msg, unsigned int ev_type,
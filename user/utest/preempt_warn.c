@@ -0,0 +1,96 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Checks that a vcore warned about an upcoming preemption yields its core
+ * before the deadline.  The warning comes from the proc ctl's preemptwarn
+ * command, which needs a kernel built with CONFIG_PREEMPT_WARN_CTL. */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <parlib/vcore.h>
+#include <utest/utest.h>
+
+TEST_SUITE("PREEMPT_WARN");
+
+static volatile bool spin_stop;
+static volatile int spin_vcoreid = -1;
+
+static void *spinner(void *arg)
+{
+	spin_vcoreid = vcore_id();
+	while (!spin_stop)
+		cpu_relax();
+	return NULL;
+}
+
+/* <--- Begin definition of test cases ---> */
+
+/* The spinner never enters vcore context on its own, so only the warning's IPI
+ * gets its vcore to yield. */
+bool test_warned_vcore_yields(void)
+{
+	const unsigned long GRACE_USEC = 100000;
+	pthread_t thread;
+	uint64_t deadline;
+	char path[32], cmd[64];
+	int fd, ret, vcoreid;
+
+	if (max_vcores() < 2)
+		return true;
+	parlib_never_yield = TRUE;
+	pthread_mcp_init();
+	vcore_request_total(2);
+	parlib_never_vc_request = TRUE;
+	pthread_create(&thread, NULL, spinner, NULL);
+	while (spin_vcoreid < 0)
+		cpu_relax();
+	vcoreid = spin_vcoreid;
+	UT_ASSERT_M("Spinner should run on a vcore other than 0", vcoreid != 0,
+	            spin_stop = TRUE);
+
+	snprintf(path, sizeof(path), "/proc/%d/ctl", getpid());
+	snprintf(cmd, sizeof(cmd), "preemptwarn %d %lu", vcoreid, GRACE_USEC);
+	fd = open(path, O_WRONLY);
+	UT_ASSERT_M("Could not open our proc ctl", fd >= 0, spin_stop = TRUE);
+	deadline = read_tsc() + usec2tsc(GRACE_USEC);
+	ret = write(fd, cmd, strlen(cmd));
+	close(fd);
+	if ((ret < 0) && (errno == ENOSYS)) {
+		spin_stop = TRUE;
+		pthread_join(thread, NULL);
+		return true;
+	}
+	UT_ASSERT_M("Could not warn the spinner's vcore", ret == strlen(cmd),
+	            spin_stop = TRUE);
+	/* The kernel clears preempt_pending when the vcore yields */
+	while (__procinfo.vcoremap[vcoreid].preempt_pending &&
+	       (read_tsc() < deadline))
+		cpu_relax();
+	UT_ASSERT_M("Warned vcore did not yield before the deadline",
+	            !__procinfo.vcoremap[vcoreid].preempt_pending,
+	            spin_stop = TRUE);
+
+	spin_stop = TRUE;
+	pthread_join(thread, NULL);
+	return true;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(warned_vcore_yields),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	// Run test suite passing it all the args as whitelist of what tests to run.
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}